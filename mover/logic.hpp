@@ -40,6 +40,12 @@ public:
 
   Json::Value GameStateToJson (const spacexpanse::GameStateData& state) override;
 
+  bool
+  IsStateJsonSelfContained () const override
+  {
+    return true;
+  }
+
 };
 
 } // namespace mover
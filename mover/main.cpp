@@ -38,15 +38,49 @@ DEFINE_int32 (enable_pruning, -1,
               " data and keep as many blocks as specified by the value");
 
 DEFINE_string (storage_type, "memory",
-               "the type of storage to use for game data (memory or sqlite)");
+               "the type of storage to use for game data"
+               " (memory, lmdb, log or sqlite)");
 DEFINE_string (datadir, "",
                "base data directory for game data (will be extended by the"
                " game ID and chain); must be set if --storage_type is not"
                " memory");
+DEFINE_int32 (memory_undo_limit_mb, 0,
+              "if positive and memory storage is used, limit the memory for"
+              " undo data to this many MiB by evicting the oldest");
+DEFINE_string (undo_compression, "",
+               "if set, compress undo data with this codec"
+               " (zlib, fast or none)");
+
+DEFINE_bool (lmdb_writemap, false,
+             "whether to open the LMDB storage with MDB_WRITEMAP");
+DEFINE_bool (lmdb_nosync, false,
+             "whether to open the LMDB storage with MDB_NOSYNC, so that"
+             " commits are only synced to disk periodically");
+DEFINE_int32 (lmdb_sync_interval, 0,
+              "with --lmdb_nosync, sync LMDB to disk after this many commits"
+              " (if zero, only on shutdown)");
+
+DEFINE_bool (async_commit, false,
+             "whether to sync storage commits to disk in the background"
+             " while the next batch of blocks is processed");
+
+DEFINE_int32 (max_data_loss_ms, 0,
+              "if positive, size transaction batches adaptively such that no"
+              " block stays uncommitted for longer than this");
 
 DEFINE_bool (pending_moves, true,
              "whether or not pending moves should be tracked");
 
+DEFINE_string (record_zmq, "",
+               "if set, record all ZMQ messages from SpaceXpanse Core to"
+               " this file for replaying them later");
+DEFINE_string (replay_zmq, "",
+               "if set, replay the ZMQ messages from this recording instead"
+               " of connecting to SpaceXpanse Core, and print statistics");
+DEFINE_bool (replay_realtime, false,
+             "whether to replay messages at the recorded timing instead of"
+             " as fast as possible");
+
 } // anonymous namespace
 
 int
@@ -59,7 +93,7 @@ main (int argc, char** argv)
   gflags::SetVersionString (PACKAGE_VERSION);
   gflags::ParseCommandLineFlags (&argc, &argv, true);
 
-  if (FLAGS_spacexpanse_rpc_url.empty ())
+  if (FLAGS_spacexpanse_rpc_url.empty () && FLAGS_replay_zmq.empty ())
     {
       std::cerr << "Error: --spacexpanse_rpc_url must be set" << std::endl;
       return EXIT_FAILURE;
@@ -84,7 +118,18 @@ main (int argc, char** argv)
     }
   config.EnablePruning = FLAGS_enable_pruning;
   config.StorageType = FLAGS_storage_type;
+  if (FLAGS_memory_undo_limit_mb > 0)
+    config.MemoryUndoLimitMb = FLAGS_memory_undo_limit_mb;
+  config.UndoCompression = FLAGS_undo_compression;
+  config.LMDBWriteMap = FLAGS_lmdb_writemap;
+  config.LMDBNoSync = FLAGS_lmdb_nosync;
+  config.LMDBSyncInterval = FLAGS_lmdb_sync_interval;
+  config.AsyncCommit = FLAGS_async_commit;
+  config.MaxDataLossMs = FLAGS_max_data_loss_ms;
   config.DataDirectory = FLAGS_datadir;
+  config.RecordZmqFile = FLAGS_record_zmq;
+  config.ReplayZmqFile = FLAGS_replay_zmq;
+  config.ReplayRealTime = FLAGS_replay_realtime;
 
   mover::PendingMoves pending;
   if (FLAGS_pending_moves)
@@ -13,11 +13,12 @@ Amount
 GetDbBalance (const spacexpanse::SQLiteDatabase& db, const Asset& a,
               const std::string& name)
 {
-  auto stmt = db.PrepareRo (R"(
+  static const auto id = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
     SELECT `balance`
       FROM `balances`
       WHERE `name` = ?1 AND `minter` = ?2 AND `asset` = ?3
   )");
+  auto stmt = db.PrepareRo (id);
   stmt.Bind (1, name);
   a.BindToParams (stmt, 2, 3);
 
@@ -33,11 +34,12 @@ GetDbBalance (const spacexpanse::SQLiteDatabase& db, const Asset& a,
 bool
 MoveParser::AssetExists (const Asset& a) const
 {
-  auto stmt = db.PrepareRo (R"(
+  static const auto id = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
     SELECT COUNT(*)
       FROM `assets`
       WHERE `minter` = ?1 AND `asset` = ?2
   )");
+  auto stmt = db.PrepareRo (id);
   a.BindToParams (stmt, 1, 2);
 
   CHECK (stmt.Step ());
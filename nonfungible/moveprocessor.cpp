@@ -29,21 +29,25 @@ MoveProcessor::UpdateBalance (const Asset& a, const std::string& name,
 
   if (newBalance == 0)
     {
-      auto stmt = MutableDb ().Prepare (R"(
+      static const auto id
+          = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
         DELETE FROM `balances`
           WHERE `name` = ?1 AND `minter` = ?2 AND `asset` = ?3
       )");
+      auto stmt = MutableDb ().Prepare (id);
       stmt.Bind (1, name);
       a.BindToParams (stmt, 2, 3);
       stmt.Execute ();
     }
   else
     {
-      auto stmt = MutableDb ().Prepare (R"(
+      static const auto id
+          = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
         INSERT OR REPLACE INTO `balances`
             (`name`, `minter`, `asset`, `balance`)
             VALUES (?1, ?2, ?3, ?4)
       )");
+      auto stmt = MutableDb ().Prepare (id);
       stmt.Bind (1, name);
       a.BindToParams (stmt, 2, 3);
       stmt.Bind (4, newBalance);
@@ -55,11 +59,12 @@ void
 MoveProcessor::ProcessMint (const Asset& a, const Amount supply,
                             const std::string* data)
 {
-  auto stmt = MutableDb ().Prepare (R"(
+  static const auto id = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
     INSERT INTO `assets`
       (`minter`, `asset`, `data`)
       VALUES (?1, ?2, ?3)
   )");
+  auto stmt = MutableDb ().Prepare (id);
   a.BindToParams (stmt, 1, 2);
   if (data != nullptr)
     stmt.Bind (3, *data);
@@ -586,27 +586,33 @@ ShipsLogic::UpdateStats (spacexpanse::SQLiteDatabase& db,
   const std::string& winnerName = meta.participants (winner).name ();
   const std::string& loserName = meta.participants (loser).name ();
 
-  auto stmt = db.Prepare (R"(
+  static const auto insertId
+      = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
     INSERT OR IGNORE INTO `game_stats`
       (`name`, `won`, `lost`) VALUES (?1, 0, 0), (?2, 0, 0)
   )");
+  auto stmt = db.Prepare (insertId);
   stmt.Bind (1, winnerName);
   stmt.Bind (2, loserName);
   stmt.Execute ();
 
-  stmt = db.Prepare (R"(
+  static const auto wonId
+      = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
     UPDATE `game_stats`
       SET `won` = `won` + 1
       WHERE `name` = ?1
   )");
+  stmt = db.Prepare (wonId);
   stmt.Bind (1, winnerName);
   stmt.Execute ();
 
-  stmt = db.Prepare (R"(
+  static const auto lostId
+      = spacexpanse::SQLiteDatabase::RegisterStatement (R"(
     UPDATE `game_stats`
       SET `lost` = `lost` + 1
       WHERE `name` = ?2
   )");
+  stmt = db.Prepare (lostId);
   stmt.Bind (2, loserName);
   stmt.Execute ();
 }
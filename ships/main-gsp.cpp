@@ -40,10 +40,23 @@ DEFINE_int32 (enable_pruning, -1,
 DEFINE_string (datadir, "",
                "base data directory for game data (will be extended by the"
                " game ID and chain)");
+DEFINE_string (undo_compression, "",
+               "if set, compress undo data with this codec"
+               " (zlib, fast or none)");
 
 DEFINE_bool (pending_moves, true,
              "whether or not pending moves should be tracked");
 
+DEFINE_string (record_zmq, "",
+               "if set, record all ZMQ messages from SpaceXpanse Core to"
+               " this file for replaying them later");
+DEFINE_string (replay_zmq, "",
+               "if set, replay the ZMQ messages from this recording instead"
+               " of connecting to SpaceXpanse Core, and print statistics");
+DEFINE_bool (replay_realtime, false,
+             "whether to replay messages at the recorded timing instead of"
+             " as fast as possible");
+
 } // anonymous namespace
 
 int
@@ -56,7 +69,7 @@ main (int argc, char** argv)
   gflags::SetVersionString (PACKAGE_VERSION);
   gflags::ParseCommandLineFlags (&argc, &argv, true);
 
-  if (FLAGS_spacexpanse_rpc_url.empty ())
+  if (FLAGS_spacexpanse_rpc_url.empty () && FLAGS_replay_zmq.empty ())
     {
       std::cerr << "Error: --spacexpanse_rpc_url must be set" << std::endl;
       return EXIT_FAILURE;
@@ -79,6 +92,10 @@ main (int argc, char** argv)
     }
   config.EnablePruning = FLAGS_enable_pruning;
   config.DataDirectory = FLAGS_datadir;
+  config.UndoCompression = FLAGS_undo_compression;
+  config.RecordZmqFile = FLAGS_record_zmq;
+  config.ReplayZmqFile = FLAGS_replay_zmq;
+  config.ReplayRealTime = FLAGS_replay_realtime;
 
   ships::ShipsLogic rules;
   spacexpanse::ChannelGspInstanceFactory instanceFact(rules);
@@ -0,0 +1,131 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_BROADCAST_HPP
+#define SPACEXPANSEGAME_BROADCAST_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/**
+ * Statistics about threads waiting on a VersionedBroadcast.
+ */
+struct BroadcastStats
+{
+
+  /** Number of threads currently waiting.  */
+  size_t waiters = 0;
+
+  /** Maximum number of concurrently waiting threads seen so far.  */
+  size_t maxWaiters = 0;
+
+  /** Total number of waiting threads that got woken by a new version.  */
+  uint64_t wakeups = 0;
+
+  /**
+   * Sum of the latencies between publishing of a new version and
+   * the waiting threads actually returning it.
+   */
+  std::chrono::microseconds totalWakeLatency{0};
+
+  /** Maximum wake latency seen so far.  */
+  std::chrono::microseconds maxWakeLatency{0};
+
+};
+
+/**
+ * A value of type T (e.g. some JSON state) that is published in versions,
+ * with support for threads to wait until a new version is available.  The
+ * value is computed once by the publisher and then shared between all
+ * waiting threads, so that a notification does not cause each of them to
+ * recompute it.  Waiting only uses an internal lock that is held very
+ * briefly, and not any lock of the publisher.
+ */
+template <typename T>
+  class VersionedBroadcast
+{
+
+private:
+
+  using Clock = std::chrono::steady_clock;
+
+  /** Lock for the data and condition variable.  */
+  mutable std::mutex mut;
+
+  /** Condition variable signalled for new versions (and wake-ups).  */
+  mutable std::condition_variable cv;
+
+  /** The current version.  */
+  uint64_t version = 0;
+
+  /**
+   * Counter for explicit wake-ups (without a new version), e.g. when
+   * the publisher is shutting down.
+   */
+  uint64_t wakeCounter = 0;
+
+  /** The current value (may be null).  */
+  std::shared_ptr<const T> value;
+
+  /** Time when the current version was published.  */
+  Clock::time_point publishTime;
+
+  /** Statistics about the waiters.  */
+  mutable BroadcastStats stats;
+
+public:
+
+  VersionedBroadcast () = default;
+
+  VersionedBroadcast (const VersionedBroadcast<T>&) = delete;
+  void operator= (const VersionedBroadcast<T>&) = delete;
+
+  /**
+   * Publishes a new value (which may be null), incrementing the version
+   * and waking up all waiting threads.
+   */
+  void Publish (std::shared_ptr<const T> val);
+
+  /**
+   * Wakes up all waiting threads without publishing a new version.
+   */
+  void Wake ();
+
+  /**
+   * Returns the current value and version.
+   */
+  std::shared_ptr<const T> Get (uint64_t& ver) const;
+
+  /**
+   * Blocks until the version is different from the known one, an explicit
+   * wake-up happens or the timeout expires.  Returns the value and version
+   * current at that time.
+   */
+  template <typename Rep, typename Period>
+    std::shared_ptr<const T> WaitForChange (
+        uint64_t knownVersion,
+        const std::chrono::duration<Rep, Period>& timeout,
+        uint64_t& ver) const;
+
+  /**
+   * Returns the current statistics.
+   */
+  BroadcastStats GetStats () const;
+
+};
+
+} // namespace internal
+} // namespace spacexpanse
+
+#include "broadcast.tpp"
+
+#endif // SPACEXPANSEGAME_BROADCAST_HPP
@@ -0,0 +1,95 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/* Template implementation code for broadcast.hpp.  */
+
+#include <algorithm>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+template <typename T>
+  void
+  VersionedBroadcast<T>::Publish (std::shared_ptr<const T> val)
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    ++version;
+    value = std::move (val);
+    publishTime = Clock::now ();
+  }
+
+  cv.notify_all ();
+}
+
+template <typename T>
+  void
+  VersionedBroadcast<T>::Wake ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    ++wakeCounter;
+  }
+
+  cv.notify_all ();
+}
+
+template <typename T>
+  std::shared_ptr<const T>
+  VersionedBroadcast<T>::Get (uint64_t& ver) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  ver = version;
+  return value;
+}
+
+template <typename T>
+template <typename Rep, typename Period>
+  std::shared_ptr<const T>
+  VersionedBroadcast<T>::WaitForChange (
+      const uint64_t knownVersion,
+      const std::chrono::duration<Rep, Period>& timeout,
+      uint64_t& ver) const
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  if (version == knownVersion)
+    {
+      ++stats.waiters;
+      stats.maxWaiters = std::max (stats.maxWaiters, stats.waiters);
+
+      const uint64_t startWake = wakeCounter;
+      cv.wait_for (lock, timeout, [this, knownVersion, startWake] ()
+        {
+          return version != knownVersion || wakeCounter != startWake;
+        });
+
+      --stats.waiters;
+      if (version != knownVersion)
+        {
+          const auto latency
+              = std::chrono::duration_cast<std::chrono::microseconds> (
+                  Clock::now () - publishTime);
+          ++stats.wakeups;
+          stats.totalWakeLatency += latency;
+          stats.maxWakeLatency = std::max (stats.maxWakeLatency, latency);
+        }
+    }
+
+  ver = version;
+  return value;
+}
+
+template <typename T>
+  BroadcastStats
+  VersionedBroadcast<T>::GetStats () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return stats;
+}
+
+} // namespace internal
+} // namespace spacexpanse
@@ -0,0 +1,157 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "broadcast.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace spacexpanse
+{
+namespace internal
+{
+namespace
+{
+
+/** Timeout for waiting in tests that are expected to be woken up.  */
+constexpr auto LONG_TIMEOUT = std::chrono::seconds (10);
+
+/** Timeout for waiting in tests that are expected to time out.  */
+constexpr auto SHORT_TIMEOUT = std::chrono::milliseconds (10);
+
+/**
+ * Sleeps some time to give waiting threads a chance to block.
+ */
+void
+SleepSome ()
+{
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+}
+
+class VersionedBroadcastTests : public testing::Test
+{
+
+protected:
+
+  VersionedBroadcast<std::string> broadcast;
+
+};
+
+TEST_F (VersionedBroadcastTests, Initial)
+{
+  uint64_t ver;
+  EXPECT_EQ (broadcast.Get (ver), nullptr);
+  EXPECT_EQ (ver, 0u);
+}
+
+TEST_F (VersionedBroadcastTests, Publish)
+{
+  broadcast.Publish (std::make_shared<std::string> ("foo"));
+  broadcast.Publish (std::make_shared<std::string> ("bar"));
+
+  uint64_t ver;
+  auto val = broadcast.Get (ver);
+  ASSERT_NE (val, nullptr);
+  EXPECT_EQ (*val, "bar");
+  EXPECT_EQ (ver, 2u);
+
+  broadcast.Publish (nullptr);
+  EXPECT_EQ (broadcast.Get (ver), nullptr);
+  EXPECT_EQ (ver, 3u);
+}
+
+TEST_F (VersionedBroadcastTests, ImmediateReturn)
+{
+  broadcast.Publish (std::make_shared<std::string> ("foo"));
+
+  uint64_t ver;
+  auto val = broadcast.WaitForChange (0, LONG_TIMEOUT, ver);
+  ASSERT_NE (val, nullptr);
+  EXPECT_EQ (*val, "foo");
+  EXPECT_EQ (ver, 1u);
+
+  const auto stats = broadcast.GetStats ();
+  EXPECT_EQ (stats.maxWaiters, 0u);
+  EXPECT_EQ (stats.wakeups, 0u);
+}
+
+TEST_F (VersionedBroadcastTests, Timeout)
+{
+  uint64_t ver;
+  EXPECT_EQ (broadcast.WaitForChange (0, SHORT_TIMEOUT, ver), nullptr);
+  EXPECT_EQ (ver, 0u);
+
+  const auto stats = broadcast.GetStats ();
+  EXPECT_EQ (stats.waiters, 0u);
+  EXPECT_EQ (stats.maxWaiters, 1u);
+  EXPECT_EQ (stats.wakeups, 0u);
+}
+
+TEST_F (VersionedBroadcastTests, Wake)
+{
+  std::atomic<bool> done(false);
+  std::thread waiter([&] ()
+    {
+      uint64_t ver;
+      broadcast.WaitForChange (0, LONG_TIMEOUT, ver);
+      EXPECT_EQ (ver, 0u);
+      done = true;
+    });
+
+  SleepSome ();
+  EXPECT_FALSE (done);
+  broadcast.Wake ();
+  waiter.join ();
+  EXPECT_TRUE (done);
+}
+
+TEST_F (VersionedBroadcastTests, ManyWaiters)
+{
+  constexpr unsigned numWaiters = 10;
+
+  std::vector<std::shared_ptr<const std::string>> results(numWaiters);
+  std::vector<std::thread> waiters;
+  for (unsigned i = 0; i < numWaiters; ++i)
+    waiters.emplace_back ([this, &results, i] ()
+      {
+        uint64_t ver;
+        results[i] = broadcast.WaitForChange (0, LONG_TIMEOUT, ver);
+        EXPECT_EQ (ver, 1u);
+      });
+
+  SleepSome ();
+  EXPECT_EQ (broadcast.GetStats ().waiters, numWaiters);
+
+  auto val = std::make_shared<std::string> ("foo");
+  broadcast.Publish (val);
+  for (auto& w : waiters)
+    w.join ();
+
+  /* All waiters should have gotten the very same instance.  */
+  for (const auto& r : results)
+    EXPECT_EQ (r, val);
+
+  const auto stats = broadcast.GetStats ();
+  EXPECT_EQ (stats.waiters, 0u);
+  EXPECT_EQ (stats.maxWaiters, numWaiters);
+  EXPECT_EQ (stats.wakeups, numWaiters);
+  EXPECT_LE (stats.maxWakeLatency.count (),
+             stats.totalWakeLatency.count ());
+
+  LOG (INFO)
+      << "Woke " << stats.wakeups << " waiters, average latency: "
+      << stats.totalWakeLatency.count () / stats.wakeups << " us";
+}
+
+} // anonymous namespace
+} // namespace internal
+} // namespace spacexpanse
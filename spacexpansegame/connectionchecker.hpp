@@ -0,0 +1,44 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_CONNECTIONCHECKER_HPP
+#define SPACEXPANSEGAME_CONNECTIONCHECKER_HPP
+
+/* This file is an implementation detail of Game and should not be
+   used directly by external code!  */
+
+#include "periodictimer.hpp"
+
+#include <chrono>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/**
+ * Helper class that runs a background thread.  At regular intervals,
+ * it calls a check function (e.g. Game::ProbeAndFixConnection).
+ */
+class ConnectionChecker : public PeriodicTimer
+{
+
+public:
+
+  /** Type of the check function.  */
+  using Check = Callback;
+
+  /**
+   * Constructs the instance and starts the background thread.
+   */
+  explicit ConnectionChecker (const Check& c, const std::chrono::milliseconds i)
+    : PeriodicTimer(c, i)
+  {}
+
+};
+
+} // namespace internal
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_CONNECTIONCHECKER_HPP
@@ -4,9 +4,13 @@
 
 #include "defaultmain.hpp"
 
+#include "gamehost.hpp"
 #include "gamerpcserver.hpp"
 #include "lmdbstorage.hpp"
+#include "logstorage.hpp"
 #include "sqlitestorage.hpp"
+#include "undocompression.hpp"
+#include "zmqreplayer.hpp"
 
 #include "rpc-stubs/spacexpanserpcclient.h"
 
@@ -20,6 +24,7 @@
 #include <chrono>
 #include <cstdlib>
 #include <exception>
+#include <iostream>
 #include <thread>
 
 namespace spacexpanse
@@ -78,7 +83,13 @@ CreateStorage (const GameDaemonConfiguration& config,
                const std::string& gameId, const Chain chain)
 {
   if (config.StorageType == "memory")
-    return std::make_unique<MemoryStorage> ();
+    {
+      auto res = std::make_unique<MemoryStorage> ();
+      if (config.MemoryUndoLimitMb > 0)
+        res->SetUndoMemoryLimit (
+            static_cast<size_t> (config.MemoryUndoLimitMb) << 20);
+      return res;
+    }
 
   const fs::path gameDir = GetGameDirectory (config, gameId, chain);
 
@@ -90,7 +101,25 @@ CreateStorage (const GameDaemonConfiguration& config,
           LOG (INFO) << "Creating directory for LMDB environment: " << lmdbDir;
           CHECK (fs::create_directories (lmdbDir));
         }
-      return std::make_unique<LMDBStorage> (lmdbDir.string ());
+
+      LMDBStorage::Options options;
+      options.writeMap = config.LMDBWriteMap;
+      options.noSync = config.LMDBNoSync;
+      options.syncInterval = config.LMDBSyncInterval;
+
+      return std::make_unique<LMDBStorage> (lmdbDir.string (), options);
+    }
+
+  if (config.StorageType == "log")
+    {
+      const fs::path logDir = gameDir / fs::path ("log");
+      if (!fs::is_directory (logDir))
+        {
+          LOG (INFO) << "Creating directory for log storage: " << logDir;
+          CHECK (fs::create_directories (logDir));
+        }
+
+      return std::make_unique<LogStorage> (logDir.string ());
     }
 
   if (config.StorageType == "sqlite")
@@ -103,6 +132,26 @@ CreateStorage (const GameDaemonConfiguration& config,
   return nullptr;
 }
 
+/**
+ * Wraps the given storage for compression of undo data, if that is
+ * enabled in the configuration.  The wrapper (if any) is put into the
+ * holder, and the storage that should be used by the game is returned.
+ */
+StorageInterface&
+WrapStorage (const GameDaemonConfiguration& config, StorageInterface& base,
+             std::unique_ptr<StorageInterface>& holder)
+{
+  if (config.UndoCompression.empty ())
+    return base;
+
+  LOG (INFO) << "Compressing undo data with codec " << config.UndoCompression;
+  const auto codec
+      = CompressedUndoStorage::CodecFromString (config.UndoCompression);
+  holder = std::make_unique<CompressedUndoStorage> (base, codec);
+
+  return *holder;
+}
+
 /**
  * Constructs the server connector for the JSON-RPC server (if any) based
  * on the configuration.
@@ -189,6 +238,62 @@ GetClientVersion (const GameDaemonConfiguration& config)
     }
 }
 
+/**
+ * Connects the game either to SpaceXpanse Core at the configured RPC URL
+ * (whose connector is returned in httpConnector), or to a replayer if
+ * a recording should be replayed instead (returned in replayer).
+ */
+void
+ConnectGame (const GameDaemonConfiguration& config, Game& game,
+             std::unique_ptr<jsonrpc::HttpClient>& httpConnector,
+             std::unique_ptr<ZmqReplayer>& replayer)
+{
+  if (!config.ReplayZmqFile.empty ())
+    {
+      replayer = std::make_unique<ZmqReplayer> (config.ReplayZmqFile);
+      replayer->SetRealTime (config.ReplayRealTime);
+      game.ConnectRpcClient (replayer->GetRpcConnector (),
+                             jsonrpc::JSONRPC_CLIENT_V2);
+      return;
+    }
+
+  CHECK (!config.SpaceXpanseRpcUrl.empty ()) << "SpaceXpanseRpcUrl must be configured";
+  httpConnector
+      = std::make_unique<jsonrpc::HttpClient> (config.SpaceXpanseRpcUrl);
+
+  const auto protocol = GetClientVersion (config);
+  if (config.SpaceXpanseRpcWait)
+    WaitForSpaceXpanse (*httpConnector, protocol);
+
+  game.ConnectRpcClient (*httpConnector, protocol);
+  VerifySpaceXpanseVersion (config, game.GetSpaceXpanseVersion ());
+  CHECK (game.DetectZmqEndpoint ());
+
+  if (!config.RecordZmqFile.empty ())
+    game.EnableZmqRecording (config.RecordZmqFile);
+}
+
+/**
+ * Runs the game together with its components, or the replay if
+ * a replayer is given.
+ */
+void
+RunGame (Game& game, ZmqReplayer* replayer, const std::string& storageType,
+         std::vector<std::unique_ptr<GameComponent>>& components)
+{
+  if (replayer != nullptr)
+    {
+      replayer->Run (game).Print (std::cout, storageType + " storage");
+      return;
+    }
+
+  for (auto& c : components)
+    c->Start ();
+  game.Run ();
+  for (auto& c : components)
+    c->Stop ();
+}
+
 } // anonymous namespace
 
 int
@@ -205,22 +310,15 @@ DefaultMain (const GameDaemonConfiguration& config, const std::string& gameId,
           instanceFact = defaultInstanceFact.get ();
         }
 
-      CHECK (!config.SpaceXpanseRpcUrl.empty ()) << "SpaceXpanseRpcUrl must be configured";
-      const std::string jsonRpcUrl(config.SpaceXpanseRpcUrl);
-      jsonrpc::HttpClient httpConnector(jsonRpcUrl);
-
-      const auto protocol = GetClientVersion (config);
-      if (config.SpaceXpanseRpcWait)
-        WaitForSpaceXpanse (httpConnector, protocol);
-
+      std::unique_ptr<jsonrpc::HttpClient> httpConnector;
+      std::unique_ptr<ZmqReplayer> replayer;
       auto game = std::make_unique<Game> (gameId);
-      game->ConnectRpcClient (httpConnector, protocol);
-      VerifySpaceXpanseVersion (config, game->GetSpaceXpanseVersion ());
-      CHECK (game->DetectZmqEndpoint ());
+      ConnectGame (config, *game, httpConnector, replayer);
 
       std::unique_ptr<StorageInterface> storage
           = CreateStorage (config, gameId, game->GetChain ());
-      game->SetStorage (*storage);
+      std::unique_ptr<StorageInterface> compressed;
+      game->SetStorage (WrapStorage (config, *storage, compressed));
 
       game->SetGameLogic (rules);
 
@@ -230,6 +328,16 @@ DefaultMain (const GameDaemonConfiguration& config, const std::string& gameId,
       if (config.EnablePruning >= 0)
         game->EnablePruning (config.EnablePruning);
 
+      if (config.BulkCatchUp)
+        game->EnableBulkCatchUp (true);
+
+      if (config.AsyncCommit)
+        game->EnableAsyncCommit (true);
+
+      if (config.MaxDataLossMs > 0)
+        game->EnableAdaptiveBatching (
+            std::chrono::milliseconds (config.MaxDataLossMs));
+
       auto components = instanceFact->BuildGameComponents (*game);
 
       auto serverConnector = CreateRpcServerConnector (config);
@@ -241,11 +349,7 @@ DefaultMain (const GameDaemonConfiguration& config, const std::string& gameId,
           components.push_back (
               instanceFact->BuildRpcServer (*game, *serverConnector));
 
-      for (auto& c : components)
-        c->Start ();
-      game->Run ();
-      for (auto& c : components)
-        c->Stop ();
+      RunGame (*game, replayer.get (), config.StorageType, components);
 
       /* We need to make sure that the Game instance is destructed before the
          storage is.  That is necessary, since destructing the Game instance
@@ -279,25 +383,18 @@ SQLiteMain (const GameDaemonConfiguration& config, const std::string& gameId,
           instanceFact = defaultInstanceFact.get ();
         }
 
-      CHECK (!config.SpaceXpanseRpcUrl.empty ()) << "SpaceXpanseRpcUrl must be configured";
-      const std::string jsonRpcUrl(config.SpaceXpanseRpcUrl);
-      jsonrpc::HttpClient httpConnector(jsonRpcUrl);
-
-      const auto protocol = GetClientVersion (config);
-      if (config.SpaceXpanseRpcWait)
-        WaitForSpaceXpanse (httpConnector, protocol);
-
+      std::unique_ptr<jsonrpc::HttpClient> httpConnector;
+      std::unique_ptr<ZmqReplayer> replayer;
       auto game = std::make_unique<Game> (gameId);
-      game->ConnectRpcClient (httpConnector, protocol);
-      VerifySpaceXpanseVersion (config, game->GetSpaceXpanseVersion ());
-      CHECK (game->DetectZmqEndpoint ());
+      ConnectGame (config, *game, httpConnector, replayer);
 
       const fs::path gameDir = GetGameDirectory (config, gameId,
                                                  game->GetChain ());
       const fs::path dbFile = gameDir / fs::path ("storage.sqlite");
 
       rules.Initialise (dbFile.string ());
-      game->SetStorage (rules.GetStorage ());
+      std::unique_ptr<StorageInterface> compressed;
+      game->SetStorage (WrapStorage (config, rules.GetStorage (), compressed));
 
       game->SetGameLogic (rules);
 
@@ -307,6 +404,16 @@ SQLiteMain (const GameDaemonConfiguration& config, const std::string& gameId,
       if (config.EnablePruning >= 0)
         game->EnablePruning (config.EnablePruning);
 
+      if (config.BulkCatchUp)
+        game->EnableBulkCatchUp (true);
+
+      if (config.AsyncCommit)
+        game->EnableAsyncCommit (true);
+
+      if (config.MaxDataLossMs > 0)
+        game->EnableAdaptiveBatching (
+            std::chrono::milliseconds (config.MaxDataLossMs));
+
       auto components = instanceFact->BuildGameComponents (*game);
 
       auto serverConnector = CreateRpcServerConnector (config);
@@ -318,17 +425,150 @@ SQLiteMain (const GameDaemonConfiguration& config, const std::string& gameId,
           components.push_back (
               instanceFact->BuildRpcServer (*game, *serverConnector));
 
-      for (auto& c : components)
-        c->Start ();
-      game->Run ();
-      for (auto& c : components)
-        c->Stop ();
+      RunGame (*game, replayer.get (), "sqlite", components);
 
       /* We need to make sure that the Game instance is destructed before the
          storage is.  That is necessary, since destructing the Game instance
          may still cause some batched transactions to be flushed, and this
          needs the storage intact.  */
       game.reset ();
+
+      /* Processors may still be computing in the background.  They are
+         typically owned by the caller and destructed before the rules,
+         so wait for them here.  */
+      rules.FinishProcessors ();
+    }
+  catch (const std::exception& exc)
+    {
+      LOG (FATAL) << "Exception caught: " << exc.what ();
+    }
+  catch (...)
+    {
+      LOG (FATAL) << "Unknown exception caught";
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+DefaultHostMain (const GameDaemonConfiguration& config,
+                 const std::vector<HostedGameConfiguration>& hosted)
+{
+  try
+    {
+      CustomisedInstanceFactory* instanceFact = config.InstanceFactory;
+      std::unique_ptr<CustomisedInstanceFactory> defaultInstanceFact;
+      if (instanceFact == nullptr)
+        {
+          defaultInstanceFact = std::make_unique<CustomisedInstanceFactory> ();
+          instanceFact = defaultInstanceFact.get ();
+        }
+
+      CHECK (!hosted.empty ()) << "No games configured for the host";
+      CHECK (config.RecordZmqFile.empty () && config.ReplayZmqFile.empty ())
+          << "Recording and replay are not supported for hosted games";
+      CHECK (!config.SpaceXpanseRpcUrl.empty ()) << "SpaceXpanseRpcUrl must be configured";
+      const std::string jsonRpcUrl(config.SpaceXpanseRpcUrl);
+      jsonrpc::HttpClient httpConnector(jsonRpcUrl);
+
+      const auto protocol = GetClientVersion (config);
+      if (config.SpaceXpanseRpcWait)
+        WaitForSpaceXpanse (httpConnector, protocol);
+
+      auto host = std::make_unique<GameHost> ();
+      host->ConnectRpcClient (httpConnector, protocol);
+      VerifySpaceXpanseVersion (config, host->GetSpaceXpanseVersion ());
+      CHECK (host->DetectZmqEndpoint ());
+      const Chain chain = host->GetChain ();
+
+      std::vector<std::unique_ptr<StorageInterface>> storages;
+      std::vector<std::unique_ptr<Game>> games;
+      std::vector<std::unique_ptr<jsonrpc::AbstractServerConnector>> connectors;
+      std::vector<std::unique_ptr<GameComponent>> components;
+
+      for (const auto& h : hosted)
+        {
+          auto game = std::make_unique<Game> (h.GameId);
+          host->AddGame (*game);
+
+          if (h.SQLiteRules != nullptr)
+            {
+              CHECK (h.Rules == nullptr)
+                  << "Only one of Rules and SQLiteRules can be set";
+              const fs::path gameDir = GetGameDirectory (config, h.GameId,
+                                                         chain);
+              const fs::path dbFile = gameDir / fs::path ("storage.sqlite");
+
+              h.SQLiteRules->Initialise (dbFile.string ());
+              std::unique_ptr<StorageInterface> compressed;
+              game->SetStorage (WrapStorage (config,
+                                             h.SQLiteRules->GetStorage (),
+                                             compressed));
+              if (compressed != nullptr)
+                storages.push_back (std::move (compressed));
+              game->SetGameLogic (*h.SQLiteRules);
+            }
+          else
+            {
+              CHECK (h.Rules != nullptr)
+                  << "No rules configured for game " << h.GameId;
+              storages.push_back (CreateStorage (config, h.GameId, chain));
+              std::unique_ptr<StorageInterface> compressed;
+              game->SetStorage (WrapStorage (config, *storages.back (),
+                                             compressed));
+              if (compressed != nullptr)
+                storages.push_back (std::move (compressed));
+              game->SetGameLogic (*h.Rules);
+            }
+
+          if (h.PendingMoves != nullptr)
+            game->SetPendingMoveProcessor (*h.PendingMoves);
+
+          if (config.EnablePruning >= 0)
+            game->EnablePruning (config.EnablePruning);
+
+          if (config.BulkCatchUp)
+            game->EnableBulkCatchUp (true);
+
+          if (config.AsyncCommit)
+            game->EnableAsyncCommit (true);
+
+          if (config.MaxDataLossMs > 0)
+            game->EnableAdaptiveBatching (
+                std::chrono::milliseconds (config.MaxDataLossMs));
+
+          for (auto& c : instanceFact->BuildGameComponents (*game))
+            components.push_back (std::move (c));
+
+          GameDaemonConfiguration gameConfig = config;
+          gameConfig.GameRpcPort = h.GameRpcPort;
+          auto serverConnector = CreateRpcServerConnector (gameConfig);
+          if (serverConnector == nullptr)
+              LOG (WARNING)
+                  << "No connector has been set up for the RPC server of "
+                  << h.GameId << ", no RPC interface will be available";
+          else
+            {
+              components.push_back (
+                  instanceFact->BuildRpcServer (*game, *serverConnector));
+              connectors.push_back (std::move (serverConnector));
+            }
+
+          games.push_back (std::move (game));
+        }
+
+      for (auto& c : components)
+        c->Start ();
+      host->Run ();
+      for (auto& c : components)
+        c->Stop ();
+
+      /* The host needs to be destructed first, as it still references the
+         games.  After that, the games have to be destructed before the
+         storages, just as in DefaultMain.  */
+      host.reset ();
+      components.clear ();
+      games.clear ();
     }
   catch (const std::exception& exc)
     {
@@ -397,6 +637,14 @@ public:
     return GameLogic::GameStateToJson (state);
   }
 
+  bool
+  IsStateJsonSelfContained () const override
+  {
+    /* The callback only gets the encoded state, so it cannot depend
+       on anything else.  */
+    return true;
+  }
+
 };
 
 } // anonymous namespace
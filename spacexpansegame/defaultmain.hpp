@@ -221,11 +221,88 @@ struct GameDaemonConfiguration
   int EnablePruning = -1;
 
   /**
-   * The storage type to be used.  Can be "memory" (default), "lmdb"
-   * or "sqlite".
+   * If true, then the game is configured for bulk catch-up (see
+   * Game::EnableBulkCatchUp), which speeds up syncing of long ranges of
+   * blocks at the expense of state-change notifications while syncing.
+   */
+  bool BulkCatchUp = false;
+
+  /**
+   * If true, storage commits are synced to disk in the background while
+   * the next batch of blocks is processed (see Game::EnableAsyncCommit).
+   */
+  bool AsyncCommit = false;
+
+  /**
+   * If positive, adaptive batching of transactions is enabled (see
+   * Game::EnableAdaptiveBatching), and no block stays uncommitted for
+   * longer than this many milliseconds.
+   */
+  int MaxDataLossMs = 0;
+
+  /**
+   * If set, all ZMQ messages received from SpaceXpanse Core are recorded
+   * to this file, so that they can be replayed later on.
+   */
+  std::string RecordZmqFile;
+
+  /**
+   * If set, the game does not connect to SpaceXpanse Core at all.  Instead,
+   * it replays the ZMQ messages from this recording file, prints statistics
+   * about the processing performance and exits.  The game's storage must
+   * either be empty or match the state at the start of the recording.
+   */
+  std::string ReplayZmqFile;
+
+  /**
+   * If true, the messages of ReplayZmqFile are replayed with the timing
+   * at which they were recorded, rather than as fast as possible.
+   */
+  bool ReplayRealTime = false;
+
+  /**
+   * The storage type to be used.  Can be "memory" (default), "lmdb",
+   * "log" or "sqlite".
    */
   std::string StorageType = "memory";
 
+  /**
+   * If non-zero and memory storage is used, the memory for undo data is
+   * limited to this many MiB.  The oldest undo data is evicted when the
+   * limit is exceeded, so that reorgs back to those blocks need a resync
+   * from scratch.
+   */
+  unsigned MemoryUndoLimitMb = 0;
+
+  /**
+   * If true and LMDB storage is used, the LMDB environment is opened with
+   * MDB_WRITEMAP for faster writes.
+   */
+  bool LMDBWriteMap = false;
+
+  /**
+   * If true and LMDB storage is used, commits are not flushed to disk
+   * right away (MDB_NOSYNC).  Instead, the data is synced explicitly every
+   * LMDBSyncInterval commits and on shutdown, so a system crash may lose
+   * the commits since the last sync (but not corrupt the database).
+   */
+  bool LMDBNoSync = false;
+
+  /**
+   * With LMDBNoSync, the number of committed transactions after which the
+   * LMDB environment is explicitly synced to disk.  If zero, it is only
+   * synced on shutdown.
+   */
+  unsigned LMDBSyncInterval = 0;
+
+  /**
+   * If set, undo data is compressed before it is written to the storage.
+   * The value selects the codec:  "zlib" for the best compression, "fast"
+   * for faster but weaker compression, or "none" to store new undo data
+   * uncompressed while still being able to read compressed data.
+   */
+  std::string UndoCompression;
+
   /**
    * The base data directory for persistent storage.  Must be set unless memory
    * storage is selected.  The game ID is added as an additional directory part
@@ -278,6 +355,52 @@ int SQLiteMain (const GameDaemonConfiguration& config,
                 const std::string& gameId,
                 SQLiteGame& rules);
 
+/**
+ * Configuration of one game that is run as part of a multi-game host
+ * through DefaultHostMain.  Settings shared between all games are taken
+ * from the GameDaemonConfiguration instead.
+ */
+struct HostedGameConfiguration
+{
+
+  /** The game ID.  */
+  std::string GameId;
+
+  /**
+   * The game rules.  Exactly one of Rules and SQLiteRules must be set.
+   * With Rules, the storage is chosen based on the shared StorageType.
+   */
+  GameLogic* Rules = nullptr;
+
+  /**
+   * The game rules for an SQLite-based game.  For them, the storage is
+   * always an SQLite database (as with SQLiteMain).
+   */
+  SQLiteGame* SQLiteRules = nullptr;
+
+  /**
+   * The PendingMoveProcessor for this game, if any.  The PendingMoves field
+   * of the shared configuration is ignored by DefaultHostMain.
+   */
+  PendingMoveProcessor* PendingMoves = nullptr;
+
+  /**
+   * The port for this game's own JSON-RPC server.  The type of server
+   * is taken from the shared configuration.
+   */
+  int GameRpcPort = 0;
+
+};
+
+/**
+ * Runs a default main function for a process hosting multiple games with
+ * a shared connection to SpaceXpanse Core (see GameHost).  The shared
+ * configuration is used for all games, with the per-game settings
+ * (ID, rules, pending moves and RPC port) taken from the hosted list.
+ */
+int DefaultHostMain (const GameDaemonConfiguration& config,
+                     const std::vector<HostedGameConfiguration>& hosted);
+
 /**
  * Struct that holds function pointers for implementations of the
  * various GameLogic functions.  This can be passed directly to the
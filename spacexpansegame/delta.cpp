@@ -0,0 +1,326 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "delta.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/*
+ * The delta format is a varint with the size of the target, followed by
+ * a sequence of instructions.  Each instruction starts with a varint, whose
+ * lowest bit determines the type and whose other bits are the length.
+ * A copy instruction (type 0) is followed by a varint with the offset in
+ * the base string.  An insert instruction (type 1) is followed by the
+ * literal bytes.
+ */
+
+namespace
+{
+
+/** Size of the blocks in the base string that are indexed.  */
+constexpr size_t BLOCK_SIZE = 16;
+
+/** Multiplier for the rolling hash.  */
+constexpr uint64_t HASH_BASE = 1'099'511'628'211;
+
+/**
+ * Appends an unsigned integer as varint (seven bits per byte, with the
+ * highest bit set for all but the last byte).
+ */
+void
+WriteVarInt (std::string& out, uint64_t val)
+{
+  while (val >= 0x80)
+    {
+      out.push_back (static_cast<char> ((val & 0x7F) | 0x80));
+      val >>= 7;
+    }
+  out.push_back (static_cast<char> (val));
+}
+
+/**
+ * Reads a varint from the input at the given position, advancing it.
+ * Returns false if the input ends before the varint does.
+ */
+bool
+ReadVarInt (const std::string& in, size_t& pos, uint64_t& val)
+{
+  val = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+      if (pos >= in.size ())
+        return false;
+
+      const unsigned char byte = in[pos++];
+      val |= static_cast<uint64_t> (byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0)
+        return true;
+    }
+
+  return false;
+}
+
+/**
+ * Helper class that builds up the delta instructions, merging adjacent
+ * copies and collecting literal bytes.
+ */
+class DeltaWriter
+{
+
+private:
+
+  /** The output delta.  */
+  std::string& out;
+
+  /** The target string whose bytes are inserted as literals.  */
+  const std::string& target;
+
+  /** Start of the pending copy in the base, if copyLen is non-zero.  */
+  size_t copyOffset = 0;
+  /** Length of the pending copy.  */
+  size_t copyLen = 0;
+
+  /** Start of the pending literal in the target.  */
+  size_t literalStart = 0;
+  /** Length of the pending literal.  */
+  size_t literalLen = 0;
+
+  void
+  FlushCopy ()
+  {
+    if (copyLen == 0)
+      return;
+
+    WriteVarInt (out, copyLen << 1);
+    WriteVarInt (out, copyOffset);
+    copyLen = 0;
+  }
+
+  void
+  FlushLiteral ()
+  {
+    if (literalLen == 0)
+      return;
+
+    WriteVarInt (out, (literalLen << 1) | 1);
+    out.append (target, literalStart, literalLen);
+    literalLen = 0;
+  }
+
+public:
+
+  explicit DeltaWriter (std::string& o, const std::string& t)
+    : out(o), target(t)
+  {}
+
+  /**
+   * Adds a copy of the given range from the base.
+   */
+  void
+  Copy (const size_t offset, const size_t len)
+  {
+    if (len == 0)
+      return;
+
+    FlushLiteral ();
+    if (copyLen > 0 && copyOffset + copyLen == offset)
+      {
+        copyLen += len;
+        return;
+      }
+
+    FlushCopy ();
+    copyOffset = offset;
+    copyLen = len;
+  }
+
+  /**
+   * Adds the given range of the target as literal bytes.
+   */
+  void
+  Literal (const size_t start, const size_t len)
+  {
+    if (len == 0)
+      return;
+
+    FlushCopy ();
+    if (literalLen > 0 && literalStart + literalLen == start)
+      {
+        literalLen += len;
+        return;
+      }
+
+    FlushLiteral ();
+    literalStart = start;
+    literalLen = len;
+  }
+
+  /**
+   * Writes out all pending instructions.
+   */
+  void
+  Finish ()
+  {
+    FlushCopy ();
+    FlushLiteral ();
+  }
+
+};
+
+/**
+ * Computes the hash of a block of data.
+ */
+uint64_t
+HashBlock (const char* data)
+{
+  uint64_t res = 0;
+  for (size_t i = 0; i < BLOCK_SIZE; ++i)
+    res = res * HASH_BASE + static_cast<unsigned char> (data[i]);
+  return res;
+}
+
+} // anonymous namespace
+
+std::string
+ComputeDelta (const std::string& base, const std::string& target)
+{
+  std::string res;
+  WriteVarInt (res, target.size ());
+  DeltaWriter writer(res, target);
+
+  /* Find the common prefix and suffix first.  They are usually the bulk
+     of the data for small changes, and can be found cheaply.  */
+  const size_t maxCommon = std::min (base.size (), target.size ());
+  size_t prefix = 0;
+  while (prefix < maxCommon && base[prefix] == target[prefix])
+    ++prefix;
+  size_t suffix = 0;
+  while (suffix < maxCommon - prefix
+          && base[base.size () - 1 - suffix]
+                == target[target.size () - 1 - suffix])
+    ++suffix;
+
+  writer.Copy (0, prefix);
+
+  const size_t baseEnd = base.size () - suffix;
+  const size_t targetEnd = target.size () - suffix;
+
+  /* Index all aligned blocks of the base in the middle part.  */
+  std::unordered_map<uint64_t, size_t> index;
+  for (size_t pos = prefix; pos + BLOCK_SIZE <= baseEnd; pos += BLOCK_SIZE)
+    index.emplace (HashBlock (&base[pos]), pos);
+
+  /* Precompute HASH_BASE^(BLOCK_SIZE - 1) for rolling the hash.  */
+  uint64_t highFactor = 1;
+  for (size_t i = 1; i < BLOCK_SIZE; ++i)
+    highFactor *= HASH_BASE;
+
+  /* Scan through the target's middle part, and look for blocks matching
+     the indexed ones with a rolling hash.  */
+  size_t literalStart = prefix;
+  size_t pos = prefix;
+  bool hashValid = false;
+  uint64_t hash = 0;
+  while (!index.empty () && pos + BLOCK_SIZE <= targetEnd)
+    {
+      if (!hashValid)
+        {
+          hash = HashBlock (&target[pos]);
+          hashValid = true;
+        }
+
+      const auto mit = index.find (hash);
+      if (mit != index.end ()
+            && std::memcmp (&target[pos], &base[mit->second], BLOCK_SIZE) == 0)
+        {
+          size_t basePos = mit->second;
+          size_t len = BLOCK_SIZE;
+          while (pos + len < targetEnd && basePos + len < baseEnd
+                  && target[pos + len] == base[basePos + len])
+            ++len;
+          while (pos > literalStart && basePos > prefix
+                  && target[pos - 1] == base[basePos - 1])
+            {
+              --pos;
+              --basePos;
+              ++len;
+            }
+
+          writer.Literal (literalStart, pos - literalStart);
+          writer.Copy (basePos, len);
+
+          pos += len;
+          literalStart = pos;
+          hashValid = false;
+          continue;
+        }
+
+      if (pos + BLOCK_SIZE < targetEnd)
+        {
+          const auto out = static_cast<unsigned char> (target[pos]);
+          const auto in = static_cast<unsigned char> (target[pos + BLOCK_SIZE]);
+          hash = (hash - out * highFactor) * HASH_BASE + in;
+        }
+      ++pos;
+    }
+
+  writer.Literal (literalStart, targetEnd - literalStart);
+  writer.Copy (baseEnd, suffix);
+  writer.Finish ();
+
+  return res;
+}
+
+bool
+ApplyDelta (const std::string& base, const std::string& delta,
+            std::string& target)
+{
+  size_t pos = 0;
+  uint64_t size;
+  if (!ReadVarInt (delta, pos, size))
+    return false;
+
+  target.clear ();
+  target.reserve (size);
+
+  while (pos < delta.size ())
+    {
+      uint64_t header;
+      if (!ReadVarInt (delta, pos, header))
+        return false;
+      const uint64_t len = header >> 1;
+      if (len > size - target.size ())
+        return false;
+
+      if (header & 1)
+        {
+          if (len > delta.size () - pos)
+            return false;
+          target.append (delta, pos, len);
+          pos += len;
+        }
+      else
+        {
+          uint64_t offset;
+          if (!ReadVarInt (delta, pos, offset))
+            return false;
+          if (offset > base.size () || len > base.size () - offset)
+            return false;
+          target.append (base, offset, len);
+        }
+    }
+
+  return target.size () == size;
+}
+
+} // namespace internal
+} // namespace spacexpanse
@@ -0,0 +1,38 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_DELTA_HPP
+#define SPACEXPANSEGAME_DELTA_HPP
+
+/* This file is an implementation detail of DeltaCachingGame and should not
+   be used directly by external code!  */
+
+#include <string>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/**
+ * Computes a compact binary delta that allows to reconstruct the target
+ * string from the base string.  The delta consists of instructions that
+ * either copy a range from the base or insert literal bytes.  Matching
+ * ranges are found from a common prefix and suffix, and in between through
+ * a hash index of fixed-size blocks in the base.  This is efficient if the
+ * two strings differ only in a few places.
+ */
+std::string ComputeDelta (const std::string& base, const std::string& target);
+
+/**
+ * Applies a delta computed by ComputeDelta to the base string, yielding
+ * the target.  Returns false if the delta is invalid for the given base.
+ */
+bool ApplyDelta (const std::string& base, const std::string& delta,
+                 std::string& target);
+
+} // namespace internal
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_DELTA_HPP
@@ -0,0 +1,178 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "delta.hpp"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace spacexpanse
+{
+namespace internal
+{
+namespace
+{
+
+class DeltaTests : public testing::Test
+{
+
+protected:
+
+  /**
+   * Computes the delta between base and target, verifies that applying it
+   * yields the target again, and returns the delta's size.
+   */
+  static size_t
+  ExpectRoundTrip (const std::string& base, const std::string& target)
+  {
+    const std::string delta = ComputeDelta (base, target);
+
+    std::string applied;
+    EXPECT_TRUE (ApplyDelta (base, delta, applied));
+    EXPECT_EQ (applied, target);
+
+    return delta.size ();
+  }
+
+};
+
+TEST_F (DeltaTests, EmptyStrings)
+{
+  ExpectRoundTrip ("", "");
+  ExpectRoundTrip ("", "foo");
+  ExpectRoundTrip ("foo", "");
+}
+
+TEST_F (DeltaTests, Identical)
+{
+  const std::string data(10'000, 'a');
+  EXPECT_LT (ExpectRoundTrip (data, data), 10u);
+}
+
+TEST_F (DeltaTests, CompletelyDifferent)
+{
+  ExpectRoundTrip ("foo", "bar");
+  ExpectRoundTrip ("short", "a much longer string than before");
+  ExpectRoundTrip ("a much longer string than before", "short");
+}
+
+TEST_F (DeltaTests, InsertAndRemove)
+{
+  std::string base;
+  for (unsigned i = 0; i < 1'000; ++i)
+    base += "entry " + std::to_string (i) + "\n";
+
+  std::string target = base;
+  target.insert (5'000, "inserted data");
+  target.erase (2'000, 100);
+  target.insert (100, "more");
+  EXPECT_LT (ExpectRoundTrip (base, target), 100u);
+  EXPECT_LT (ExpectRoundTrip (target, base), 200u);
+}
+
+TEST_F (DeltaTests, MovedBlocks)
+{
+  std::string first, second;
+  for (unsigned i = 0; i < 500; ++i)
+    {
+      first += "first " + std::to_string (i) + ";";
+      second += "second " + std::to_string (i) + ";";
+    }
+
+  EXPECT_LT (ExpectRoundTrip (first + second, second + first), 100u);
+}
+
+TEST_F (DeltaTests, Random)
+{
+  std::mt19937 rnd(42);
+  for (unsigned trial = 0; trial < 100; ++trial)
+    {
+      std::string base;
+      const size_t len = rnd () % 2'000;
+      for (size_t i = 0; i < len; ++i)
+        base.push_back (static_cast<char> (rnd () % 4));
+
+      std::string target = base;
+      for (unsigned i = rnd () % 10; i > 0 && !target.empty (); --i)
+        {
+          const size_t pos = rnd () % target.size ();
+          switch (rnd () % 3)
+            {
+            case 0:
+              target[pos] = static_cast<char> (rnd ());
+              break;
+            case 1:
+              target.erase (pos, rnd () % 50);
+              break;
+            default:
+              target.insert (pos, rnd () % 50, static_cast<char> (rnd ()));
+              break;
+            }
+        }
+
+      ExpectRoundTrip (base, target);
+    }
+}
+
+TEST_F (DeltaTests, InvalidDelta)
+{
+  const std::string base = "some base string";
+  std::string delta = ComputeDelta (base, "some target string");
+
+  std::string out;
+  EXPECT_FALSE (ApplyDelta (base, "", out));
+  EXPECT_FALSE (ApplyDelta (base, delta.substr (0, delta.size () - 1), out));
+  EXPECT_FALSE (ApplyDelta ("short", delta, out));
+  EXPECT_FALSE (ApplyDelta (base, delta + "x", out));
+}
+
+/**
+ * Tests a game state like the one of mover (a large map of players with
+ * positions), where each block only changes a few of the entries.  The
+ * deltas must restore the old states and be much smaller than them.
+ */
+TEST_F (DeltaTests, ScatteredChanges)
+{
+  constexpr unsigned numPlayers = 1'000;
+  constexpr unsigned numBlocks = 5;
+  constexpr unsigned changesPerBlock = 10;
+
+  std::mt19937 rnd(42);
+  std::vector<int> positions(numPlayers);
+  for (auto& p : positions)
+    p = rnd () % 1'000;
+
+  const auto serialise = [&positions] ()
+    {
+      std::ostringstream out;
+      for (unsigned i = 0; i < positions.size (); ++i)
+        out << "player" << i << ":" << positions[i] << ";";
+      return out.str ();
+    };
+
+  std::string state = serialise ();
+  for (unsigned b = 0; b < numBlocks; ++b)
+    {
+      for (unsigned i = 0; i < changesPerBlock; ++i)
+        positions[rnd () % numPlayers] = rnd () % 1'000;
+      const std::string newState = serialise ();
+
+      const std::string delta = ComputeDelta (newState, state);
+      EXPECT_LT (delta.size () * 10, state.size ());
+
+      std::string restored;
+      ASSERT_TRUE (ApplyDelta (newState, delta, restored));
+      ASSERT_EQ (restored, state);
+
+      state = newState;
+    }
+}
+
+} // anonymous namespace
+} // namespace internal
+} // namespace spacexpanse
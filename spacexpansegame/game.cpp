@@ -4,12 +4,15 @@
 
 #include "game.hpp"
 
+#include "gamehost.hpp"
+
 #include <jsonrpccpp/common/errors.h>
 #include <jsonrpccpp/common/exception.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <chrono>
 #include <sstream>
 #include <thread>
@@ -37,6 +40,25 @@ DEFINE_int32 (spacexpanse_zmq_staleness_ms, 120'000,
 DEFINE_int32 (spacexpanse_connection_check_ms, 0,
               "if non-zero, interval between connection checks");
 
+/**
+ * If set to non-zero, then ZMQ notifications are received and parsed
+ * in a separate thread from the one applying them to the game state,
+ * with up to this many parsed notifications queued in between.
+ */
+DEFINE_int32 (spacexpanse_zmq_pipeline_depth, 0,
+              "if non-zero, queue depth for pipelined ZMQ processing");
+
+/**
+ * Pending moves are queued up and processed on a separate thread, only
+ * while no block notifications are waiting.  These flags configure
+ * how many of them can be queued (the oldest are dropped beyond that)
+ * and how many are processed in one batch under the game lock.
+ */
+DEFINE_int32 (spacexpanse_zmq_pending_queue, 10'000,
+              "maximum number of queued pending moves");
+DEFINE_int32 (spacexpanse_zmq_pending_batch, 100,
+              "maximum number of pending moves processed in one batch");
+
 namespace spacexpanse
 {
 
@@ -51,81 +73,32 @@ using CallbackDuration = std::chrono::microseconds;
 /** Unit (as string) for the callback timings.  */
 constexpr const char* CALLBACK_DURATION_UNIT = "us";
 
-} // anonymous namespace
-
-/* ************************************************************************** */
-
 /**
- * Helper class that runs a background thread.  At regular intervals,
- * it calls Game::ProbeAndFixConnection.
+ * Returns the number of seconds (as floating-point value) elapsed since
+ * the given time point.
  */
-class Game::ConnectionCheckerThread
+double
+SecondsSince (const std::chrono::steady_clock::time_point start)
 {
+  using Seconds = std::chrono::duration<double>;
+  const auto elapsed = std::chrono::steady_clock::now () - start;
+  return std::chrono::duration_cast<Seconds> (elapsed).count ();
+}
 
-private:
-
-  /** The Game instance to call the check on.  */
-  Game& game;
-
-  /** The interval for checks.  */
-  const std::chrono::milliseconds intv;
-
-  /** Mutex for this instance.  */
-  std::mutex mut;
-
-  /** Condition variable to wait on / signal a stop request.  */
-  std::condition_variable cv;
-
-  /** The actual thread running.  */
-  std::unique_ptr<std::thread> runner;
-
-  /** Set to true if the thread should stop.  */
-  bool shouldStop;
-
-  /**
-   * Runs the thread's main loop.
-   */
-  void
-  Run ()
-  {
-    std::unique_lock<std::mutex> lock(mut);
-    while (!shouldStop)
-      {
-        cv.wait_for (lock, intv);
-        game.ProbeAndFixConnection ();
-      }
-  }
-
-public:
-
-  explicit ConnectionCheckerThread (Game& g)
-    : game(g), intv(FLAGS_spacexpanse_connection_check_ms), shouldStop(false)
-  {
-    runner = std::make_unique<std::thread> ([this] () { Run (); });
-  }
-
-  ~ConnectionCheckerThread ()
-  {
-    {
-      std::lock_guard<std::mutex> lock(mut);
-      shouldStop = true;
-      cv.notify_all ();
-    }
-
-    runner->join ();
-    runner.reset ();
-  }
-
-};
+} // anonymous namespace
 
 /* ************************************************************************** */
 
 Game::Game (const std::string& id)
-  : gameId(id), state(State::DISCONNECTED), genesisHeight(-1)
+  : gameId(id), state(State::DISCONNECTED), genesisHeight(-1), zmq(&ownZmq)
 {
   targetBlock.SetNull ();
   genesisHash.SetNull ();
-  zmq.AddListener (gameId, this);
+  ownZmq.AddListener (gameId, this);
+
+  /* Only processed blocks should count towards batches, not e.g. pruning
+     transactions.  */
+  transactionManager.SetExplicitBlocks (true);
 }
 
 Game::~Game () = default;
@@ -170,7 +143,7 @@ Game::UpdateStateForAttach (const uint256& parent, const uint256& hash,
       return false;
     }
 
-  const GameStateData oldState = storage->GetCurrentGameState ();
+  const SharedGameStateData oldState = storage->GetCurrentGameStateShared ();
 
   CHECK (blockData.isObject ());
   const auto& blockHeader = blockData["block"];
@@ -182,25 +155,23 @@ Game::UpdateStateForAttach (const uint256& parent, const uint256& hash,
 
     UndoData undo;
     const auto start = PerformanceTimer::now ();
-    const GameStateData newState
+    const SharedGameStateData newState
         = rules->ProcessForward (oldState, blockData, undo);
     const auto end = PerformanceTimer::now ();
-    LOG (INFO)
+    LOG_IF (INFO, !IsBulkCatchingUp ())
         << "Processing block " << height << " forward took "
         << std::chrono::duration_cast<CallbackDuration> (end - start).count ()
         << " " << CALLBACK_DURATION_UNIT;
 
     storage->AddUndoData (hash, height, undo);
-    storage->SetCurrentGameStateWithHeight (hash, height, newState);
+    storage->SetCurrentGameStateShared (hash, height, newState);
 
     tx.Commit ();
-    rules->GameStateUpdated (newState, blockHeader);
+    transactionManager.BlockProcessed ();
+    rules->GameStateUpdated (*newState, blockHeader);
   }
 
-  LOG (INFO)
-      << "Current game state is at height " << height
-      << " (block " << hash.ToHex () << ")";
-  NotifyStateChange ();
+  BlockProcessed (height, hash);
 
   return true;
 }
@@ -230,13 +201,13 @@ Game::UpdateStateForDetach (const uint256& parent, const uint256& hash,
       return false;
     }
 
-  const GameStateData newState = storage->GetCurrentGameState ();
+  const SharedGameStateData newState = storage->GetCurrentGameStateShared ();
 
   {
     internal::ActiveTransaction tx(transactionManager);
 
     const auto start = PerformanceTimer::now ();
-    const GameStateData oldState
+    const SharedGameStateData oldState
         = rules->ProcessBackwards (newState, blockData, undo);
     const auto end = PerformanceTimer::now ();
 
@@ -246,30 +217,102 @@ Game::UpdateStateForDetach (const uint256& parent, const uint256& hash,
     const unsigned height = blockHeader["height"].asUInt ();
     CHECK_GT (height, 0);
 
-    LOG (INFO)
+    LOG_IF (INFO, !IsBulkCatchingUp ())
         << "Undoing block " << height << " took "
         << std::chrono::duration_cast<CallbackDuration> (end - start).count ()
         << " " << CALLBACK_DURATION_UNIT;
 
-    storage->SetCurrentGameStateWithHeight (parent, height - 1, oldState);
+    storage->SetCurrentGameStateShared (parent, height - 1, oldState);
     storage->ReleaseUndoData (hash);
 
     tx.Commit ();
+    transactionManager.BlockProcessed ();
 
     /* The new state's block data is not directly known, but we can conclude
        some information about it.  */
     Json::Value stateBlockHeader(Json::objectValue);
     stateBlockHeader["height"] = static_cast<Json::Int64> (height - 1);
     stateBlockHeader["hash"] = parent.ToHex ();
-    rules->GameStateUpdated (oldState, stateBlockHeader);
+    rules->GameStateUpdated (*oldState, stateBlockHeader);
+
+    LOG_IF (INFO, !IsBulkCatchingUp ())
+        << "Detached " << hash.ToHex () << ", restored state for block "
+        << parent.ToHex ();
+    BlockProcessed (height - 1, parent);
   }
 
+  return true;
+}
+
+void
+Game::BlockProcessed (const unsigned height, const uint256& hash)
+{
+  if (state == State::CATRODNG_UP && catchUpActive)
+    {
+      ++catchUpBlocks;
+
+      constexpr unsigned PROGRESS_INTERVAL = 1'000;
+      if (catchUpBlocks % PROGRESS_INTERVAL == 0)
+        LOG (INFO)
+            << "Catching up: processed " << catchUpBlocks << " blocks,"
+            << " now at height " << height << " ("
+            << catchUpBlocks / SecondsSince (catchUpStart) << " blocks/s)";
+    }
+
+  if (IsBulkCatchingUp ())
+    {
+      VLOG (1)
+          << "Current game state is at height " << height
+          << " (block " << hash.ToHex () << ")";
+      stateChangeSuppressed = true;
+      return;
+    }
+
   LOG (INFO)
-      << "Detached " << hash.ToHex () << ", restored state for block "
-      << parent.ToHex ();
+      << "Current game state is at height " << height
+      << " (block " << hash.ToHex () << ")";
+  PublishSnapshot ();
   NotifyStateChange ();
+}
 
-  return true;
+void
+Game::StartCatchUp ()
+{
+  if (stateChangeSuppressed)
+    {
+      stateChangeSuppressed = false;
+      PublishSnapshot ();
+      NotifyStateChange ();
+    }
+
+  if (catchUpActive)
+    return;
+
+  catchUpActive = true;
+  catchUpBlocks = 0;
+  catchUpStart = std::chrono::steady_clock::now ();
+}
+
+void
+Game::FinishCatchUp ()
+{
+  if (stateChangeSuppressed)
+    {
+      stateChangeSuppressed = false;
+      PublishSnapshot ();
+      NotifyStateChange ();
+    }
+
+  if (!catchUpActive)
+    return;
+  catchUpActive = false;
+
+  const double elapsed = SecondsSince (catchUpStart);
+  LOG (INFO)
+      << "Catch-up finished: processed " << catchUpBlocks << " blocks in "
+      << elapsed << " s";
+  if (elapsed > 0)
+    LOG (INFO) << "Catch-up speed: " << catchUpBlocks / elapsed << " blocks/s";
 }
 
 bool
@@ -387,13 +430,17 @@ Game::BlockAttach (const std::string& id, const Json::Value& data,
   if (needReinit)
     ReinitialiseState ();
 
+  if (state != State::CATRODNG_UP)
+    FinishCatchUp ();
+
   LOG_IF (INFO, state == State::AT_TARGET)
       << "Reached target block " << targetBlock.ToHex ()
       << ", pausing sync for now";
 
   if (state == State::UP_TO_DATE && pending != nullptr)
     {
-      pending->ProcessAttachedBlock (storage->GetCurrentGameState (), data);
+      pending->ProcessAttachedBlock (*storage->GetCurrentGameStateShared (),
+                                     data);
       NotifyPendingStateChange ();
     }
 }
@@ -496,6 +543,9 @@ Game::BlockDetach (const std::string& id, const Json::Value& data,
   if (needReinit)
     ReinitialiseState ();
 
+  if (state != State::CATRODNG_UP)
+    FinishCatchUp ();
+
   LOG_IF (INFO, state == State::AT_TARGET)
       << "Reached target block " << targetBlock.ToHex ()
       << ", pausing sync for now";
@@ -508,31 +558,48 @@ Game::BlockDetach (const std::string& id, const Json::Value& data,
       const unsigned height = data["block"]["height"].asUInt ();
       CHECK_GT (height, 0);
 
-      pending->ProcessDetachedBlock (storage->GetCurrentGameState (), data);
+      pending->ProcessDetachedBlock (*storage->GetCurrentGameStateShared (),
+                                     data);
       NotifyPendingStateChange ();
     }
 }
 
 void
 Game::PendingMove (const std::string& id, const Json::Value& data)
+{
+  PendingMoves (id, {data});
+}
+
+void
+Game::PendingMoves (const std::string& id,
+                    const std::vector<Json::Value>& moves)
 {
   CHECK_EQ (id, gameId);
 
+  /* A shared subscriber of a GameHost forwards pending moves to all games,
+     including those without a processor.  */
+  if (pending == nullptr)
+    {
+      CHECK (host != nullptr);
+      VLOG (1) << "Ignoring pending move without a processor";
+      return;
+    }
+
   std::lock_guard<std::mutex> lock(mut);
   if (state == State::UP_TO_DATE)
     {
       uint256 hash;
       CHECK (storage->GetCurrentBlockHash (hash));
 
-      CHECK (pending != nullptr);
-      pending->ProcessTx (storage->GetCurrentGameState (), data);
+      const auto currentState = storage->GetCurrentGameStateShared ();
+      for (const auto& mv : moves)
+        pending->ProcessTx (*currentState, mv);
       NotifyPendingStateChange ();
     }
   else
-    {
-      VLOG (1) << "Ignoring pending move while not up-to-date";
-      VLOG (2) << "Full data: " << data;
-    }
+    VLOG (1)
+        << "Ignoring " << moves.size ()
+        << " pending moves while not up-to-date";
 }
 
 void
@@ -667,6 +734,59 @@ Game::EnablePruning (const unsigned nBlocks)
     pruningQueue->SetDesiredSize (nBlocks);
 }
 
+void
+Game::EnableBulkCatchUp (const bool enable)
+{
+  LOG (INFO) << "Bulk catch-up mode enabled: " << enable;
+
+  std::lock_guard<std::mutex> lock(mut);
+  bulkCatchUp = enable;
+}
+
+void
+Game::EnableAsyncCommit (const bool enable)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  transactionManager.SetAsyncCommit (enable);
+}
+
+void
+Game::EnableAdaptiveBatching (const std::chrono::milliseconds maxDataLoss)
+{
+  internal::AdaptiveBatchSizer::Limits limits;
+  limits.maxBatchSize = std::max (1u, transactionBatchSize);
+  limits.maxDataLoss = maxDataLoss;
+
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    transactionManager.EnableAdaptiveBatching (limits);
+  }
+
+  /* Batches are normally committed when a block is processed, but after
+     a burst of blocks the next one may not come in time.  So check the
+     open batch regularly as well.  The timer must not be replaced while
+     holding the lock, as its thread may be waiting for it.  */
+  const auto interval = std::max (std::chrono::milliseconds (1),
+                                  maxDataLoss / 10);
+  flushTimer = std::make_unique<internal::PeriodicTimer> (
+      [this] () { FlushBatchIfDue (); }, interval);
+}
+
+void
+Game::FlushBatchIfDue ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  try
+    {
+      transactionManager.FlushIfDue (std::chrono::steady_clock::now ());
+    }
+  catch (const StorageInterface::RetryWithNewTransaction& exc)
+    {
+      LOG (WARNING) << "Committing the batch failed: " << exc.what ();
+      ReinitialiseState ();
+    }
+}
+
 void
 Game::SetTargetBlock (const uint256& blk)
 {
@@ -691,41 +811,36 @@ Game::DetectZmqEndpoint ()
   }
   VLOG (1) << "Configured ZMQ notifications:\n" << notifications;
 
-  bool foundBlocks = false;
-  for (const auto& val : notifications)
-    {
-      const auto& typeVal = val["type"];
-      if (!typeVal.isString ())
-        continue;
-
-      const auto& addrVal = val["address"];
-      CHECK (addrVal.isString ());
-      const std::string address = addrVal.asString ();
-      CHECK (!address.empty ());
-
-      const std::string type = typeVal.asString ();
-      if (type == "pubgameblocks")
-        {
-          LOG (INFO) << "Detected ZMQ blocks endpoint: " << address;
-          zmq.SetEndpoint (address);
-          foundBlocks = true;
-          continue;
-        }
-      if (type == "pubgamepending")
-        {
-          LOG (INFO) << "Detected ZMQ pending endpoint: " << address;
-          zmq.SetEndpointForPending (address);
-          continue;
-        }
-    }
-
-  if (foundBlocks)
+  if (zmq->ConfigureEndpoints (notifications))
     return true;
 
   LOG (WARNING) << "No -zmqpubgameblocks notifier seems to be set up";
   return false;
 }
 
+void
+Game::EnableZmqRecording (const std::string& file)
+{
+  CHECK (host == nullptr) << "Recording is not supported for hosted games";
+  CHECK (!zmq->IsRunning ());
+  CHECK (chain != Chain::UNKNOWN) << "RPC client is not yet set up";
+
+  recorder = std::make_unique<internal::ZmqRecorder> (file, gameId,
+                                                      ChainToString (chain));
+  zmq->SetRecorder (recorder.get ());
+}
+
+Json::Value
+Game::GetBaseStateJson () const
+{
+  Json::Value res(Json::objectValue);
+  res["gameid"] = gameId;
+  res["chain"] = ChainToString (chain);
+  res["state"] = StateToString (state);
+
+  return res;
+}
+
 Json::Value
 Game::GetCustomStateData (
     const std::string& jsonField,
@@ -733,10 +848,7 @@ Game::GetCustomStateData (
 {
   std::unique_lock<std::mutex> lock(mut);
 
-  Json::Value res(Json::objectValue);
-  res["gameid"] = gameId;
-  res["chain"] = ChainToString (chain);
-  res["state"] = StateToString (state);
+  Json::Value res = GetBaseStateJson ();
 
   uint256 hash;
   unsigned height;
@@ -760,8 +872,8 @@ Game::GetCustomStateData (
   res["blockhash"] = hash.ToHex ();
   res["height"] = height;
 
-  const GameStateData gameState = storage->GetCurrentGameState ();
-  res[jsonField] = cb (gameState, hash, height, std::move (lock));
+  const auto gameState = storage->GetCurrentGameStateShared ();
+  res[jsonField] = cb (*gameState, hash, height, std::move (lock));
 
   return res;
 }
@@ -771,6 +883,54 @@ Game::GetCustomStateData (
     const std::string& jsonField,
     const ExtractJsonFromStateWithBlock& cb) const
 {
+  /* The callback does not need the lock, so we can serve the request
+     from the published snapshot if there is one.  */
+  const auto snapshot = snapshots.Get ();
+  const auto fromSnapshot = [&] ()
+    {
+      Json::Value res = GetBaseStateJson ();
+      res["blockhash"] = snapshot->GetHash ().ToHex ();
+      res["height"] = snapshot->GetHeight ();
+      res[jsonField] = cb (snapshot->GetState (), snapshot->GetHash (),
+                           snapshot->GetHeight ());
+      return res;
+    };
+  if (snapshot != nullptr && !stateChangeSuppressed)
+    return fromSnapshot ();
+
+  /* While catching up in bulk, the published snapshot is not updated for
+     each block.  Try to get a read snapshot from the storage instead, which
+     has the last committed state.  We only need the lock briefly while
+     opening it, and the callback can run while blocks are being processed.
+     Hash and height are taken from the snapshot itself, since the storage
+     may have uncommitted changes (e.g. while a batch of blocks is processed
+     in a single transaction) that the snapshot does not see.  */
+  std::unique_ptr<StorageSnapshot> storageSnapshot;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    storageSnapshot = storage->GetReadSnapshot ();
+  }
+  if (storageSnapshot != nullptr)
+    {
+      uint256 hash;
+      unsigned height;
+      if (storageSnapshot->GetCurrentBlockHash (hash)
+            && storageSnapshot->GetCurrentBlockHeight (height))
+        {
+          Json::Value res = GetBaseStateJson ();
+          res["blockhash"] = hash.ToHex ();
+          res["height"] = height;
+          res[jsonField] = cb (storageSnapshot->GetCurrentGameState (),
+                               hash, height);
+          return res;
+        }
+    }
+
+  /* A stale published snapshot is still better than blocking on the lock
+     while blocks are being processed.  */
+  if (snapshot != nullptr)
+    return fromSnapshot ();
+
   return GetCustomStateData (jsonField,
     [&cb] (const GameStateData& state, const uint256& hash,
            const unsigned height,
@@ -797,6 +957,64 @@ Game::GetCustomStateData (
 Json::Value
 Game::GetCurrentJsonState () const
 {
+  return GetSerialisedJsonState ()->GetValue ();
+}
+
+std::shared_ptr<const SerialisedJson>
+Game::GetSerialisedJsonState () const
+{
+  /* While catching up in bulk, the published snapshot is stale and the
+     state actually served comes from elsewhere (see GetCustomStateData),
+     so we cannot look up the cache by the snapshot's block hash.  */
+  const auto snapshot = snapshots.Get ();
+  if (snapshot != nullptr && !stateChangeSuppressed)
+    {
+      auto cached = jsonCache.Get (snapshot->GetHash (),
+                                   StateToString (state));
+      if (cached != nullptr)
+        return cached;
+    }
+
+  auto res = std::make_shared<const SerialisedJson> (
+      ComputeCurrentJsonState ());
+
+  /* The state may have changed in the mean time, so we use the block hash
+     and syncing state from the actual result as key for the cache.  */
+  const auto& val = res->GetValue ();
+  uint256 hash;
+  if (val.isMember ("blockhash")
+        && hash.FromHex (val["blockhash"].asString ()))
+    jsonCache.Store (hash, val["state"].asString (), res);
+
+  return res;
+}
+
+Json::Value
+Game::ComputeCurrentJsonState () const
+{
+  /* If the game's JSON conversion only depends on the state data, we can
+     use the (cached) JSON from the published snapshot without locking.  */
+  const auto snapshot = snapshots.Get ();
+  if (snapshot != nullptr && snapshot->HasJson () && !stateChangeSuppressed)
+    {
+      Json::Value res = GetBaseStateJson ();
+      res["blockhash"] = snapshot->GetHash ().ToHex ();
+      res["height"] = snapshot->GetHeight ();
+      res["gamestate"] = snapshot->GetJson ();
+      return res;
+    }
+
+  /* Otherwise, such games can still convert whatever state
+     GetCustomStateData serves without the lock, so that the result is
+     consistent with it also while catching up in bulk.  */
+  if (rules->IsStateJsonSelfContained ())
+    return GetCustomStateData ("gamestate",
+        [this] (const GameStateData& state,
+                const uint256& hash, const unsigned height)
+          {
+            return rules->GameStateToJson (state);
+          });
+
   return GetCustomStateData ("gamestate",
       [this] (const GameStateData& state,
               const uint256& hash, const unsigned height,
@@ -833,7 +1051,7 @@ Game::GetPendingJsonState () const
 Json::Value
 Game::UnlockedPendingJsonState () const
 {
-  if (!zmq.IsPendingEnabled ())
+  if (!IsPendingEnabled ())
     throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
                                      "pending moves are not tracked");
   CHECK (pending != nullptr);
@@ -864,12 +1082,76 @@ Game::IsHealthy () const
 }
 
 void
-Game::NotifyStateChange () const
+Game::PublishSnapshot ()
 {
-  /* Callers are expected to already hold the mut lock here (as that is the
-     typical case when they make changes to the state anyway).  */
+  uint256 hash;
+  unsigned height;
+
+  /* As in GetCustomStateData, looking up the height may throw if it has
+     to be done through RPC.  In that case, we just clear the snapshot, so
+     that readers fall back to the locked code path.  */
+  try
+    {
+      if (!storage->GetCurrentBlockHashWithHeight (hash, height))
+        {
+          snapshots.Publish (nullptr);
+          jsonCache.Invalidate ();
+          return;
+        }
+    }
+  catch (const std::exception& exc)
+    {
+      LOG (WARNING) << "Failed to publish state snapshot: " << exc.what ();
+      snapshots.Publish (nullptr);
+      jsonCache.Invalidate ();
+      return;
+    }
+
+  const auto old = snapshots.Get ();
+  if (old != nullptr && old->GetHash () == hash && old->GetHeight () == height)
+    return;
+
+  jsonCache.Invalidate ();
+
+  internal::StateSnapshot::JsonConverter conv;
+  if (rules->IsStateJsonSelfContained ())
+    {
+      GameLogic* r = rules;
+      conv = [r] (const GameStateData& s)
+        {
+          return r->GameStateToJson (s);
+        };
+    }
+
+  snapshots.Publish (std::make_shared<internal::StateSnapshot> (
+      hash, height, storage->GetCurrentGameStateShared (), conv));
+  VLOG (1) << "Published state snapshot for block " << hash.ToHex ();
+}
+
+bool
+Game::GetSnapshotBlock (uint256& hash) const
+{
+  const auto snapshot = snapshots.Get ();
+  if (snapshot == nullptr)
+    {
+      hash.SetNull ();
+      return false;
+    }
+
+  hash = snapshot->GetHash ();
+  return true;
+}
+
+void
+Game::NotifyStateChange ()
+{
+  std::shared_ptr<const uint256> hash;
+  const auto snapshot = snapshots.Get ();
+  if (snapshot != nullptr)
+    hash = std::make_shared<uint256> (snapshot->GetHash ());
+
   VLOG (1) << "Notifying waiting threads about state change...";
-  cvStateChanged.notify_all ();
+  stateBroadcast.Publish (std::move (hash));
 }
 
 void
@@ -882,15 +1164,58 @@ Game::NotifyPendingStateChange ()
   VLOG (1)
       << "Notifying waiting threads about change of pending state,"
       << " new version: " << pendingStateVersion;
-  cvPendingStateChanged.notify_all ();
+
+  /* The pending JSON is computed here once for the new version, so that
+     waiting threads need neither recompute it nor take the lock.  If that
+     fails, we publish null, which makes waiters compute it themselves.
+     If no thread is waiting, we skip it as well; a thread starting to wait
+     right now just computes the JSON itself then.  */
+  std::shared_ptr<PendingSnapshot> snapshot;
+  if (IsPendingEnabled () && pendingBroadcast.GetStats ().waiters > 0)
+    try
+      {
+        auto s = std::make_shared<PendingSnapshot> ();
+        s->version = pendingStateVersion;
+        if (!storage->GetCurrentBlockHash (s->block))
+          s->block.SetNull ();
+        s->json = UnlockedPendingJsonState ();
+        snapshot = std::move (s);
+      }
+    catch (const std::exception& exc)
+      {
+        LOG (WARNING) << "Failed to compute pending state: " << exc.what ();
+      }
+
+  pendingBroadcast.Publish (std::move (snapshot));
+}
+
+Json::Value
+Game::PendingJsonFromBroadcast (
+    const std::shared_ptr<const PendingSnapshot>& snapshot) const
+{
+  uint256 current;
+  if (snapshot == nullptr || !GetSnapshotBlock (current)
+        || current != snapshot->block)
+    return GetPendingJsonState ();
+
+  /* The sync state may change without a new pending state (e.g. when we
+     start catching up), so fill in the current one.  This is cheap, as
+     we have to copy the JSON value for returning it anyway.  */
+  Json::Value res = snapshot->json;
+  res["state"] = StateToString (state);
+
+  return res;
 }
 
 void
 Game::WaitForChange (const uint256& oldBlock, uint256& newBlock) const
 {
-  std::unique_lock<std::mutex> lock(mut);
+  /* The version must be read before checking the current block, so that
+     we do not miss a change happening in between.  */
+  uint64_t version;
+  stateBroadcast.Get (version);
 
-  if (!oldBlock.IsNull () && storage->GetCurrentBlockHash (newBlock)
+  if (!oldBlock.IsNull () && GetSnapshotBlock (newBlock)
           && newBlock != oldBlock)
     {
       VLOG (1)
@@ -899,41 +1224,66 @@ Game::WaitForChange (const uint256& oldBlock, uint256& newBlock) const
       return;
     }
 
-  if (zmq.IsRunning ())
+  if (zmq->IsRunning ())
     {
-      VLOG (1) << "Waiting for state change on condition variable...";
-      cvStateChanged.wait_for (lock,
-          std::chrono::milliseconds (FLAGS_spacexpanse_waitforchange_timeout_ms));
+      VLOG (1) << "Waiting for state change...";
+      const uint64_t oldVersion = version;
+      const auto hash = stateBroadcast.WaitForChange (oldVersion,
+          std::chrono::milliseconds (FLAGS_spacexpanse_waitforchange_timeout_ms),
+          version);
       VLOG (1) << "Potential state change detected in WaitForChange";
+
+      if (version != oldVersion)
+        {
+          if (hash == nullptr)
+            newBlock.SetNull ();
+          else
+            newBlock = *hash;
+          return;
+        }
     }
   else
     LOG (WARNING)
         << "WaitForChange called with no active ZMQ listener,"
            " returning immediately";
 
-  if (!storage->GetCurrentBlockHash (newBlock))
-    newBlock.SetNull ();
+  GetSnapshotBlock (newBlock);
 }
 
 Json::Value
 Game::WaitForPendingChange (const int oldVersion) const
 {
-  std::unique_lock<std::mutex> lock(mut);
+  uint64_t version;
+  auto current = pendingBroadcast.Get (version);
 
-  if (oldVersion != WAITFORCHANGE_ALWAYS_BLOCK
-        && oldVersion != pendingStateVersion)
+  if (oldVersion != WAITFORCHANGE_ALWAYS_BLOCK)
     {
-      VLOG (1)
-          << "Known version differs from current one,"
-             " returning immediately from WaitForPendingState";
-      return UnlockedPendingJsonState ();
+      bool changed;
+      if (current != nullptr)
+        changed = (oldVersion != current->version);
+      else
+        {
+          /* Without a broadcast pending state, we have to look at the
+             actual version under the lock.  */
+          std::lock_guard<std::mutex> lock(mut);
+          changed = (oldVersion != pendingStateVersion);
+        }
+
+      if (changed)
+        {
+          VLOG (1)
+              << "Known version differs from current one,"
+                 " returning immediately from WaitForPendingState";
+          return PendingJsonFromBroadcast (current);
+        }
     }
 
-  if (zmq.IsRunning () && zmq.IsPendingEnabled ())
+  if (zmq->IsRunning () && IsPendingEnabled ())
     {
-      VLOG (1) << "Waiting for pending state change on condition variable...";
-      cvPendingStateChanged.wait_for (lock,
-          std::chrono::milliseconds (FLAGS_spacexpanse_waitforchange_timeout_ms));
+      VLOG (1) << "Waiting for pending state change...";
+      current = pendingBroadcast.WaitForChange (version,
+          std::chrono::milliseconds (FLAGS_spacexpanse_waitforchange_timeout_ms),
+          version);
       VLOG (1) << "Potential state change detected in WaitForPendingChange";
     }
   else
@@ -941,7 +1291,22 @@ Game::WaitForPendingChange (const int oldVersion) const
         << "WaitForPendingChange called with no ZMQ listener on pending moves,"
            " returning immediately";
 
-  return UnlockedPendingJsonState ();
+  return PendingJsonFromBroadcast (current);
+}
+
+Game::WaitStats
+Game::GetWaitStats () const
+{
+  WaitStats res;
+  res.state = stateBroadcast.GetStats ();
+  res.pending = pendingBroadcast.GetStats ();
+  return res;
+}
+
+internal::ZmqSubscriber::PendingStats
+Game::GetPendingQueueStats () const
+{
+  return zmq->GetPendingStats ();
 }
 
 void
@@ -965,16 +1330,26 @@ Game::UntrackGame ()
 void
 Game::ConnectToZmq ()
 {
-  if (pending == nullptr)
+  if (host == nullptr)
     {
-      LOG (WARNING)
-          << "No PendingMoveProcessor has been set, disabling pending moves"
-             " in the ZMQ subscriber";
-      zmq.SetEndpointForPending ("");
-    }
+      if (pending == nullptr)
+        {
+          LOG (WARNING)
+              << "No PendingMoveProcessor has been set, disabling pending"
+                 " moves in the ZMQ subscriber";
+          zmq->SetEndpointForPending ("");
+        }
 
-  TrackGame ();
-  zmq.Start ();
+      CHECK_GE (FLAGS_spacexpanse_zmq_pipeline_depth, 0);
+      zmq->SetPipelineDepth (FLAGS_spacexpanse_zmq_pipeline_depth);
+      CHECK_GT (FLAGS_spacexpanse_zmq_pending_queue, 0);
+      CHECK_GT (FLAGS_spacexpanse_zmq_pending_batch, 0);
+      zmq->SetPendingQueue (FLAGS_spacexpanse_zmq_pending_queue,
+                            FLAGS_spacexpanse_zmq_pending_batch);
+
+      TrackGame ();
+      zmq->Start ();
+    }
 
   std::lock_guard<std::mutex> lock(mut);
   ReinitialiseState ();
@@ -985,26 +1360,74 @@ Game::Start ()
 {
   ConnectToZmq ();
 
-  if (FLAGS_spacexpanse_connection_check_ms > 0)
-    connectionChecker = std::make_unique<ConnectionCheckerThread> (*this);
+  if (host == nullptr && FLAGS_spacexpanse_connection_check_ms > 0)
+    connectionChecker = std::make_unique<internal::ConnectionChecker> (
+        [this] () { ProbeAndFixConnection (); },
+        std::chrono::milliseconds (FLAGS_spacexpanse_connection_check_ms));
 }
 
 void
 Game::Stop ()
 {
   connectionChecker.reset ();
-
-  zmq.Stop ();
+  flushTimer.reset ();
+
+  /* For a hosted game, the GameHost stops the shared subscriber
+     before stopping the individual games.  */
+  if (host == nullptr)
+    zmq->Stop ();
+  if (recorder != nullptr)
+    recorder->Flush ();
   UntrackGame ();
   CHECK (state == State::DISCONNECTED);
 
+  /* No more blocks will be processed, but the last batch may still be
+     synced in the background.  Finish that while the storage is
+     certainly still alive.  */
+  transactionManager.WaitForSync ();
+
   /* Make sure to wake up all listeners waiting for a state update (as there
      won't be one anymore).  */
-  NotifyStateChange ();
-  NotifyPendingStateChange ();
+  stateBroadcast.Wake ();
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    NotifyPendingStateChange ();
+  }
 
-  /* Give the RPC server some more time to return still active calls.  */
-  std::this_thread::sleep_for (std::chrono::milliseconds (100));
+  const WaitStats stats = GetWaitStats ();
+  LOG (INFO)
+      << "Waiters for state changes: max " << stats.state.maxWaiters
+      << ", woken " << stats.state.wakeups
+      << ", max latency " << stats.state.maxWakeLatency.count () << " us";
+  LOG (INFO)
+      << "Waiters for pending changes: max " << stats.pending.maxWaiters
+      << ", woken " << stats.pending.wakeups
+      << ", max latency " << stats.pending.maxWakeLatency.count () << " us";
+
+  if (IsPendingEnabled ())
+    {
+      const auto queueStats = GetPendingQueueStats ();
+      LOG (INFO)
+          << "Pending moves: " << queueStats.processed << " processed in "
+          << queueStats.batches << " batches, " << queueStats.dropped
+          << " dropped, " << queueStats.flushed
+          << " flushed ahead of blocks, maximum queue depth "
+          << queueStats.maxDepth;
+    }
+
+  /* Give the RPC server some more time to return still active calls.  The
+     GameHost does this once for all its games.  */
+  if (host == nullptr)
+    std::this_thread::sleep_for (std::chrono::milliseconds (100));
+}
+
+void
+Game::RequestStop ()
+{
+  if (host != nullptr)
+    host->RequestStop ();
+  else
+    mainLoop.Stop ();
 }
 
 void
@@ -1012,6 +1435,7 @@ Game::Run ()
 {
   CHECK (storage != nullptr && rules != nullptr)
       << "Storage and GameLogic must be set before starting the main loop";
+  CHECK (host == nullptr) << "Hosted games must be run through the GameHost";
 
   internal::MainLoop::Functor startAction = [this] () { Start (); };
   internal::MainLoop::Functor stopAction = [this] () { Stop (); };
@@ -1030,6 +1454,7 @@ Game::SyncFromCurrentState (const Json::Value& blockchainInfo,
     {
       LOG (INFO) << "Game state matches sync target";
       state = State::AT_TARGET;
+      FinishCatchUp ();
       return;
     }
 
@@ -1041,6 +1466,8 @@ Game::SyncFromCurrentState (const Json::Value& blockchainInfo,
       LOG (INFO) << "Game state matches current tip, we are up-to-date";
       state = State::UP_TO_DATE;
       transactionManager.SetBatchSize (1);
+      transactionManager.SetRemainingBlocks (0);
+      FinishCatchUp ();
       return;
     }
 
@@ -1069,6 +1496,9 @@ Game::SyncFromCurrentState (const Json::Value& blockchainInfo,
 
   state = State::CATRODNG_UP;
   transactionManager.SetBatchSize (transactionBatchSize);
+  transactionManager.SetRemainingBlocks (upd["steps"]["detach"].asUInt ()
+                                         + upd["steps"]["attach"].asUInt ());
+  StartCatchUp ();
 
   CHECK (catchingUpTarget.FromHex (upd["toblock"].asString ()));
   reqToken = upd["reqtoken"].asString ();
@@ -1086,6 +1516,7 @@ Game::ReinitialiseState ()
   if (storage->GetCurrentBlockHash (currentHash))
     {
       LOG (INFO) << "We have a current game state, syncing from there";
+      PublishSnapshot ();
       state = State::OUT_OF_SYNC;
       SyncFromCurrentState (data, currentHash);
       return;
@@ -1120,6 +1551,7 @@ Game::ReinitialiseState ()
       LOG (INFO)
           << "Block height " << data["blocks"].asInt ()
           << " is before the genesis height " << genesisHeight;
+      PublishSnapshot ();
       state = State::PREGENESIS;
       return;
     }
@@ -1165,6 +1597,10 @@ Game::ReinitialiseState ()
                                                 genesisData);
         tx.Commit ();
 
+        /* The genesis state counts as block, so that it does not stay
+           in an uncommitted batch until the next block comes in.  */
+        transactionManager.BlockProcessed ();
+
         Json::Value stateBlockHeader(Json::objectValue);
         stateBlockHeader["height"] = static_cast<Json::Int64> (genesisHeight);
         stateBlockHeader["hash"] = genesisHash.ToHex ();
@@ -1180,6 +1616,7 @@ Game::ReinitialiseState ()
   LOG (INFO)
       << "We are at the genesis height, stored initial game state for block "
       << genesisHash.ToHex ();
+  PublishSnapshot ();
   NotifyStateChange ();
 
   state = State::OUT_OF_SYNC;
@@ -1203,7 +1640,7 @@ Game::ProbeAndFixConnection ()
       catch (const std::exception& exc)
         {
           LOG_FIRST_N (ERROR, 10) << "Exception caught: " << exc.what ();
-          zmq.RequestStop ();
+          zmq->RequestStop ();
           return;
         }
     }
@@ -1217,7 +1654,7 @@ Game::ProbeAndFixConnection ()
      that we will ping & process the ping before attempting a reconnect
      in case the connection is still working fine.  */
   const auto pingStaleness = maxStaleness / 2;
-  const auto staleness = zmq.GetBlockStaleness<std::chrono::milliseconds> ();
+  const auto staleness = zmq->GetBlockStaleness<std::chrono::milliseconds> ();
 
   if (staleness < pingStaleness)
     return;
@@ -1225,7 +1662,7 @@ Game::ProbeAndFixConnection ()
   if (staleness > maxStaleness)
     {
       LOG (ERROR) << "ZMQ connection is stale, disconnecting...";
-      zmq.RequestStop ();
+      zmq->RequestStop ();
       return;
     }
 
@@ -1245,7 +1682,7 @@ Game::ProbeAndFixConnection ()
   catch (const std::exception& exc)
     {
       LOG_FIRST_N (ERROR, 10) << "Exception caught: " << exc.what ();
-      zmq.RequestStop ();
+      zmq->RequestStop ();
     }
 }
 
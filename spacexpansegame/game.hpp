@@ -5,11 +5,16 @@
 #ifndef SPACEXPANSEGAME_GAME_HPP
 #define SPACEXPANSEGAME_GAME_HPP
 
+#include "broadcast.hpp"
+#include "connectionchecker.hpp"
 #include "gamelogic.hpp"
 #include "heightcache.hpp"
+#include "jsoncache.hpp"
 #include "mainloop.hpp"
 #include "pendingmoves.hpp"
+#include "periodictimer.hpp"
 #include "pruningqueue.hpp"
+#include "statesnapshot.hpp"
 #include "storage.hpp"
 #include "transactionmanager.hpp"
 #include "zmqsubscriber.hpp"
@@ -22,7 +27,7 @@
 #include <jsonrpccpp/client.h>
 
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -31,6 +36,9 @@
 namespace spacexpanse
 {
 
+class GameHost;
+class ZmqReplayer;
+
 /**
  * The main class implementing a game on the SpaceXpanse platform.  It handles the
  * ZMQ and RPC communication with the SpaceXpanse daemon as well as the RPC interface
@@ -45,8 +53,6 @@ class Game : private internal::ZmqListener
 
 private:
 
-  class ConnectionCheckerThread;
-
   /**
    * States for the game engine during syncing / operation.  The basic states
    * and transitions between states are as follows:
@@ -103,21 +109,44 @@ private:
    * changes might be made from the ZMQ listener on the ZMQ subscriber's
    * worker thread in addition to the main thread.
    *
-   * It is also used as lock for the waitforchange condition variable.
+   * Threads waiting for state changes do not hold this lock; they wait
+   * on the broadcasts below instead.
    */
   mutable std::mutex mut;
 
   /**
-   * Condition variable that is signalled whenever the game state is changed
-   * (due to attached/detached blocks or the initial state becoming known).
+   * A computed pending state, as it is broadcast to threads waiting
+   * in WaitForPendingChange.
+   */
+  struct PendingSnapshot
+  {
+
+    /** The pending state's version.  */
+    int version;
+
+    /** The block hash of the confirmed state it is based on.  */
+    uint256 block;
+
+    /** The full pending JSON state.  */
+    Json::Value json;
+
+  };
+
+  /**
+   * Broadcast of the current block hash to threads waiting in
+   * WaitForChange.  A new version is published whenever the game state
+   * is changed (due to attached/detached blocks or the initial state
+   * becoming known).  The value is null if there is no current state.
    */
-  mutable std::condition_variable cvStateChanged;
+  internal::VersionedBroadcast<uint256> stateBroadcast;
 
   /**
-   * Condition variable that is signalled whenever the pending state
-   * is changed.
+   * Broadcast of the pending state to threads waiting in
+   * WaitForPendingChange.  The JSON is computed once whenever the
+   * pending state changes while threads are waiting, and then shared
+   * by all of them.  Otherwise the value is null.
    */
-  mutable std::condition_variable cvPendingStateChanged;
+  internal::VersionedBroadcast<PendingSnapshot> pendingBroadcast;
 
   /** The chain type to which the game is connected.  */
   Chain chain = Chain::UNKNOWN;
@@ -171,12 +200,44 @@ private:
   /** The JSON-RPC client connection to the SpaceXpanse daemon.  */
   std::unique_ptr<SpaceXpanseRpcClient> rpcClient;
 
-  /** The ZMQ subscriber.  */
-  internal::ZmqSubscriber zmq;
+  /**
+   * The recorder for received ZMQ messages, if recording is enabled.  This
+   * must be declared before ownZmq, so that the subscriber's thread is
+   * stopped before the recorder is destructed.
+   */
+  std::unique_ptr<internal::ZmqRecorder> recorder;
+
+  /** The ZMQ subscriber owned by this instance.  */
+  internal::ZmqSubscriber ownZmq;
+
+  /**
+   * The ZMQ subscriber in use.  This is ownZmq for a standalone game, and
+   * the shared subscriber of the GameHost if the game is hosted.
+   */
+  internal::ZmqSubscriber* zmq;
+
+  /**
+   * The GameHost running this game, if any.  In that case, the host
+   * takes care of the ZMQ subscriber and connection checks.
+   */
+  GameHost* host = nullptr;
 
   /** The height-caching storage we use.  */
   std::unique_ptr<internal::StorageWithCachedHeight> storage;
 
+  /**
+   * The most recently published snapshot of the current state.  It is
+   * updated (with mut held) whenever a state change is notified, and
+   * read without any lock by the RPC methods for the current state.
+   */
+  internal::SnapshotPublisher snapshots;
+
+  /**
+   * Cache for the serialised current JSON state.  It is invalidated
+   * whenever a new snapshot is published.
+   */
+  mutable internal::StateJsonCache jsonCache;
+
   /** The game rules in use.  */
   GameLogic* rules = nullptr;
 
@@ -199,6 +260,28 @@ private:
   /** The manager for batched atomic transactions.  */
   internal::TransactionManager transactionManager;
 
+  /**
+   * If enabled, then notifications of waiting threads and per-block logging
+   * are suppressed while catching up, until a catch-up target is reached.
+   */
+  bool bulkCatchUp = false;
+
+  /**
+   * Set to true if a state change has not been notified to waiting
+   * threads due to bulk catch-up.  The published snapshot is then stale.
+   * This is read without holding the lock by GetCustomStateData.
+   */
+  std::atomic<bool> stateChangeSuppressed{false};
+
+  /** Whether or not we are in a catch-up phase that is being timed.  */
+  bool catchUpActive = false;
+
+  /** Number of blocks processed in the current catch-up phase.  */
+  unsigned catchUpBlocks = 0;
+
+  /** Time at which the current catch-up phase started.  */
+  std::chrono::steady_clock::time_point catchUpStart;
+
   /** The main loop.  */
   internal::MainLoop mainLoop;
 
@@ -206,13 +289,22 @@ private:
   std::unique_ptr<internal::PruningQueue> pruningQueue;
 
   /** The background thread running regular connection checks, if any.  */
-  std::unique_ptr<ConnectionCheckerThread> connectionChecker;
+  std::unique_ptr<internal::ConnectionChecker> connectionChecker;
+
+  /**
+   * The background thread that regularly commits an open batch of
+   * transactions once it reaches the data-loss window with adaptive
+   * batching, even if no more blocks come in.
+   */
+  std::unique_ptr<internal::PeriodicTimer> flushTimer;
 
   void BlockAttach (const std::string& id, const Json::Value& data,
                     bool seqMismatch) override;
   void BlockDetach (const std::string& id, const Json::Value& data,
                     bool seqMismatch) override;
   void PendingMove (const std::string& id, const Json::Value& data) override;
+  void PendingMoves (const std::string& id,
+                     const std::vector<Json::Value>& moves) override;
   void HasStopped () override;
 
   /**
@@ -252,6 +344,45 @@ private:
   bool UpdateStateForDetach (const uint256& parent, const uint256& child,
                              const Json::Value& blockData);
 
+  /**
+   * Returns true if pending moves are tracked for this game, i.e. there
+   * is a processor and the ZMQ subscriber receives them.
+   */
+  bool
+  IsPendingEnabled () const
+  {
+    return pending != nullptr && zmq->IsPendingEnabled ();
+  }
+
+  /**
+   * Returns true if we are currently catching up in bulk mode, which means
+   * that per-block logging and notifications should be suppressed.
+   */
+  bool
+  IsBulkCatchingUp () const
+  {
+    return bulkCatchUp && state == State::CATRODNG_UP;
+  }
+
+  /**
+   * Handles the notifications and statistics after a block has been
+   * attached or detached successfully.
+   */
+  void BlockProcessed (unsigned height, const uint256& hash);
+
+  /**
+   * Starts timing a catch-up phase if not yet active, and notifies waiting
+   * threads about a state change if that has been suppressed in the
+   * previous (already finished) part of the catch-up.
+   */
+  void StartCatchUp ();
+
+  /**
+   * Marks the current catch-up phase as done, reports the sync speed and
+   * sends out a suppressed notification about the state change (if any).
+   */
+  void FinishCatchUp ();
+
   /**
    * Starts to sync from the current game state to the current chain tip.
    * This is a helper method called from ReinitialiseState when the state
@@ -279,18 +410,52 @@ private:
    */
   void ProbeAndFixConnection ();
 
+  /**
+   * Commits the current batch of transactions if it has reached the
+   * data-loss window of adaptive batching.  This is run periodically by
+   * the flush timer.
+   */
+  void FlushBatchIfDue ();
+
   /**
    * Connects the GSP daemon to the ZMQ server and initialises everything
    * for starting it up.  This is shared logic between the Start() method
    * and connection recovery from ProbeAndFixConnection.
+   *
+   * For a hosted game, the GameHost tracks the game and starts the shared
+   * ZMQ subscriber itself, so that this just reinitialises the state.
    */
   void ConnectToZmq ();
 
   /**
-   * Notifies potentially-waiting threads that the state has changed.  Callers
-   * must hold the mut lock.
+   * Publishes a new snapshot of the current state from storage (or clears
+   * it if there is no current state).  Callers must hold the mut lock.
    */
-  void NotifyStateChange () const;
+  void PublishSnapshot ();
+
+  /**
+   * Returns the block hash of the currently published snapshot.  Returns
+   * false (and sets the hash to null) if there is none.
+   */
+  bool GetSnapshotBlock (uint256& hash) const;
+
+  /**
+   * Returns the basic JSON object (game ID, chain, syncing state) that
+   * is extended by GetCustomStateData with the actual data.
+   */
+  Json::Value GetBaseStateJson () const;
+
+  /**
+   * Computes the full current JSON state (without using the cache).
+   */
+  Json::Value ComputeCurrentJsonState () const;
+
+  /**
+   * Notifies potentially-waiting threads that the state has changed.
+   * This publishes the block hash of the current snapshot, so it
+   * must be called after PublishSnapshot.
+   */
+  void NotifyStateChange ();
 
   /**
    * Notifies potentially-waiting threads that the pending state has changed.
@@ -303,13 +468,25 @@ private:
    */
   Json::Value UnlockedPendingJsonState () const;
 
+  /**
+   * Returns the JSON for a pending state received through the broadcast.
+   * If it is null or based on a different block than the current
+   * snapshot (e.g. because the confirmed state changed in the meantime
+   * without a pending update), the JSON is computed freshly instead.
+   */
+  Json::Value
+  PendingJsonFromBroadcast (
+      const std::shared_ptr<const PendingSnapshot>& snapshot) const;
+
   /**
    * Converts a state enum value to a string for use in log messages and the
    * JSON-RPC interface.
    */
   static std::string StateToString (State s);
 
+  friend class GameHost;
   friend class GameTestFixture;
+  friend class ZmqReplayer;
 
 public:
 
@@ -406,6 +583,33 @@ public:
    */
   void EnablePruning (unsigned nBlocks);
 
+  /**
+   * Enables or disables bulk catch-up mode.  In it, waiting threads are not
+   * notified about each block applied while catching up (only when
+   * a catch-up target is reached), and the per-block logging is reduced.
+   * This speeds up syncing large ranges of blocks.
+   */
+  void EnableBulkCatchUp (bool enable);
+
+  /**
+   * Enables or disables asynchronous commits.  With them, batches of blocks
+   * applied while catching up are synced to disk in the background, while
+   * the next batch is being processed.  A crash may then lose the last
+   * batch, which is just synced again after restarting.
+   */
+  void EnableAsyncCommit (bool enable);
+
+  /**
+   * Enables adaptive batching of transactions, both while catching up and
+   * at the tip.  Batches are sized from the observed block and commit timing,
+   * such that no block stays uncommitted for longer than the given window
+   * (and they are at most as large as the fixed batch size while catching
+   * up).  The batch is also committed when the catch-up target is reached,
+   * and by a background timer when no further block comes in before the
+   * window is used up.
+   */
+  void EnableAdaptiveBatching (std::chrono::milliseconds maxDataLoss);
+
   /**
    * Sets an explicit block hash to sync to (and then stop as AT_TARGET),
    * or disables one (i.e. sync to tip) if the value is null.
@@ -418,17 +622,21 @@ public:
    */
   bool DetectZmqEndpoint ();
 
+  /**
+   * Enables recording of all received ZMQ messages to the given file, which
+   * can then be replayed offline with ZmqReplayer.  Must be called after
+   * the RPC client is connected and before the game is started.
+   */
+  void EnableZmqRecording (const std::string& file);
+
   /**
    * Requests the server to stop; this may be called always, but only has
    * an effect if the Run() is currently blocking in the main loop.  This method
    * is mainly meant to be exposed by the game daemon through its JSON-RPC
-   * interface.
+   * interface.  For a hosted game, the request is forwarded to the
+   * GameHost (and stops all its games).
    */
-  void
-  RequestStop ()
-  {
-    mainLoop.Stop ();
-  }
+  void RequestStop ();
 
   /**
    * Returns a JSON object that contains information about the current
@@ -454,6 +662,14 @@ public:
    * This function can be used to implement custom "getter" RPC methods
    * that do not need to return the full game state but just some part
    * of it that is interesting at the moment.
+   *
+   * If a snapshot of the current state has been published, the data is
+   * extracted from it without locking the Game instance.  Note that while
+   * catching up in bulk mode, snapshots are only published when the
+   * catch-up target is reached.  In that case, a read snapshot of the
+   * storage (with the last committed state) is used instead if the storage
+   * supports it, so that the callback still runs without holding the lock
+   * and sees a recent state.
    */
   Json::Value GetCustomStateData (
       const std::string& jsonField,
@@ -475,9 +691,22 @@ public:
    * This method is exposed by GameRpcServer externally (as the main external
    * interface to a game daemon), and can be exposed by custom JSON-RPC servers
    * as well.
+   *
+   * If the GameLogic's JSON conversion is self-contained, then the JSON is
+   * computed once per published state snapshot and returned from there,
+   * without locking the Game instance.
    */
   Json::Value GetCurrentJsonState () const;
 
+  /**
+   * Returns the current JSON state as per GetCurrentJsonState, but in
+   * a shared form that also provides the serialised (and gzip-compressed)
+   * bytes.  The result is cached for as long as the current block and
+   * syncing state do not change, so that repeated requests do not need
+   * to convert and serialise the state again.
+   */
+  std::shared_ptr<const SerialisedJson> GetSerialisedJsonState () const;
+
   /**
    * Returns a JSON object that just contains basic stats about the game daemon
    * itself (e.g. syncing state, current block height) but no specific pieces
@@ -540,6 +769,29 @@ public:
    */
   Json::Value WaitForPendingChange (int oldState) const;
 
+  /**
+   * Statistics about the threads waiting in WaitForChange and
+   * WaitForPendingChange.
+   */
+  struct WaitStats
+  {
+    internal::BroadcastStats state;
+    internal::BroadcastStats pending;
+  };
+
+  /**
+   * Returns the current statistics about waiting threads (number of
+   * waiters and wake-up latencies).
+   */
+  WaitStats GetWaitStats () const;
+
+  /**
+   * Returns the statistics of the ZMQ subscriber's queue of pending moves
+   * (e.g. its depth and the age of the oldest queued move).  For a hosted
+   * game, these are the stats of the subscriber shared by all games.
+   */
+  internal::ZmqSubscriber::PendingStats GetPendingQueueStats () const;
+
   /**
    * Starts the ZMQ subscriber and other logic.  Must not be called before
    * the ZMQ endpoint has been configured, and must not be called when
@@ -557,6 +809,8 @@ public:
    * Runs the main event loop for the Game.  This starts the game logic as
    * Start does, blocks the calling thread until a stop of the server is
    * requested, and then stops everything again.
+   *
+   * This must not be called for games that are run by a GameHost.
    */
   void Run ();
 
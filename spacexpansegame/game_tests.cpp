@@ -29,6 +29,7 @@
 #include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
 
 DECLARE_int32 (spacexpanse_zmq_staleness_ms);
 
@@ -286,6 +287,12 @@ public:
     return res;
   }
 
+  bool
+  IsStateJsonSelfContained () const override
+  {
+    return true;
+  }
+
   void
   SetGenesisHash (const std::string& h)
   {
@@ -340,6 +347,9 @@ protected:
 
 public:
 
+  /** Number of times the JSON state has been requested.  */
+  mutable unsigned toJsonCalls = 0;
+
   TestPendingMoves ()
     : data(Json::objectValue)
   {}
@@ -347,6 +357,7 @@ public:
   Json::Value
   ToJson () const override
   {
+    ++toJsonCalls;
     return data;
   }
 
@@ -760,6 +771,13 @@ TEST_F (GetCurrentJsonStateTests, HeightResolvedViaRpc)
                                 TestGame::GenesisBlockHash ());
   ReinitialiseState (g);
 
+  /* Overwrite the current state without height, so that the storage
+     does not know it (as for a storage that does not persist heights).  */
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (TestGame::GenesisBlockHash (),
+                               storage.GetCurrentGameState ());
+  storage.CommitTransaction ();
+
   /* Use another game instance (but with the same underlying storage) to
      simulate startup without a cached height (but persisted current game
      state).  */
@@ -820,6 +838,317 @@ TEST_F (GetCurrentJsonStateTests, CallbackUnblocked)
 
 /* ************************************************************************** */
 
+using PublishedSnapshotTests = InitialStateTests;
+
+TEST_F (PublishedSnapshotTests, ReadersNotBlockedByLock)
+{
+  mockSpaceXpanseServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  SetStartingBlock (GAME_GENESIS_HEIGHT, TestGame::GenesisBlockHash ());
+  AttachBlock (g, BlockHash (11), Moves ("a0"));
+
+  std::atomic<bool> lockHeld;
+  std::atomic<bool> lockReleased;
+  lockHeld = false;
+  lockReleased = false;
+
+  /* Keep the Game instance locked for a while (as BlockAttach would while
+     processing a block).  */
+  std::thread locker([&] ()
+    {
+      g.GetCustomStateData ("data",
+          [&] (const GameStateData& state, const uint256& hash,
+               const unsigned height, std::unique_lock<std::mutex> lock)
+          {
+            lockHeld = true;
+            std::this_thread::sleep_for (std::chrono::milliseconds (100));
+            lockReleased = true;
+            return Json::Value ();
+          });
+    });
+
+  while (!lockHeld)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  const Json::Value state = g.GetCurrentJsonState ();
+  EXPECT_EQ (state["blockhash"], BlockHash (11).ToHex ());
+  EXPECT_EQ (state["height"].asInt (), 11);
+  EXPECT_EQ (state["gamestate"]["state"], "a0");
+
+  const Json::Value nullState = g.GetNullJsonState ();
+  EXPECT_EQ (nullState["height"].asInt (), 11);
+
+  EXPECT_FALSE (lockReleased);
+  locker.join ();
+}
+
+TEST_F (PublishedSnapshotTests, UpdatedOnDetach)
+{
+  mockSpaceXpanseServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  SetStartingBlock (GAME_GENESIS_HEIGHT, TestGame::GenesisBlockHash ());
+  AttachBlock (g, BlockHash (11), Moves ("a0"));
+  AttachBlock (g, BlockHash (12), Moves ("b1"));
+  EXPECT_EQ (g.GetCurrentJsonState ()["gamestate"]["state"], "a0b1");
+
+  DetachBlock (g);
+  const Json::Value state = g.GetCurrentJsonState ();
+  EXPECT_EQ (state["blockhash"], BlockHash (11).ToHex ());
+  EXPECT_EQ (state["height"].asInt (), 11);
+  EXPECT_EQ (state["gamestate"]["state"], "a0");
+}
+
+TEST_F (PublishedSnapshotTests, SerialisedStateCached)
+{
+  mockSpaceXpanseServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  SetStartingBlock (GAME_GENESIS_HEIGHT, TestGame::GenesisBlockHash ());
+  AttachBlock (g, BlockHash (11), Moves ("a0"));
+
+  const auto first = g.GetSerialisedJsonState ();
+  EXPECT_EQ (first->GetValue (), g.GetCurrentJsonState ());
+  EXPECT_EQ (ParseJson (first->GetSerialised ()), first->GetValue ());
+  EXPECT_EQ (g.GetSerialisedJsonState (), first);
+
+  AttachBlock (g, BlockHash (12), Moves ("b1"));
+  const auto second = g.GetSerialisedJsonState ();
+  EXPECT_NE (second, first);
+  EXPECT_EQ (second->GetValue ()["height"].asInt (), 12);
+  EXPECT_EQ (second->GetValue ()["gamestate"]["state"], "a0b1");
+  EXPECT_EQ (g.GetSerialisedJsonState (), second);
+
+  DetachBlock (g);
+  const auto third = g.GetSerialisedJsonState ();
+  EXPECT_NE (third, second);
+  EXPECT_EQ (third->GetValue (), first->GetValue ());
+}
+
+/**
+ * Tests that readers calling GetCurrentJsonState concurrently with blocks
+ * being attached always see a consistent state that only moves forward.
+ */
+TEST_F (PublishedSnapshotTests, ConcurrentReaders)
+{
+  constexpr unsigned numBlocks = 50;
+  constexpr unsigned numReaders = 4;
+
+  mockSpaceXpanseServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  SetStartingBlock (GAME_GENESIS_HEIGHT, TestGame::GenesisBlockHash ());
+
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> reads(0);
+  std::vector<std::thread> readers;
+  for (unsigned i = 0; i < numReaders; ++i)
+    readers.emplace_back ([&] ()
+      {
+        unsigned lastHeight = 0;
+        while (!done)
+          {
+            const Json::Value state = g.GetCurrentJsonState ();
+            const unsigned height = state["height"].asUInt ();
+            EXPECT_GE (height, lastHeight);
+            lastHeight = height;
+
+            /* The game state must match the height it is reported for.  */
+            if (height > GAME_GENESIS_HEIGHT)
+              {
+                const bool even = (height - GAME_GENESIS_HEIGHT) % 2 == 0;
+                EXPECT_EQ (state["gamestate"]["state"], even ? "a0" : "a1");
+              }
+            ++reads;
+          }
+      });
+
+  for (unsigned i = 1; i <= numBlocks; ++i)
+    AttachBlock (g, BlockHash (GAME_GENESIS_HEIGHT + i),
+                 Moves (i % 2 == 0 ? "a0" : "a1"));
+
+  done = true;
+  for (auto& t : readers)
+    t.join ();
+
+  EXPECT_GT (reads, 0);
+  const Json::Value state = g.GetCurrentJsonState ();
+  EXPECT_EQ (state["height"].asInt (), GAME_GENESIS_HEIGHT + numBlocks);
+}
+
+/**
+ * Memory storage that supports read snapshots, which simply copy the
+ * current state when they are created.
+ */
+class SnapshotMemoryStorage : public MemoryStorage
+{
+
+private:
+
+  class Snapshot : public StorageSnapshot
+  {
+
+  private:
+
+    bool hasHash;
+    bool hasHeight;
+    uint256 hash;
+    unsigned height;
+    GameStateData state;
+
+  public:
+
+    explicit Snapshot (const MemoryStorage& s)
+    {
+      hasHash = s.GetCurrentBlockHash (hash);
+      hasHeight = s.GetCurrentBlockHeight (height);
+      if (hasHash)
+        state = s.GetCurrentGameState ();
+    }
+
+    bool
+    GetCurrentBlockHash (uint256& h) const override
+    {
+      h = hash;
+      return hasHash;
+    }
+
+    GameStateData
+    GetCurrentGameState () const override
+    {
+      return state;
+    }
+
+    bool
+    GetCurrentBlockHeight (unsigned& h) const override
+    {
+      h = height;
+      return hasHeight;
+    }
+
+  };
+
+public:
+
+  /** Number of read snapshots taken so far.  */
+  mutable unsigned snapshotsTaken = 0;
+
+  std::unique_ptr<StorageSnapshot>
+  GetReadSnapshot () const override
+  {
+    ++snapshotsTaken;
+    return std::make_unique<Snapshot> (*this);
+  }
+
+};
+
+class StorageSnapshotTests : public InitialStateTests
+{
+
+protected:
+
+  SnapshotMemoryStorage snapshotStorage;
+
+  StorageSnapshotTests ()
+  {
+    g.SetStorage (snapshotStorage);
+    SetStartingBlock (GAME_GENESIS_HEIGHT, TestGame::GenesisBlockHash ());
+  }
+
+  /**
+   * Returns the custom state data with the raw game state as "data".
+   */
+  Json::Value
+  GetCustomState ()
+  {
+    return g.GetCustomStateData ("data",
+        [] (const GameStateData& state, const uint256& hash,
+            const unsigned height)
+        {
+          return Json::Value (state);
+        });
+  }
+
+};
+
+TEST_F (StorageSnapshotTests, UsedDuringBulkCatchUp)
+{
+  g.EnableBulkCatchUp (true);
+
+  Json::Value upd(Json::objectValue);
+  upd["toblock"] = BlockHash (12).ToHex ();
+  upd["reqtoken"] = "reqtoken";
+  EXPECT_CALL (*mockSpaceXpanseServer,
+               game_sendupdates (GAME_GENESIS_HASH, GAME_ID))
+      .WillOnce (Return (upd));
+
+  mockSpaceXpanseServer->SetBestBlock (12, BlockHash (12));
+  ReinitialiseState (g);
+  ASSERT_EQ (GetState (g), State::CATRODNG_UP);
+
+  /* The published snapshot is not updated for the intermediate block,
+     but the storage snapshot has it.  */
+  CallBlockAttach (g, "reqtoken",
+                   TestGame::GenesisBlockHash (), BlockHash (11), 11,
+                   Moves ("a0b1"), NO_SEQ_MISMATCH);
+  ASSERT_EQ (GetState (g), State::CATRODNG_UP);
+
+  const Json::Value res = GetCustomState ();
+  EXPECT_EQ (res["blockhash"], BlockHash (11).ToHex ());
+  EXPECT_EQ (res["height"].asInt (), 11);
+  EXPECT_EQ (res["data"], "a0b1");
+  EXPECT_GT (snapshotStorage.snapshotsTaken, 0u);
+}
+
+TEST_F (StorageSnapshotTests, JsonStateDuringBulkCatchUp)
+{
+  g.EnableBulkCatchUp (true);
+
+  Json::Value upd(Json::objectValue);
+  upd["toblock"] = BlockHash (12).ToHex ();
+  upd["reqtoken"] = "reqtoken";
+  EXPECT_CALL (*mockSpaceXpanseServer,
+               game_sendupdates (GAME_GENESIS_HASH, GAME_ID))
+      .WillOnce (Return (upd));
+
+  mockSpaceXpanseServer->SetBestBlock (12, BlockHash (12));
+  ReinitialiseState (g);
+  ASSERT_EQ (GetState (g), State::CATRODNG_UP);
+
+  /* This caches the JSON state for the genesis block, which must not be
+     returned anymore after the next block, even though the published
+     snapshot still has the genesis state.  */
+  Json::Value res = g.GetCurrentJsonState ();
+  EXPECT_EQ (res["blockhash"], TestGame::GenesisBlockHash ().ToHex ());
+
+  CallBlockAttach (g, "reqtoken",
+                   TestGame::GenesisBlockHash (), BlockHash (11), 11,
+                   Moves ("a0b1"), NO_SEQ_MISMATCH);
+  ASSERT_EQ (GetState (g), State::CATRODNG_UP);
+
+  res = g.GetCurrentJsonState ();
+  EXPECT_EQ (res["blockhash"], BlockHash (11).ToHex ());
+  EXPECT_EQ (res["height"].asInt (), 11);
+  EXPECT_EQ (res["gamestate"]["state"], "a0b1");
+  EXPECT_EQ (res["blockhash"], GetCustomState ()["blockhash"]);
+}
+
+TEST_F (StorageSnapshotTests, NotUsedWhenUpToDate)
+{
+  mockSpaceXpanseServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  AttachBlock (g, BlockHash (11), Moves ("a0"));
+
+  const Json::Value res = GetCustomState ();
+  EXPECT_EQ (res["height"].asInt (), 11);
+  EXPECT_EQ (res["data"], "a0");
+  EXPECT_EQ (snapshotStorage.snapshotsTaken, 0u);
+}
+
+/* ************************************************************************** */
+
 class GetPendingJsonStateTests : public InitialStateTests
 {
 
@@ -907,6 +1236,27 @@ TEST_F (GetPendingJsonStateTests, PendingState)
   )"));
 }
 
+TEST_F (GetPendingJsonStateTests, NotComputedWithoutWaiters)
+{
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockSpaceXpanseServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  AttachBlock (g, BlockHash (11), Moves (""));
+  CallPendingMove (g, Moves ("ax")[0]);
+  EXPECT_EQ (proc.toJsonCalls, 0u);
+
+  const auto state = g.GetPendingJsonState ();
+  EXPECT_EQ (state["pending"]["a"], "x");
+  EXPECT_EQ (proc.toJsonCalls, 1u);
+}
+
 /* ************************************************************************** */
 
 class WaitForChangeTests : public InitialStateTests
@@ -1091,6 +1441,78 @@ TEST_F (WaitForChangeTests, OutdatedOldBlock)
   EXPECT_TRUE (newBlock == BlockHash (11));
 }
 
+TEST_F (WaitForChangeTests, ManyWaiters)
+{
+  mockSpaceXpanseServer->SetBestBlock (10, TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  EXPECT_EQ (GetState (g), State::UP_TO_DATE);
+
+  constexpr unsigned numWaiters = 10;
+  std::vector<uint256> newBlocks(numWaiters);
+  std::vector<std::thread> waiters;
+  for (unsigned i = 0; i < numWaiters; ++i)
+    waiters.emplace_back ([this, &newBlocks, i] ()
+      {
+        g.WaitForChange (nullOldBlock, newBlocks[i]);
+      });
+  SleepSome ();
+  EXPECT_EQ (g.GetWaitStats ().state.waiters, numWaiters);
+
+  AttachBlock (g, BlockHash (11), Moves (""));
+  for (auto& w : waiters)
+    w.join ();
+
+  for (const auto& b : newBlocks)
+    EXPECT_TRUE (b == BlockHash (11));
+
+  const auto stats = g.GetWaitStats ().state;
+  EXPECT_EQ (stats.waiters, 0u);
+  EXPECT_EQ (stats.maxWaiters, numWaiters);
+  EXPECT_EQ (stats.wakeups, numWaiters);
+}
+
+TEST_F (WaitForChangeTests, BulkCatchUp)
+{
+  g.EnableBulkCatchUp (true);
+
+  Json::Value upd(Json::objectValue);
+  upd["toblock"] = BlockHash (12).ToHex ();
+  upd["reqtoken"] = "reqtoken";
+  EXPECT_CALL (*mockSpaceXpanseServer,
+               game_sendupdates (GAME_GENESIS_HASH, GAME_ID))
+      .WillOnce (Return (upd));
+
+  mockSpaceXpanseServer->SetBestBlock (12, BlockHash (12));
+  ReinitialiseState (g);
+  EXPECT_EQ (GetState (g), State::CATRODNG_UP);
+
+  std::atomic<bool> done(false);
+  uint256 newBlock;
+  std::thread waiter([&] ()
+    {
+      g.WaitForChange (nullOldBlock, newBlock);
+      done = true;
+    });
+  SleepSome ();
+
+  /* The intermediate block does not wake up the waiter.  */
+  CallBlockAttach (g, "reqtoken",
+                   TestGame::GenesisBlockHash (), BlockHash (11), 11,
+                   Moves ("a0b1"), NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::CATRODNG_UP);
+  SleepSome ();
+  EXPECT_FALSE (done);
+
+  /* Reaching the target does.  */
+  CallBlockAttach (g, "reqtoken", BlockHash (11), BlockHash (12), 12,
+                   Moves ("a2c3"), NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::UP_TO_DATE);
+  waiter.join ();
+
+  EXPECT_TRUE (done);
+  EXPECT_TRUE (newBlock == BlockHash (12));
+}
+
 /* ************************************************************************** */
 
 class WaitForPendingChangeTests : public GetPendingJsonStateTests
@@ -1293,6 +1715,36 @@ TEST_F (WaitForPendingChangeTests, DetachedBlock)
   EXPECT_EQ (out["pending"], ParseJson ("{}"));
 }
 
+TEST_F (WaitForPendingChangeTests, ManyWaiters)
+{
+  SetupZmqEndpoints (true);
+  g.Start ();
+  AttachBlock (g, BlockHash (11), Moves (""));
+
+  constexpr unsigned numWaiters = 10;
+  std::vector<Json::Value> outputs(numWaiters);
+  std::vector<std::thread> waiters;
+  for (unsigned i = 0; i < numWaiters; ++i)
+    waiters.emplace_back ([this, &outputs, i] ()
+      {
+        outputs[i] = g.WaitForPendingChange (Game::WAITFORCHANGE_ALWAYS_BLOCK);
+      });
+  SleepSome ();
+  EXPECT_EQ (g.GetWaitStats ().pending.waiters, numWaiters);
+
+  CallPendingMove (g, Moves ("ax")[0]);
+  for (auto& w : waiters)
+    w.join ();
+
+  const auto expected = g.GetPendingJsonState ();
+  for (const auto& out : outputs)
+    EXPECT_EQ (out, expected);
+
+  const auto stats = g.GetWaitStats ().pending;
+  EXPECT_EQ (stats.waiters, 0u);
+  EXPECT_EQ (stats.wakeups, numWaiters);
+}
+
 /* ************************************************************************** */
 
 class SyncingTests : public InitialStateTests
@@ -1890,6 +2342,18 @@ public:
     MemoryStorage::SetCurrentGameState (hash, data);
   }
 
+  void
+  SetCurrentGameStateShared (const uint256& hash, const unsigned height,
+                             const SharedGameStateData& data) override
+  {
+    if (shouldFail)
+      {
+        LOG (INFO) << "Failing call to SetCurrentGameStateShared on purpose";
+        throw Failure ();
+      }
+    MemoryStorage::SetCurrentGameStateShared (hash, height, data);
+  }
+
 };
 
 class GameLogicTransactionsTests : public SyncingTests
@@ -2012,6 +2476,21 @@ private:
    */
   bool retryNext = false;
 
+  /**
+   * Throws a retry request if the next update should fail.
+   */
+  void
+  MaybeRetry ()
+  {
+    if (retryNext)
+      {
+        ++numFailures;
+        retryNext = false;
+        LOG (INFO) << "Failing update for the " << numFailures << "th time";
+        throw StorageInterface::RetryWithNewTransaction ("retry commit");
+      }
+  }
+
 public:
 
   RetryMemoryStorage () = default;
@@ -2033,17 +2512,18 @@ public:
   void
   SetCurrentGameState (const uint256& hash, const GameStateData& state) override
   {
-    if (retryNext)
-      {
-        ++numFailures;
-        retryNext = false;
-        LOG (INFO) << "Failing update for the " << numFailures << "th time";
-        throw StorageInterface::RetryWithNewTransaction ("retry commit");
-      }
-
+    MaybeRetry ();
     MemoryStorage::SetCurrentGameState (hash, state);
   }
 
+  void
+  SetCurrentGameStateShared (const uint256& hash, const unsigned height,
+                             const SharedGameStateData& state) override
+  {
+    MaybeRetry ();
+    MemoryStorage::SetCurrentGameStateShared (hash, height, state);
+  }
+
 };
 
 class GameStorageRetryTests : public SyncingTests
@@ -0,0 +1,266 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "gamehost.hpp"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+DECLARE_int32 (spacexpanse_zmq_staleness_ms);
+DECLARE_int32 (spacexpanse_connection_check_ms);
+DECLARE_int32 (spacexpanse_zmq_pipeline_depth);
+DECLARE_int32 (spacexpanse_zmq_pending_queue);
+DECLARE_int32 (spacexpanse_zmq_pending_batch);
+
+namespace spacexpanse
+{
+
+/**
+ * JSON-RPC client connector that forwards to another one, but makes sure
+ * that only one message is sent at a time.  The HTTP client connectors are
+ * not thread-safe, and with the connection shared between multiple games
+ * running on their own threads, we need to serialise the calls.
+ */
+class GameHost::SerialisedConnector : public jsonrpc::IClientConnector
+{
+
+private:
+
+  /** The underlying connector.  */
+  jsonrpc::IClientConnector& conn;
+
+  /** Lock for sending messages.  */
+  std::mutex mut;
+
+public:
+
+  explicit SerialisedConnector (jsonrpc::IClientConnector& c)
+    : conn(c)
+  {}
+
+  void
+  SendRPCMessage (const std::string& message, std::string& result) override
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    conn.SendRPCMessage (message, result);
+  }
+
+};
+
+/* ************************************************************************** */
+
+GameHost::GameHost () = default;
+GameHost::~GameHost () = default;
+
+void
+GameHost::ConnectRpcClient (jsonrpc::IClientConnector& conn,
+                            const jsonrpc::clientVersion_t version)
+{
+  CHECK (rpcConnector == nullptr) << "RPC client is already connected";
+
+  rpcConnector = std::make_unique<SerialisedConnector> (conn);
+  rpcVersion = version;
+  rpcClient = std::make_unique<SpaceXpanseRpcClient> (*rpcConnector, version);
+}
+
+unsigned
+GameHost::GetSpaceXpanseVersion () const
+{
+  CHECK (rpcClient != nullptr);
+
+  const auto info = rpcClient->getnetworkinfo ();
+  CHECK (info.isObject ());
+  const auto& version = info["version"];
+  CHECK (version.isUInt ());
+
+  return version.asUInt ();
+}
+
+Chain
+GameHost::GetChain () const
+{
+  CHECK (rpcClient != nullptr);
+
+  const Json::Value info = rpcClient->getblockchaininfo ();
+  const std::string chainStr = info["chain"].asString ();
+  const Chain chain = ChainFromString (chainStr);
+  CHECK (chain != Chain::UNKNOWN)
+      << "Unexpected chain type returned by SpaceXpanse Core: " << chainStr;
+
+  return chain;
+}
+
+bool
+GameHost::DetectZmqEndpoint ()
+{
+  CHECK (rpcClient != nullptr) << "RPC client is not yet set up";
+  const Json::Value notifications = rpcClient->getzmqnotifications ();
+  VLOG (1) << "Configured ZMQ notifications:\n" << notifications;
+
+  if (zmq.ConfigureEndpoints (notifications))
+    return true;
+
+  LOG (WARNING) << "No -zmqpubgameblocks notifier seems to be set up";
+  return false;
+}
+
+void
+GameHost::AddGame (Game& g)
+{
+  CHECK (rpcConnector != nullptr) << "RPC client is not yet set up";
+  CHECK (!zmq.IsRunning ());
+  CHECK (g.host == nullptr) << "Game " << g.gameId << " is already hosted";
+
+  g.ConnectRpcClient (*rpcConnector, rpcVersion);
+  g.host = this;
+  g.zmq = &zmq;
+
+  auto h = std::make_unique<HostedGame> (g);
+  h->worker = std::make_unique<internal::QueuedZmqListener> (
+      static_cast<internal::ZmqListener&> (g),
+      [this] ()
+        {
+          /* Errors are handled as for a standalone game, i.e. by stopping
+             the subscriber and reconnecting later on.  */
+          if (zmq.IsRunning ())
+            zmq.RequestStop ();
+        });
+  zmq.AddListener (g.gameId, h->worker.get ());
+
+  LOG (INFO) << "Added game " << g.gameId << " to the host";
+  games.push_back (std::move (h));
+}
+
+void
+GameHost::ConnectToZmq ()
+{
+  /* If the subscriber stopped by itself, make sure the games have seen
+     that before we reinitialise them.  */
+  for (auto& h : games)
+    h->worker->Flush ();
+
+  CHECK_GE (FLAGS_spacexpanse_zmq_pipeline_depth, 0);
+  zmq.SetPipelineDepth (FLAGS_spacexpanse_zmq_pipeline_depth);
+  CHECK_GT (FLAGS_spacexpanse_zmq_pending_queue, 0);
+  CHECK_GT (FLAGS_spacexpanse_zmq_pending_batch, 0);
+  zmq.SetPendingQueue (FLAGS_spacexpanse_zmq_pending_queue,
+                       FLAGS_spacexpanse_zmq_pending_batch);
+
+  for (auto& h : games)
+    h->game.TrackGame ();
+  zmq.Start ();
+
+  for (auto& h : games)
+    h->game.ConnectToZmq ();
+}
+
+void
+GameHost::Start ()
+{
+  CHECK (!games.empty ()) << "No games have been added to the host";
+  LOG (INFO) << "Starting host with " << games.size () << " games";
+
+  ConnectToZmq ();
+
+  if (FLAGS_spacexpanse_connection_check_ms > 0)
+    connectionChecker = std::make_unique<internal::ConnectionChecker> (
+        [this] () { ProbeAndFixConnection (); },
+        std::chrono::milliseconds (FLAGS_spacexpanse_connection_check_ms));
+}
+
+void
+GameHost::Stop ()
+{
+  connectionChecker.reset ();
+  zmq.Stop ();
+
+  /* Make sure that all games have processed what was still queued up for
+     them, including the notification that the subscriber has stopped.  */
+  for (auto& h : games)
+    {
+      h->worker->Flush ();
+      LOG (INFO)
+          << "Maximum queue depth for game " << h->game.gameId << ": "
+          << h->worker->GetMaxDepth ();
+      h->game.Stop ();
+    }
+
+  /* Give the RPC servers some more time to return still active calls.  */
+  std::this_thread::sleep_for (std::chrono::milliseconds (100));
+}
+
+void
+GameHost::Run ()
+{
+  for (const auto& h : games)
+    CHECK (h->game.storage != nullptr && h->game.rules != nullptr)
+        << "Storage and GameLogic must be set before starting the main loop";
+
+  internal::MainLoop::Functor startAction = [this] () { Start (); };
+  internal::MainLoop::Functor stopAction = [this] () { Stop (); };
+
+  mainLoop.Run (startAction, stopAction);
+}
+
+void
+GameHost::ProbeAndFixConnection ()
+{
+  VLOG (1) << "Probing host connection to SpaceXpanse...";
+
+  if (!zmq.IsRunning ())
+    {
+      LOG (INFO) << "Attempting to re-establish the SpaceXpanse connection...";
+      try
+        {
+          CHECK (DetectZmqEndpoint ())
+              << "ZMQ endpoints not configured in SpaceXpanse";
+          ConnectToZmq ();
+        }
+      catch (const std::exception& exc)
+        {
+          LOG_FIRST_N (ERROR, 10) << "Exception caught: " << exc.what ();
+          if (zmq.IsRunning ())
+            zmq.RequestStop ();
+          return;
+        }
+    }
+
+  /* This follows the same logic as Game::ProbeAndFixConnection.  Since
+     the subscriber's staleness is based on notifications for any of the
+     games, requesting updates for one of them is enough.  */
+  const auto maxStaleness
+      = std::chrono::milliseconds (FLAGS_spacexpanse_zmq_staleness_ms);
+  const auto pingStaleness = maxStaleness / 2;
+  const auto staleness = zmq.GetBlockStaleness<std::chrono::milliseconds> ();
+
+  if (staleness < pingStaleness)
+    return;
+
+  if (staleness > maxStaleness)
+    {
+      LOG (ERROR) << "ZMQ connection is stale, disconnecting...";
+      zmq.RequestStop ();
+      return;
+    }
+
+  try
+    {
+      LOG (WARNING) << "ZMQ connection seems stale, requesting a block";
+      const auto data = rpcClient->getblockchaininfo ();
+      const std::string fromHash
+          = rpcClient->getblockhash (data["blocks"].asInt () - 1);
+      rpcClient->game_sendupdates (fromHash, games.front ()->game.gameId);
+    }
+  catch (const std::exception& exc)
+    {
+      LOG_FIRST_N (ERROR, 10) << "Exception caught: " << exc.what ();
+      zmq.RequestStop ();
+    }
+}
+
+} // namespace spacexpanse
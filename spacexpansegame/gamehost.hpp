@@ -0,0 +1,175 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_GAMEHOST_HPP
+#define SPACEXPANSEGAME_GAMEHOST_HPP
+
+#include "connectionchecker.hpp"
+#include "game.hpp"
+#include "mainloop.hpp"
+#include "zmqsubscriber.hpp"
+
+#include "rpc-stubs/spacexpanserpcclient.h"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <jsonrpccpp/client.h>
+
+#include <memory>
+#include <vector>
+
+namespace spacexpanse
+{
+
+/**
+ * Runs multiple games in a single process.  The host owns one ZMQ
+ * subscriber that dispatches the notifications to all its games, and one
+ * connection to the SpaceXpanse daemon that is shared between them.
+ * Each game processes its notifications on its own worker thread and uses
+ * its own storage, while connection checks are done by a single thread
+ * for all of them.
+ *
+ * Games are configured as usual (storage, rules, pending processor and
+ * so on), but instead of running them individually, they are added to
+ * the host with AddGame and then run together through the host's Run.
+ */
+class GameHost
+{
+
+private:
+
+  class SerialisedConnector;
+
+  /** Data about one of the hosted games.  */
+  struct HostedGame
+  {
+
+    /** The game itself.  */
+    Game& game;
+
+    /** The listener that runs the game's ZMQ callbacks on a worker.  */
+    std::unique_ptr<internal::QueuedZmqListener> worker;
+
+    explicit HostedGame (Game& g)
+      : game(g)
+    {}
+
+  };
+
+  /** The connector to the daemon, shared between all games.  */
+  std::unique_ptr<SerialisedConnector> rpcConnector;
+
+  /** The JSON-RPC protocol version to use with the daemon.  */
+  jsonrpc::clientVersion_t rpcVersion;
+
+  /** The host's own RPC client (using the shared connector).  */
+  std::unique_ptr<SpaceXpanseRpcClient> rpcClient;
+
+  /** The hosted games.  */
+  std::vector<std::unique_ptr<HostedGame>> games;
+
+  /**
+   * The shared ZMQ subscriber.  It is declared after the games, so that it
+   * is destructed (and its thread joined) before their worker listeners.
+   */
+  internal::ZmqSubscriber zmq;
+
+  /** The main loop.  */
+  internal::MainLoop mainLoop;
+
+  /** The background thread running regular connection checks, if any.  */
+  std::unique_ptr<internal::ConnectionChecker> connectionChecker;
+
+  /**
+   * Tracks all games, starts the ZMQ subscriber and reinitialises the
+   * state of each game.  This is shared logic between Start() and the
+   * connection recovery.
+   */
+  void ConnectToZmq ();
+
+  /**
+   * Checks the connection to the daemon and tries to fix it if it seems
+   * broken.  This does for all hosted games what Game::ProbeAndFixConnection
+   * does for a standalone game.
+   */
+  void ProbeAndFixConnection ();
+
+  friend class GameHostTests;
+
+public:
+
+  GameHost ();
+  ~GameHost ();
+
+  GameHost (const GameHost&) = delete;
+  void operator= (const GameHost&) = delete;
+
+  /**
+   * Sets up the RPC connection to the daemon, which is then shared by
+   * the host and all games.  Calls through the given connector are
+   * serialised, so that it can be used from all game threads.  This must
+   * be called once before adding games.
+   */
+  void ConnectRpcClient (
+      jsonrpc::IClientConnector& conn,
+      jsonrpc::clientVersion_t version = jsonrpc::JSONRPC_CLIENT_V1);
+
+  /**
+   * Returns the version of the connected SpaceXpanse Core daemon (in the
+   * same format as Game::GetSpaceXpanseVersion).
+   */
+  unsigned GetSpaceXpanseVersion () const;
+
+  /**
+   * Returns the chain of the connected daemon.
+   */
+  Chain GetChain () const;
+
+  /**
+   * Detects the ZMQ endpoint(s) for the shared subscriber by calling
+   * getzmqnotifications on the daemon.  Returns false if pubgameblocks
+   * is not enabled.
+   */
+  bool DetectZmqEndpoint ();
+
+  /**
+   * Adds a game to be run by this host.  The game's RPC client is connected
+   * through the shared connection, so ConnectRpcClient must not be called
+   * on it separately.  Must not be called while the host is running.
+   *
+   * The Game instance must remain valid until the host is destructed.
+   */
+  void AddGame (Game& g);
+
+  /**
+   * Starts the ZMQ subscriber and all games.
+   */
+  void Start ();
+
+  /**
+   * Stops the ZMQ subscriber and all games.
+   */
+  void Stop ();
+
+  /**
+   * Runs the main event loop, which starts all games, blocks until a stop
+   * is requested, and then stops everything again.
+   */
+  void Run ();
+
+  /**
+   * Requests the main loop to stop.  This is also what Game::RequestStop
+   * does for hosted games.
+   */
+  void
+  RequestStop ()
+  {
+    mainLoop.Stop ();
+  }
+
+};
+
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_GAMEHOST_HPP
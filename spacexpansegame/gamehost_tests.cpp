@@ -0,0 +1,231 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "gamehost.hpp"
+
+#include "gamelogic.hpp"
+#include "storage.hpp"
+
+#include "testutils.hpp"
+
+#include <json/json.h>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <string>
+#include <thread>
+
+DECLARE_int32 (spacexpanse_connection_check_ms);
+
+namespace spacexpanse
+{
+
+using testing::_;
+using testing::AnyNumber;
+using testing::Return;
+
+namespace
+{
+
+constexpr const char GAME_A[] = "game-a";
+constexpr const char GAME_B[] = "game-b";
+
+constexpr unsigned GENESIS_HEIGHT = 100;
+
+/**
+ * Very simple game logic used for the hosted games.  The state is just
+ * the concatenation of all moves, and the tests do not actually process
+ * any blocks anyway.
+ */
+class AppendingGame : public GameLogic
+{
+
+protected:
+
+  GameStateData
+  GetInitialStateInternal (unsigned& height, std::string& hashHex) override
+  {
+    height = GENESIS_HEIGHT;
+    hashHex = BlockHash (GENESIS_HEIGHT).ToHex ();
+    return "";
+  }
+
+  GameStateData
+  ProcessForwardInternal (const GameStateData& oldState,
+                          const Json::Value& blockData,
+                          UndoData& undoData) override
+  {
+    std::string res = oldState;
+    for (const auto& m : blockData["moves"])
+      res += m["move"].asString ();
+    undoData = oldState;
+    return res;
+  }
+
+  GameStateData
+  ProcessBackwardsInternal (const GameStateData& newState,
+                            const Json::Value& blockData,
+                            const UndoData& undoData) override
+  {
+    return undoData;
+  }
+
+};
+
+} // anonymous namespace
+
+/**
+ * Test fixture with a GameHost running two games against a mock
+ * SpaceXpanse Core server.  The fixture is friend of GameHost, so that
+ * we can access the shared subscriber and connection checks directly.
+ */
+class GameHostTests : public GameTestFixture
+{
+
+protected:
+
+  HttpRpcServer<MockSpaceXpanseRpcServer> mockSpaceXpanseServer;
+
+  MemoryStorage storageA;
+  MemoryStorage storageB;
+  AppendingGame rulesA;
+  AppendingGame rulesB;
+
+  Game gameA;
+  Game gameB;
+
+  GameHost host;
+
+  GameHostTests ()
+    : GameTestFixture(GAME_A),
+      gameA(GAME_A), gameB(GAME_B)
+  {
+    Json::Value info(Json::objectValue);
+    info["chain"] = "main";
+    info["blocks"] = 5;
+    info["bestblockhash"] = BlockHash (5).ToHex ();
+    EXPECT_CALL (*mockSpaceXpanseServer, getblockchaininfo ())
+        .WillRepeatedly (Return (info));
+    EXPECT_CALL (*mockSpaceXpanseServer, getblockhash (_))
+        .Times (AnyNumber ());
+
+    /* We need to be able to start the ZMQ subscriber, even if for the test
+       no publisher is connected to it.  */
+    const Json::Value notifications = ParseJson (R"(
+      [
+        {"type": "pubgameblocks", "address": "ipc:///tmp/spacexpansegame_gamehost_tests"}
+      ]
+    )");
+    EXPECT_CALL (*mockSpaceXpanseServer, getzmqnotifications ())
+        .WillRepeatedly (Return (notifications));
+
+    host.ConnectRpcClient (mockSpaceXpanseServer.GetClientConnector ());
+    CHECK (host.DetectZmqEndpoint ());
+
+    gameA.SetStorage (storageA);
+    gameA.SetGameLogic (rulesA);
+    gameB.SetStorage (storageB);
+    gameB.SetGameLogic (rulesB);
+
+    host.AddGame (gameA);
+    host.AddGame (gameB);
+
+    /* The tests drive connection checks explicitly.  */
+    FLAGS_spacexpanse_connection_check_ms = 0;
+  }
+
+  void
+  ExpectTracking (const std::string& cmd, const unsigned times)
+  {
+    EXPECT_CALL (*mockSpaceXpanseServer, trackedgames (cmd, GAME_A))
+        .Times (times);
+    EXPECT_CALL (*mockSpaceXpanseServer, trackedgames (cmd, GAME_B))
+        .Times (times);
+  }
+
+  internal::ZmqSubscriber&
+  GetHostZmq ()
+  {
+    return host.zmq;
+  }
+
+  void
+  ProbeAndFixConnection ()
+  {
+    host.ProbeAndFixConnection ();
+  }
+
+  /**
+   * Waits until both games are in the given state.
+   */
+  void
+  WaitForState (const State s)
+  {
+    while (GetState (gameA) != s || GetState (gameB) != s)
+      SleepSome ();
+  }
+
+};
+
+namespace
+{
+
+TEST_F (GameHostTests, StartStop)
+{
+  ExpectTracking ("add", 1);
+  ExpectTracking ("remove", 1);
+
+  host.Start ();
+  EXPECT_TRUE (GetHostZmq ().IsRunning ());
+  EXPECT_EQ (GetState (gameA), State::PREGENESIS);
+  EXPECT_EQ (GetState (gameB), State::PREGENESIS);
+
+  host.Stop ();
+  EXPECT_FALSE (GetHostZmq ().IsRunning ());
+  EXPECT_EQ (GetState (gameA), State::DISCONNECTED);
+  EXPECT_EQ (GetState (gameB), State::DISCONNECTED);
+}
+
+TEST_F (GameHostTests, SubscriberStopDisconnectsAll)
+{
+  ExpectTracking ("add", 2);
+  ExpectTracking ("remove", 1);
+
+  host.Start ();
+  GetHostZmq ().RequestStop ();
+  WaitForState (State::DISCONNECTED);
+  EXPECT_FALSE (GetHostZmq ().IsRunning ());
+
+  ProbeAndFixConnection ();
+  EXPECT_TRUE (GetHostZmq ().IsRunning ());
+  EXPECT_EQ (GetState (gameA), State::PREGENESIS);
+  EXPECT_EQ (GetState (gameB), State::PREGENESIS);
+
+  host.Stop ();
+}
+
+TEST_F (GameHostTests, RequestStopFromGame)
+{
+  ExpectTracking ("add", 1);
+  ExpectTracking ("remove", 1);
+
+  std::thread runner([this] ()
+    {
+      host.Run ();
+    });
+
+  WaitForState (State::PREGENESIS);
+  gameB.RequestStop ();
+  runner.join ();
+
+  EXPECT_EQ (GetState (gameA), State::DISCONNECTED);
+  EXPECT_EQ (GetState (gameB), State::DISCONNECTED);
+}
+
+} // anonymous namespace
+} // namespace spacexpanse
@@ -4,11 +4,14 @@
 
 #include "gamelogic.hpp"
 
+#include "delta.hpp"
+
 #include <spacexpanseutil/hash.hpp>
 
 #include <glog/logging.h>
 
 #include <map>
+#include <memory>
 
 namespace spacexpanse
 {
@@ -245,6 +248,54 @@ GameLogic::ProcessBackwards (const GameStateData& newState,
   return ProcessBackwardsInternal (newState, blockData, undoData);
 }
 
+SharedGameStateData
+GameLogic::ProcessForward (const SharedGameStateData& oldState,
+                           const Json::Value& blockData,
+                           UndoData& undoData)
+{
+  CHECK (oldState != nullptr);
+
+  Context context(*this, BlockRngSeed (GetGameId (), blockData));
+  ContextSetter setter(*this, context);
+
+  auto res = ProcessForwardSharedInternal (oldState, blockData, undoData);
+  CHECK (res != nullptr);
+  return res;
+}
+
+SharedGameStateData
+GameLogic::ProcessBackwards (const SharedGameStateData& newState,
+                             const Json::Value& blockData,
+                             const UndoData& undoData)
+{
+  CHECK (newState != nullptr);
+
+  Context context(*this, BlockRngSeed (GetGameId (), blockData));
+  ContextSetter setter(*this, context);
+
+  auto res = ProcessBackwardsSharedInternal (newState, blockData, undoData);
+  CHECK (res != nullptr);
+  return res;
+}
+
+SharedGameStateData
+GameLogic::ProcessForwardSharedInternal (const SharedGameStateData& oldState,
+                                         const Json::Value& blockData,
+                                         UndoData& undoData)
+{
+  return std::make_shared<const GameStateData> (
+      ProcessForwardInternal (*oldState, blockData, undoData));
+}
+
+SharedGameStateData
+GameLogic::ProcessBackwardsSharedInternal (const SharedGameStateData& newState,
+                                           const Json::Value& blockData,
+                                           const UndoData& undoData)
+{
+  return std::make_shared<const GameStateData> (
+      ProcessBackwardsInternal (*newState, blockData, undoData));
+}
+
 Json::Value
 GameLogic::GameStateToJson (const GameStateData& state)
 {
@@ -273,4 +324,30 @@ CachingGame::ProcessBackwardsInternal (const GameStateData& newState,
 
 /* ************************************************************************** */
 
+GameStateData
+DeltaCachingGame::ProcessForwardInternal (const GameStateData& oldState,
+                                          const Json::Value& blockData,
+                                          UndoData& undoData)
+{
+  const GameStateData newState = UpdateState (oldState, blockData);
+  undoData = internal::ComputeDelta (newState, oldState);
+  VLOG (2)
+      << "Delta undo data has " << undoData.size ()
+      << " bytes for an old state of " << oldState.size () << " bytes";
+  return newState;
+}
+
+GameStateData
+DeltaCachingGame::ProcessBackwardsInternal (const GameStateData& newState,
+                                            const Json::Value& blockData,
+                                            const UndoData& undoData)
+{
+  GameStateData oldState;
+  CHECK (internal::ApplyDelta (newState, undoData, oldState))
+      << "Invalid delta undo data for the current game state";
+  return oldState;
+}
+
+/* ************************************************************************** */
+
 } // namespace spacexpanse
@@ -260,6 +260,24 @@ protected:
                                                   const Json::Value& blockData,
                                                   const UndoData& undoData) = 0;
 
+  /**
+   * Variant of ProcessForwardInternal that works on shared state handles.
+   * The default implementation just calls ProcessForwardInternal and wraps
+   * its result.  Games can override this to avoid copying the state when
+   * it is not changed (by returning the passed-in handle again).
+   */
+  virtual SharedGameStateData ProcessForwardSharedInternal (
+      const SharedGameStateData& oldState, const Json::Value& blockData,
+      UndoData& undoData);
+
+  /**
+   * Variant of ProcessBackwardsInternal that works on shared state handles.
+   * By default, it calls ProcessBackwardsInternal and wraps the result.
+   */
+  virtual SharedGameStateData ProcessBackwardsSharedInternal (
+      const SharedGameStateData& newState, const Json::Value& blockData,
+      const UndoData& undoData);
+
 public:
 
   GameLogic () = default;
@@ -289,6 +307,24 @@ public:
                                   const Json::Value& blockData,
                                   const UndoData& undoData);
 
+  /**
+   * Processes the game state forward in time, working on shared handles
+   * to the state data.  This is what Game uses, so that the state data
+   * does not need to be copied between the storage and the game logic.
+   * It sets up the Context and calls ProcessForwardSharedInternal.
+   */
+  SharedGameStateData ProcessForward (const SharedGameStateData& oldState,
+                                      const Json::Value& blockData,
+                                      UndoData& undoData);
+
+  /**
+   * Processes the game state backwards in time, working on shared handles
+   * to the state data.  It calls ProcessBackwardsSharedInternal.
+   */
+  SharedGameStateData ProcessBackwards (const SharedGameStateData& newState,
+                                        const Json::Value& blockData,
+                                        const UndoData& undoData);
+
   /**
    * A notification method that gets called whenever the Game instance
    * updated the game state, when the new state has been committed to storage.
@@ -311,6 +347,22 @@ public:
    */
   virtual Json::Value GameStateToJson (const GameStateData& state);
 
+  /**
+   * Returns true if GameStateToJson depends only on the GameStateData
+   * passed to it (and not on external data like a database that gets updated
+   * together with the current state), and if it can be called from multiple
+   * threads at the same time.  In that case, Game may convert published
+   * snapshots of the state to JSON without holding its lock, so that
+   * RPC readers do not contend with block processing.
+   *
+   * The default implementation returns false, which is always safe.
+   */
+  virtual bool
+  IsStateJsonSelfContained () const
+  {
+    return false;
+  }
+
 };
 
 /**
@@ -341,6 +393,30 @@ protected:
 
 };
 
+/**
+ * Variant of CachingGame that stores a compact binary delta as undo data,
+ * from which the old state can be reconstructed given the new one, instead
+ * of the full old state.  For games whose state is large but changes only
+ * in a few places per block, this reduces the undo data by a lot.
+ *
+ * Concrete games implement UpdateState just like for CachingGame.  The undo
+ * data is not compatible with the one from CachingGame, so switching an
+ * existing game between the two requires a resync.
+ */
+class DeltaCachingGame : public CachingGame
+{
+
+protected:
+
+  GameStateData ProcessForwardInternal (const GameStateData& oldState,
+                                        const Json::Value& blockData,
+                                        UndoData& undoData) override;
+  GameStateData ProcessBackwardsInternal (const GameStateData& newState,
+                                          const Json::Value& blockData,
+                                          const UndoData& undoData) override;
+
+};
+
 } // namespace spacexpanse
 
 #endif // SPACEXPANSEGAME_GAMELOGIC_HPP
@@ -14,6 +14,7 @@
 
 #include <glog/logging.h>
 
+#include <memory>
 #include <sstream>
 #include <stack>
 
@@ -75,10 +76,11 @@ protected:
   }
 
   /**
-   * Processes the state forward using game and the simulated blockchain.
+   * Constructs the block data for attaching the next block with the
+   * given moves to the simulated blockchain.
    */
-  void
-  AttachBlock (const Json::Value& moves)
+  Json::Value
+  BlockData (const Json::Value& moves) const
   {
     Json::Value blk(Json::objectValue);
     blk["rngseed"] = BlockHash (blockStack.size ()).ToHex ();
@@ -87,6 +89,16 @@ protected:
     blockData["block"] = blk;
     blockData["moves"] = moves;
 
+    return blockData;
+  }
+
+  /**
+   * Processes the state forward using game and the simulated blockchain.
+   */
+  void
+  AttachBlock (const Json::Value& moves)
+  {
+    const Json::Value blockData = BlockData (moves);
     blockStack.push (blockData);
 
     UndoData undo;
@@ -198,8 +210,10 @@ TEST_F (ContextRandomTests, Works)
 /**
  * A very simple game implemented using CachingGame:  The state is just a string
  * that can be changed.  The move is the new value, which replaces the old one.
+ * The base class can be CachingGame or DeltaCachingGame.
  */
-class ReplacingGame : public CachingGame
+template <typename Base>
+  class ReplacingGame : public Base
 {
 
 protected:
@@ -221,7 +235,8 @@ protected:
 
 };
 
-class CachingGameTests : public GameLogicFixture<ReplacingGame>
+template <typename G>
+  class ReplacingGameTests : public GameLogicFixture<G>
 {
 
 protected:
@@ -243,6 +258,8 @@ protected:
 
 };
 
+using CachingGameTests = ReplacingGameTests<ReplacingGame<CachingGame>>;
+
 TEST_F (CachingGameTests, Works)
 {
   AttachBlock (Move ("foo"));
@@ -267,6 +284,113 @@ TEST_F (CachingGameTests, Works)
   EXPECT_EQ (state, "");
 }
 
+/**
+ * ReplacingGame that overrides the processing with shared handles, so that
+ * the state is not copied for blocks without moves.
+ */
+class SharingReplacingGame : public ReplacingGame<CachingGame>
+{
+
+protected:
+
+  SharedGameStateData
+  ProcessForwardSharedInternal (const SharedGameStateData& oldState,
+                                const Json::Value& blockData,
+                                UndoData& undoData) override
+  {
+    if (!blockData["moves"].empty ())
+      return CachingGame::ProcessForwardSharedInternal (oldState, blockData,
+                                                        undoData);
+
+    undoData = *oldState;
+    return oldState;
+  }
+
+};
+
+using SharedStateTests = ReplacingGameTests<SharingReplacingGame>;
+
+TEST_F (SharedStateTests, Works)
+{
+  const auto initial = std::make_shared<const GameStateData> ("foo");
+
+  UndoData undo;
+  const auto unchanged = game.ProcessForward (initial, BlockData (NoMove ()),
+                                              undo);
+  EXPECT_EQ (unchanged, initial);
+  EXPECT_EQ (undo, "foo");
+
+  const auto changed = game.ProcessForward (initial, BlockData (Move ("bar")),
+                                            undo);
+  ASSERT_NE (changed, nullptr);
+  EXPECT_EQ (*changed, "bar");
+  EXPECT_EQ (*initial, "foo");
+
+  const auto restored = game.ProcessBackwards (changed,
+                                               BlockData (Move ("bar")), undo);
+  ASSERT_NE (restored, nullptr);
+  EXPECT_EQ (*restored, "foo");
+}
+
+TEST_F (SharedStateTests, StringInterfaceStillWorks)
+{
+  AttachBlock (Move ("foo"));
+  AttachBlock (NoMove ());
+  EXPECT_EQ (state, "foo");
+  DetachBlock ();
+  DetachBlock ();
+  EXPECT_EQ (state, "");
+}
+
+using DeltaCachingGameTests
+    = ReplacingGameTests<ReplacingGame<DeltaCachingGame>>;
+
+TEST_F (DeltaCachingGameTests, Works)
+{
+  AttachBlock (Move ("foo"));
+  EXPECT_EQ (state, "foo");
+  AttachBlock (Move ("bar"));
+  EXPECT_EQ (state, "bar");
+
+  DetachBlock ();
+  EXPECT_EQ (state, "foo");
+
+  AttachBlock (NoMove ());
+  EXPECT_EQ (state, "foo");
+  AttachBlock (Move ("baz"));
+  EXPECT_EQ (state, "baz");
+
+  DetachBlock ();
+  EXPECT_EQ (state, "foo");
+  DetachBlock ();
+  EXPECT_EQ (state, "foo");
+  DetachBlock ();
+  EXPECT_TRUE (blockStack.empty ());
+  EXPECT_EQ (state, "");
+}
+
+TEST_F (DeltaCachingGameTests, SmallUndoForSmallChanges)
+{
+  std::string value(100'000, 'x');
+  AttachBlock (Move (value));
+  const GameStateData large = state;
+
+  value[50'000] = 'y';
+  AttachBlock (Move (value));
+  EXPECT_EQ (state, value);
+  EXPECT_LT (undoStack.top ().size (), 100u);
+
+  DetachBlock ();
+  EXPECT_EQ (state, large);
+}
+
+TEST_F (DeltaCachingGameTests, InvalidUndo)
+{
+  AttachBlock (Move ("foo"));
+  undoStack.top () = "invalid";
+  EXPECT_DEATH (DetachBlock (), "Invalid delta undo data");
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
@@ -22,7 +22,19 @@ void
 StorageWithCachedHeight::SetCurrentGameStateWithHeight (
     const uint256& hash, const unsigned height, const GameStateData& data)
 {
-  storage->SetCurrentGameState (hash, data);
+  storage->SetCurrentGameStateWithHeight (hash, height, data);
+
+  hasHeight = true;
+  cachedHeight = height;
+
+  VLOG (1) << "Cached height for block " <<  hash.ToHex () << ": " << height;
+}
+
+void
+StorageWithCachedHeight::SetCurrentGameStateShared (
+    const uint256& hash, const unsigned height, const SharedGameStateData& data)
+{
+  storage->SetCurrentGameStateShared (hash, height, data);
 
   hasHeight = true;
   cachedHeight = height;
@@ -40,10 +52,23 @@ StorageWithCachedHeight::GetCurrentBlockHashWithHeight (uint256& hash,
   bool retrievedHeight = false;
   if (!hasHeight)
     {
-      LOG (INFO) << "No cached block height, retrieving for " << hash.ToHex ();
-      cachedHeight = hashToHeight (hash);
+      if (storage->GetCurrentBlockHeight (cachedHeight))
+        LOG (INFO)
+            << "Using stored block height for " << hash.ToHex ()
+            << ": " << cachedHeight;
+      else if (storage->GetBlockHeight (hash, cachedHeight))
+        LOG (INFO)
+            << "Using block height from undo data for " << hash.ToHex ()
+            << ": " << cachedHeight;
+      else
+        {
+          LOG (INFO)
+              << "No cached block height, retrieving for " << hash.ToHex ();
+          cachedHeight = hashToHeight (hash);
+          retrievedHeight = true;
+        }
+
       hasHeight = true;
-      retrievedHeight = true;
     }
 
   CHECK (hasHeight);
@@ -13,6 +13,7 @@
 #include <spacexpanseutil/uint256.hpp>
 
 #include <functional>
+#include <memory>
 
 namespace spacexpanse
 {
@@ -26,11 +27,13 @@ namespace internal
  * GetCurrentGameStateWithHeight method is provided to access the associated
  * height as well.
  *
- * When no cached height is available yet or for cross-checking in regtest
- * mode, a function has to be provided that retrieves the block height for
- * a block hash (e.g. by calling SpaceXpanse Core's RPC interface).  That is used
- * for cases when the height is requested right after start-up and before
- * it has been set.
+ * The height is also passed on to the wrapped storage, which may persist
+ * it.  When no cached height is available yet (e.g. right after start-up),
+ * we first try to get it from the storage itself (either the persisted
+ * current height or the height recorded with the undo data of the block).
+ * Only if that fails, or for cross-checking in regtest mode, a function is
+ * used that retrieves the block height for a block hash (e.g. by calling
+ * SpaceXpanse Core's RPC interface).
  */
 class StorageWithCachedHeight : public StorageInterface
 {
@@ -92,7 +95,15 @@ public:
    */
   void SetCurrentGameStateWithHeight (const uint256& hash,
                                       unsigned height,
-                                      const GameStateData& data);
+                                      const GameStateData& data) override;
+
+  /**
+   * Sets the current game state from a shared handle in the underlying
+   * storage, and caches the associated block height like
+   * SetCurrentGameStateWithHeight.
+   */
+  void SetCurrentGameStateShared (const uint256& hash, unsigned height,
+                                  const SharedGameStateData& data) override;
 
   /**
    * Retrieves the current block hash (if any) together with the associated
@@ -128,6 +139,18 @@ public:
     return storage->GetCurrentGameState ();
   }
 
+  SharedGameStateData
+  GetCurrentGameStateShared () const override
+  {
+    return storage->GetCurrentGameStateShared ();
+  }
+
+  std::unique_ptr<StorageSnapshot>
+  GetReadSnapshot () const override
+  {
+    return storage->GetReadSnapshot ();
+  }
+
   /**
    * SetCurrentGameState must not be called.  Instead,
    * SetCurrentGameStateWithHeight has to be used.  This method crashes always.
@@ -135,6 +158,18 @@ public:
   void SetCurrentGameState (const uint256& hash,
                             const GameStateData& data) override;
 
+  bool
+  GetCurrentBlockHeight (unsigned& height) const override
+  {
+    return storage->GetCurrentBlockHeight (height);
+  }
+
+  bool
+  GetBlockHeight (const uint256& hash, unsigned& height) const override
+  {
+    return storage->GetBlockHeight (hash, height);
+  }
+
   bool
   GetUndoData (const uint256& hash, UndoData& data) const override
   {
@@ -160,6 +195,12 @@ public:
     storage->PruneUndoData (height);
   }
 
+  unsigned
+  PruneUndoDataRange (const unsigned height, const unsigned limit) override
+  {
+    return storage->PruneUndoDataRange (height, limit);
+  }
+
   void
   BeginTransaction () override
   {
@@ -181,6 +222,18 @@ public:
     storage->RollbackTransaction ();
   }
 
+  bool
+  SetDeferredSync (const bool enable) override
+  {
+    return storage->SetDeferredSync (enable);
+  }
+
+  void
+  SyncCommitted () override
+  {
+    storage->SyncCommitted ();
+  }
+
 };
 
 } // namespace internal
@@ -86,7 +86,7 @@ INSTANTIATE_TYPED_TEST_CASE_P (HeightCache, PruningStorageTests,
 class HeightCacheTests : public testing::Test
 {
 
-private:
+protected:
 
   /** The underlying memory storage.  */
   MemoryStorage memoryStorage;
@@ -106,8 +106,6 @@ private:
     LOG (FATAL) << "Unexpected test block hash: " << hash.ToHex ();
   }
 
-protected:
-
   /** The height-caching storage that can be used for tests.  */
   StorageWithCachedHeight storage;
 
@@ -184,6 +182,35 @@ TEST_F (HeightCacheTests, TranslationFunction)
   EXPECT_EQ (hashToHeightCount, 1);
 }
 
+TEST_F (HeightCacheTests, HeightFromStorage)
+{
+  StoreHashAndHeight (BlockHash (2), 10);
+
+  /* A fresh cache (as after a restart) should pick up the height that
+     has been persisted in the underlying storage.  */
+  StorageWithCachedHeight fresh(memoryStorage,
+                                [this] (const uint256& hash) {
+                                  return HashToHeight (hash);
+                                });
+  uint256 hash;
+  unsigned height;
+  ASSERT_TRUE (fresh.GetCurrentBlockHashWithHeight (hash, height));
+  EXPECT_EQ (hash, BlockHash (2));
+  EXPECT_EQ (height, 10u);
+  EXPECT_EQ (hashToHeightCount, 0);
+}
+
+TEST_F (HeightCacheTests, HeightFromUndoData)
+{
+  memoryStorage.BeginTransaction ();
+  memoryStorage.AddUndoData (BlockHash (2), 10, UndoData ());
+  memoryStorage.CommitTransaction ();
+
+  StoreOnlyHash (BlockHash (2));
+  ExpectHashAndHeight (BlockHash (2), 10);
+  EXPECT_EQ (hashToHeightCount, 0);
+}
+
 TEST_F (HeightCacheTests, CrossChecks)
 {
   storage.EnableCrossChecks ();
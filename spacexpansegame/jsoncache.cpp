@@ -0,0 +1,94 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsoncache.hpp"
+
+#include "spacexpanseutil/compression.hpp"
+
+#include <glog/logging.h>
+
+namespace spacexpanse
+{
+
+std::string
+WriteCompactJson (const Json::Value& val)
+{
+  Json::StreamWriterBuilder wbuilder;
+  wbuilder["commentStyle"] = "None";
+  wbuilder["indentation"] = "";
+  wbuilder["enableYAMLCompatibility"] = false;
+  wbuilder["dropNullPlaceholders"] = false;
+  wbuilder["useSpecialFloats"] = false;
+
+  return Json::writeString (wbuilder, val);
+}
+
+const std::string&
+SerialisedJson::GetSerialised () const
+{
+  std::call_once (serialisedFlag, [this] ()
+    {
+      serialised = WriteCompactJson (value);
+    });
+
+  return serialised;
+}
+
+const std::string&
+SerialisedJson::GetGzipped () const
+{
+  std::call_once (gzippedFlag, [this] ()
+    {
+      gzipped = GzipData (GetSerialised ());
+    });
+
+  return gzipped;
+}
+
+namespace internal
+{
+
+std::shared_ptr<const SerialisedJson>
+StateJsonCache::Get (const uint256& h, const std::string& s) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (entry == nullptr || h != hash || s != syncState)
+    {
+      ++misses;
+      return nullptr;
+    }
+
+  ++hits;
+  return entry;
+}
+
+void
+StateJsonCache::Store (const uint256& h, const std::string& s,
+                       std::shared_ptr<const SerialisedJson> e)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  hash = h;
+  syncState = s;
+  entry = std::move (e);
+}
+
+void
+StateJsonCache::Invalidate ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  entry.reset ();
+}
+
+void
+StateJsonCache::GetStats (unsigned long& h, unsigned long& m) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  h = hits;
+  m = misses;
+}
+
+} // namespace internal
+} // namespace spacexpanse
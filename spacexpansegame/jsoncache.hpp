@@ -0,0 +1,145 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_JSONCACHE_HPP
+#define SPACEXPANSEGAME_JSONCACHE_HPP
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <json/json.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace spacexpanse
+{
+
+/**
+ * A JSON value together with its serialised (compact) form and a
+ * gzip-compressed copy of that.  The serialised and compressed forms are
+ * computed lazily (at most once) when they are first requested, so that
+ * a single instance can be shared between many readers that each just
+ * return the already prepared bytes.
+ */
+class SerialisedJson
+{
+
+private:
+
+  /** The JSON value itself.  */
+  const Json::Value value;
+
+  /** Flag for computing the serialised form once.  */
+  mutable std::once_flag serialisedFlag;
+  /** The serialised form, once computed.  */
+  mutable std::string serialised;
+
+  /** Flag for computing the compressed form once.  */
+  mutable std::once_flag gzippedFlag;
+  /** The gzip-compressed serialised form, once computed.  */
+  mutable std::string gzipped;
+
+public:
+
+  explicit SerialisedJson (const Json::Value& val)
+    : value(val)
+  {}
+
+  SerialisedJson () = delete;
+  SerialisedJson (const SerialisedJson&) = delete;
+  void operator= (const SerialisedJson&) = delete;
+
+  const Json::Value&
+  GetValue () const
+  {
+    return value;
+  }
+
+  /**
+   * Returns the value serialised as compact JSON string.
+   */
+  const std::string& GetSerialised () const;
+
+  /**
+   * Returns the serialised JSON string compressed in gzip format.
+   */
+  const std::string& GetGzipped () const;
+
+};
+
+/**
+ * Serialises a JSON value in compact form (without whitespace).
+ */
+std::string WriteCompactJson (const Json::Value& val);
+
+namespace internal
+{
+
+/**
+ * Cache for the serialised JSON of the current game state.  It holds the
+ * entry for a single block hash and syncing state (as the JSON state
+ * returned to clients contains both).  Game invalidates it whenever
+ * a new state is published after a block attach or detach.
+ */
+class StateJsonCache
+{
+
+private:
+
+  /** Lock for the cache data.  */
+  mutable std::mutex mut;
+
+  /** The block hash of the cached entry.  */
+  uint256 hash;
+
+  /** The syncing state of the cached entry.  */
+  std::string syncState;
+
+  /** The cached entry itself, or null if there is none.  */
+  std::shared_ptr<const SerialisedJson> entry;
+
+  /** Number of lookups that returned a cached entry.  */
+  mutable unsigned long hits = 0;
+
+  /** Number of lookups that did not find an entry.  */
+  mutable unsigned long misses = 0;
+
+public:
+
+  StateJsonCache () = default;
+
+  StateJsonCache (const StateJsonCache&) = delete;
+  void operator= (const StateJsonCache&) = delete;
+
+  /**
+   * Returns the cached entry if it matches the given block hash and
+   * syncing state, and null otherwise.
+   */
+  std::shared_ptr<const SerialisedJson> Get (const uint256& h,
+                                             const std::string& s) const;
+
+  /**
+   * Stores a new entry for the given block hash and syncing state,
+   * replacing any existing one.
+   */
+  void Store (const uint256& h, const std::string& s,
+              std::shared_ptr<const SerialisedJson> e);
+
+  /**
+   * Removes the cached entry (if any).
+   */
+  void Invalidate ();
+
+  /**
+   * Returns the number of cache hits and misses so far.
+   */
+  void GetStats (unsigned long& h, unsigned long& m) const;
+
+};
+
+} // namespace internal
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_JSONCACHE_HPP
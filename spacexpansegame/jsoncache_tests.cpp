@@ -0,0 +1,120 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsoncache.hpp"
+
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <memory>
+
+namespace spacexpanse
+{
+namespace
+{
+
+/* ************************************************************************** */
+
+TEST (SerialisedJsonTests, Serialisation)
+{
+  const SerialisedJson val(ParseJson (R"({
+    "foo": "bar",
+    "array": [1, 2, null]
+  })"));
+
+  EXPECT_EQ (val.GetSerialised (), R"({"array":[1,2,null],"foo":"bar"})");
+  EXPECT_EQ (ParseJson (val.GetSerialised ()), val.GetValue ());
+}
+
+TEST (SerialisedJsonTests, ComputedOnce)
+{
+  const SerialisedJson val(ParseJson (R"({"foo": "bar"})"));
+
+  const std::string& first = val.GetSerialised ();
+  const std::string& second = val.GetSerialised ();
+  EXPECT_EQ (&first, &second);
+
+  const std::string& firstGz = val.GetGzipped ();
+  const std::string& secondGz = val.GetGzipped ();
+  EXPECT_EQ (&firstGz, &secondGz);
+}
+
+TEST (SerialisedJsonTests, Gzip)
+{
+  const SerialisedJson val(Json::Value (std::string (1 << 16, 'x')));
+  const std::string& gz = val.GetGzipped ();
+
+  /* Verify the gzip magic bytes and that the data got compressed.  The
+     actual round-trip is tested together with the REST client.  */
+  ASSERT_GE (gz.size (), 2);
+  EXPECT_EQ (static_cast<unsigned char> (gz[0]), 0x1f);
+  EXPECT_EQ (static_cast<unsigned char> (gz[1]), 0x8b);
+  EXPECT_LT (gz.size (), val.GetSerialised ().size () / 10);
+}
+
+/* ************************************************************************** */
+
+class StateJsonCacheTests : public testing::Test
+{
+
+protected:
+
+  internal::StateJsonCache cache;
+
+  /**
+   * Expects the given number of hits and misses in the cache's stats.
+   */
+  void
+  ExpectStats (const unsigned long expectedHits,
+               const unsigned long expectedMisses) const
+  {
+    unsigned long hits, misses;
+    cache.GetStats (hits, misses);
+    EXPECT_EQ (hits, expectedHits);
+    EXPECT_EQ (misses, expectedMisses);
+  }
+
+};
+
+TEST_F (StateJsonCacheTests, Empty)
+{
+  EXPECT_EQ (cache.Get (BlockHash (1), "up-to-date"), nullptr);
+  ExpectStats (0, 1);
+}
+
+TEST_F (StateJsonCacheTests, MatchesBlockAndState)
+{
+  auto entry = std::make_shared<SerialisedJson> (Json::Value ("foo"));
+  cache.Store (BlockHash (1), "up-to-date", entry);
+
+  EXPECT_EQ (cache.Get (BlockHash (1), "up-to-date"), entry);
+  EXPECT_EQ (cache.Get (BlockHash (2), "up-to-date"), nullptr);
+  EXPECT_EQ (cache.Get (BlockHash (1), "catching-up"), nullptr);
+  ExpectStats (1, 2);
+}
+
+TEST_F (StateJsonCacheTests, ReplaceAndInvalidate)
+{
+  auto first = std::make_shared<SerialisedJson> (Json::Value ("foo"));
+  auto second = std::make_shared<SerialisedJson> (Json::Value ("bar"));
+
+  cache.Store (BlockHash (1), "up-to-date", first);
+  cache.Store (BlockHash (2), "up-to-date", second);
+  EXPECT_EQ (cache.Get (BlockHash (1), "up-to-date"), nullptr);
+  EXPECT_EQ (cache.Get (BlockHash (2), "up-to-date"), second);
+
+  cache.Invalidate ();
+  EXPECT_EQ (cache.Get (BlockHash (2), "up-to-date"), nullptr);
+
+  /* The entries stay valid for holders.  */
+  EXPECT_EQ (first->GetValue (), "foo");
+}
+
+/* ************************************************************************** */
+
+} // anonymous namespace
+} // namespace spacexpanse
@@ -6,6 +6,10 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <limits>
+#include <mutex>
+
 namespace spacexpanse
 {
 
@@ -16,6 +20,11 @@ namespace
 constexpr char KEY_CURRENT_HASH = 'h';
 /** Single-character key for "current game state".  */
 constexpr char KEY_CURRENT_STATE = 's';
+/**
+ * Single-character key for "current block height", if known.  The height
+ * is stored as big-endian number using UNDO_HEIGHT_BYTES bytes.
+ */
+constexpr char KEY_CURRENT_HEIGHT = 'n';
 /**
  * Key prefix character for undo data (followed by hash bytes in big-endian
  * byte order as returned from uint256::GetBlob).
@@ -39,8 +48,16 @@ constexpr size_t UNDO_HEIGHT_BYTES = 4;
 } // anonymous namespace
 
 LMDBStorage::LMDBStorage (const std::string& dir)
-  : directory(dir)
+  : LMDBStorage(dir, Options ())
+{}
+
+LMDBStorage::LMDBStorage (const std::string& dir, const Options& opt)
+  : directory(dir), options(opt)
 {
+  CHECK_GE (options.minFreeFraction, 0.0);
+  CHECK_LT (options.minFreeFraction, 1.0);
+  CHECK_GE (options.longReaderThreshold.count (), 0);
+
   LOG (INFO)
       << "Using LMDB version " << mdb_version (nullptr, nullptr, nullptr);
 
@@ -52,6 +69,21 @@ LMDBStorage::~LMDBStorage ()
 {
   if (env != nullptr)
     {
+      /* Read snapshots may still be in use by other threads, e.g. by RPC
+         calls that are just finishing up.  They have to be closed before
+         the environment is.  */
+      WaitForSnapshots ();
+
+      /* With MDB_NOSYNC, closing the environment does not flush the latest
+         commits.  Do that explicitly, so that a clean shutdown does not
+         lose any data.  */
+      if (options.noSync || deferredSync)
+        {
+          const int code = mdb_env_sync (env, 1);
+          if (code != 0)
+            LOG (WARNING) << "Final LMDB sync failed: " << mdb_strerror (code);
+        }
+
       mdb_env_close (env);
       LOG (INFO) << "Closed LMDB environment";
     }
@@ -94,8 +126,32 @@ LMDBStorage::CheckOk (const int code) const
 void
 LMDBStorage::Initialise ()
 {
+  /* Read transactions are not tied to threads, so that snapshots can be
+     handed over to other threads, and so that a thread holding a snapshot
+     can still do other reads.  */
+  unsigned flags = MDB_NOTLS;
+  if (options.writeMap)
+    {
+      LOG (INFO) << "Using MDB_WRITEMAP for LMDB";
+      flags |= MDB_WRITEMAP;
+    }
+  if (options.noSync)
+    {
+      LOG (INFO)
+          << "Using MDB_NOSYNC for LMDB, syncing explicitly every "
+          << options.syncInterval << " commits";
+      flags |= MDB_NOSYNC;
+    }
+
   LOG (INFO) << "Opening LMDB database at " << directory;
-  CheckOk (mdb_env_open (env, directory.c_str (), 0, 0644));
+  CheckOk (mdb_env_open (env, directory.c_str (), flags, 0644));
+
+  /* Clear reader slots left behind by processes that have crashed.  They
+     would otherwise hold back the reuse of freed pages forever.  */
+  int dead;
+  CheckOk (mdb_reader_check (env, &dead));
+  if (dead > 0)
+    LOG (WARNING) << "Cleared " << dead << " stale LMDB reader slots";
 
   MDB_envinfo stat;
   CheckOk (mdb_env_info (env, &stat));
@@ -242,9 +298,19 @@ public:
    * ensure that already-modified state is seen.
    */
   explicit ReadTransaction (const LMDBStorage& s)
+    : ReadTransaction(s, false)
+  {}
+
+  /**
+   * Constructs a read transaction.  If forceNew is set, then a fresh
+   * read-only transaction is always started, even if the storage has
+   * a currently open write transaction.  Such a transaction sees only
+   * committed data, and can be used from other threads.
+   */
+  explicit ReadTransaction (const LMDBStorage& s, const bool forceNew)
     : storage(s)
   {
-    if (storage.startedTxn == nullptr)
+    if (forceNew || storage.startedTxn == nullptr)
       {
         ownTx = true;
         VLOG (1) << "Starting a new read-only LMDB transaction";
@@ -290,39 +356,230 @@ public:
     LOG (FATAL) << "CheckOk should have failed with code " << code;
   }
 
+  /**
+   * Reads the current block hash.  Returns false if there is none.
+   */
+  bool
+  ReadCurrentBlockHash (uint256& hash) const
+  {
+    MDB_val key;
+    SingleByteValue (KEY_CURRENT_HASH, key);
+
+    MDB_val data;
+    if (!ReadData (key, data))
+      return false;
+
+    CHECK_EQ (data.mv_size, uint256::NUM_BYTES)
+        << "Invalid data for current block hash in LMDB";
+    hash.FromBlob (static_cast<const unsigned char*> (data.mv_data));
+
+    return true;
+  }
+
+  /**
+   * Reads the current game state, which must exist.
+   */
+  GameStateData
+  ReadCurrentGameState () const
+  {
+    MDB_val key;
+    SingleByteValue (KEY_CURRENT_STATE, key);
+
+    MDB_val data;
+    CHECK (ReadData (key, data));
+
+    return ValueToString (data, 0);
+  }
+
+  /**
+   * Reads the current block height.  Returns false if it is not known.
+   */
+  bool
+  ReadCurrentBlockHeight (unsigned& height) const
+  {
+    MDB_val key;
+    SingleByteValue (KEY_CURRENT_HEIGHT, key);
+
+    MDB_val data;
+    if (!ReadData (key, data))
+      return false;
+
+    CHECK_EQ (data.mv_size, UNDO_HEIGHT_BYTES)
+        << "Invalid data for current block height in LMDB";
+    height = DecodeUnsigned (static_cast<const unsigned char*> (data.mv_data));
+
+    return true;
+  }
+
 };
 
-bool
-LMDBStorage::GetCurrentBlockHash (uint256& hash) const
+/**
+ * Read snapshot of an LMDBStorage.  It pins its own read-only transaction
+ * for as long as it exists, and is registered with the storage for
+ * tracking of long-lived readers.
+ */
+class LMDBStorage::Snapshot : public StorageSnapshot
 {
-  ReadTransaction tx(*this);
 
-  MDB_val key;
-  SingleByteValue (KEY_CURRENT_HASH, key);
+private:
 
-  MDB_val data;
-  if (!tx.ReadData (key, data))
-    return false;
+  /** The storage this is for.  */
+  const LMDBStorage& storage;
 
-  CHECK_EQ (data.mv_size, uint256::NUM_BYTES)
-      << "Invalid data for current block hash in LMDB";
-  hash.FromBlob (static_cast<const unsigned char*> (data.mv_data));
+  /** ID of this snapshot as registered with the storage.  */
+  const uint64_t id;
 
-  return true;
+  /**
+   * Lock for using the transaction.  LMDB does not allow a transaction to
+   * be used by more than one thread at the same time.
+   */
+  mutable std::mutex mut;
+
+  /** The pinned read transaction.  */
+  ReadTransaction tx;
+
+public:
+
+  explicit Snapshot (const LMDBStorage& s)
+    : storage(s), id(storage.RefSnapshot ()), tx(storage, true)
+  {}
+
+  ~Snapshot ()
+  {
+    storage.UnrefSnapshot (id);
+  }
+
+  bool
+  GetCurrentBlockHash (uint256& hash) const override
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return tx.ReadCurrentBlockHash (hash);
+  }
+
+  GameStateData
+  GetCurrentGameState () const override
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return tx.ReadCurrentGameState ();
+  }
+
+  bool
+  GetCurrentBlockHeight (unsigned& height) const override
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return tx.ReadCurrentBlockHeight (height);
+  }
+
+};
+
+bool
+LMDBStorage::GetCurrentBlockHash (uint256& hash) const
+{
+  ReadTransaction tx(*this);
+  return tx.ReadCurrentBlockHash (hash);
 }
 
 GameStateData
 LMDBStorage::GetCurrentGameState () const
 {
   ReadTransaction tx(*this);
+  return tx.ReadCurrentGameState ();
+}
 
-  MDB_val key;
-  SingleByteValue (KEY_CURRENT_STATE, key);
+std::unique_ptr<StorageSnapshot>
+LMDBStorage::GetReadSnapshot () const
+{
+  return std::make_unique<Snapshot> (*this);
+}
 
-  MDB_val data;
-  CHECK (tx.ReadData (key, data));
+uint64_t
+LMDBStorage::RefSnapshot () const
+{
+  std::unique_lock<std::mutex> lock(mutSnapshots);
+  cvSnapshots.wait (lock, [this] () { return !resizing; });
+
+  const uint64_t id = ++nextSnapshotId;
+  openSnapshots.emplace (id, std::chrono::steady_clock::now ());
+  VLOG (1) << "Opened LMDB snapshot " << id;
+
+  return id;
+}
+
+void
+LMDBStorage::UnrefSnapshot (const uint64_t id) const
+{
+  std::lock_guard<std::mutex> lock(mutSnapshots);
+
+  const auto mit = openSnapshots.find (id);
+  CHECK (mit != openSnapshots.end ()) << "Unknown LMDB snapshot " << id;
+
+  const auto age = std::chrono::steady_clock::now () - mit->second;
+  if (age > options.longReaderThreshold)
+    {
+      const auto ms
+          = std::chrono::duration_cast<std::chrono::milliseconds> (age);
+      LOG (WARNING)
+          << "LMDB snapshot " << id << " was held for " << ms.count ()
+          << " ms, which prevents reuse of freed pages in the mean time";
+      ++longLivedSnapshots;
+    }
+
+  openSnapshots.erase (mit);
+  VLOG (1) << "Closed LMDB snapshot " << id;
+
+  cvSnapshots.notify_all ();
+}
+
+void
+LMDBStorage::WaitForSnapshots () const
+{
+  std::unique_lock<std::mutex> lock(mutSnapshots);
+  if (!openSnapshots.empty ())
+    LOG (INFO)
+        << "Waiting for " << openSnapshots.size ()
+        << " LMDB snapshots to be closed";
+  cvSnapshots.wait (lock, [this] () { return openSnapshots.empty (); });
+}
 
-  return ValueToString (data, 0);
+LMDBStorage::SnapshotStats
+LMDBStorage::GetSnapshotStats () const
+{
+  std::lock_guard<std::mutex> lock(mutSnapshots);
+
+  SnapshotStats res;
+  res.open = openSnapshots.size ();
+  res.created = nextSnapshotId;
+  res.longLived = longLivedSnapshots;
+  if (!openSnapshots.empty ())
+    res.oldestAge = std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now () - openSnapshots.begin ()->second);
+
+  return res;
+}
+
+void
+LMDBStorage::CheckLongReaders ()
+{
+  std::lock_guard<std::mutex> lock(mutSnapshots);
+
+  const auto now = std::chrono::steady_clock::now ();
+  for (auto it = openSnapshots.upper_bound (lastWarnedSnapshot);
+       it != openSnapshots.end (); ++it)
+    {
+      /* The snapshots are ordered by their ID, and thus also by their
+         starting time.  So once we find one that is not too old, all
+         following ones are fine as well.  */
+      const auto age = now - it->second;
+      if (age <= options.longReaderThreshold)
+        break;
+
+      const auto ms
+          = std::chrono::duration_cast<std::chrono::milliseconds> (age);
+      LOG (WARNING)
+          << "LMDB snapshot " << it->first << " is open for " << ms.count ()
+          << " ms, pages freed since then cannot be reused";
+      lastWarnedSnapshot = it->first;
+    }
 }
 
 void
@@ -345,6 +602,60 @@ LMDBStorage::SetCurrentGameState (const uint256& hash,
   SingleByteValue (KEY_CURRENT_STATE, key);
   StringToValue (state, data);
   CheckOk (mdb_put (startedTxn, dbi, &key, &data, 0));
+
+  /* Remove the current height, as it is not known for the new state.
+     If the height is known, SetCurrentGameStateWithHeight will add
+     it back afterwards.  */
+  SingleByteValue (KEY_CURRENT_HEIGHT, key);
+  const int code = mdb_del (startedTxn, dbi, &key, nullptr);
+  if (code != MDB_NOTFOUND)
+    CheckOk (code);
+}
+
+void
+LMDBStorage::SetCurrentGameStateWithHeight (const uint256& hash,
+                                            const unsigned height,
+                                            const GameStateData& state)
+{
+  SetCurrentGameState (hash, state);
+
+  MDB_val key;
+  SingleByteValue (KEY_CURRENT_HEIGHT, key);
+
+  MDB_val data;
+  data.mv_size = UNDO_HEIGHT_BYTES;
+  data.mv_data = nullptr;
+  CheckOk (mdb_put (startedTxn, dbi, &key, &data, MDB_RESERVE));
+
+  CHECK (data.mv_data != nullptr);
+  EncodeUnsigned (height, static_cast<unsigned char*> (data.mv_data));
+}
+
+bool
+LMDBStorage::GetCurrentBlockHeight (unsigned& height) const
+{
+  ReadTransaction tx(*this);
+  return tx.ReadCurrentBlockHeight (height);
+}
+
+bool
+LMDBStorage::GetBlockHeight (const uint256& hash, unsigned& height) const
+{
+  ReadTransaction tx(*this);
+
+  MDB_val key;
+  const std::string strKey = KeyForUndoData (hash);
+  StringToValue (strKey, key);
+
+  MDB_val data;
+  if (!tx.ReadData (key, data))
+    return false;
+
+  CHECK (data.mv_size >= UNDO_HEIGHT_BYTES)
+      << "Invalid data stored in LMDB database for undo entry";
+  height = DecodeUnsigned (static_cast<const unsigned char*> (data.mv_data));
+
+  return true;
 }
 
 bool
@@ -490,7 +801,20 @@ public:
 void
 LMDBStorage::PruneUndoData (unsigned height)
 {
+  PruneUndoDataRange (height, std::numeric_limits<unsigned>::max ());
+}
+
+unsigned
+LMDBStorage::PruneUndoDataRange (const unsigned height, const unsigned limit)
+{
+  CHECK_GT (limit, 0);
+
+  /* Undo entries are keyed by block hash, so we have to scan through all of
+     them.  The scan itself is cheap with the memory map; what matters for
+     the transaction size is the number of deleted entries, and that
+     is bounded by limit.  */
   Cursor cursor(*this, startedTxn, dbi);
+  unsigned removed = 0;
 
   MDB_val key;
   SingleByteValue (KEY_PREFIX_UNDO, key);
@@ -513,10 +837,15 @@ LMDBStorage::PruneUndoData (unsigned height)
         {
           VLOG (1) << "Found undo entry for height " << h << ", pruning";
           cursor.Delete ();
+          ++removed;
+          if (removed == limit)
+            break;
         }
 
       hasNext = cursor.Next (key, data);
     }
+
+  return removed;
 }
 
 void
@@ -525,6 +854,16 @@ LMDBStorage::BeginTransaction ()
   CHECK (!needsResize);
   CHECK (startedTxn == nullptr);
 
+  CheckLongReaders ();
+  MaybeGrow ();
+  StartWriteTransaction ();
+}
+
+void
+LMDBStorage::StartWriteTransaction ()
+{
+  CHECK (startedTxn == nullptr);
+
   VLOG (1) << "Starting a new LMDB transaction";
   CheckOk (mdb_txn_begin (env, nullptr, 0, &startedTxn));
   CHECK (startedTxn != nullptr);
@@ -554,6 +893,48 @@ LMDBStorage::CommitTransaction ()
       startedTxn = nullptr;
       throw;
     }
+
+  if (options.noSync && !deferredSync && options.syncInterval > 0)
+    {
+      ++commitsSinceSync;
+      if (commitsSinceSync >= options.syncInterval)
+        Sync ();
+    }
+}
+
+void
+LMDBStorage::Sync ()
+{
+  VLOG (1) << "Syncing the LMDB environment to disk";
+  std::lock_guard<std::mutex> lock(mutSync);
+  CheckOk (mdb_env_sync (env, 1));
+  commitsSinceSync = 0;
+}
+
+bool
+LMDBStorage::SetDeferredSync (const bool enable)
+{
+  CHECK (startedTxn == nullptr);
+
+  /* MDB_NOSYNC can be changed on an open environment.  When disabling
+     deferred syncing, it stays on if the options request it anyway.  */
+  const bool noSync = enable || options.noSync;
+  CheckOk (mdb_env_set_flags (env, MDB_NOSYNC, noSync ? 1 : 0));
+  deferredSync = enable;
+
+  LOG (INFO) << "Deferred syncing for LMDB enabled: " << enable;
+  return enable;
+}
+
+void
+LMDBStorage::SyncCommitted ()
+{
+  /* mdb_env_sync is safe to call while another thread has a write
+     transaction open, but it must not overlap with resizing the map.
+     CheckOk is fine here as well, since MDB_MAP_FULL is not possible.  */
+  VLOG (1) << "Syncing committed LMDB transactions to disk";
+  std::lock_guard<std::mutex> lock(mutSync);
+  CheckOk (mdb_env_sync (env, 1));
 }
 
 void
@@ -578,29 +959,142 @@ LMDBStorage::RollbackTransaction ()
   if (needsResize)
     {
       needsResize = false;
-      Resize ();
+
+      MDB_envinfo stat;
+      CheckOk (mdb_env_info (env, &stat));
+      Resize (stat.me_mapsize << 1);
+      ++mapFullResizes;
     }
 
   CHECK (startedTxn == nullptr);
   CHECK (!needsResize);
 }
 
+size_t
+LMDBStorage::CountFreeListPages () const
+{
+  MDB_txn* txn = nullptr;
+  CheckOk (mdb_txn_begin (env, nullptr, MDB_RDONLY, &txn));
+  CHECK (txn != nullptr);
+
+  /* The free list is kept by LMDB in its internal database with handle
+     zero.  Each value there is a list of page numbers, with the first
+     element being the length of the list.  */
+  MDB_cursor* cursor = nullptr;
+  CheckOk (mdb_cursor_open (txn, 0, &cursor));
+  CHECK (cursor != nullptr);
+
+  size_t res = 0;
+  MDB_val key, data;
+  int code;
+  while ((code = mdb_cursor_get (cursor, &key, &data, MDB_NEXT)) == 0)
+    {
+      CHECK_GE (data.mv_size, sizeof (size_t));
+      res += *static_cast<const size_t*> (data.mv_data);
+    }
+  CHECK_EQ (code, MDB_NOTFOUND) << "LMDB error: " << mdb_strerror (code);
+
+  mdb_cursor_close (cursor);
+  mdb_txn_abort (txn);
+
+  return res;
+}
+
+void
+LMDBStorage::MaybeGrow ()
+{
+  CHECK (startedTxn == nullptr);
+  if (options.minFreeFraction <= 0.0)
+    return;
+
+  MDB_envinfo info;
+  CheckOk (mdb_env_info (env, &info));
+  MDB_stat stat;
+  CheckOk (mdb_env_stat (env, &stat));
+
+  const size_t mapSize = info.me_mapsize;
+  const size_t minFree = mapSize * options.minFreeFraction;
+  const size_t used = std::min<size_t> ((info.me_last_pgno + 1) * stat.ms_psize,
+                                        mapSize);
+
+  /* First check just the unused pages at the end of the map, which is
+     cheap.  Only if they are not enough, take the free list into account
+     as well.  Counting it is expensive, so we reuse the last count unless
+     it may be outdated:  LMDB only moves the last page when it cannot
+     reuse pages from the free list anymore.  */
+  size_t free = mapSize - used;
+  if (free >= minFree)
+    return;
+
+  ++txnsSinceFreeListCheck;
+  if (!freeListCached || freeListLastPgno != info.me_last_pgno
+        || txnsSinceFreeListCheck >= options.freeListCheckInterval)
+    {
+      freeListPages = CountFreeListPages ();
+      freeListLastPgno = info.me_last_pgno;
+      freeListCached = true;
+      txnsSinceFreeListCheck = 0;
+    }
+
+  free += freeListPages * stat.ms_psize;
+  if (free >= minFree)
+    return;
+
+  /* Double the map until the data that is in use takes up at most the
+     allowed fraction of it.  */
+  const size_t inUse = mapSize - std::min (free, mapSize);
+  size_t newSize = mapSize << 1;
+  while (newSize - inUse < newSize * options.minFreeFraction)
+    newSize <<= 1;
+
+  LOG (INFO)
+      << "Only " << (free >> 10) << " KiB of the LMDB map are free,"
+      << " growing it proactively";
+  Resize (newSize);
+  ++proactiveResizes;
+}
+
 void
-LMDBStorage::Resize ()
+LMDBStorage::Resize (const size_t newSize)
 {
   CHECK (startedTxn == nullptr);
 
   MDB_envinfo stat;
   CheckOk (mdb_env_info (env, &stat));
-  const size_t newSize = (stat.me_mapsize << 1);
+  CHECK_GT (newSize, stat.me_mapsize);
 
   LOG (INFO)
       << "Resizing LMDB map from " << (stat.me_mapsize >> 20) << " MiB to "
       << (newSize >> 20) << " MiB";
   needsResize = false;
 
+  /* LMDB requires that no read transactions are active while the map size
+     is changed.  Block new snapshots and wait for the open ones to be
+     closed.  Our own ReadTransaction's are not active at this point.  */
+  {
+    std::unique_lock<std::mutex> lock(mutSnapshots);
+    resizing = true;
+    if (!openSnapshots.empty ())
+      LOG (INFO)
+          << "Waiting for " << openSnapshots.size ()
+          << " LMDB snapshots to be closed before resizing";
+    cvSnapshots.wait (lock, [this] () { return openSnapshots.empty (); });
+  }
+
   mdb_dbi_close (env, dbi);
-  CheckOk (mdb_env_set_mapsize (env, newSize));
+  int code;
+  {
+    /* A background sync may be flushing the map right now.  */
+    std::lock_guard<std::mutex> lock(mutSync);
+    code = mdb_env_set_mapsize (env, newSize);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutSnapshots);
+    resizing = false;
+    cvSnapshots.notify_all ();
+  }
+  CheckOk (code);
 
   CheckOk (mdb_env_info (env, &stat));
   LOG (INFO) << "New size: " << stat.me_mapsize;
@@ -609,7 +1103,7 @@ LMDBStorage::Resize ()
      transaction has been committed.  To satisfy this requirement immediately,
      we keep a counter of how many resizes have been made in the database.
      Increment that now.  */
-  BeginTransaction ();
+  StartWriteTransaction ();
   try
     {
       MDB_val key;
@@ -11,6 +11,14 @@
 
 #include <lmdb.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
 namespace spacexpanse
 {
 
@@ -22,8 +30,86 @@ namespace spacexpanse
 class LMDBStorage : public StorageInterface
 {
 
+public:
+
+  /**
+   * Tuning options for the LMDB environment.
+   */
+  struct Options
+  {
+
+    /**
+     * If true, the environment is opened with MDB_WRITEMAP, so that LMDB
+     * writes through a writable memory map instead of with write calls.
+     * This is faster, but stray writes into the map (e.g. by bugs in
+     * the process) can corrupt the database.
+     */
+    bool writeMap = false;
+
+    /**
+     * If true, the environment is opened with MDB_NOSYNC, so that commits
+     * are not flushed to disk.  The database stays consistent, but the
+     * latest commits may be lost on a system crash.  Durability is then
+     * only guaranteed at explicit sync points (see syncInterval).
+     */
+    bool noSync = false;
+
+    /**
+     * With noSync, the environment is explicitly synced to disk after
+     * this many committed transactions.  If zero, it is only synced
+     * when the storage is closed.
+     */
+    unsigned syncInterval = 0;
+
+    /**
+     * If the free space in the map (unused pages at the end plus pages
+     * on the free list) drops below this fraction of the map size, the
+     * map is grown before the next transaction starts.  This avoids
+     * running into MDB_MAP_FULL, which requires the whole transaction
+     * to be retried.  Zero disables proactive growth.
+     */
+    double minFreeFraction = 0.25;
+
+    /**
+     * Counting the pages on the free list requires a scan of LMDB's free
+     * database, so the count is cached and only refreshed after this many
+     * transactions, or earlier if the map's last used page has moved (which
+     * means that the free list has been used up).
+     */
+    unsigned freeListCheckInterval = 100;
+
+    /**
+     * Read snapshots that are held open for longer than this are reported
+     * as long-lived readers.  They prevent LMDB from reusing the pages freed
+     * since they were opened, so that the map grows instead.
+     */
+    std::chrono::milliseconds longReaderThreshold{10'000};
+
+  };
+
+  /**
+   * Statistics about read snapshots.
+   */
+  struct SnapshotStats
+  {
+
+    /** Number of snapshots that are currently open.  */
+    unsigned open = 0;
+
+    /** Total number of snapshots that have been created.  */
+    uint64_t created = 0;
+
+    /** Number of closed snapshots that were held too long.  */
+    uint64_t longLived = 0;
+
+    /** Age of the oldest currently open snapshot.  */
+    std::chrono::milliseconds oldestAge{0};
+
+  };
+
 private:
 
+  class Snapshot;
   class ReadTransaction;
   class Cursor;
 
@@ -36,15 +122,80 @@ private:
   /** The LMDB environment pointer.  */
   MDB_env* env = nullptr;
 
+  /** The tuning options.  */
+  const Options options;
+
   /** The currently open DB transaction of null if none.  */
   MDB_txn* startedTxn = nullptr;
 
+  /** Number of commits since the last explicit sync to disk.  */
+  unsigned commitsSinceSync = 0;
+
+  /**
+   * Whether deferred syncing has been enabled.  In that case, the
+   * environment uses MDB_NOSYNC and SyncCommitted flushes it.
+   */
+  bool deferredSync = false;
+
+  /**
+   * Lock held while syncing the environment, so that a background sync
+   * does not overlap with changing the map size.
+   */
+  std::mutex mutSync;
+
+  /** Number of map resizes done proactively.  */
+  unsigned proactiveResizes = 0;
+
+  /** Number of map resizes done after MDB_MAP_FULL errors.  */
+  unsigned mapFullResizes = 0;
+
+  /** Whether freeListPages holds a cached count.  */
+  bool freeListCached = false;
+
+  /** Number of pages on the free list when it was last counted.  */
+  size_t freeListPages = 0;
+
+  /** The map's last used page number when the free list was counted.  */
+  size_t freeListLastPgno = 0;
+
+  /** Number of transactions started since the free list was counted.  */
+  unsigned txnsSinceFreeListCheck = 0;
+
+  /** Lock for the data about open snapshots.  */
+  mutable std::mutex mutSnapshots;
+
+  /** Signalled when a snapshot is closed.  */
+  mutable std::condition_variable cvSnapshots;
+
+  /** Start times of the open snapshots, keyed by an increasing ID.  */
+  mutable std::map<uint64_t, std::chrono::steady_clock::time_point>
+      openSnapshots;
+
+  /** The next ID to assign to a snapshot.  */
+  mutable uint64_t nextSnapshotId = 0;
+
+  /** Number of long-lived snapshots that have been closed.  */
+  mutable uint64_t longLivedSnapshots = 0;
+
+  /**
+   * Set while the map is being resized.  LMDB requires that no read
+   * transactions are active then, so new snapshots wait for it.
+   */
+  bool resizing = false;
+
+  /**
+   * ID of the last open snapshot for which we warned about it holding
+   * back page reuse when starting a write transaction.  This is used
+   * to warn only once per snapshot.
+   */
+  uint64_t lastWarnedSnapshot = 0;
+
   /**
    * The identifier of the opened database in the LMDB environment.  We always
    * use the "unnamed" database.  This field is properly set any time when
    * a transaction is started (startedTxn is not null).
    */
-  MDB_dbi dbi;
+  MDB_dbi dbi = 0;
 
   /**
    * Special flag that is set to true if we encountered an MDB_MAP_FULL error
@@ -62,10 +213,46 @@ private:
   void CheckOk (int code) const;
 
   /**
-   * Increases the database map size.  This must only be called if no current
-   * transaction is active (i.e. startedTxn == nullptr).
+   * Increases the database map size to the given value.  This must only
+   * be called if no current transaction is active (i.e. startedTxn
+   * == nullptr).
+   */
+  void Resize (size_t newSize);
+
+  /**
+   * Returns the number of pages on LMDB's free list, which can be reused
+   * for new data without growing the map.
+   */
+  size_t CountFreeListPages () const;
+
+  /**
+   * Grows the map if its free space is below the configured threshold.
+   * Must only be called if no transaction is active.
+   */
+  void MaybeGrow ();
+
+  /**
+   * Starts a write transaction without checking for proactive growth.
    */
-  void Resize ();
+  void StartWriteTransaction ();
+
+  /**
+   * Registers a new snapshot as open and returns its ID.  This waits
+   * if the map is currently being resized.
+   */
+  uint64_t RefSnapshot () const;
+
+  /**
+   * Removes the snapshot with the given ID from the open ones.  This is
+   * called when a snapshot is destructed.
+   */
+  void UnrefSnapshot (uint64_t id) const;
+
+  /**
+   * Warns if there are open snapshots that have been held for longer than
+   * the threshold.  This is done when starting write transactions.
+   */
+  void CheckLongReaders ();
 
 public:
 
@@ -75,6 +262,11 @@ public:
    */
   explicit LMDBStorage (const std::string& dir);
 
+  /**
+   * Creates a storage instance with the given tuning options.
+   */
+  explicit LMDBStorage (const std::string& dir, const Options& opt);
+
   LMDBStorage () = delete;
   LMDBStorage (const LMDBStorage&) = delete;
   void operator= (const LMDBStorage&) = delete;
@@ -87,19 +279,71 @@ public:
 
   bool GetCurrentBlockHash (uint256& hash) const override;
   GameStateData GetCurrentGameState () const override;
+
+  /**
+   * Returns a read snapshot of the last committed state.  It pins an LMDB
+   * read transaction, so that it can be used (also from other threads)
+   * while the writer proceeds.  Snapshots must be destructed before
+   * the storage itself.
+   */
+  std::unique_ptr<StorageSnapshot> GetReadSnapshot () const override;
+
   void SetCurrentGameState (const uint256& hash,
                             const GameStateData& state) override;
+  void SetCurrentGameStateWithHeight (const uint256& hash, unsigned height,
+                                      const GameStateData& state) override;
+  bool GetCurrentBlockHeight (unsigned& height) const override;
+  bool GetBlockHeight (const uint256& hash, unsigned& height) const override;
 
   bool GetUndoData (const uint256& hash, UndoData& undo) const override;
   void AddUndoData (const uint256& hash,
                     unsigned height, const UndoData& undo) override;
   void ReleaseUndoData (const uint256& hash) override;
   void PruneUndoData (unsigned height) override;
+  unsigned PruneUndoDataRange (unsigned height, unsigned limit) override;
 
   void BeginTransaction () override;
   void CommitTransaction () override;
   void RollbackTransaction () override;
 
+  bool SetDeferredSync (bool enable) override;
+  void SyncCommitted () override;
+
+  /**
+   * Blocks until all read snapshots have been closed.
+   */
+  void WaitForSnapshots () const;
+
+  /**
+   * Returns statistics about the read snapshots.
+   */
+  SnapshotStats GetSnapshotStats () const;
+
+  /**
+   * Flushes all committed data to disk.  This is only needed explicitly
+   * if the environment has been opened with noSync.
+   */
+  void Sync ();
+
+  /**
+   * Returns the number of map resizes that have been done proactively.
+   */
+  unsigned
+  GetProactiveResizes () const
+  {
+    return proactiveResizes;
+  }
+
+  /**
+   * Returns the number of map resizes that were triggered by MDB_MAP_FULL
+   * errors (and thus required the transaction to be retried).
+   */
+  unsigned
+  GetMapFullResizes () const
+  {
+    return mapFullResizes;
+  }
+
 };
 
 } // namespace spacexpanse
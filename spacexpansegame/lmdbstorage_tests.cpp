@@ -7,56 +7,21 @@
 #include "storage_tests.hpp"
 
 #include "storage.hpp"
+#include "testutils.hpp"
 
 #include <spacexpanseutil/uint256.hpp>
 
 #include <gtest/gtest.h>
 
-#include <experimental/filesystem>
-
+#include <chrono>
 #include <cstdio>
+#include <thread>
 
 namespace spacexpanse
 {
 namespace
 {
 
-namespace fs = std::experimental::filesystem;
-
-/**
- * Creates a temporary directory and removes it again in the destructor.
- */
-class TemporaryDirectory
-{
-
-private:
-
-  /** Path of the created directory.  */
-  fs::path dir;
-
-public:
-
-  TemporaryDirectory ()
-  {
-    dir = std::tmpnam (nullptr);
-    LOG (INFO) << "Temporary directory for LMDB: " << dir;
-    CHECK (fs::create_directories (dir));
-  }
-
-  ~TemporaryDirectory ()
-  {
-    LOG (INFO) << "Cleaning up temporary directory: " << dir;
-    fs::remove_all (dir);
-  }
-
-  const std::string
-  GetPath () const
-  {
-    return dir.string ();
-  }
-
-};
-
 /**
  * Helper class that wraps LMDBStorage but also manages a temporary data
  * directory for the database.  We cannot simply extend LMDBStorage, as that
@@ -110,6 +75,25 @@ public:
     storage.SetCurrentGameState (hash, data);
   }
 
+  void
+  SetCurrentGameStateWithHeight (const uint256& hash, const unsigned height,
+                                 const GameStateData& data) override
+  {
+    storage.SetCurrentGameStateWithHeight (hash, height, data);
+  }
+
+  bool
+  GetCurrentBlockHeight (unsigned& height) const override
+  {
+    return storage.GetCurrentBlockHeight (height);
+  }
+
+  bool
+  GetBlockHeight (const uint256& hash, unsigned& height) const override
+  {
+    return storage.GetBlockHeight (hash, height);
+  }
+
   bool
   GetUndoData (const uint256& hash, UndoData& data) const override
   {
@@ -135,6 +119,12 @@ public:
     storage.PruneUndoData (height);
   }
 
+  unsigned
+  PruneUndoDataRange (const unsigned height, const unsigned limit) override
+  {
+    return storage.PruneUndoDataRange (height, limit);
+  }
+
   void
   BeginTransaction () override
   {
@@ -216,17 +206,82 @@ TEST_F (LMDBStorageTests, PersistsData)
   }
 }
 
-TEST_F (LMDBStorageTests, ResizingMap)
+TEST_F (LMDBStorageTests, PersistsDataWithNoSync)
+{
+  uint256 hash;
+  CHECK (hash.FromHex ("99" + std::string (62, '0')));
+
+  LMDBStorage::Options options;
+  options.writeMap = true;
+  options.noSync = true;
+  options.syncInterval = 2;
+
+  {
+    LMDBStorage storage(GetDir (), options);
+    storage.Initialise ();
+
+    for (unsigned i = 0; i < 5; ++i)
+      {
+        storage.BeginTransaction ();
+        storage.SetCurrentGameState (hash, "state " + std::to_string (i));
+        storage.CommitTransaction ();
+      }
+  }
+
+  {
+    LMDBStorage storage(GetDir (), options);
+    storage.Initialise ();
+
+    uint256 h;
+    ASSERT_TRUE (storage.GetCurrentBlockHash (h));
+    EXPECT_TRUE (h == hash);
+    EXPECT_EQ (storage.GetCurrentGameState (), "state 4");
+  }
+}
+
+TEST_F (LMDBStorageTests, DeferredSync)
 {
+  uint256 hash;
+  CHECK (hash.FromHex ("99" + std::string (62, '0')));
+
+  {
+    LMDBStorage storage(GetDir ());
+    storage.Initialise ();
+    ASSERT_TRUE (storage.SetDeferredSync (true));
+
+    storage.BeginTransaction ();
+    storage.SetCurrentGameState (hash, "committed");
+    storage.CommitTransaction ();
+
+    /* The next transaction can run while the previous one is synced.  */
+    storage.BeginTransaction ();
+    std::thread syncer([&storage] () { storage.SyncCommitted (); });
+    storage.SetCurrentGameState (hash, "rolled back");
+    storage.RollbackTransaction ();
+    syncer.join ();
+
+    storage.SetDeferredSync (false);
+  }
+
   LMDBStorage storage(GetDir ());
   storage.Initialise ();
+  EXPECT_EQ (storage.GetCurrentGameState (), "committed");
+}
 
+/**
+ * Writes many undo entries to the storage, one per transaction, and retries
+ * transactions that fail with RetryWithNewTransaction.  Returns the number
+ * of retries that were needed.
+ */
+unsigned
+FillWithUndoData (LMDBStorage& storage)
+{
   /* The default map size is 1 MiB.  Each undo entry has at least a size of
      64 bytes, as that corresponds to the raw data of block hash and
      undo string.  So writing 2^20 / 2^6 = 2^14 undo entries to the
      map certainly exceeds the size and requires that the database handles
      resizing by itself.  */
-  unsigned resized = 0;
+  unsigned retries = 0;
   for (unsigned i = 0; i < (1 << 14); ++i)
     {
       std::string hex(64, '0');
@@ -249,12 +304,181 @@ TEST_F (LMDBStorageTests, ResizingMap)
         catch (const StorageInterface::RetryWithNewTransaction& exc)
           {
             storage.RollbackTransaction ();
-            ++resized;
+            ++retries;
           }
     }
 
+  return retries;
+}
+
+TEST_F (LMDBStorageTests, ResizingMap)
+{
+  /* Disable proactive growth, so that the map fills up and we test the
+     resizing after MDB_MAP_FULL.  */
+  LMDBStorage::Options options;
+  options.minFreeFraction = 0.0;
+
+  LMDBStorage storage(GetDir (), options);
+  storage.Initialise ();
+
+  const unsigned resized = FillWithUndoData (storage);
   LOG (INFO) << "Resized the LMDB map " << resized << " times";
   CHECK_GT (resized, 0);
+  EXPECT_EQ (storage.GetMapFullResizes (), resized);
+  EXPECT_EQ (storage.GetProactiveResizes (), 0u);
+}
+
+TEST_F (LMDBStorageTests, ProactiveGrowth)
+{
+  LMDBStorage storage(GetDir ());
+  storage.Initialise ();
+
+  EXPECT_EQ (FillWithUndoData (storage), 0u);
+  EXPECT_EQ (storage.GetMapFullResizes (), 0u);
+  EXPECT_GT (storage.GetProactiveResizes (), 0u);
+  LOG (INFO)
+      << "Grew the LMDB map " << storage.GetProactiveResizes ()
+      << " times proactively";
+}
+
+TEST_F (LMDBStorageTests, SnapshotSeesCommittedState)
+{
+  LMDBStorage storage(GetDir ());
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameStateWithHeight (BlockHash (1), 1, "first");
+  storage.CommitTransaction ();
+
+  const auto snapshot = storage.GetReadSnapshot ();
+  ASSERT_NE (snapshot, nullptr);
+
+  /* Uncommitted and later committed changes are not seen.  */
+  storage.BeginTransaction ();
+  storage.SetCurrentGameStateWithHeight (BlockHash (2), 2, "second");
+  EXPECT_EQ (storage.GetCurrentGameState (), "second");
+  EXPECT_EQ (snapshot->GetCurrentGameState (), "first");
+  storage.CommitTransaction ();
+
+  uint256 hash;
+  unsigned height;
+  ASSERT_TRUE (snapshot->GetCurrentBlockHash (hash));
+  EXPECT_TRUE (hash == BlockHash (1));
+  ASSERT_TRUE (snapshot->GetCurrentBlockHeight (height));
+  EXPECT_EQ (height, 1u);
+  EXPECT_EQ (snapshot->GetCurrentGameState (), "first");
+
+  const auto newSnapshot = storage.GetReadSnapshot ();
+  EXPECT_EQ (newSnapshot->GetCurrentGameState (), "second");
+}
+
+TEST_F (LMDBStorageTests, SnapshotWithoutState)
+{
+  LMDBStorage storage(GetDir ());
+  storage.Initialise ();
+
+  const auto snapshot = storage.GetReadSnapshot ();
+  uint256 hash;
+  EXPECT_FALSE (snapshot->GetCurrentBlockHash (hash));
+}
+
+TEST_F (LMDBStorageTests, SnapshotInOtherThread)
+{
+  LMDBStorage storage(GetDir ());
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (BlockHash (1), "first");
+  storage.CommitTransaction ();
+
+  /* The snapshot is opened on this thread (which then also does reads and
+     writes itself), and used from and closed on another one.  */
+  auto snapshot = storage.GetReadSnapshot ();
+  std::thread reader([&snapshot] ()
+    {
+      for (unsigned i = 0; i < 100; ++i)
+        EXPECT_EQ (snapshot->GetCurrentGameState (), "first");
+      snapshot.reset ();
+    });
+
+  for (unsigned i = 0; i < 100; ++i)
+    {
+      const std::string state = "state " + std::to_string (i);
+      storage.BeginTransaction ();
+      storage.SetCurrentGameState (BlockHash (i), state);
+      storage.CommitTransaction ();
+      EXPECT_EQ (storage.GetCurrentGameState (), state);
+    }
+
+  reader.join ();
+  EXPECT_EQ (storage.GetSnapshotStats ().open, 0u);
+}
+
+TEST_F (LMDBStorageTests, SnapshotStats)
+{
+  LMDBStorage::Options options;
+  options.longReaderThreshold = std::chrono::milliseconds (10);
+
+  LMDBStorage storage(GetDir (), options);
+  storage.Initialise ();
+
+  auto stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.open, 0u);
+  EXPECT_EQ (stats.created, 0u);
+  EXPECT_EQ (stats.longLived, 0u);
+  EXPECT_EQ (stats.oldestAge.count (), 0);
+
+  /* Create snapshots that are closed right away or soon after, and one
+     that is held for longer than the threshold.  */
+  storage.GetReadSnapshot ();
+  auto longLived = storage.GetReadSnapshot ();
+  auto shortLived = storage.GetReadSnapshot ();
+  shortLived.reset ();
+  std::this_thread::sleep_for (std::chrono::milliseconds (20));
+
+  stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.open, 1u);
+  EXPECT_EQ (stats.created, 3u);
+  EXPECT_EQ (stats.longLived, 0u);
+  EXPECT_GE (stats.oldestAge.count (), 20);
+
+  /* Starting a write transaction warns about the long reader, but works
+     just fine otherwise.  */
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (BlockHash (1), "state");
+  storage.CommitTransaction ();
+
+  longLived.reset ();
+  stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.open, 0u);
+  EXPECT_EQ (stats.created, 3u);
+  EXPECT_EQ (stats.longLived, 1u);
+}
+
+TEST_F (LMDBStorageTests, ResizeWaitsForSnapshots)
+{
+  LMDBStorage storage(GetDir ());
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (BlockHash (1), "state");
+  storage.CommitTransaction ();
+
+  /* Keep a snapshot open in another thread for a while.  The writer will
+     need to grow the map in the mean time, which has to wait until the
+     snapshot is closed.  */
+  auto snapshot = storage.GetReadSnapshot ();
+  std::thread reader([&snapshot] ()
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (100));
+      EXPECT_EQ (snapshot->GetCurrentGameState (), "state");
+      snapshot.reset ();
+    });
+
+  EXPECT_EQ (FillWithUndoData (storage), 0u);
+  EXPECT_GT (storage.GetProactiveResizes (), 0u);
+
+  reader.join ();
 }
 
 } // anonymous namespace
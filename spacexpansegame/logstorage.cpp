@@ -0,0 +1,1203 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logstorage.hpp"
+
+#include <glog/logging.h>
+
+#include <zlib.h>
+
+#include <experimental/filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+namespace spacexpanse
+{
+
+namespace fs = std::experimental::filesystem;
+
+/*
+ * Each segment file starts with SEGMENT_MAGIC, followed by records.  A record
+ * consists of the payload length (four bytes), the type character, the
+ * payload, and a CRC32 checksum of type and payload (four bytes).  All numbers
+ * are encoded in big-endian byte order.
+ *
+ * The payload starts with a fixed-size prefix depending on the type (e.g. the
+ * block hash and height for undo data), followed by the variable data (e.g.
+ * the undo data itself).  Records only take effect once a commit record
+ * follows them.
+ */
+
+namespace
+{
+
+/** Magic bytes at the start of each segment file.  */
+constexpr char SEGMENT_MAGIC[] = "spexlog1";
+/** Length of the segment magic.  */
+constexpr size_t MAGIC_SIZE = sizeof (SEGMENT_MAGIC) - 1;
+
+/** Record type for undo data (prefix: hash and height).  */
+constexpr char RECORD_UNDO = 'u';
+/** Record type for released undo data (prefix: hash).  */
+constexpr char RECORD_RELEASE = 'r';
+/** Record type for pruning undo data (prefix: height).  */
+constexpr char RECORD_PRUNE = 'p';
+/**
+ * Record type for the current state (prefix: hash, flag whether the height
+ * is known, and height).
+ */
+constexpr char RECORD_STATE = 's';
+/** Record type for a commit marker (no payload).  */
+constexpr char RECORD_COMMIT = 'c';
+
+/** Number of bytes used for encoding numbers.  */
+constexpr size_t NUMBER_BYTES = 4;
+
+/** Size of the record header (length and type).  */
+constexpr size_t HEADER_SIZE = NUMBER_BYTES + 1;
+/** Size of the record trailer (checksum).  */
+constexpr size_t TRAILER_SIZE = NUMBER_BYTES;
+
+/**
+ * Encodes a number as big-endian bytes.
+ */
+void
+EncodeNumber (uint32_t num, char* bytes)
+{
+  for (size_t i = 0; i < NUMBER_BYTES; ++i)
+    {
+      bytes[NUMBER_BYTES - i - 1] = static_cast<char> (num & 0xFF);
+      num >>= 8;
+    }
+}
+
+/**
+ * Decodes big-endian bytes as number.
+ */
+uint32_t
+DecodeNumber (const char* bytes)
+{
+  uint32_t num = 0;
+  for (size_t i = 0; i < NUMBER_BYTES; ++i)
+    {
+      num <<= 8;
+      num |= static_cast<unsigned char> (bytes[i]);
+    }
+  return num;
+}
+
+/**
+ * Returns the size of the fixed payload prefix for the given record type,
+ * or -1 if the type is invalid.
+ */
+int
+PrefixSize (const char type)
+{
+  switch (type)
+    {
+    case RECORD_UNDO:
+      return uint256::NUM_BYTES + NUMBER_BYTES;
+    case RECORD_RELEASE:
+      return uint256::NUM_BYTES;
+    case RECORD_PRUNE:
+      return NUMBER_BYTES;
+    case RECORD_STATE:
+      return uint256::NUM_BYTES + 1 + NUMBER_BYTES;
+    case RECORD_COMMIT:
+      return 0;
+    default:
+      return -1;
+    }
+}
+
+/**
+ * Returns true if the given record type has variable data after the prefix.
+ */
+bool
+HasData (const char type)
+{
+  return type == RECORD_UNDO || type == RECORD_STATE;
+}
+
+/**
+ * Updates a CRC32 checksum with the given data.
+ */
+uLong
+UpdateChecksum (uLong crc, const char* data, size_t len)
+{
+  while (len > 0)
+    {
+      const uInt n = std::min<size_t> (len, 1 << 30);
+      crc = crc32 (crc, reinterpret_cast<const Bytef*> (data), n);
+      data += n;
+      len -= n;
+    }
+  return crc;
+}
+
+/**
+ * Parses the record at the given position of a segment.  Returns false
+ * if it is truncated or invalid (which is the case for a torn write at the
+ * end of the log).
+ */
+bool
+ParseRecord (const char* data, const size_t size, const size_t pos,
+             char& type, size_t& payloadSize)
+{
+  if (size - pos < HEADER_SIZE + TRAILER_SIZE)
+    return false;
+
+  payloadSize = DecodeNumber (data + pos);
+  type = data[pos + NUMBER_BYTES];
+  if (payloadSize > size - pos - HEADER_SIZE - TRAILER_SIZE)
+    return false;
+
+  const int prefix = PrefixSize (type);
+  if (prefix < 0)
+    return false;
+  if (HasData (type) ? payloadSize < static_cast<size_t> (prefix)
+                     : payloadSize != static_cast<size_t> (prefix))
+    return false;
+
+  uLong crc = crc32 (0, Z_NULL, 0);
+  crc = UpdateChecksum (crc, data + pos + NUMBER_BYTES, 1 + payloadSize);
+  const char* trailer = data + pos + HEADER_SIZE + payloadSize;
+
+  return DecodeNumber (trailer) == static_cast<uint32_t> (crc);
+}
+
+/**
+ * Syncs the given directory, so that newly created or deleted files in
+ * it are persisted.
+ */
+void
+SyncDirectory (const std::string& dir)
+{
+  const int fd = open (dir.c_str (), O_RDONLY | O_DIRECTORY);
+  CHECK_GE (fd, 0)
+      << "Failed to open " << dir << ": " << std::strerror (errno);
+  CHECK_EQ (fsync (fd), 0)
+      << "Failed to sync " << dir << ": " << std::strerror (errno);
+  close (fd);
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+/**
+ * A single segment file of the log.  It is memory-mapped for reading, and
+ * the last segment is also opened for appending data to it.
+ */
+class LogStorage::Segment
+{
+
+private:
+
+  /** The file name.  */
+  const std::string file;
+
+  /** File descriptor for writing, or -1 if not opened for writing.  */
+  int fd = -1;
+
+  /** The memory map of the file.  */
+  char* map = nullptr;
+
+  /** Size of the memory map, which may be larger than the file.  */
+  size_t mapSize = 0;
+
+  /** Number of bytes in the file.  */
+  size_t size = 0;
+
+  /**
+   * Sets up the memory map with the given size.  Mapping beyond the
+   * end of the file is fine, as long as we do not access that part.
+   */
+  void
+  Map (const size_t len)
+  {
+    if (map != nullptr)
+      {
+        munmap (map, mapSize);
+        map = nullptr;
+      }
+
+    mapSize = len;
+    if (mapSize == 0)
+      return;
+
+    const int readFd = open (file.c_str (), O_RDONLY);
+    CHECK_GE (readFd, 0)
+        << "Failed to open " << file << ": " << std::strerror (errno);
+    void* res = mmap (nullptr, mapSize, PROT_READ, MAP_SHARED, readFd, 0);
+    close (readFd);
+
+    CHECK (res != MAP_FAILED)
+        << "Failed to map " << file << ": " << std::strerror (errno);
+    map = static_cast<char*> (res);
+  }
+
+  /**
+   * Writes the given bytes at the given offset, handling partial writes.
+   */
+  void
+  WriteAt (const char* data, size_t len, size_t offset)
+  {
+    while (len > 0)
+      {
+        const ssize_t n = pwrite (fd, data, len, offset);
+        CHECK_GT (n, 0)
+            << "Failed to write to " << file << ": " << std::strerror (errno);
+        data += n;
+        len -= n;
+        offset += n;
+      }
+  }
+
+public:
+
+  /** Total size of the live records in this segment.  */
+  size_t liveBytes = 0;
+
+  /**
+   * Opens an existing segment file for reading.
+   */
+  explicit Segment (const std::string& f)
+    : file(f)
+  {
+    struct stat st;
+    CHECK_EQ (stat (file.c_str (), &st), 0)
+        << "Failed to stat " << file << ": " << std::strerror (errno);
+    size = st.st_size;
+    Map (size);
+  }
+
+  /**
+   * Creates a new segment file and opens it for writing with the given
+   * capacity.
+   */
+  explicit Segment (const std::string& f, const size_t capacity)
+    : file(f)
+  {
+    fd = open (file.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE (fd, 0)
+        << "Failed to create " << file << ": " << std::strerror (errno);
+
+    WriteAt (SEGMENT_MAGIC, MAGIC_SIZE, 0);
+    size = MAGIC_SIZE;
+    Map (std::max (capacity, size));
+  }
+
+  ~Segment ()
+  {
+    if (map != nullptr)
+      munmap (map, mapSize);
+    if (fd >= 0)
+      close (fd);
+  }
+
+  Segment () = delete;
+  Segment (const Segment&) = delete;
+  void operator= (const Segment&) = delete;
+
+  const char*
+  GetData () const
+  {
+    return map;
+  }
+
+  size_t
+  GetSize () const
+  {
+    return size;
+  }
+
+  /**
+   * Returns the number of bytes that can still be appended.
+   */
+  size_t
+  GetFreeSpace () const
+  {
+    CHECK_GE (fd, 0);
+    return mapSize - size;
+  }
+
+  /**
+   * Returns true if the file starts with the segment magic.
+   */
+  bool
+  HasValidHeader () const
+  {
+    return size >= MAGIC_SIZE
+              && std::memcmp (map, SEGMENT_MAGIC, MAGIC_SIZE) == 0;
+  }
+
+  /**
+   * Opens the file for appending, with space for at least the given
+   * number of bytes in total.
+   */
+  void
+  OpenForWriting (const size_t capacity)
+  {
+    CHECK_LT (fd, 0);
+    fd = open (file.c_str (), O_WRONLY);
+    CHECK_GE (fd, 0)
+        << "Failed to open " << file << ": " << std::strerror (errno);
+    Map (std::max (capacity, size));
+  }
+
+  /**
+   * Closes the file for writing.  The data can still be read.
+   */
+  void
+  CloseForWriting ()
+  {
+    CHECK_GE (fd, 0);
+    close (fd);
+    fd = -1;
+    Map (size);
+  }
+
+  /**
+   * Appends the given parts of data to the file.  They must fit into
+   * the free space.
+   */
+  void
+  Append (const std::vector<iovec>& parts)
+  {
+    CHECK_GE (fd, 0);
+
+    size_t total = 0;
+    for (const auto& p : parts)
+      total += p.iov_len;
+    CHECK_LE (total, GetFreeSpace ());
+
+    /* Usually, a single pwritev call writes everything.  If it does not,
+       finish the remaining parts one by one.  */
+    const ssize_t n = pwritev (fd, parts.data (), parts.size (), size);
+    CHECK_GE (n, 0)
+        << "Failed to write to " << file << ": " << std::strerror (errno);
+
+    size_t done = n;
+    size_t offset = size;
+    for (const auto& p : parts)
+      {
+        const size_t skip = std::min (done, p.iov_len);
+        done -= skip;
+        offset += skip;
+        if (skip < p.iov_len)
+          {
+            WriteAt (static_cast<const char*> (p.iov_base) + skip,
+                     p.iov_len - skip, offset);
+            offset += p.iov_len - skip;
+          }
+      }
+
+    size += total;
+  }
+
+  /**
+   * Flushes the written data to disk.
+   */
+  void
+  Sync ()
+  {
+    CHECK_GE (fd, 0);
+    CHECK_EQ (fdatasync (fd), 0)
+        << "Failed to sync " << file << ": " << std::strerror (errno);
+  }
+
+  /**
+   * Truncates the file to the given size.  It must be open for writing.
+   */
+  void
+  Truncate (const size_t newSize)
+  {
+    CHECK_GE (fd, 0);
+    CHECK_LE (newSize, size);
+    CHECK_EQ (ftruncate (fd, newSize), 0)
+        << "Failed to truncate " << file << ": " << std::strerror (errno);
+    size = newSize;
+  }
+
+  /**
+   * Deletes the file from disk.  The instance must not be used anymore
+   * for anything except destructing it afterwards.
+   */
+  void
+  Remove ()
+  {
+    CHECK_EQ (unlink (file.c_str ()), 0)
+        << "Failed to delete " << file << ": " << std::strerror (errno);
+  }
+
+};
+
+/* ************************************************************************** */
+
+LogStorage::LogStorage (const std::string& dir)
+  : LogStorage(dir, Options ())
+{}
+
+LogStorage::LogStorage (const std::string& dir, const Options& opt)
+  : directory(dir), options(opt)
+{
+  CHECK_GT (options.segmentSize, MAGIC_SIZE);
+  CHECK_GE (options.compactionThreshold, 0.0);
+  CHECK_LT (options.compactionThreshold, 1.0);
+}
+
+LogStorage::~LogStorage ()
+{
+  CHECK (!startedTxn);
+
+  /* Without syncing on each commit, make sure that a clean shutdown does
+     not lose any data.  */
+  if (!options.sync && !segments.empty ())
+    Sync ();
+}
+
+std::string
+LogStorage::SegmentFile (const unsigned id) const
+{
+  char name[32];
+  std::snprintf (name, sizeof (name), "%08u.log", id);
+  return (fs::path (directory) / fs::path (name)).string ();
+}
+
+void
+LogStorage::Initialise ()
+{
+  CHECK (fs::is_directory (directory))
+      << "Log storage directory does not exist: " << directory;
+  CHECK (segments.empty ());
+
+  LOG (INFO) << "Opening log storage at " << directory;
+  const auto start = std::chrono::steady_clock::now ();
+  Recover ();
+  const auto duration = std::chrono::duration_cast<std::chrono::milliseconds> (
+      std::chrono::steady_clock::now () - start);
+
+  LOG (INFO)
+      << "Recovered log storage with " << segments.size () << " segments and "
+      << undoIndex.size () << " undo entries in " << duration.count () << " ms";
+}
+
+void
+LogStorage::Recover ()
+{
+  std::vector<unsigned> ids;
+  for (const auto& entry : fs::directory_iterator (directory))
+    {
+      const std::string name = entry.path ().filename ().string ();
+      unsigned id;
+      char rest;
+      if (name.size () == 12
+            && std::sscanf (name.c_str (), "%08u.lo%c", &id, &rest) == 2
+            && rest == 'g' && SegmentFile (id) == entry.path ().string ())
+        ids.push_back (id);
+    }
+  std::sort (ids.begin (), ids.end ());
+
+  /* Records are collected until a commit marker is found, and only then
+     applied.  We also keep track of where the last commit ended, so that
+     everything after it (an incomplete or torn transaction) can be removed
+     at the end.  */
+  struct ReplayedRecord
+  {
+    char type;
+    const char* payload;
+    Location loc;
+  };
+  std::vector<ReplayedRecord> txn;
+  unsigned commitSegment = 0;
+  size_t commitOffset = MAGIC_SIZE;
+
+  bool corrupt = false;
+  size_t i = 0;
+  for (; i < ids.size () && !corrupt; ++i)
+    {
+      const unsigned id = ids[i];
+      auto seg = std::make_unique<Segment> (SegmentFile (id));
+
+      /* A missing header can happen if we crashed right after creating the
+         last segment.  Anywhere else, it means the data is broken.  */
+      if (!seg->HasValidHeader ())
+        {
+          CHECK_EQ (i + 1, ids.size ())
+              << "Invalid log segment " << SegmentFile (id);
+          LOG (WARNING) << "Removing incomplete segment " << SegmentFile (id);
+          seg->Remove ();
+          break;
+        }
+
+      if (i == 0)
+        commitSegment = id;
+
+      const Segment& s = *seg;
+      segments.emplace (id, std::move (seg));
+
+      size_t pos = MAGIC_SIZE;
+      while (pos < s.GetSize ())
+        {
+          char type;
+          size_t payloadSize;
+          if (!ParseRecord (s.GetData (), s.GetSize (), pos, type, payloadSize))
+            {
+              corrupt = true;
+              break;
+            }
+
+          const size_t prefix = PrefixSize (type);
+          ReplayedRecord rec;
+          rec.type = type;
+          rec.payload = s.GetData () + pos + HEADER_SIZE;
+          rec.loc.segment = id;
+          rec.loc.offset = pos + HEADER_SIZE + prefix;
+          rec.loc.size = payloadSize - prefix;
+          rec.loc.recordSize = HEADER_SIZE + payloadSize + TRAILER_SIZE;
+          pos += rec.loc.recordSize;
+
+          if (type != RECORD_COMMIT)
+            {
+              txn.push_back (rec);
+              continue;
+            }
+
+          for (const auto& r : txn)
+            ApplyRecord (r.type, r.payload, r.loc);
+          txn.clear ();
+
+          commitSegment = id;
+          commitOffset = pos;
+        }
+    }
+
+  /* If we stopped at a corrupted record, the following segments have
+     not even been opened.  They are discarded as well.  */
+  for (; i < ids.size (); ++i)
+    {
+      LOG (WARNING)
+          << "Removing segment " << SegmentFile (ids[i])
+          << " after corrupted data";
+      CHECK (fs::remove (SegmentFile (ids[i])));
+    }
+
+  if (segments.empty ())
+    {
+      StartSegment (options.segmentSize);
+      return;
+    }
+
+  /* Remove everything after the last commit.  */
+  while (segments.rbegin ()->first > commitSegment)
+    {
+      const auto it = std::prev (segments.end ());
+      LOG (WARNING)
+          << "Removing uncommitted segment " << SegmentFile (it->first);
+      it->second->Remove ();
+      segments.erase (it);
+    }
+
+  Segment& last = *segments.rbegin ()->second;
+  last.OpenForWriting (options.segmentSize);
+  if (last.GetSize () > commitOffset)
+    {
+      LOG (WARNING)
+          << "Discarding " << (last.GetSize () - commitOffset)
+          << " bytes of uncommitted data at the end of the log";
+      last.Truncate (commitOffset);
+      last.Sync ();
+    }
+
+  DropSegments ();
+}
+
+void
+LogStorage::Clear ()
+{
+  CHECK (!startedTxn);
+  LOG (INFO) << "Deleting all segments to clear the log storage";
+
+  /* Delete the newest segments first.  If we crash in between, the remaining
+     segments form a prefix of the log, which is still consistent.  */
+  while (!segments.empty ())
+    {
+      const auto it = std::prev (segments.end ());
+      it->second->Remove ();
+      segments.erase (it);
+    }
+  SyncDirectory (directory);
+
+  undoIndex.clear ();
+  hasState = false;
+  hasHeight = false;
+  currentState.reset ();
+
+  StartSegment (options.segmentSize);
+}
+
+void
+LogStorage::StartSegment (const size_t minSize)
+{
+  unsigned id = 1;
+  if (!segments.empty ())
+    {
+      /* The closed segment is always synced, even without syncing commits.
+         LogStorage::Sync only syncs the newest segment, and the records
+         in this one may supersede data in older segments that get
+         deleted later.  This happens only once per segment, so it
+         is cheap.  */
+      Segment& last = *segments.rbegin ()->second;
+      last.Sync ();
+      last.CloseForWriting ();
+      id = segments.rbegin ()->first + 1;
+    }
+
+  VLOG (1) << "Starting new log segment " << id;
+  const size_t capacity = std::max (options.segmentSize, MAGIC_SIZE + minSize);
+  segments.emplace (id, std::make_unique<Segment> (SegmentFile (id), capacity));
+
+  if (options.sync)
+    {
+      segments.rbegin ()->second->Sync ();
+      SyncDirectory (directory);
+    }
+}
+
+LogStorage::Location
+LogStorage::Append (const PendingRecord& rec)
+{
+  const size_t dataSize = (rec.data == nullptr ? 0 : rec.data->size ());
+  const size_t payloadSize = rec.prefix.size () + dataSize;
+  CHECK_LE (payloadSize, UINT32_MAX) << "Log record is too large";
+  const size_t recordSize = HEADER_SIZE + payloadSize + TRAILER_SIZE;
+
+  CHECK (!segments.empty ());
+  if (segments.rbegin ()->second->GetFreeSpace () < recordSize)
+    StartSegment (recordSize);
+
+  char header[HEADER_SIZE];
+  EncodeNumber (payloadSize, header);
+  header[NUMBER_BYTES] = rec.type;
+
+  uLong crc = crc32 (0, Z_NULL, 0);
+  crc = UpdateChecksum (crc, &rec.type, 1);
+  crc = UpdateChecksum (crc, rec.prefix.data (), rec.prefix.size ());
+  if (dataSize > 0)
+    crc = UpdateChecksum (crc, rec.data->data (), dataSize);
+  char trailer[TRAILER_SIZE];
+  EncodeNumber (crc, trailer);
+
+  const auto part = [] (const char* data, const size_t len)
+    {
+      iovec res;
+      res.iov_base = const_cast<char*> (data);
+      res.iov_len = len;
+      return res;
+    };
+
+  std::vector<iovec> parts;
+  parts.push_back (part (header, HEADER_SIZE));
+  if (!rec.prefix.empty ())
+    parts.push_back (part (rec.prefix.data (), rec.prefix.size ()));
+  if (dataSize > 0)
+    parts.push_back (part (rec.data->data (), dataSize));
+  parts.push_back (part (trailer, TRAILER_SIZE));
+
+  Segment& seg = *segments.rbegin ()->second;
+  Location res;
+  res.segment = segments.rbegin ()->first;
+  res.offset = seg.GetSize () + HEADER_SIZE + rec.prefix.size ();
+  res.size = dataSize;
+  res.recordSize = recordSize;
+
+  seg.Append (parts);
+
+  return res;
+}
+
+void
+LogStorage::WriteRecords (const std::vector<PendingRecord>& records)
+{
+  if (records.empty ())
+    return;
+
+  std::vector<Location> locs;
+  locs.reserve (records.size ());
+  for (const auto& rec : records)
+    locs.push_back (Append (rec));
+
+  PendingRecord commit;
+  commit.type = RECORD_COMMIT;
+  Append (commit);
+
+  if (options.sync)
+    segments.rbegin ()->second->Sync ();
+
+  for (size_t i = 0; i < records.size (); ++i)
+    ApplyRecord (records[i].type, records[i].prefix.data (), locs[i]);
+}
+
+void
+LogStorage::ReleaseRecord (const Location& loc)
+{
+  auto& seg = *segments.at (loc.segment);
+  CHECK_GE (seg.liveBytes, loc.recordSize);
+  seg.liveBytes -= loc.recordSize;
+}
+
+void
+LogStorage::ApplyRecord (const char type, const char* payload,
+                         const Location& loc)
+{
+  switch (type)
+    {
+    case RECORD_UNDO:
+      {
+        uint256 hash;
+        hash.FromBlob (reinterpret_cast<const unsigned char*> (payload));
+
+        UndoEntry entry;
+        entry.height = DecodeNumber (payload + uint256::NUM_BYTES);
+        entry.loc = loc;
+
+        auto mit = undoIndex.find (hash);
+        if (mit == undoIndex.end ())
+          undoIndex.emplace (hash, entry);
+        else
+          {
+            ReleaseRecord (mit->second.loc);
+            mit->second = entry;
+          }
+
+        segments.at (loc.segment)->liveBytes += loc.recordSize;
+        break;
+      }
+
+    case RECORD_RELEASE:
+      {
+        uint256 hash;
+        hash.FromBlob (reinterpret_cast<const unsigned char*> (payload));
+
+        auto mit = undoIndex.find (hash);
+        if (mit != undoIndex.end ())
+          {
+            ReleaseRecord (mit->second.loc);
+            undoIndex.erase (mit);
+          }
+        break;
+      }
+
+    case RECORD_PRUNE:
+      {
+        const unsigned height = DecodeNumber (payload);
+        for (auto mit = undoIndex.begin (); mit != undoIndex.end (); )
+          if (mit->second.height <= height)
+            {
+              ReleaseRecord (mit->second.loc);
+              mit = undoIndex.erase (mit);
+            }
+          else
+            ++mit;
+        break;
+      }
+
+    case RECORD_STATE:
+      {
+        if (hasState)
+          ReleaseRecord (currentLoc);
+
+        hasState = true;
+        currentHash.FromBlob (reinterpret_cast<const unsigned char*> (payload));
+        hasHeight = (payload[uint256::NUM_BYTES] != 0);
+        currentHeight = DecodeNumber (payload + uint256::NUM_BYTES + 1);
+        currentLoc = loc;
+
+        segments.at (loc.segment)->liveBytes += loc.recordSize;
+        break;
+      }
+
+    default:
+      LOG (FATAL) << "Unexpected log record type: " << type;
+    }
+}
+
+std::string
+LogStorage::Read (const Location& loc) const
+{
+  const auto& seg = *segments.at (loc.segment);
+  CHECK_LE (loc.offset + loc.size, seg.GetSize ());
+  return std::string (seg.GetData () + loc.offset, loc.size);
+}
+
+void
+LogStorage::Sync ()
+{
+  CHECK (!segments.empty ());
+  segments.rbegin ()->second->Sync ();
+}
+
+void
+LogStorage::DropSegments ()
+{
+  bool compacted = false;
+  bool removed = false;
+  while (segments.size () > 1)
+    {
+      const auto it = segments.begin ();
+      Segment& seg = *it->second;
+
+      if (seg.liveBytes > 0)
+        {
+          /* Compact at most one segment per call, so that the extra work
+             for it is spread out over multiple commits.  The decision is
+             based on the whole log rather than the oldest segment alone,
+             since compacted records accumulate near the head and would
+             otherwise keep the next segments above the threshold.  */
+          if (compacted || options.compactionThreshold <= 0.0)
+            break;
+
+          size_t live = 0;
+          size_t total = 0;
+          for (const auto& entry : segments)
+            {
+              live += entry.second->liveBytes;
+              total += entry.second->GetSize ();
+            }
+          if (live > total * options.compactionThreshold)
+            break;
+
+          Compact (it->first);
+          CHECK_EQ (seg.liveBytes, 0);
+          compacted = true;
+        }
+
+      /* Before deleting the segment, make sure that the records superseding
+         its data are on disk.  All but the newest segment have been synced
+         already when they were closed.  */
+      if (!options.sync)
+        Sync ();
+
+      VLOG (1) << "Deleting log segment " << it->first;
+      seg.Remove ();
+      segments.erase (it);
+      ++droppedSegments;
+      removed = true;
+    }
+
+  if (removed)
+    SyncDirectory (directory);
+}
+
+void
+LogStorage::Compact (const unsigned id)
+{
+  VLOG (1) << "Compacting log segment " << id;
+
+  std::vector<PendingRecord> records;
+  for (const auto& entry : undoIndex)
+    if (entry.second.loc.segment == id)
+      records.push_back (UndoRecord (
+          entry.first, entry.second.height,
+          std::make_shared<const std::string> (Read (entry.second.loc))));
+
+  if (hasState && currentLoc.segment == id)
+    {
+      const SharedGameStateData state = GetCurrentGameStateShared ();
+      records.push_back (StateRecord (currentHash, hasHeight, currentHeight,
+                                      state));
+    }
+
+  /* The current state data does not change, so we can keep the cached
+     handle (which ApplyRecord does not touch).  */
+  WriteRecords (records);
+  ++compactedSegments;
+}
+
+LogStorage::PendingRecord
+LogStorage::UndoRecord (const uint256& hash, const unsigned height,
+                        SharedData data)
+{
+  PendingRecord res;
+  res.type = RECORD_UNDO;
+  res.prefix.resize (PrefixSize (RECORD_UNDO));
+  std::copy (hash.GetBlob (), hash.GetBlob () + uint256::NUM_BYTES,
+             res.prefix.begin ());
+  EncodeNumber (height, &res.prefix[uint256::NUM_BYTES]);
+  res.data = std::move (data);
+  return res;
+}
+
+LogStorage::PendingRecord
+LogStorage::StateRecord (const uint256& hash, const bool withHeight,
+                         const unsigned height, SharedData data)
+{
+  PendingRecord res;
+  res.type = RECORD_STATE;
+  res.prefix.resize (PrefixSize (RECORD_STATE));
+  std::copy (hash.GetBlob (), hash.GetBlob () + uint256::NUM_BYTES,
+             res.prefix.begin ());
+  res.prefix[uint256::NUM_BYTES] = (withHeight ? 1 : 0);
+  EncodeNumber (withHeight ? height : 0,
+                &res.prefix[uint256::NUM_BYTES + 1]);
+  res.data = std::move (data);
+  return res;
+}
+
+/* ************************************************************************** */
+
+bool
+LogStorage::GetCurrentBlockHash (uint256& hash) const
+{
+  if (pendingStateSet)
+    {
+      hash = pendingHash;
+      return true;
+    }
+
+  if (!hasState)
+    return false;
+
+  hash = currentHash;
+  return true;
+}
+
+GameStateData
+LogStorage::GetCurrentGameState () const
+{
+  return *GetCurrentGameStateShared ();
+}
+
+SharedGameStateData
+LogStorage::GetCurrentGameStateShared () const
+{
+  if (pendingStateSet)
+    return pendingState;
+
+  CHECK (hasState);
+  if (currentState == nullptr)
+    currentState = std::make_shared<const GameStateData> (Read (currentLoc));
+
+  return currentState;
+}
+
+bool
+LogStorage::GetCurrentBlockHeight (unsigned& height) const
+{
+  if (pendingStateSet)
+    {
+      if (!pendingHasHeight)
+        return false;
+      height = pendingHeight;
+      return true;
+    }
+
+  if (!hasState || !hasHeight)
+    return false;
+
+  height = currentHeight;
+  return true;
+}
+
+void
+LogStorage::SetPendingState (const uint256& hash, const bool withHeight,
+                             const unsigned height,
+                             const SharedGameStateData& data)
+{
+  CHECK (startedTxn);
+  CHECK (data != nullptr);
+
+  pendingStateSet = true;
+  pendingHash = hash;
+  pendingHasHeight = withHeight;
+  pendingHeight = height;
+  pendingState = data;
+}
+
+void
+LogStorage::SetCurrentGameState (const uint256& hash,
+                                 const GameStateData& data)
+{
+  SetPendingState (hash, false, 0,
+                   std::make_shared<const GameStateData> (data));
+}
+
+void
+LogStorage::SetCurrentGameStateWithHeight (const uint256& hash,
+                                           const unsigned height,
+                                           const GameStateData& data)
+{
+  SetPendingState (hash, true, height,
+                   std::make_shared<const GameStateData> (data));
+}
+
+void
+LogStorage::SetCurrentGameStateShared (const uint256& hash,
+                                       const unsigned height,
+                                       const SharedGameStateData& data)
+{
+  SetPendingState (hash, true, height, data);
+}
+
+bool
+LogStorage::GetBlockHeight (const uint256& hash, unsigned& height) const
+{
+  const auto pit = pendingUndo.find (hash);
+  if (pit != pendingUndo.end ())
+    {
+      if (!pit->second.present)
+        return false;
+      height = pit->second.height;
+      return true;
+    }
+
+  const auto mit = undoIndex.find (hash);
+  if (mit == undoIndex.end ())
+    return false;
+  if (pendingPruned && mit->second.height <= pendingPruneHeight)
+    return false;
+
+  height = mit->second.height;
+  return true;
+}
+
+bool
+LogStorage::GetUndoData (const uint256& hash, UndoData& data) const
+{
+  const auto pit = pendingUndo.find (hash);
+  if (pit != pendingUndo.end ())
+    {
+      if (!pit->second.present)
+        return false;
+      data = *pit->second.data;
+      return true;
+    }
+
+  const auto mit = undoIndex.find (hash);
+  if (mit == undoIndex.end ())
+    return false;
+  if (pendingPruned && mit->second.height <= pendingPruneHeight)
+    return false;
+
+  data = Read (mit->second.loc);
+  return true;
+}
+
+void
+LogStorage::AddUndoData (const uint256& hash,
+                         const unsigned height, const UndoData& data)
+{
+  CHECK (startedTxn);
+
+  PendingUndo entry;
+  entry.present = true;
+  entry.height = height;
+  entry.data = std::make_shared<const std::string> (data);
+
+  pendingRecords.push_back (UndoRecord (hash, height, entry.data));
+  pendingUndo[hash] = std::move (entry);
+}
+
+void
+LogStorage::ReleaseUndoData (const uint256& hash)
+{
+  CHECK (startedTxn);
+
+  PendingRecord rec;
+  rec.type = RECORD_RELEASE;
+  rec.prefix.assign (reinterpret_cast<const char*> (hash.GetBlob ()),
+                     uint256::NUM_BYTES);
+  pendingRecords.push_back (std::move (rec));
+
+  PendingUndo entry;
+  entry.present = false;
+  entry.height = 0;
+  pendingUndo[hash] = std::move (entry);
+}
+
+void
+LogStorage::PruneUndoData (const unsigned height)
+{
+  CHECK (startedTxn);
+
+  PendingRecord rec;
+  rec.type = RECORD_PRUNE;
+  rec.prefix.resize (NUMBER_BYTES);
+  EncodeNumber (height, &rec.prefix[0]);
+  pendingRecords.push_back (std::move (rec));
+
+  if (!pendingPruned || height > pendingPruneHeight)
+    {
+      pendingPruned = true;
+      pendingPruneHeight = height;
+    }
+
+  for (auto& entry : pendingUndo)
+    if (entry.second.present && entry.second.height <= height)
+      {
+        entry.second.present = false;
+        entry.second.data.reset ();
+      }
+}
+
+void
+LogStorage::BeginTransaction ()
+{
+  CHECK (!startedTxn);
+  startedTxn = true;
+}
+
+void
+LogStorage::CommitTransaction ()
+{
+  CHECK (startedTxn);
+
+  /* Only the last state set in the transaction matters, so it is written
+     just once at the end instead of for each update.  */
+  if (pendingStateSet)
+    pendingRecords.push_back (StateRecord (pendingHash, pendingHasHeight,
+                                           pendingHeight, pendingState));
+
+  WriteRecords (pendingRecords);
+  if (pendingStateSet)
+    currentState = pendingState;
+
+  ClearPending ();
+  startedTxn = false;
+
+  DropSegments ();
+}
+
+void
+LogStorage::RollbackTransaction ()
+{
+  CHECK (startedTxn);
+
+  ClearPending ();
+  startedTxn = false;
+}
+
+void
+LogStorage::ClearPending ()
+{
+  pendingRecords.clear ();
+  pendingUndo.clear ();
+  pendingPruned = false;
+  pendingStateSet = false;
+  pendingState.reset ();
+}
+
+} // namespace spacexpanse
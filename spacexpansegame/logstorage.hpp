@@ -0,0 +1,365 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_LOGSTORAGE_HPP
+#define SPACEXPANSEGAME_LOGSTORAGE_HPP
+
+#include "storage.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace spacexpanse
+{
+
+/**
+ * Implementation of StorageInterface that keeps data in an append-only log
+ * of segment files on disk.  This matches the access pattern of a game
+ * daemon, which appends undo data for each block, overwrites the current
+ * state, only rarely reads undo data and prunes old undo data.
+ *
+ * All changes of a transaction are appended to the log at once when it is
+ * committed, followed by a commit marker.  An in-memory index points to the
+ * latest records, which are read through memory maps of the segment files.
+ * Segments that no longer contain live records are deleted as a whole,
+ * and on startup the log is replayed to rebuild the index (discarding
+ * a torn tail that has not been fully committed).
+ */
+class LogStorage : public StorageInterface
+{
+
+public:
+
+  /**
+   * Tuning options for the log storage.
+   */
+  struct Options
+  {
+
+    /**
+     * Size of each segment file.  When a record does not fit into the
+     * current segment anymore, a new one is started.  Records larger than
+     * this get a segment of their own.
+     */
+    size_t segmentSize = 64 << 20;
+
+    /**
+     * If true, each commit is synced to disk before CommitTransaction
+     * returns.  Otherwise the latest commits may be lost on a system crash,
+     * but the log always stays consistent.
+     */
+    bool sync = true;
+
+    /**
+     * If the live records take up at most this fraction of all segments,
+     * the live records of the oldest segment are copied to the head of the
+     * log and the segment is deleted.  This keeps the log from growing with
+     * old game states if undo data is not pruned, and bounds its size to
+     * the live data divided by the threshold.  Zero disables compaction.
+     */
+    double compactionThreshold = 0.5;
+
+  };
+
+private:
+
+  class Segment;
+
+  /** Position of a record's data in the log.  */
+  struct Location
+  {
+
+    /** The segment it is in.  */
+    unsigned segment = 0;
+
+    /** Offset of the data (not the record header) in the segment.  */
+    size_t offset = 0;
+
+    /** Size of the data.  */
+    size_t size = 0;
+
+    /** Size of the full record, including header and checksum.  */
+    size_t recordSize = 0;
+
+  };
+
+  /** Data about stored undo data in the index.  */
+  struct UndoEntry
+  {
+
+    /** The block height of the undo data.  */
+    unsigned height;
+
+    /** Where the undo data is stored.  */
+    Location loc;
+
+  };
+
+  /** Type for the data of a record that is going to be written.  */
+  using SharedData = std::shared_ptr<const std::string>;
+
+  /** A record of the current transaction that has not yet been written.  */
+  struct PendingRecord
+  {
+
+    /** The type of the record.  */
+    char type;
+
+    /** The fixed-size first part of the payload (e.g. block hash).  */
+    std::string prefix;
+
+    /** The variable data following the prefix.  May be null.  */
+    SharedData data;
+
+  };
+
+  /** A change to undo data in the current transaction.  */
+  struct PendingUndo
+  {
+
+    /** True if the undo data is present, false if it has been removed.  */
+    bool present;
+
+    /** The height, if present.  */
+    unsigned height;
+
+    /** The undo data, if present.  */
+    SharedData data;
+
+  };
+
+  /** Directory in which the segment files are stored.  */
+  const std::string directory;
+
+  /** The tuning options.  */
+  const Options options;
+
+  /** All segments in the log, oldest first.  */
+  std::map<unsigned, std::unique_ptr<Segment>> segments;
+
+  /** Index of the undo data by block hash.  */
+  std::map<uint256, UndoEntry> undoIndex;
+
+  /** Whether or not there is a current state.  */
+  bool hasState = false;
+
+  /** Block hash of the current state.  */
+  uint256 currentHash;
+
+  /** Whether or not the height of the current state is known.  */
+  bool hasHeight = false;
+
+  /** Height of the current state, if known.  */
+  unsigned currentHeight;
+
+  /** Location of the current state in the log.  */
+  Location currentLoc;
+
+  /**
+   * The current state data, if it has been loaded already (or set as
+   * shared handle).  This avoids reading it from the log every time.
+   */
+  mutable SharedGameStateData currentState;
+
+  /** Set while a transaction is open.  */
+  bool startedTxn = false;
+
+  /**
+   * Records of the current transaction.  This does not include the
+   * current state, which is only added (once) on commit.
+   */
+  std::vector<PendingRecord> pendingRecords;
+
+  /** Changes to undo data in the current transaction.  */
+  std::map<uint256, PendingUndo> pendingUndo;
+
+  /** The largest height pruned in the current transaction, if any.  */
+  bool pendingPruned = false;
+  unsigned pendingPruneHeight;
+
+  /** Whether the current state has been changed in the transaction.  */
+  bool pendingStateSet = false;
+  uint256 pendingHash;
+  bool pendingHasHeight;
+  unsigned pendingHeight;
+  SharedGameStateData pendingState;
+
+  /** Number of segments that have been deleted.  */
+  unsigned droppedSegments = 0;
+
+  /** Number of segments that have been compacted before deletion.  */
+  unsigned compactedSegments = 0;
+
+  /**
+   * Constructs a pending record for undo data.
+   */
+  static PendingRecord UndoRecord (const uint256& hash, unsigned height,
+                                   SharedData data);
+
+  /**
+   * Constructs a pending record for the current state.
+   */
+  static PendingRecord StateRecord (const uint256& hash, bool withHeight,
+                                    unsigned height, SharedData data);
+
+  /**
+   * Sets the current state in the pending transaction.
+   */
+  void SetPendingState (const uint256& hash, bool withHeight, unsigned height,
+                        const SharedGameStateData& data);
+
+  /**
+   * Copies the live records of the given segment to the head of the log,
+   * so that the segment can be deleted.
+   */
+  void Compact (unsigned id);
+
+  /**
+   * Returns the segment file name for the given ID.
+   */
+  std::string SegmentFile (unsigned id) const;
+
+  /**
+   * Opens a new, empty segment after the current last one (which is
+   * closed for writing).  The segment's map is made large enough to
+   * hold at least the given number of bytes.
+   */
+  void StartSegment (size_t minSize);
+
+  /**
+   * Appends the given record to the log, starting a new segment if needed.
+   * Returns the location at which it was written.
+   */
+  Location Append (const PendingRecord& rec);
+
+  /**
+   * Appends a list of records followed by a commit marker to the log,
+   * syncs it if configured, and applies the records to the index.
+   */
+  void WriteRecords (const std::vector<PendingRecord>& records);
+
+  /**
+   * Applies a record (from the log or just written) to the in-memory
+   * index.  The payload points to the record's full payload data.
+   */
+  void ApplyRecord (char type, const char* payload, const Location& loc);
+
+  /**
+   * Marks the given record as dead, subtracting its size from the live
+   * bytes of its segment.
+   */
+  void ReleaseRecord (const Location& loc);
+
+  /**
+   * Reads the data at the given location.
+   */
+  std::string Read (const Location& loc) const;
+
+  /**
+   * Replays the segment files in the directory to rebuild the index.
+   */
+  void Recover ();
+
+  /**
+   * Deletes the oldest segments if they contain no live data anymore,
+   * and compacts the oldest one if it is mostly dead.
+   */
+  void DropSegments ();
+
+  /**
+   * Syncs the last segment to disk.
+   */
+  void Sync ();
+
+  /**
+   * Resets the pending data of a transaction.
+   */
+  void ClearPending ();
+
+public:
+
+  /**
+   * Creates a storage instance that keeps its data in the given directory.
+   * The directory must already exist.
+   */
+  explicit LogStorage (const std::string& dir);
+
+  /**
+   * Creates a storage instance with the given tuning options.
+   */
+  explicit LogStorage (const std::string& dir, const Options& opt);
+
+  LogStorage () = delete;
+  LogStorage (const LogStorage&) = delete;
+  void operator= (const LogStorage&) = delete;
+
+  ~LogStorage ();
+
+  void Initialise () override;
+
+  void Clear () override;
+
+  bool GetCurrentBlockHash (uint256& hash) const override;
+  GameStateData GetCurrentGameState () const override;
+  SharedGameStateData GetCurrentGameStateShared () const override;
+
+  void SetCurrentGameState (const uint256& hash,
+                            const GameStateData& data) override;
+  void SetCurrentGameStateWithHeight (const uint256& hash, unsigned height,
+                                      const GameStateData& data) override;
+  void SetCurrentGameStateShared (const uint256& hash, unsigned height,
+                                  const SharedGameStateData& data) override;
+  bool GetCurrentBlockHeight (unsigned& height) const override;
+  bool GetBlockHeight (const uint256& hash, unsigned& height) const override;
+
+  bool GetUndoData (const uint256& hash, UndoData& data) const override;
+  void AddUndoData (const uint256& hash,
+                    unsigned height, const UndoData& data) override;
+  void ReleaseUndoData (const uint256& hash) override;
+  void PruneUndoData (unsigned height) override;
+
+  void BeginTransaction () override;
+  void CommitTransaction () override;
+  void RollbackTransaction () override;
+
+  /**
+   * Returns the number of segment files that the log consists of.
+   */
+  unsigned
+  GetNumSegments () const
+  {
+    return segments.size ();
+  }
+
+  /**
+   * Returns the number of segments that have been deleted because they
+   * contained no live data anymore.
+   */
+  unsigned
+  GetDroppedSegments () const
+  {
+    return droppedSegments;
+  }
+
+  /**
+   * Returns the number of segments whose live data has been copied to the
+   * head of the log, so that they could be deleted.
+   */
+  unsigned
+  GetCompactedSegments () const
+  {
+    return compactedSegments;
+  }
+
+};
+
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_LOGSTORAGE_HPP
@@ -0,0 +1,414 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logstorage.hpp"
+
+#include "storage_tests.hpp"
+#include "testutils.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <experimental/filesystem>
+
+#include <cstdio>
+#include <string>
+
+namespace spacexpanse
+{
+namespace
+{
+
+namespace fs = std::experimental::filesystem;
+
+/**
+ * Holder for a temporary directory, which is used as first base class of
+ * TempLogStorage so that the directory is created before and removed after
+ * the storage itself.
+ */
+struct TemporaryDirectoryHolder
+{
+  TemporaryDirectory tempDir;
+};
+
+/**
+ * LogStorage instance that keeps its data in a temporary directory.
+ */
+class TempLogStorage : private TemporaryDirectoryHolder, public LogStorage
+{
+
+public:
+
+  TempLogStorage ()
+    : LogStorage(tempDir.GetPath ())
+  {}
+
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P (Log, BasicStorageTests, TempLogStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (Log, PruningStorageTests, TempLogStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (Log, TransactingStorageTests, TempLogStorage);
+
+/**
+ * Returns a block hash for the given height.  In contrast to BlockHash,
+ * this supports large numbers.
+ */
+uint256
+HashForHeight (const unsigned height)
+{
+  std::string hex(64, '0');
+  std::sprintf (&hex[0], "%08x", height);
+  hex[8] = '0';
+
+  uint256 res;
+  CHECK (res.FromHex (hex));
+  return res;
+}
+
+/**
+ * Tests for things specific to the log storage.  The fixture manages
+ * a temporary directory, and the tests construct storages in it.
+ */
+class LogStorageTests : public testing::Test
+{
+
+private:
+
+  TemporaryDirectory dir;
+
+protected:
+
+  const std::string&
+  GetDir () const
+  {
+    return dir.GetPath ();
+  }
+
+  /**
+   * Returns the path of the last segment file in the directory.
+   */
+  std::string
+  GetLastSegment () const
+  {
+    std::string res;
+    for (const auto& entry : fs::directory_iterator (GetDir ()))
+      res = std::max (res, entry.path ().string ());
+    CHECK (!res.empty ());
+    return res;
+  }
+
+  /**
+   * Attaches a block to the storage in a transaction, i.e. stores undo
+   * data and a new current state for it.  If keep is non-zero, undo data
+   * older than that many blocks is pruned.
+   */
+  static void
+  AttachBlock (StorageInterface& storage, const unsigned height,
+               const GameStateData& state, const unsigned keep = 0)
+  {
+    storage.BeginTransaction ();
+    storage.AddUndoData (HashForHeight (height), height,
+                         "undo " + std::to_string (height));
+    storage.SetCurrentGameStateWithHeight (HashForHeight (height), height,
+                                           state);
+    if (keep > 0 && height > keep)
+      storage.PruneUndoData (height - keep);
+    storage.CommitTransaction ();
+  }
+
+  /**
+   * Expects that the storage has the given current state and height.
+   */
+  static void
+  ExpectState (const StorageInterface& storage, const unsigned height,
+               const GameStateData& state)
+  {
+    uint256 hash;
+    ASSERT_TRUE (storage.GetCurrentBlockHash (hash));
+    EXPECT_EQ (hash, HashForHeight (height));
+
+    unsigned h;
+    ASSERT_TRUE (storage.GetCurrentBlockHeight (h));
+    EXPECT_EQ (h, height);
+
+    EXPECT_EQ (storage.GetCurrentGameState (), state);
+  }
+
+};
+
+TEST_F (LogStorageTests, PersistsData)
+{
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+
+    for (unsigned i = 1; i <= 10; ++i)
+      AttachBlock (storage, i, "state " + std::to_string (i));
+
+    storage.BeginTransaction ();
+    storage.ReleaseUndoData (HashForHeight (10));
+    storage.PruneUndoData (3);
+    storage.CommitTransaction ();
+  }
+
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+    ExpectState (storage, 10, "state 10");
+
+    UndoData undo;
+    EXPECT_FALSE (storage.GetUndoData (HashForHeight (3), undo));
+    EXPECT_FALSE (storage.GetUndoData (HashForHeight (10), undo));
+    ASSERT_TRUE (storage.GetUndoData (HashForHeight (4), undo));
+    EXPECT_EQ (undo, "undo 4");
+
+    unsigned height;
+    ASSERT_TRUE (storage.GetBlockHeight (HashForHeight (9), height));
+    EXPECT_EQ (height, 9u);
+  }
+}
+
+TEST_F (LogStorageTests, StateWithoutHeight)
+{
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+
+    AttachBlock (storage, 1, "first");
+    storage.BeginTransaction ();
+    storage.SetCurrentGameState (HashForHeight (2), "second");
+    storage.CommitTransaction ();
+  }
+
+  LogStorage storage(GetDir ());
+  storage.Initialise ();
+
+  unsigned height;
+  EXPECT_FALSE (storage.GetCurrentBlockHeight (height));
+  EXPECT_EQ (storage.GetCurrentGameState (), "second");
+}
+
+TEST_F (LogStorageTests, ReadsInTransaction)
+{
+  LogStorage storage(GetDir ());
+  storage.Initialise ();
+
+  AttachBlock (storage, 10, "state");
+  AttachBlock (storage, 11, "state");
+
+  UndoData undo;
+  storage.BeginTransaction ();
+  storage.PruneUndoData (10);
+  EXPECT_FALSE (storage.GetUndoData (HashForHeight (10), undo));
+  EXPECT_TRUE (storage.GetUndoData (HashForHeight (11), undo));
+
+  storage.ReleaseUndoData (HashForHeight (11));
+  EXPECT_FALSE (storage.GetUndoData (HashForHeight (11), undo));
+
+  storage.AddUndoData (HashForHeight (5), 5, "added");
+  ASSERT_TRUE (storage.GetUndoData (HashForHeight (5), undo));
+  EXPECT_EQ (undo, "added");
+  storage.RollbackTransaction ();
+
+  EXPECT_TRUE (storage.GetUndoData (HashForHeight (10), undo));
+  EXPECT_TRUE (storage.GetUndoData (HashForHeight (11), undo));
+  EXPECT_FALSE (storage.GetUndoData (HashForHeight (5), undo));
+}
+
+TEST_F (LogStorageTests, TornTailIsDiscarded)
+{
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+    AttachBlock (storage, 1, "first");
+    AttachBlock (storage, 2, "second");
+  }
+
+  /* Cut off the last byte, which belongs to the commit marker of the
+     second block.  This simulates a crash while writing it.  */
+  const std::string file = GetLastSegment ();
+  fs::resize_file (file, fs::file_size (file) - 1);
+
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+    ExpectState (storage, 1, "first");
+
+    UndoData undo;
+    EXPECT_FALSE (storage.GetUndoData (HashForHeight (2), undo));
+
+    /* New data is appended properly after the discarded tail.  */
+    AttachBlock (storage, 3, "third");
+  }
+
+  LogStorage storage(GetDir ());
+  storage.Initialise ();
+  ExpectState (storage, 3, "third");
+}
+
+TEST_F (LogStorageTests, CorruptedRecordIsDiscarded)
+{
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+    AttachBlock (storage, 1, "first");
+    AttachBlock (storage, 2, "second");
+  }
+
+  /* Flip a byte in the checksum of the second block's state record, so that
+     it does not match anymore.  */
+  const std::string file = GetLastSegment ();
+  FILE* f = std::fopen (file.c_str (), "r+b");
+  ASSERT_NE (f, nullptr);
+  ASSERT_EQ (std::fseek (f, -10, SEEK_END), 0);
+  const int c = std::fgetc (f);
+  ASSERT_EQ (std::fseek (f, -10, SEEK_END), 0);
+  std::fputc (c ^ 0xFF, f);
+  std::fclose (f);
+
+  LogStorage storage(GetDir ());
+  storage.Initialise ();
+  ExpectState (storage, 1, "first");
+}
+
+TEST_F (LogStorageTests, PruningDropsSegments)
+{
+  LogStorage::Options options;
+  options.segmentSize = 1 << 10;
+  options.compactionThreshold = 0.0;
+  options.sync = false;
+
+  {
+    LogStorage storage(GetDir (), options);
+    storage.Initialise ();
+
+    for (unsigned i = 1; i <= 1'000; ++i)
+      AttachBlock (storage, i, "state " + std::to_string (i), 10);
+
+    EXPECT_GT (storage.GetDroppedSegments (), 100u);
+    EXPECT_LT (storage.GetNumSegments (), 10u);
+    EXPECT_EQ (storage.GetCompactedSegments (), 0u);
+  }
+
+  LogStorage storage(GetDir (), options);
+  storage.Initialise ();
+  ExpectState (storage, 1'000, "state 1000");
+
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (HashForHeight (990), undo));
+  ASSERT_TRUE (storage.GetUndoData (HashForHeight (991), undo));
+  EXPECT_EQ (undo, "undo 991");
+}
+
+TEST_F (LogStorageTests, CompactionWithoutPruning)
+{
+  LogStorage::Options options;
+  options.segmentSize = 4 << 10;
+  options.sync = false;
+
+  const std::string state(500, 'x');
+  {
+    LogStorage storage(GetDir (), options);
+    storage.Initialise ();
+
+    for (unsigned i = 1; i <= 500; ++i)
+      AttachBlock (storage, i, state);
+
+    /* Without compaction, the old states would keep all segments.  */
+    EXPECT_GT (storage.GetCompactedSegments (), 0u);
+    EXPECT_LT (storage.GetNumSegments (), 20u);
+  }
+
+  LogStorage storage(GetDir (), options);
+  storage.Initialise ();
+  ExpectState (storage, 500, state);
+
+  for (unsigned i = 1; i <= 500; ++i)
+    {
+      UndoData undo;
+      ASSERT_TRUE (storage.GetUndoData (HashForHeight (i), undo));
+      EXPECT_EQ (undo, "undo " + std::to_string (i));
+    }
+}
+
+TEST_F (LogStorageTests, RecordLargerThanSegment)
+{
+  LogStorage::Options options;
+  options.segmentSize = 1 << 10;
+
+  const std::string large(10'000, 'x');
+  {
+    LogStorage storage(GetDir (), options);
+    storage.Initialise ();
+    AttachBlock (storage, 1, large);
+    AttachBlock (storage, 2, "small");
+    AttachBlock (storage, 3, large);
+    ExpectState (storage, 3, large);
+  }
+
+  LogStorage storage(GetDir (), options);
+  storage.Initialise ();
+  ExpectState (storage, 3, large);
+}
+
+TEST_F (LogStorageTests, OneStateRecordPerTransaction)
+{
+  LogStorage::Options options;
+  options.segmentSize = 1 << 10;
+
+  const auto stateFor = [] (const unsigned height)
+    {
+      return std::string (500, 'a' + height);
+    };
+
+  {
+    LogStorage storage(GetDir (), options);
+    storage.Initialise ();
+    const unsigned before = storage.GetNumSegments ();
+
+    storage.BeginTransaction ();
+    for (unsigned i = 1; i <= 10; ++i)
+      storage.SetCurrentGameStateWithHeight (HashForHeight (i), i,
+                                             stateFor (i));
+    storage.CommitTransaction ();
+
+    /* Only the final state is written, and that fits into one segment.
+       If all states were written, they would fill multiple segments,
+       which are then dropped again.  */
+    EXPECT_LE (storage.GetNumSegments (), before + 1);
+    EXPECT_EQ (storage.GetDroppedSegments (), 0u);
+    ExpectState (storage, 10, stateFor (10));
+  }
+
+  LogStorage storage(GetDir (), options);
+  storage.Initialise ();
+  ExpectState (storage, 10, stateFor (10));
+}
+
+TEST_F (LogStorageTests, ClearRemovesData)
+{
+  {
+    LogStorage storage(GetDir ());
+    storage.Initialise ();
+    AttachBlock (storage, 1, "state");
+    storage.Clear ();
+
+    uint256 hash;
+    EXPECT_FALSE (storage.GetCurrentBlockHash (hash));
+  }
+
+  LogStorage storage(GetDir ());
+  storage.Initialise ();
+
+  uint256 hash;
+  EXPECT_FALSE (storage.GetCurrentBlockHash (hash));
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (HashForHeight (1), undo));
+}
+
+} // anonymous namespace
+} // namespace spacexpanse
@@ -14,6 +14,10 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
 namespace
 {
@@ -23,18 +27,25 @@ DEFINE_string (db, "",
 DEFINE_string (table, "",
                "If set, only the given table is dumped");
 DEFINE_bool (sha256, false, "If true, hash the output with SHA-256");
+DEFINE_int32 (threads, 1,
+              "Number of threads (each with its own database connection)"
+              " to use for reading the tables");
 
 /**
- * Runs the main dumping on the given output stream.
+ * Runs the main dumping on the given output stream.  If more than one
+ * connection is passed, the tables are read in parallel.
  */
 template <typename Out>
   void
-  Run (Out& s, const spacexpanse::SQLiteDatabase& db)
+  Run (Out& s, const std::vector<const spacexpanse::SQLiteDatabase*>& dbs)
 {
+  std::set<std::string> tables;
   if (FLAGS_table.empty ())
-    WriteAllTables (s, db);
+    tables = spacexpanse::GetSqliteTables (*dbs.front ());
   else
-    WriteTableContent (s, db, FLAGS_table);
+    tables.insert (FLAGS_table);
+
+  WriteTablesParallel (s, dbs, tables);
 }
 
 } // anonymous namespace
@@ -54,16 +65,31 @@ main (int argc, char** argv)
       return EXIT_FAILURE;
     }
 
-  spacexpanse::SQLiteDatabase db(FLAGS_db, SQLITE_OPEN_READONLY);
+  if (FLAGS_threads < 1)
+    {
+      std::cerr << "Error: --threads must be at least one" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  std::vector<std::unique_ptr<spacexpanse::SQLiteDatabase>> connections;
+  if (FLAGS_threads == 1)
+    connections.push_back (std::make_unique<spacexpanse::SQLiteDatabase> (
+        FLAGS_db, SQLITE_OPEN_READONLY));
+  else
+    connections = spacexpanse::OpenConsistentReaders (FLAGS_db, FLAGS_threads);
+
+  std::vector<const spacexpanse::SQLiteDatabase*> dbs;
+  for (const auto& c : connections)
+    dbs.push_back (c.get ());
 
   if (FLAGS_sha256)
     {
       spacexpanse::SHA256 hasher;
-      Run (hasher, db);
+      Run (hasher, dbs);
       std::cout << hasher.Finalise ().ToHex () << std::endl;
     }
   else
-    Run (std::cout, db);
+    Run (std::cout, dbs);
 
   return EXIT_SUCCESS;
 }
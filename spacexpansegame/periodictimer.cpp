@@ -0,0 +1,43 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "periodictimer.hpp"
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+PeriodicTimer::PeriodicTimer (const Callback& c,
+                              const std::chrono::milliseconds i)
+  : cb(c), intv(i), shouldStop(false)
+{
+  runner = std::make_unique<std::thread> ([this] () { Run (); });
+}
+
+PeriodicTimer::~PeriodicTimer ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  runner->join ();
+  runner.reset ();
+}
+
+void
+PeriodicTimer::Run ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (!shouldStop)
+    {
+      cv.wait_for (lock, intv);
+      cb ();
+    }
+}
+
+} // namespace internal
+} // namespace spacexpanse
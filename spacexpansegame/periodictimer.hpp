@@ -0,0 +1,85 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_PERIODICTIMER_HPP
+#define SPACEXPANSEGAME_PERIODICTIMER_HPP
+
+/* This file is an implementation detail of Game and should not be
+   used directly by external code!  */
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/**
+ * Helper class that runs a background thread, which calls a callback
+ * function at regular intervals until the instance is destructed.
+ *
+ * The callback is invoked while an internal lock is held, which the
+ * destructor needs as well.  Thus the instance must not be destructed
+ * while holding a lock that the callback acquires.
+ */
+class PeriodicTimer
+{
+
+public:
+
+  /** Type of the callback function.  */
+  using Callback = std::function<void ()>;
+
+private:
+
+  /** The callback function to call.  */
+  const Callback cb;
+
+  /** The interval between calls.  */
+  const std::chrono::milliseconds intv;
+
+  /** Mutex for this instance.  */
+  std::mutex mut;
+
+  /** Condition variable to wait on / signal a stop request.  */
+  std::condition_variable cv;
+
+  /** The actual thread running.  */
+  std::unique_ptr<std::thread> runner;
+
+  /** Set to true if the thread should stop.  */
+  bool shouldStop;
+
+  /**
+   * Runs the thread's main loop.
+   */
+  void Run ();
+
+public:
+
+  /**
+   * Constructs the instance and starts the background thread.
+   */
+  explicit PeriodicTimer (const Callback& c, std::chrono::milliseconds i);
+
+  /**
+   * Stops and joins the background thread.
+   */
+  ~PeriodicTimer ();
+
+  PeriodicTimer () = delete;
+  PeriodicTimer (const PeriodicTimer&) = delete;
+  void operator= (const PeriodicTimer&) = delete;
+
+};
+
+} // namespace internal
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_PERIODICTIMER_HPP
@@ -0,0 +1,54 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "periodictimer.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace spacexpanse
+{
+namespace internal
+{
+namespace
+{
+
+TEST (PeriodicTimerTests, CallsRegularly)
+{
+  std::atomic<unsigned> calls(0);
+
+  {
+    PeriodicTimer timer([&calls] () { ++calls; },
+                        std::chrono::milliseconds (1));
+    while (calls < 5)
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  }
+
+  /* After destruction, there are no more calls.  */
+  const unsigned afterStop = calls;
+  std::this_thread::sleep_for (std::chrono::milliseconds (10));
+  EXPECT_EQ (calls, afterStop);
+}
+
+TEST (PeriodicTimerTests, StopsBeforeInterval)
+{
+  std::atomic<unsigned> calls(0);
+
+  const auto start = std::chrono::steady_clock::now ();
+  {
+    PeriodicTimer timer([&calls] () { ++calls; },
+                        std::chrono::hours (1));
+  }
+  const auto elapsed = std::chrono::steady_clock::now () - start;
+
+  EXPECT_LT (elapsed, std::chrono::minutes (1));
+  EXPECT_LE (calls, 1u);
+}
+
+} // anonymous namespace
+} // namespace internal
+} // namespace spacexpanse
@@ -6,6 +6,8 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+
 namespace spacexpanse
 {
 namespace internal
@@ -16,8 +18,17 @@ PruningQueue::PruningQueue (StorageInterface& s, TransactionManager& tm,
   : storage(s), transactionManager(tm), nBlocks(n)
 {
   LOG (INFO) << "Created empty pruning queue with desired size " << nBlocks;
+  transactionManager.AddListener (*this);
+}
+
+PruningQueue::~PruningQueue ()
+{
+  transactionManager.RemoveListener (*this);
 }
 
+constexpr unsigned PruningQueue::DEFAULT_CHUNK_SIZE;
+constexpr std::chrono::milliseconds PruningQueue::DEFAULT_TIME_BUDGET;
+
 void
 PruningQueue::PruneIfTooLong ()
 {
@@ -28,20 +39,115 @@ PruningQueue::PruneIfTooLong ()
   if (hashes.size () <= nBlocks)
     return;
 
-  VLOG (1) << "Pruning " << (hashes.size () - nBlocks) << " old blocks";
+  VLOG (1) << "Scheduling " << (hashes.size () - nBlocks) << " old blocks";
 
-  /* We use just one transaction for pruning all blocks to avoid excessive
-     transaction creation.  This means that if a failure occurs, it may be
-     that the deletion of data from the storage is rolled back while the
-     in-memory queue thinks it is deleted.  But that is no big deal, as
-     we will re-prune anyway on the next startup at the latest.  */
-  ActiveTransaction tx(transactionManager);
+  if (!HasPendingWork ())
+    backlogStart = stats;
   while (hashes.size () > nBlocks)
     {
-      storage.ReleaseUndoData (hashes.front ());
+      toRelease.push_back (hashes.front ());
       hashes.pop_front ();
     }
+}
+
+void
+PruningQueue::BatchCommitted ()
+{
+  releasedInBatch.clear ();
+  rangeDoneInBatch = false;
+}
+
+void
+PruningQueue::BatchRolledBack ()
+{
+  if (releasedInBatch.empty () && !rangeDoneInBatch)
+    return;
+
+  VLOG (1) << "Pruning work has been rolled back, scheduling it again";
+  if (!HasPendingWork ())
+    backlogStart = stats;
+
+  toRelease.insert (toRelease.begin (),
+                    releasedInBatch.begin (), releasedInBatch.end ());
+  if (rangeDoneInBatch)
+    rangePending = true;
+
+  BatchCommitted ();
+}
+
+void
+PruningQueue::ProcessPending ()
+{
+  if (!HasPendingWork ())
+    return;
+
+  const auto start = std::chrono::steady_clock::now ();
+  while (PruneChunk ())
+    if (std::chrono::steady_clock::now () - start >= timeBudget)
+      {
+        VLOG (1) << "Pruning time budget used up, continuing later";
+        break;
+      }
+}
+
+bool
+PruningQueue::PruneChunk ()
+{
+  if (!HasPendingWork ())
+    return false;
+
+  const auto start = std::chrono::steady_clock::now ();
+  unsigned removed;
+
+  /* The in-memory state is updated right before committing, with the work
+     done remembered as part of the current batch.  If the transaction
+     (or later the batch it is part of) is rolled back instead of
+     committed, BatchRolledBack schedules the work again.  */
+  ActiveTransaction tx(transactionManager);
+  if (!toRelease.empty ())
+    {
+      removed = std::min<size_t> (chunkSize, toRelease.size ());
+      for (unsigned i = 0; i < removed; ++i)
+        storage.ReleaseUndoData (toRelease[i]);
+
+      releasedInBatch.insert (releasedInBatch.end (), toRelease.begin (),
+                              toRelease.begin () + removed);
+      toRelease.erase (toRelease.begin (), toRelease.begin () + removed);
+    }
+  else
+    {
+      CHECK (rangePending);
+      removed = storage.PruneUndoDataRange (rangeHeight, chunkSize);
+
+      if (removed < chunkSize)
+        {
+          LOG (INFO)
+              << "Removed all undo data up to height " << rangeHeight;
+          rangePending = false;
+          rangeDoneInBatch = true;
+        }
+    }
   tx.Commit ();
+
+  ++stats.chunks;
+  stats.entries += removed;
+  stats.time += std::chrono::duration_cast<std::chrono::microseconds> (
+      std::chrono::steady_clock::now () - start);
+  VLOG (1) << "Pruned chunk of " << removed << " undo entries";
+
+  if (HasPendingWork ())
+    return true;
+
+  Stats backlog;
+  backlog.chunks = stats.chunks - backlogStart.chunks;
+  backlog.entries = stats.entries - backlogStart.entries;
+  backlog.time = stats.time - backlogStart.time;
+  LOG_IF (INFO, backlog.chunks > 1)
+      << "Pruned backlog of " << backlog.entries << " undo entries in "
+      << backlog.chunks << " chunks (" << backlog.GetEntriesPerSecond ()
+      << " entries/s)";
+
+  return false;
 }
 
 void
@@ -52,11 +158,14 @@ PruningQueue::SetDesiredSize (const unsigned n)
       << " to " << n;
   nBlocks = n;
   PruneIfTooLong ();
+  ProcessPending ();
 }
 
 void
 PruningQueue::Reset ()
 {
+  /* Pending work that has already been scheduled is kept.  It refers to
+     blocks that were deep enough at the time, which does not change.  */
   LOG (INFO) << "Resetting pruning queue";
   hashes.clear ();
   initialPruningDone = false;
@@ -77,19 +186,22 @@ PruningQueue::AttachBlock (const uint256& hash, const unsigned height)
       const unsigned frontHeight = height + 1 - hashes.size ();
 
       LOG (INFO)
-          << "Pruning queue has filled up, removing all old blocks before"
-             " the front height " << frontHeight;
+          << "Pruning queue has filled up, scheduling removal of all old"
+             " blocks before the front height " << frontHeight;
 
       if (frontHeight > 0)
         {
-          ActiveTransaction tx(transactionManager);
-          storage.PruneUndoData (frontHeight - 1);
-          tx.Commit ();
+          if (!HasPendingWork ())
+            backlogStart = stats;
+          rangeHeight = rangePending ? std::max (rangeHeight, frontHeight - 1)
+                                     : frontHeight - 1;
+          rangePending = true;
         }
       initialPruningDone = true;
     }
 
   PruneIfTooLong ();
+  ProcessPending ();
 }
 
 void
@@ -111,5 +223,17 @@ PruningQueue::DetachBlock ()
   hashes.pop_back ();
 }
 
+void
+PruningQueue::SetChunking (const unsigned entries,
+                           const std::chrono::milliseconds budget)
+{
+  CHECK_GT (entries, 0);
+  LOG (INFO)
+      << "Pruning in chunks of " << entries << " entries with a time budget of "
+      << budget.count () << " ms per block";
+  chunkSize = entries;
+  timeBudget = budget;
+}
+
 } // namespace internal
 } // namespace spacexpanse
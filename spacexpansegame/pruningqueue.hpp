@@ -13,6 +13,8 @@
 
 #include <spacexpanseutil/uint256.hpp>
 
+#include <chrono>
+#include <cstdint>
 #include <deque>
 
 namespace spacexpanse
@@ -23,10 +25,59 @@ namespace internal
 /**
  * A queue of the last few block hashes in the blockchain, which helps us
  * implement pruning.
+ *
+ * The actual removal of undo data is done in bounded chunks, each in its
+ * own transaction and separate from the block's state update.  After each
+ * attached block, chunks are processed until a time budget is used up.
+ * This way, also a large backlog (e.g. when pruning is first enabled on
+ * an existing database) is worked off incrementally without stalling
+ * the block processing.
+ *
+ * With batching in the transaction manager, a committed chunk may still be
+ * rolled back together with its batch.  The work done in the current batch
+ * is thus remembered until the batch has been committed to the storage,
+ * and scheduled again if it is rolled back instead.
  */
-class PruningQueue
+class PruningQueue : private TransactionManager::BatchListener
 {
 
+public:
+
+  /**
+   * Statistics about the pruning work done.
+   */
+  struct Stats
+  {
+
+    /** Number of chunks (transactions) processed.  */
+    uint64_t chunks = 0;
+
+    /** Number of undo entries removed.  */
+    uint64_t entries = 0;
+
+    /** Total time spent removing undo data.  */
+    std::chrono::microseconds time{0};
+
+    /**
+     * Returns the pruning throughput in entries per second, or zero if
+     * nothing has been done yet.
+     */
+    double
+    GetEntriesPerSecond () const
+    {
+      if (time.count () == 0)
+        return 0.0;
+      return entries * 1e6 / time.count ();
+    }
+
+  };
+
+  /** Default maximum number of undo entries removed per chunk.  */
+  static constexpr unsigned DEFAULT_CHUNK_SIZE = 1'000;
+
+  /** Default time budget for pruning after each attached block.  */
+  static constexpr std::chrono::milliseconds DEFAULT_TIME_BUDGET{50};
+
 private:
 
   /**
@@ -58,11 +109,57 @@ private:
    */
   bool initialPruningDone = false;
 
+  /** Hashes that have dropped out of the queue and still need releasing.  */
+  std::deque<uint256> toRelease;
+
+  /**
+   * Set if the initial pruning by height has not been done completely yet.
+   * All undo data up to (including) rangeHeight should then be removed.
+   */
+  bool rangePending = false;
+
+  /** The height up to which range pruning is pending.  */
+  unsigned rangeHeight = 0;
+
   /**
-   * Performs the actual pruning if the queue is longer than necessary.
+   * Hashes that have been released in the current batch of the transaction
+   * manager, which may still be rolled back.
+   */
+  std::deque<uint256> releasedInBatch;
+
+  /** Set if the range pruning has been completed in the current batch.  */
+  bool rangeDoneInBatch = false;
+
+  /** Maximum number of undo entries removed per chunk.  */
+  unsigned chunkSize = DEFAULT_CHUNK_SIZE;
+
+  /** Time budget for pruning chunks after each attached block.  */
+  std::chrono::milliseconds timeBudget = DEFAULT_TIME_BUDGET;
+
+  /** Statistics about all pruning done.  */
+  Stats stats;
+
+  /**
+   * Statistics at the time the current backlog started, so that we can
+   * report the throughput for it when it has been worked off.
+   */
+  Stats backlogStart;
+
+  /**
+   * Moves the blocks that are too many in the queue to toRelease.
    */
   void PruneIfTooLong ();
 
+  /**
+   * Processes pending chunks until none are left or the time budget
+   * is used up.  At least one chunk is done if there is work, so that
+   * progress is guaranteed.
+   */
+  void ProcessPending ();
+
+  void BatchCommitted () override;
+  void BatchRolledBack () override;
+
 public:
 
   /**
@@ -72,6 +169,12 @@ public:
   explicit PruningQueue (StorageInterface& s, TransactionManager& tm,
                          unsigned n);
 
+  ~PruningQueue ();
+
+  PruningQueue () = delete;
+  PruningQueue (const PruningQueue&) = delete;
+  void operator= (const PruningQueue&) = delete;
+
   /**
    * Changes the number of desired blocks.  If the new value is smaller
    * than the current size of the queue, pruning is done to bring the size
@@ -100,6 +203,36 @@ public:
    */
   void DetachBlock ();
 
+  /**
+   * Changes the size of pruning chunks and the time budget per attached
+   * block.  The chunk size must be positive.
+   */
+  void SetChunking (unsigned entries, std::chrono::milliseconds budget);
+
+  /**
+   * Returns true if there is pruning work that has not been done yet.
+   */
+  bool
+  HasPendingWork () const
+  {
+    return rangePending || !toRelease.empty ();
+  }
+
+  /**
+   * Removes one chunk of pending undo data in its own transaction.
+   * Returns true if there is more work left afterwards.
+   */
+  bool PruneChunk ();
+
+  /**
+   * Returns the statistics about the pruning done so far.
+   */
+  const Stats&
+  GetStats () const
+  {
+    return stats;
+  }
+
 };
 
 } // namespace internal
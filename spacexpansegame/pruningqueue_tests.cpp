@@ -15,6 +15,8 @@
 
 #include <glog/logging.h>
 
+#include <chrono>
+
 namespace spacexpanse
 {
 namespace internal
@@ -203,6 +205,76 @@ TEST_F (PruningQueueTests, Reset)
   AssertFirstNonPruned (50);
 }
 
+TEST_F (PruningQueueTests, ChunkedInitialPruning)
+{
+  PruningQueue queue(storage, transactionManager, 10);
+  queue.SetChunking (10, std::chrono::milliseconds (0));
+
+  /* With a zero time budget, each attach does exactly one chunk.  */
+  nextHeight = 100;
+  AttachBlocks (queue, 10);
+  EXPECT_TRUE (queue.HasPendingWork ());
+  EXPECT_EQ (queue.GetStats ().chunks, 1);
+  EXPECT_EQ (queue.GetStats ().entries, 10);
+
+  while (queue.PruneChunk ())
+    ;
+  EXPECT_FALSE (queue.HasPendingWork ());
+  AssertFirstNonPruned (100);
+
+  /* The last chunk finds nothing more to prune.  */
+  EXPECT_EQ (queue.GetStats ().chunks, 11);
+  EXPECT_EQ (queue.GetStats ().entries, 100);
+}
+
+TEST_F (PruningQueueTests, ChunkedRelease)
+{
+  PruningQueue queue(storage, transactionManager, 10);
+
+  AttachBlocks (queue, 50);
+  AssertFirstNonPruned (40);
+
+  queue.SetChunking (3, std::chrono::milliseconds (0));
+  queue.SetDesiredSize (0);
+  EXPECT_TRUE (queue.HasPendingWork ());
+  AssertFirstNonPruned (43);
+
+  AttachBlocks (queue, 1);
+  AssertFirstNonPruned (46);
+
+  while (queue.PruneChunk ())
+    ;
+  EXPECT_FALSE (queue.HasPendingWork ());
+  AssertPrunedUpTo (nextHeight - 1);
+}
+
+TEST_F (PruningQueueTests, RolledBackChunksAreRetried)
+{
+  PruningQueue queue(storage, transactionManager, 10);
+
+  AttachBlocks (queue, 20);
+  AssertFirstNonPruned (10);
+
+  /* With batching, the release of the next block only becomes part of the
+     batch, which is then rolled back.  MemoryStorage cannot actually roll
+     back, so we restore the undo data manually.  */
+  transactionManager.SetBatchSize (10);
+  AttachBlocks (queue, 1);
+  transactionManager.TryAbortTransaction ();
+  {
+    ActiveTransaction tx(transactionManager);
+    storage.AddUndoData (BlockHash (10), 10, BlockHash (10).ToHex ());
+    tx.Commit ();
+  }
+  transactionManager.SetBatchSize (1);
+  AssertFirstNonPruned (10);
+
+  /* The rolled-back release is done again with the next block.  */
+  AttachBlocks (queue, 1);
+  EXPECT_FALSE (queue.HasPendingWork ());
+  AssertFirstNonPruned (12);
+}
+
 using SetDesiredSizeTests = PruningQueueTests;
 
 TEST_F (SetDesiredSizeTests, MakeLarger)
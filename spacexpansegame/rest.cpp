@@ -4,6 +4,7 @@
 
 #include "rest.hpp"
 
+#include "spacexpanseutil/compression.hpp"
 #include "spacexpanseutil/cryptorand.hpp"
 
 #include <microhttpd.h>
@@ -74,16 +75,23 @@ public:
 /* ************************************************************************** */
 
 RestApi::SuccessResult::SuccessResult (const Json::Value& val)
-  : type("application/json")
+  : type("application/json"),
+    payload(WriteCompactJson (val))
+{}
+
+RestApi::SuccessResult::SuccessResult (const SerialisedJson& val,
+                                       const bool gzip)
 {
-  Json::StreamWriterBuilder wbuilder;
-  wbuilder["commentStyle"] = "None";
-  wbuilder["indentation"] = "";
-  wbuilder["enableYAMLCompatibility"] = false;
-  wbuilder["dropNullPlaceholders"] = false;
-  wbuilder["useSpecialFloats"] = false;
-
-  payload = Json::writeString (wbuilder, val);
+  if (gzip)
+    {
+      type = "application/json+gzip";
+      payload = val.GetGzipped ();
+    }
+  else
+    {
+      type = "application/json";
+      payload = val.GetSerialised ();
+    }
 }
 
 RestApi::SuccessResult
@@ -92,50 +100,7 @@ RestApi::SuccessResult::Gzip () const
   SuccessResult res;
   res.type = type + "+gzip";
 
-  /* Unfortunately, it seems zlib supports the gzip format mainly through
-     a wrapper around files / file descriptors.  Thus we can't just encode
-     a buffer in gzip format, but have to serve it through such a descriptor.
-     We use a temporary file for this.  */
-  TempFileName file;
-
-  {
-    gzFile gz = gzopen (file.GetName ().c_str (), "wb9");
-    CHECK (gz != nullptr);
-
-    const char* data = payload.data ();
-    size_t len = payload.size ();
-    while (len > 0)
-      {
-        const int n = gzwrite (gz, data, len);
-        CHECK_GT (n, 0) << "gzwrite failed";
-        CHECK_LE (n, len);
-        data += n;
-        len -= n;
-      }
-
-    CHECK_EQ (gzclose (gz), Z_OK);
-  }
-
-  {
-    FILE* f = std::fopen (file.GetName ().c_str (), "rb");
-    CHECK (f != nullptr)
-        << "Failed to open " << file.GetName () << " for reading: "
-        << std::strerror (errno);
-
-    while (true)
-      {
-        char buf[TEMP_BUF_SIZE];
-        const int n = std::fread (buf, 1, TEMP_BUF_SIZE, f);
-        CHECK_GE (n, 0);
-        res.payload.append (buf, n);
-
-        if (std::feof (f))
-          break;
-        CHECK_EQ (n, TEMP_BUF_SIZE);
-      }
-
-    CHECK_EQ (std::fclose (f), 0);
-  }
+  res.payload = GzipData (payload);
 
   return res;
 }
@@ -302,11 +267,23 @@ RestApi::HandleState (const std::string& url, const Game& game,
                       SuccessResult& result)
 {
   std::string remainder;
-  if (!MatchEndpoint (url, "/state", remainder) || remainder != "")
+  if (!MatchEndpoint (url, "/state", remainder))
     return false;
 
-  result = SuccessResult (game.GetNullJsonState ());
-  return true;
+  if (remainder == "")
+    {
+      result = SuccessResult (game.GetNullJsonState ());
+      return true;
+    }
+
+  if (remainder == "/full" || remainder == "/full.gz")
+    {
+      const auto state = game.GetSerialisedJsonState ();
+      result = SuccessResult (*state, remainder == "/full.gz");
+      return true;
+    }
+
+  return false;
 }
 
 bool
@@ -470,7 +447,8 @@ RestClient::Request::ProcessGzip ()
     return true;
   type = type.substr (0, type.size () - suffix.size ());
 
-  /* As before, we use a temporary for zlib's gzip interface.  */
+  /* zlib supports reading the gzip format mainly through a wrapper around
+     files / file descriptors, so we use a temporary file for it.  */
   TempFileName file;
 
   {
@@ -7,6 +7,7 @@
 
 #include "defaultmain.hpp"
 #include "game.hpp"
+#include "jsoncache.hpp"
 
 #include <curl/curl.h>
 
@@ -55,6 +56,10 @@ protected:
    * getnullstate).  Returns true if it matched and the output result has
    * been set, and false if the endpoint did not match (nothing happens
    * to result).
+   *
+   * This also handles /state/full and /state/full.gz, which return the
+   * full current state (as getcurrentstate) from the Game's per-block cache
+   * of serialised and compressed JSON.
    */
   bool HandleState (const std::string& url, const Game& game,
                     SuccessResult& result);
@@ -125,6 +130,12 @@ public:
 
   explicit SuccessResult (const Json::Value& val);
 
+  /**
+   * Constructs a JSON result from already serialised data, using either
+   * the plain or gzip-compressed bytes.
+   */
+  explicit SuccessResult (const SerialisedJson& val, bool gzip);
+
   SuccessResult (SuccessResult&&) = default;
   SuccessResult (const SuccessResult&) = default;
 
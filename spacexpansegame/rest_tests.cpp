@@ -205,6 +205,26 @@ TEST_F (RestTests, Json)
   EXPECT_EQ (req2.GetJson (), value);
 }
 
+TEST_F (RestTests, SerialisedJson)
+{
+  const SerialisedJson value(ParseJson (R"({
+    "foo": "bar",
+    "array": [1, 2, null]
+  })"));
+  srv.AddResult ("/data.json", SuccessResult (value, false));
+  srv.AddResult ("/data.json.gz", SuccessResult (value, true));
+
+  RestClient::Request req1(client);
+  ASSERT_TRUE (req1.Send ("/data.json"));
+  EXPECT_EQ (req1.GetType (), "application/json");
+  EXPECT_EQ (req1.GetJson (), value.GetValue ());
+
+  RestClient::Request req2(client);
+  ASSERT_TRUE (req2.Send ("/data.json.gz"));
+  EXPECT_EQ (req2.GetType (), "application/json");
+  EXPECT_EQ (req2.GetJson (), value.GetValue ());
+}
+
 TEST_F (RestTests, InvalidJson)
 {
   srv.AddResult ("/not.json", SuccessResult ("application/json", "invalid"));
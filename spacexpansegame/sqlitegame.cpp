@@ -202,9 +202,18 @@ protected:
        a SQLiteGame subclass not calling the parent class' SetupSchema.  */
     for (auto* p : game.processors)
       p->SetupSchema (db);
+    if (game.merkle != nullptr)
+      game.merkle->SetupSchema (db);
 
-    ActiveAutoIds ids(game);
-    game.SetupSchema (db);
+    {
+      ActiveAutoIds ids(game);
+      game.SetupSchema (db);
+    }
+
+    /* If the hasher is added to an existing game, hash its tables now
+       rather than as part of the next block.  */
+    if (game.merkle != nullptr && IsGameInitialised (db))
+      game.merkle->Initialise (db);
   }
 
 public:
@@ -246,8 +255,12 @@ SQLiteGame::Storage::InitialiseGame ()
   db.Prepare ("SAVEPOINT `spacexpansegame-stateinit`").Execute ();
   try
     {
-      ActiveAutoIds ids(game);
-      game.InitialiseState (db);
+      {
+        ActiveAutoIds ids(game);
+        game.InitialiseState (db);
+      }
+      if (game.merkle != nullptr)
+        game.merkle->Initialise (db);
       db.Prepare (R"(
         UPDATE `spacexpansegame_gamevars`
           SET `gamestate_initialised` = 1
@@ -392,6 +405,20 @@ SQLiteGame::AddProcessor (SQLiteProcessor& proc)
   processors.insert (&proc);
 }
 
+void
+SQLiteGame::SetMerkleHasher (SQLiteMerkleHasher& h)
+{
+  CHECK (database == nullptr) << "SQLiteGame has already been initialised";
+  merkle = &h;
+}
+
+void
+SQLiteGame::FinishProcessors ()
+{
+  for (auto* p : processors)
+    p->Finish ();
+}
+
 void
 SQLiteGame::SetMessForDebug (const bool val)
 {
@@ -479,6 +506,17 @@ SQLiteGame::ProcessForwardInternal (const GameStateData& oldState,
     ActiveAutoIds ids(*this);
     UpdateState (db, blockData);
   }
+
+  /* The hasher's own changes are done while the session is still active,
+     so that they become part of the undo data and are rolled back together
+     with the block's changes.  */
+  if (merkle != nullptr)
+    {
+      uint256 block;
+      CHECK (block.FromHex (blockData["block"]["hash"].asString ()));
+      merkle->ProcessBlock (db, block, session->ExtractChangeset ());
+    }
+
   undo = session->ExtractChangeset ();
 
   return BLOCKHASH_STATE + blockData["block"]["hash"].asString ();
@@ -601,7 +639,7 @@ SQLiteGame::GameStateUpdated (const GameStateData& state,
 {
   EnsureCurrentState (state);
   for (auto* p : processors)
-    p->Process (blockData, database->GetDatabase ());
+    p->Process (blockData, *database);
 }
 
 Json::Value
@@ -8,6 +8,7 @@
 #include "game.hpp"
 #include "gamelogic.hpp"
 #include "pendingmoves.hpp"
+#include "sqlitemerkle.hpp"
 #include "sqliteproc.hpp"
 #include "sqlitestorage.hpp"
 
@@ -84,6 +85,12 @@ private:
    */
   std::set<SQLiteProcessor*> processors;
 
+  /**
+   * The incremental state hasher, if one is attached.  It is not owned
+   * by this instance.
+   */
+  SQLiteMerkleHasher* merkle = nullptr;
+
   /**
    * If set to true, then we enable 'PRAGMA reverse_unordered_selects' in the
    * SQLite environment.  This can be used for debugging.
@@ -257,6 +264,19 @@ public:
    */
   void AddProcessor (SQLiteProcessor& proc);
 
+  /**
+   * Attaches an incremental state hasher, which is updated from the
+   * changes of each block as part of processing it.
+   */
+  void SetMerkleHasher (SQLiteMerkleHasher& h);
+
+  /**
+   * Waits for all processors to finish running computations and stores
+   * their results.  This must be called before the processors are
+   * destructed, if they may outlive the database otherwise.
+   */
+  void FinishProcessors ();
+
   /**
    * Sets a flag (off by default) that determines whether to set
    * 'PRAGMA reverse_unordered_selects' in SQLite (and potentially
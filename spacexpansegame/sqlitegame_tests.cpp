@@ -6,6 +6,7 @@
 
 #include "game.hpp"
 #include "sqliteintro.hpp"
+#include "sqlitemerkle.hpp"
 #include "sqliteproc.hpp"
 
 #include "testutils.hpp"
@@ -863,6 +864,102 @@ TEST_F (SQLiteGameHashingTests, Reorg)
 
 /* ************************************************************************** */
 
+class SQLiteGameMerkleTests : public UninitialisedSQLiteGameTests<ChatGame>
+{
+
+protected:
+
+  using UninitialisedSQLiteGameTests<ChatGame>::game;
+  using UninitialisedSQLiteGameTests<ChatGame>::rules;
+
+  SQLiteMerkleHasher hasher;
+
+  SQLiteGameMerkleTests ()
+  {
+    rules.SetMerkleHasher (hasher);
+
+    InitialiseGame ();
+    InitialiseState (game, rules);
+  }
+
+  /**
+   * Returns the current root from the hash structure, after verifying
+   * that it matches the root computed from scratch.
+   */
+  uint256
+  GetCurrentRoot ()
+  {
+    const auto& db = rules.GetDatabaseForTesting ();
+    const uint256 res = hasher.GetCurrentRoot (db);
+    EXPECT_EQ (res, hasher.ComputeFullRoot (db));
+    return res;
+  }
+
+  /**
+   * Returns the root recorded for the given block, or the zero uint256
+   * if none is stored.
+   */
+  uint256
+  GetStoredRoot (const uint256& blk)
+  {
+    uint256 value;
+    if (!hasher.GetRoot (rules.GetDatabaseForTesting (), blk, value))
+      value.SetNull ();
+    return value;
+  }
+
+};
+
+TEST_F (SQLiteGameMerkleTests, AttachAndDetach)
+{
+  AttachBlock (game, BlockHash (11), ChatGame::Moves ({
+    {"domob", "11"},
+    {"andy", "11"},
+  }));
+  const auto root11 = GetCurrentRoot ();
+  EXPECT_EQ (GetStoredRoot (BlockHash (11)), root11);
+
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({
+    {"domob", "12"},
+  }));
+  const auto root12 = GetCurrentRoot ();
+  EXPECT_NE (root11, root12);
+  EXPECT_EQ (GetStoredRoot (BlockHash (12)), root12);
+  EXPECT_TRUE (GetStoredRoot (BlockHash (11)).IsNull ());
+
+  DetachBlock (game);
+  EXPECT_EQ (GetCurrentRoot (), root11);
+  EXPECT_EQ (GetStoredRoot (BlockHash (11)), root11);
+  EXPECT_TRUE (GetStoredRoot (BlockHash (12)).IsNull ());
+
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({
+    {"domob", "12"},
+  }));
+  EXPECT_EQ (GetCurrentRoot (), root12);
+
+  DetachBlock (game);
+  DetachBlock (game);
+  AttachBlock (game, BlockHash (11), ChatGame::Moves ({
+    {"domob", "11"},
+    {"andy", "11"},
+  }));
+  EXPECT_EQ (GetCurrentRoot (), root11);
+}
+
+TEST_F (SQLiteGameMerkleTests, UnchangedState)
+{
+  AttachBlock (game, BlockHash (11), ChatGame::Moves ({
+    {"domob", "value"},
+  }));
+  const auto root = GetCurrentRoot ();
+
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({}));
+  EXPECT_EQ (GetCurrentRoot (), root);
+  EXPECT_EQ (GetStoredRoot (BlockHash (12)), root);
+}
+
+/* ************************************************************************** */
+
 class PersistenceTests : public GameTestWithBlockchain
 {
 
@@ -9,7 +9,12 @@
 #include <glog/logging.h>
 
 #include <cinttypes>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 namespace spacexpanse
 {
@@ -156,6 +161,444 @@ TableRowContent (std::string& out, const SQLiteDatabase::Statement& stmt)
     }
 }
 
+/* ************************************************************************** */
+
+class ParallelDump::Impl
+{
+
+private:
+
+  /**
+   * A single value of a primary-key column, used as boundary of a chunk.
+   */
+  struct KeyValue
+  {
+
+    /** The SQLite type (SQLITE_INTEGER, SQLITE_TEXT or SQLITE_BLOB).  */
+    int type;
+
+    /** The value if it is an integer.  */
+    int64_t num;
+
+    /** The data if it is text or blob.  */
+    std::string data;
+
+  };
+
+  /** The values of all primary-key columns of a row.  */
+  using Key = std::vector<KeyValue>;
+
+  /**
+   * A unit of work, i.e. a range of rows of a table.
+   */
+  struct Job
+  {
+
+    /** The table this is for.  */
+    std::string table;
+
+    /** The table's schema, if this is its first chunk.  */
+    std::string schema;
+
+    /** Set if this is the first chunk of the table.  */
+    bool tableStart;
+
+    /** The primary-key columns, formatted for use in SQL.  */
+    std::string pkColumns;
+
+    /** Exclusive lower bound of the range, if any.  */
+    Key lower;
+
+    /** Inclusive upper bound of the range, if any.  */
+    Key upper;
+
+  };
+
+  /** All jobs in the order of the output.  */
+  std::vector<Job> jobs;
+
+  /**
+   * Maximum number of chunks that may be done (or in progress) ahead of
+   * the next one returned.  This bounds the memory used.
+   */
+  size_t maxAhead;
+
+  /** Lock for the state shared between the worker threads.  */
+  std::mutex mut;
+
+  /** Signalled when a chunk is done or one has been returned.  */
+  std::condition_variable cv;
+
+  /** Index of the next job to be started by a worker.  */
+  size_t nextJob = 0;
+
+  /** Index of the next job to be returned.  */
+  size_t nextOut = 0;
+
+  /** Set when the workers should stop.  */
+  bool stop = false;
+
+  /** Chunks that are done but have not yet been returned.  */
+  std::map<size_t, Chunk> done;
+
+  /** The worker threads.  */
+  std::vector<std::thread> workers;
+
+  /**
+   * Reads the value of a column of the current row as KeyValue.  Returns
+   * false if the type is not usable as a boundary.
+   */
+  static bool
+  GetKeyValue (const SQLiteDatabase::Statement& stmt, const int ind,
+               KeyValue& val)
+  {
+    val.type = sqlite3_column_type (stmt.ro (), ind);
+    switch (val.type)
+      {
+      case SQLITE_INTEGER:
+        val.num = stmt.Get<int64_t> (ind);
+        return true;
+      case SQLITE_TEXT:
+        val.data = stmt.Get<std::string> (ind);
+        return true;
+      case SQLITE_BLOB:
+        val.data = stmt.GetBlob (ind);
+        return true;
+      default:
+        /* NULL values would not compare correctly against the range
+           boundaries, and FLOAT is not supported at all.  */
+        return false;
+      }
+  }
+
+  /**
+   * Binds the values of a key to parameters starting at the given index.
+   */
+  static void
+  BindKey (SQLiteDatabase::Statement& stmt, int ind, const Key& key)
+  {
+    for (const auto& val : key)
+      {
+        switch (val.type)
+          {
+          case SQLITE_INTEGER:
+            stmt.Bind (ind, val.num);
+            break;
+          case SQLITE_TEXT:
+            stmt.Bind (ind, val.data);
+            break;
+          case SQLITE_BLOB:
+            stmt.BindBlob (ind, val.data);
+            break;
+          default:
+            LOG (FATAL) << "Unexpected key type " << val.type;
+          }
+        ++ind;
+      }
+  }
+
+  /**
+   * Builds a list of "?n" parameters to compare the primary key against.
+   */
+  static std::string
+  KeyParams (const int start, const size_t num)
+  {
+    std::ostringstream res;
+    for (size_t i = 0; i < num; ++i)
+      {
+        if (i > 0)
+          res << ", ";
+        res << "?" << (start + i);
+      }
+    return res.str ();
+  }
+
+  /**
+   * Adds the jobs for the given table.  This scans the table's primary
+   * key in order to find boundaries for chunks of rowsPerChunk rows.
+   */
+  void
+  PlanTable (const SQLiteDatabase& db, const std::string& table,
+             const unsigned rowsPerChunk)
+  {
+    Job job;
+    job.table = table;
+    job.tableStart = true;
+
+    auto stmt = db.PrepareRo (R"(
+      SELECT `sql`
+        FROM `sqlite_master`
+        WHERE `name` = ?1 AND `type` = 'table'
+    )");
+    stmt.Bind (1, table);
+    CHECK (stmt.Step ()) << "No table '" << table << "' exists";
+    job.schema = stmt.Get<std::string> (0);
+    CHECK (!stmt.Step ());
+
+    /* This has to use the same ordering as QueryAllRows.  */
+    const auto pk
+        = GetPrimaryKeyColumns (db, table, GetTableColumns (db, table));
+    CHECK (!pk.empty ()) << "Primary key for table '" << table << "' is empty";
+
+    std::ostringstream pkColumns;
+    bool first = true;
+    for (const auto& p : pk)
+      {
+        if (!first)
+          pkColumns << ", ";
+        first = false;
+        pkColumns << "`" << p << "`";
+      }
+    job.pkColumns = pkColumns.str ();
+
+    /* Rows with a NULL in any primary-key column would not match any of
+       the range conditions (comparisons with NULL are never true), so
+       they would be missing from all chunks.  Such tables (possible for
+       non-INTEGER primary keys) are not split at all.  */
+    std::ostringstream nullCond;
+    first = true;
+    for (const auto& p : pk)
+      {
+        if (!first)
+          nullCond << " OR ";
+        first = false;
+        nullCond << "`" << p << "` IS NULL";
+      }
+    stmt = db.PrepareRo ("SELECT EXISTS (SELECT 1 FROM `" + table
+                            + "` WHERE " + nullCond.str () + ")");
+    CHECK (stmt.Step ());
+    const bool hasNullKey = stmt.Get<int64_t> (0) != 0;
+    CHECK (!stmt.Step ());
+
+    std::vector<Key> bounds;
+    if (hasNullKey)
+      VLOG (1) << "Not splitting table " << table << " with NULL keys";
+    else
+      {
+        stmt = db.PrepareRo ("SELECT " + job.pkColumns + " FROM `" + table
+                                + "` ORDER BY " + job.pkColumns);
+        for (uint64_t cnt = 1; stmt.Step (); ++cnt)
+          {
+            if (cnt % rowsPerChunk != 0)
+              continue;
+
+            Key key(pk.size ());
+            bool ok = true;
+            for (unsigned i = 0; ok && i < pk.size (); ++i)
+              ok = GetKeyValue (stmt, i, key[i]);
+            if (!ok)
+              {
+                VLOG (1) << "Not splitting table " << table;
+                bounds.clear ();
+                break;
+              }
+
+            bounds.push_back (std::move (key));
+          }
+      }
+
+    for (auto& b : bounds)
+      {
+        job.upper = b;
+        jobs.push_back (job);
+
+        job.tableStart = false;
+        job.schema.clear ();
+        job.lower = std::move (b);
+      }
+    job.upper.clear ();
+    jobs.push_back (std::move (job));
+  }
+
+  /**
+   * Reads the rows for the given job from the database.
+   */
+  static void
+  RunJob (const SQLiteDatabase& db, const Job& job, Chunk& out)
+  {
+    out.tableStart = job.tableStart;
+    out.schema = job.schema;
+    out.data.clear ();
+    out.rowEnds.clear ();
+
+    std::ostringstream sql;
+    sql << "SELECT * FROM `" << job.table << "`";
+    int ind = 1;
+    if (!job.lower.empty ())
+      {
+        sql << " WHERE (" << job.pkColumns << ") > ("
+            << KeyParams (ind, job.lower.size ()) << ")";
+        ind += job.lower.size ();
+      }
+    if (!job.upper.empty ())
+      {
+        sql << (ind > 1 ? " AND " : " WHERE ")
+            << "(" << job.pkColumns << ") <= ("
+            << KeyParams (ind, job.upper.size ()) << ")";
+      }
+    sql << " ORDER BY " << job.pkColumns;
+
+    auto stmt = db.PrepareRo (sql.str ());
+    BindKey (stmt, 1, job.lower);
+    BindKey (stmt, 1 + job.lower.size (), job.upper);
+
+    while (stmt.Step ())
+      {
+        TableRowContent (out.data, stmt);
+        out.rowEnds.push_back (out.data.size ());
+      }
+  }
+
+  /**
+   * Runs a worker thread on the given database connection.
+   */
+  void
+  Work (const SQLiteDatabase& db)
+  {
+    while (true)
+      {
+        size_t ind;
+        {
+          std::unique_lock<std::mutex> lock(mut);
+          while (!stop && nextJob < jobs.size ()
+                  && nextJob >= nextOut + maxAhead)
+            cv.wait (lock);
+          if (stop || nextJob >= jobs.size ())
+            return;
+          ind = nextJob++;
+        }
+
+        Chunk chunk;
+        RunJob (db, jobs[ind], chunk);
+
+        std::lock_guard<std::mutex> lock(mut);
+        done.emplace (ind, std::move (chunk));
+        cv.notify_all ();
+      }
+  }
+
+public:
+
+  explicit Impl (const std::vector<const SQLiteDatabase*>& dbs,
+                 const std::set<std::string>& tables,
+                 const unsigned rowsPerChunk)
+    : maxAhead(2 * dbs.size ())
+  {
+    CHECK_GT (rowsPerChunk, 0);
+    for (const auto& t : tables)
+      PlanTable (*dbs.front (), t, rowsPerChunk);
+    VLOG (1)
+        << "Dumping " << tables.size () << " tables in " << jobs.size ()
+        << " chunks with " << dbs.size () << " threads";
+
+    for (const auto* db : dbs)
+      workers.emplace_back (&Impl::Work, this, std::cref (*db));
+  }
+
+  ~Impl ()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      stop = true;
+      cv.notify_all ();
+    }
+
+    for (auto& w : workers)
+      w.join ();
+  }
+
+  bool
+  Next (Chunk& out)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    if (nextOut >= jobs.size ())
+      return false;
+
+    auto mit = done.find (nextOut);
+    while (mit == done.end ())
+      {
+        cv.wait (lock);
+        mit = done.find (nextOut);
+      }
+
+    out = std::move (mit->second);
+    done.erase (mit);
+    ++nextOut;
+    cv.notify_all ();
+
+    return true;
+  }
+
+};
+
+ParallelDump::ParallelDump (const std::vector<const SQLiteDatabase*>& dbs,
+                            const std::set<std::string>& tables,
+                            const unsigned rowsPerChunk)
+  : impl(std::make_unique<Impl> (dbs, tables, rowsPerChunk))
+{}
+
+ParallelDump::~ParallelDump () = default;
+
+bool
+ParallelDump::Next (Chunk& out)
+{
+  return impl->Next (out);
+}
+
 } // namespace internal
 
+namespace
+{
+
+/** Number of attempts to open consistent readers before giving up.  */
+constexpr unsigned MAX_READER_ATTEMPTS = 10;
+
+/**
+ * Returns the data version of the database as seen by the given connection.
+ * It changes whenever another connection commits changes.
+ */
+int64_t
+GetDataVersion (const SQLiteDatabase& db)
+{
+  auto stmt = db.PrepareRo ("PRAGMA `data_version`");
+  CHECK (stmt.Step ());
+  const auto res = stmt.Get<int64_t> (0);
+  CHECK (!stmt.Step ());
+  return res;
+}
+
+} // anonymous namespace
+
+std::vector<std::unique_ptr<SQLiteDatabase>>
+OpenConsistentReaders (const std::string& file, const unsigned num)
+{
+  CHECK_GT (num, 0);
+
+  /* Each reader sees the state at the time its read transaction starts.
+     If no other connection commits between opening the first and the last
+     reader, they all see the same state.  We check this with the data
+     version of a separate connection that stays outside a transaction.  */
+  SQLiteDatabase watcher(file, SQLITE_OPEN_READONLY);
+
+  for (unsigned attempt = 1; ; ++attempt)
+    {
+      const int64_t before = GetDataVersion (watcher);
+
+      std::vector<std::unique_ptr<SQLiteDatabase>> res;
+      for (unsigned i = 0; i < num; ++i)
+        {
+          res.push_back (
+              std::make_unique<SQLiteDatabase> (file, SQLITE_OPEN_READONLY));
+          res.back ()->StartReadTransaction ();
+        }
+
+      if (GetDataVersion (watcher) == before)
+        return res;
+
+      CHECK_LT (attempt, MAX_READER_ATTEMPTS)
+          << "Failed to open consistent readers for " << file;
+      LOG (WARNING) << "Database changed while opening readers, retrying";
+    }
+}
+
 } // namespace spacexpanse
@@ -7,8 +7,10 @@
 
 #include "sqlitestorage.hpp"
 
+#include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -60,6 +62,31 @@ template <typename Out>
 template <typename Out>
   Out& WriteAllTables (Out& s, const SQLiteDatabase& db, bool internal = false);
 
+/**
+ * Opens the given number of read-only connections to the database file.
+ * Each of them has a read transaction open, and all of them see the same
+ * state of the database.  If another connection commits changes while
+ * they are being opened, this is retried.
+ */
+std::vector<std::unique_ptr<SQLiteDatabase>> OpenConsistentReaders (
+    const std::string& file, unsigned num);
+
+/**
+ * Writes the same representation of the given tables to the stream as
+ * WriteTables, but reads the tables with one thread per passed-in
+ * connection.  Tables with more than rowsPerChunk rows are split into
+ * ranges of their primary key, which are read in parallel as well.
+ * The output is assembled in order on the calling thread.
+ *
+ * All connections must see the same state of the database, e.g. because
+ * they have been opened with OpenConsistentReaders.
+ */
+template <typename Out>
+  Out& WriteTablesParallel (Out& s,
+                            const std::vector<const SQLiteDatabase*>& dbs,
+                            const std::set<std::string>& tables,
+                            unsigned rowsPerChunk = 10'000);
+
 } // namespace spacexpanse
 
 #include "sqliteintro.tpp"
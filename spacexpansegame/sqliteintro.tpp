@@ -7,6 +7,8 @@
 #include <glog/logging.h>
 
 #include <cstdio>
+#include <memory>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -28,6 +30,67 @@ SQLiteDatabase::Statement QueryAllRows (const SQLiteDatabase& db,
  */
 void TableRowContent (std::string& out, const SQLiteDatabase::Statement& stmt);
 
+/**
+ * The engine behind WriteTablesParallel.  It splits the tables into
+ * chunks, reads them on worker threads and hands the results out
+ * in order.
+ */
+class ParallelDump
+{
+
+public:
+
+  /**
+   * The content of one chunk of a table.
+   */
+  struct Chunk
+  {
+
+    /** Set if this is the first chunk of a table.  */
+    bool tableStart;
+
+    /** The table's schema SQL, if this is the first chunk.  */
+    std::string schema;
+
+    /** The content of all rows in the chunk, concatenated.  */
+    std::string data;
+
+    /** For each row, the end offset of its content in data.  */
+    std::vector<size_t> rowEnds;
+
+  };
+
+private:
+
+  class Impl;
+
+  /** The actual implementation, defined in sqliteintro.cpp.  */
+  std::unique_ptr<Impl> impl;
+
+public:
+
+  /**
+   * Plans the chunks for all tables and starts the worker threads,
+   * one for each of the connections.
+   */
+  explicit ParallelDump (const std::vector<const SQLiteDatabase*>& dbs,
+                         const std::set<std::string>& tables,
+                         unsigned rowsPerChunk);
+
+  ~ParallelDump ();
+
+  ParallelDump () = delete;
+  ParallelDump (const ParallelDump&) = delete;
+  void operator= (const ParallelDump&) = delete;
+
+  /**
+   * Waits for the next chunk (in the order of the output) to be done and
+   * returns it.  Returns false if all chunks have been returned already.
+   */
+  bool Next (Chunk& out);
+
+};
+
 } // namespace internal
 
 template <typename Out>
@@ -80,6 +143,50 @@ template <typename Out>
   return s;
 }
 
+template <typename Out>
+  Out&
+  WriteTablesParallel (Out& s, const std::vector<const SQLiteDatabase*>& dbs,
+                       const std::set<std::string>& tables,
+                       const unsigned rowsPerChunk)
+{
+  CHECK (!dbs.empty ());
+  if (dbs.size () == 1)
+    return WriteTables (s, *dbs.front (), tables);
+
+  /* The formatting here has to match exactly what WriteTables and
+     WriteTableContent produce.  */
+
+  char numBuf[64];
+  bool first = true;
+  unsigned cnt = 0;
+
+  internal::ParallelDump dump(dbs, tables, rowsPerChunk);
+  internal::ParallelDump::Chunk chunk;
+  while (dump.Next (chunk))
+    {
+      if (chunk.tableStart)
+        {
+          if (!first)
+            s << "\n";
+          first = false;
+          s << chunk.schema << "\n";
+          cnt = 0;
+        }
+
+      size_t start = 0;
+      for (const size_t end : chunk.rowEnds)
+        {
+          std::snprintf (numBuf, sizeof (numBuf), "%d", cnt);
+          s << "\nRow " << numBuf << ":\n";
+          s << chunk.data.substr (start, end - start);
+          start = end;
+          ++cnt;
+        }
+    }
+
+  return s;
+}
+
 template <typename Out>
   Out&
   WriteAllTables (Out& s, const SQLiteDatabase& db, const bool internal)
@@ -4,12 +4,16 @@
 
 #include "sqliteintro.hpp"
 
+#include "testutils.hpp"
+
 #include <spacexpanseutil/hash.hpp>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 #include <sstream>
+#include <string>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -37,6 +41,41 @@ constexpr const char* TABLE_EMPTY = R"(
   PRIMARY KEY (`id`)
 )";
 
+/**
+ * Creates the test tables with their data in the given database.
+ */
+void
+SetupTestTables (SQLiteDatabase& db)
+{
+  db.Execute (std::string ("CREATE TABLE `autoinc` (") + TABLE_AUTOINC + ")");
+  db.Execute (std::string ("CREATE TABLE `pk` (") + TABLE_PK + ")");
+  db.Execute (std::string ("CREATE TABLE `empty` (") + TABLE_EMPTY + ")");
+  db.Execute (R"(
+    INSERT INTO `autoinc`
+      (`text`, `int`) VALUES
+      ('foo', 10), (NULL, NULL), ('bar', 42);
+    INSERT INTO `pk`
+      (`foo`, `bar`, `blob`) VALUES
+      (1, 1, 'abc'),
+      -- Some type conversion checks here.  The '123' will be seen as text
+      -- still (since the column is declared as such), while the '2' will
+      -- be seen as integer 2.
+      (2, '2', '123'),
+      (1, 2, NULL),
+      (2, 1, '');
+
+    -- Just some random index to make sure it is not seen as table.
+    CREATE INDEX `pk_foo` ON `pk` (`blob`, `foo`);
+  )");
+
+  /* Insert a real "blob" with nul character.  */
+  auto stmt = db.Prepare (R"(
+    INSERT INTO `pk` (`foo`, `bar`, `blob`) VALUES (0, 0, ?1)
+  )");
+  stmt.Bind (1, std::string ("x\0y", 3));
+  stmt.Execute ();
+}
+
 class SQLiteIntroTests : public testing::Test
 {
 
@@ -47,33 +86,7 @@ protected:
   SQLiteIntroTests ()
     : db("foo", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY)
   {
-    db.Execute (std::string ("CREATE TABLE `autoinc` (") + TABLE_AUTOINC + ")");
-    db.Execute (std::string ("CREATE TABLE `pk` (") + TABLE_PK + ")");
-    db.Execute (std::string ("CREATE TABLE `empty` (") + TABLE_EMPTY + ")");
-    db.Execute (R"(
-      INSERT INTO `autoinc`
-        (`text`, `int`) VALUES
-        ('foo', 10), (NULL, NULL), ('bar', 42);
-      INSERT INTO `pk`
-        (`foo`, `bar`, `blob`) VALUES
-        (1, 1, 'abc'),
-        -- Some type conversion checks here.  The '123' will be seen as text
-        -- still (since the column is declared as such), while the '2' will
-        -- be seen as integer 2.
-        (2, '2', '123'),
-        (1, 2, NULL),
-        (2, 1, '');
-
-      -- Just some random index to make sure it is not seen as table.
-      CREATE INDEX `pk_foo` ON `pk` (`blob`, `foo`);
-    )");
-
-    /* Insert a real "blob" with nul character.  */
-    auto stmt = db.Prepare (R"(
-      INSERT INTO `pk` (`foo`, `bar`, `blob`) VALUES (0, 0, ?1)
-    )");
-    stmt.Bind (1, std::string ("x\0y", 3));
-    stmt.Execute ();
+    SetupTestTables (db);
   }
 
 };
@@ -224,5 +237,138 @@ TEST_F (SQLiteWriteAllTablesTests, DetectsChange)
   EXPECT_EQ (hash3, hash1);
 }
 
+/* ************************************************************************** */
+
+class SQLiteParallelDumpTests : public testing::Test
+{
+
+protected:
+
+  TemporaryDirectory dir;
+  const std::string file;
+
+  SQLiteDatabase db;
+
+  SQLiteParallelDumpTests ()
+    : file(dir.GetPath () + "/test.sqlite"),
+      db(file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)
+  {
+    SetupTestTables (db);
+
+    /* A bigger table that will be split into multiple chunks, with a
+       primary key made up of multiple columns with different types.  */
+    db.Execute (R"(
+      CREATE TABLE `many` (
+        `name` TEXT NOT NULL,
+        `num` INTEGER NOT NULL,
+        `data` BLOB NULL,
+        PRIMARY KEY (`num`, `name`)
+      );
+    )");
+    auto stmt = db.Prepare (R"(
+      INSERT INTO `many` (`name`, `num`, `data`) VALUES (?1, ?2, ?3)
+    )");
+    for (int i = 0; i < 400; ++i)
+      {
+        stmt.Reset ();
+        stmt.Bind (1, std::string (1 + i % 7, 'a' + i % 5));
+        stmt.Bind (2, i % 13);
+        stmt.BindBlob (3, std::string (i % 11, '\0'));
+        stmt.Execute ();
+      }
+
+    /* A table with NULL in its primary key, which cannot be split
+       into ranges.  */
+    db.Execute (R"(
+      CREATE TABLE `nullkey` (`id` TEXT PRIMARY KEY, `value` INTEGER);
+      INSERT INTO `nullkey` (`id`, `value`)
+        VALUES (NULL, 1), ('a', 2), (NULL, 3), ('b', 4);
+    )");
+  }
+
+  /**
+   * Dumps all tables in parallel with the given number of connections
+   * and chunk size.
+   */
+  std::string
+  DumpParallel (const unsigned threads, const unsigned rowsPerChunk)
+  {
+    const auto readers = OpenConsistentReaders (file, threads);
+    std::vector<const SQLiteDatabase*> dbs;
+    for (const auto& r : readers)
+      dbs.push_back (r.get ());
+
+    std::ostringstream out;
+    WriteTablesParallel (out, dbs, GetSqliteTables (db), rowsPerChunk);
+    return out.str ();
+  }
+
+};
+
+TEST_F (SQLiteParallelDumpTests, MatchesSequential)
+{
+  std::ostringstream expected;
+  WriteAllTables (expected, db);
+
+  for (const unsigned threads : {1, 2, 3, 8})
+    for (const unsigned rowsPerChunk : {1, 7, 100, 10'000})
+      EXPECT_EQ (DumpParallel (threads, rowsPerChunk), expected.str ())
+          << threads << " threads, " << rowsPerChunk << " rows per chunk";
+}
+
+TEST_F (SQLiteParallelDumpTests, SingleNullKey)
+{
+  /* A single NULL key in a table bigger than the chunk size does not end
+     up on a chunk boundary, but must still be included in the dump.  */
+  db.Execute (R"(
+    DELETE FROM `nullkey` WHERE `id` IS NULL AND `value` = 3;
+    INSERT INTO `nullkey` (`id`, `value`)
+      VALUES ('c', 5), ('d', 6), ('e', 7), ('f', 8);
+  )");
+
+  std::ostringstream expected;
+  WriteAllTables (expected, db);
+
+  const std::string actual = DumpParallel (2, 2);
+  EXPECT_EQ (actual, expected.str ());
+  EXPECT_NE (actual.find ("NULL"), std::string::npos);
+}
+
+TEST_F (SQLiteParallelDumpTests, SameHash)
+{
+  SHA256 expected;
+  WriteAllTables (expected, db);
+
+  const auto readers = OpenConsistentReaders (file, 4);
+  std::vector<const SQLiteDatabase*> dbs;
+  for (const auto& r : readers)
+    dbs.push_back (r.get ());
+
+  SHA256 actual;
+  WriteTablesParallel (actual, dbs, GetSqliteTables (db), 10);
+
+  EXPECT_EQ (actual.Finalise (), expected.Finalise ());
+}
+
+TEST_F (SQLiteParallelDumpTests, ReadersSeeSameState)
+{
+  std::ostringstream before;
+  WriteAllTables (before, db);
+
+  const auto readers = OpenConsistentReaders (file, 3);
+  db.Execute (R"(
+    DELETE FROM `many` WHERE `num` = 5;
+    INSERT INTO `empty` (`id`) VALUES (42);
+  )");
+
+  std::vector<const SQLiteDatabase*> dbs;
+  for (const auto& r : readers)
+    dbs.push_back (r.get ());
+
+  std::ostringstream out;
+  WriteTablesParallel (out, dbs, GetSqliteTables (db), 10);
+  EXPECT_EQ (out.str (), before.str ());
+}
+
 } // anonymous namespace
 } // namespace spacexpanse
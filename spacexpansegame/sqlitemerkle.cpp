@@ -0,0 +1,796 @@
+// Copyright (C) 2022 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sqlitemerkle.hpp"
+
+#include "sqliteintro.hpp"
+
+#include <spacexpanseutil/hash.hpp>
+
+#include <glog/logging.h>
+
+#include <openssl/bn.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace spacexpanse
+{
+
+namespace
+{
+
+/** Size in bytes of the (serialised) table digests.  */
+constexpr size_t DIGEST_BYTES = 384;
+
+/** OpenSSL BIGNUM that is freed automatically.  */
+using BigNum = std::unique_ptr<BIGNUM, decltype (&BN_free)>;
+
+/**
+ * Allocates a new BigNum.
+ */
+BigNum
+NewBigNum ()
+{
+  BigNum res(BN_new (), &BN_free);
+  CHECK (res != nullptr);
+  return res;
+}
+
+/**
+ * Returns the prime modulus 2^3072 - 1103717 of the group in which
+ * the table digests are computed.
+ */
+const BIGNUM&
+DigestModulus ()
+{
+  static const BigNum modulus = [] ()
+    {
+      auto res = NewBigNum ();
+      CHECK_EQ (BN_set_word (res.get (), 1), 1);
+      CHECK_EQ (BN_lshift (res.get (), res.get (), 8 * DIGEST_BYTES), 1);
+      CHECK_EQ (BN_sub_word (res.get (), 1'103'717), 1);
+      return res;
+    } ();
+
+  return *modulus;
+}
+
+/**
+ * Multiset hash (MuHash) of the leaves of a table:  The leaf hashes are
+ * mapped to elements of the multiplicative group modulo a 3072-bit prime,
+ * and the digest is their product.  Leaves can thus be added and removed
+ * in any order, while (in contrast to e.g. a plain sum of the hashes)
+ * finding a different set of leaves with the same digest is infeasible.
+ *
+ * Removed leaves are multiplied into a separate denominator, so that only
+ * a single modular inversion is needed when the digest is finalised.
+ */
+class MuHash
+{
+
+private:
+
+  /** Context for OpenSSL's BIGNUM computations.  */
+  std::unique_ptr<BN_CTX, decltype (&BN_CTX_free)> ctx;
+
+  /** Product of the initial digest and all added leaves.  */
+  BigNum numerator;
+
+  /** Product of all removed leaves.  */
+  BigNum denominator;
+
+  /**
+   * Maps a leaf hash to a group element, by expanding it with SHA256
+   * to the size of the modulus.
+   */
+  BigNum
+  LeafElement (const uint256& leaf)
+  {
+    std::string bytes;
+    for (unsigned i = 0; bytes.size () < DIGEST_BYTES; ++i)
+      {
+        SHA256 hasher;
+        hasher << leaf << std::string (1, static_cast<char> (i));
+        const uint256 part = hasher.Finalise ();
+        bytes.append (reinterpret_cast<const char*> (part.GetBlob ()),
+                      uint256::NUM_BYTES);
+      }
+    CHECK_EQ (bytes.size (), DIGEST_BYTES);
+
+    auto res = NewBigNum ();
+    CHECK (BN_bin2bn (reinterpret_cast<const unsigned char*> (bytes.data ()),
+                      bytes.size (), res.get ()) != nullptr);
+    CHECK_EQ (BN_nnmod (res.get (), res.get (), &DigestModulus (),
+                        ctx.get ()), 1);
+    CHECK (!BN_is_zero (res.get ()));
+
+    return res;
+  }
+
+  /**
+   * Multiplies the given value with the element for a leaf.
+   */
+  void
+  Multiply (BigNum& value, const uint256& leaf)
+  {
+    const auto elem = LeafElement (leaf);
+    CHECK_EQ (BN_mod_mul (value.get (), value.get (), elem.get (),
+                          &DigestModulus (), ctx.get ()), 1);
+  }
+
+public:
+
+  /**
+   * Constructs the digest of an empty set of leaves.
+   */
+  MuHash ()
+    : ctx(BN_CTX_new (), &BN_CTX_free),
+      numerator(NewBigNum ()), denominator(NewBigNum ())
+  {
+    CHECK (ctx != nullptr);
+    CHECK_EQ (BN_one (numerator.get ()), 1);
+    CHECK_EQ (BN_one (denominator.get ()), 1);
+  }
+
+  /**
+   * Constructs the instance from a serialised digest.
+   */
+  explicit MuHash (const std::string& digest)
+    : MuHash ()
+  {
+    CHECK_EQ (digest.size (), DIGEST_BYTES);
+    CHECK (BN_bin2bn (reinterpret_cast<const unsigned char*> (digest.data ()),
+                      digest.size (), numerator.get ()) != nullptr);
+  }
+
+  MuHash (MuHash&&) = default;
+  MuHash (const MuHash&) = delete;
+  void operator= (const MuHash&) = delete;
+
+  void
+  Add (const uint256& leaf)
+  {
+    Multiply (numerator, leaf);
+  }
+
+  void
+  Remove (const uint256& leaf)
+  {
+    Multiply (denominator, leaf);
+  }
+
+  /**
+   * Computes and returns the serialised digest.
+   */
+  std::string
+  Finalise ()
+  {
+    if (!BN_is_one (denominator.get ()))
+      {
+        auto inv = NewBigNum ();
+        CHECK (BN_mod_inverse (inv.get (), denominator.get (),
+                               &DigestModulus (), ctx.get ()) != nullptr);
+        CHECK_EQ (BN_mod_mul (numerator.get (), numerator.get (), inv.get (),
+                              &DigestModulus (), ctx.get ()), 1);
+        CHECK_EQ (BN_one (denominator.get ()), 1);
+      }
+
+    std::string res(DIGEST_BYTES, '\0');
+    CHECK_EQ (BN_bn2binpad (numerator.get (),
+                            reinterpret_cast<unsigned char*> (&res[0]),
+                            res.size ()),
+              static_cast<int> (res.size ()));
+
+    return res;
+  }
+
+};
+
+/**
+ * The hash data kept for one table.
+ */
+struct TableState
+{
+
+  /** The table's schema as in sqlite_master.  */
+  std::string sql;
+
+  /** Number of rows in the table.  */
+  int64_t rows = 0;
+
+  /** The serialised MuHash digest of all leaf hashes.  */
+  std::string digest;
+
+};
+
+/**
+ * Appends a deterministic encoding of a primary-key value onto
+ * the given string.
+ */
+void
+AppendKeyValue (std::string& out, sqlite3_value* val)
+{
+  switch (sqlite3_value_type (val))
+    {
+    case SQLITE_INTEGER:
+      {
+        const auto num = static_cast<uint64_t> (sqlite3_value_int64 (val));
+        out += 'i';
+        for (int shift = 56; shift >= 0; shift -= 8)
+          out += static_cast<char> ((num >> shift) & 0xFF);
+        return;
+      }
+
+    case SQLITE_NULL:
+      out += 'n';
+      return;
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      {
+        out += sqlite3_value_type (val) == SQLITE_TEXT ? 't' : 'b';
+        const auto len = static_cast<uint32_t> (sqlite3_value_bytes (val));
+        for (int shift = 24; shift >= 0; shift -= 8)
+          out += static_cast<char> ((len >> shift) & 0xFF);
+        out.append (static_cast<const char*> (sqlite3_value_blob (val)), len);
+        return;
+      }
+
+    case SQLITE_FLOAT:
+      LOG (FATAL) << "Database column must not be FLOAT";
+    default:
+      LOG (FATAL) << "Unexpected column default type";
+    }
+}
+
+/**
+ * Computes the leaf hash for the current row of the given statement,
+ * which must have been prepared with "SELECT *" on the table.
+ */
+uint256
+LeafHash (const std::string& table, const SQLiteDatabase::Statement& stmt)
+{
+  std::string content = table + "\n";
+  internal::TableRowContent (content, stmt);
+  return SHA256::Hash (content);
+}
+
+/**
+ * Returns the schema SQL of the given table.
+ */
+std::string
+GetTableSql (const SQLiteDatabase& db, const std::string& table)
+{
+  auto stmt = db.PrepareRo (R"(
+    SELECT `sql`
+      FROM `sqlite_master`
+      WHERE `name` = ?1 AND `type` = 'table'
+  )");
+  stmt.Bind (1, table);
+
+  CHECK (stmt.Step ()) << "No table '" << table << "' exists";
+  const auto res = stmt.Get<std::string> (0);
+  CHECK (!stmt.Step ());
+
+  return res;
+}
+
+/**
+ * Returns the names of the columns of a table in the order of their
+ * column index.  The flags whether each column is part of the primary
+ * key are returned in pk.
+ */
+std::vector<std::string>
+GetColumnsInOrder (const SQLiteDatabase& db, const std::string& table,
+                   std::vector<bool>& pk)
+{
+  auto stmt = db.PrepareRo (R"(
+    SELECT `name`, `pk`
+      FROM pragma_table_info (?1)
+      ORDER BY `cid`
+  )");
+  stmt.Bind (1, table);
+
+  std::vector<std::string> res;
+  pk.clear ();
+  while (stmt.Step ())
+    {
+      res.push_back (stmt.Get<std::string> (0));
+      pk.push_back (stmt.Get<int64_t> (1) > 0);
+    }
+
+  return res;
+}
+
+/**
+ * Loads the stored data of all hashed tables.
+ */
+std::map<std::string, TableState>
+LoadTables (const SQLiteDatabase& db)
+{
+  auto stmt = db.PrepareRo (R"(
+    SELECT `tbl`, `sql`, `rows`, `digest`
+      FROM `spacexpansegame_merkletables`
+  )");
+
+  std::map<std::string, TableState> res;
+  while (stmt.Step ())
+    {
+      auto& entry = res[stmt.Get<std::string> (0)];
+      entry.sql = stmt.Get<std::string> (1);
+      entry.rows = stmt.Get<int64_t> (2);
+      entry.digest = stmt.GetBlob (3);
+    }
+
+  return res;
+}
+
+/**
+ * Computes the state root from the data of all tables.
+ */
+uint256
+RootFromTables (const std::map<std::string, TableState>& tables)
+{
+  char numBuf[64];
+
+  SHA256 hasher;
+  for (const auto& entry : tables)
+    {
+      std::snprintf (numBuf, sizeof (numBuf), "%" PRId64, entry.second.rows);
+      hasher << "table " << entry.first << "\n"
+             << entry.second.sql << "\n"
+             << "rows " << numBuf << "\n"
+             << entry.second.digest;
+    }
+
+  return hasher.Finalise ();
+}
+
+/**
+ * Hashes all rows of the given table from scratch.  The leaves callback
+ * is invoked with the key and leaf hash of each row.
+ */
+template <typename Fcn>
+  TableState
+  HashTable (const SQLiteDatabase& db, const std::string& table,
+             const Fcn& leaves)
+{
+  TableState res;
+  res.sql = GetTableSql (db, table);
+
+  std::vector<bool> pk;
+  GetColumnsInOrder (db, table, pk);
+
+  auto stmt = db.PrepareRo ("SELECT * FROM `" + table + "`");
+
+  MuHash digest;
+  std::string key;
+  while (stmt.Step ())
+    {
+      /* The column count is only up-to-date after stepping, since the cached
+         statement may be re-prepared then if the schema changed.  */
+      CHECK_EQ (sqlite3_column_count (stmt.ro ()),
+                static_cast<int> (pk.size ()));
+
+      key.clear ();
+      for (unsigned i = 0; i < pk.size (); ++i)
+        if (pk[i])
+          AppendKeyValue (key, sqlite3_column_value (stmt.ro (), i));
+
+      const uint256 leaf = LeafHash (table, stmt);
+      digest.Add (leaf);
+      ++res.rows;
+      leaves (key, leaf);
+    }
+
+  res.digest = digest.Finalise ();
+  return res;
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+/**
+ * The state of updating the hash structure for one block.
+ */
+class SQLiteMerkleHasher::Update
+{
+
+private:
+
+  /** The database being updated.  */
+  SQLiteDatabase& db;
+
+  /** The data of all hashed tables, which is modified while updating.  */
+  std::map<std::string, TableState> tables;
+
+  /**
+   * Tables that have been rehashed from scratch for this update.  Changes
+   * to them from the changeset are already included.
+   */
+  std::set<std::string> rebuilt;
+
+  /** Tables whose data has been modified and needs to be written.  */
+  std::set<std::string> dirty;
+
+  /** Digests of tables that are being updated row by row.  */
+  std::map<std::string, MuHash> digests;
+
+  /**
+   * SQL of the "SELECT *" queries for a row by primary key, per table,
+   * together with the number of primary-key columns.
+   */
+  std::map<std::string, std::pair<std::string, int>> rowQueries;
+
+  /**
+   * Rehashes the given table from scratch, replacing all existing leaves.
+   */
+  void
+  Rebuild (const std::string& table)
+  {
+    VLOG (1) << "Hashing table " << table << " from scratch";
+
+    auto stmt = db.Prepare (R"(
+      DELETE FROM `spacexpansegame_merkleleaves`
+        WHERE `tbl` = ?1
+    )");
+    stmt.Bind (1, table);
+    stmt.Execute ();
+
+    stmt = db.Prepare (R"(
+      INSERT INTO `spacexpansegame_merkleleaves`
+        (`tbl`, `key`, `hash`) VALUES (?1, ?2, ?3)
+    )");
+    tables[table] = HashTable (db, table,
+        [&stmt, &table] (const std::string& key, const uint256& leaf)
+          {
+            stmt.Reset ();
+            stmt.Bind (1, table);
+            stmt.BindBlob (2, key);
+            stmt.Bind (3, leaf);
+            stmt.Execute ();
+          });
+    rebuilt.insert (table);
+    dirty.insert (table);
+    digests.erase (table);
+  }
+
+  /**
+   * Returns the digest of the given table for updating it.
+   */
+  MuHash&
+  GetDigest (const std::string& table)
+  {
+    auto mit = digests.find (table);
+    if (mit == digests.end ())
+      mit = digests.emplace (table, MuHash (tables.at (table).digest)).first;
+    return mit->second;
+  }
+
+  /**
+   * Returns the SQL for querying a row of the table by primary key.
+   */
+  const std::pair<std::string, int>&
+  GetRowQuery (const std::string& table)
+  {
+    auto mit = rowQueries.find (table);
+    if (mit != rowQueries.end ())
+      return mit->second;
+
+    std::vector<bool> pk;
+    const auto columns = GetColumnsInOrder (db, table, pk);
+
+    std::ostringstream sql;
+    sql << "SELECT * FROM `" << table << "` WHERE ";
+    int cnt = 0;
+    for (unsigned i = 0; i < columns.size (); ++i)
+      if (pk[i])
+        {
+          if (cnt > 0)
+            sql << " AND ";
+          ++cnt;
+          sql << "`" << columns[i] << "` IS ?" << cnt;
+        }
+    CHECK_GT (cnt, 0) << "Primary key for table '" << table << "' is empty";
+
+    return rowQueries.emplace (table, std::make_pair (sql.str (), cnt))
+              .first->second;
+  }
+
+public:
+
+  explicit Update (SQLiteDatabase& d)
+    : db(d), tables(LoadTables (d))
+  {}
+
+  Update () = delete;
+  Update (const Update&) = delete;
+  void operator= (const Update&) = delete;
+
+  /**
+   * Brings the set of hashed tables in line with the given tables that
+   * exist in the database.  Tables that are new or have a changed schema
+   * are rebuilt, and those that no longer exist are removed.
+   */
+  void
+  SyncTables (const std::set<std::string>& current)
+  {
+    for (auto it = tables.begin (); it != tables.end (); )
+      {
+        if (current.count (it->first) > 0)
+          {
+            ++it;
+            continue;
+          }
+
+        VLOG (1) << "Table " << it->first << " has been removed";
+        auto stmt = db.Prepare (R"(
+          DELETE FROM `spacexpansegame_merkleleaves`
+            WHERE `tbl` = ?1
+        )");
+        stmt.Bind (1, it->first);
+        stmt.Execute ();
+
+        stmt = db.Prepare (R"(
+          DELETE FROM `spacexpansegame_merkletables`
+            WHERE `tbl` = ?1
+        )");
+        stmt.Bind (1, it->first);
+        stmt.Execute ();
+
+        dirty.erase (it->first);
+        digests.erase (it->first);
+        it = tables.erase (it);
+      }
+
+    for (const auto& t : current)
+      {
+        const auto mit = tables.find (t);
+        if (mit == tables.end () || mit->second.sql != GetTableSql (db, t))
+          Rebuild (t);
+      }
+  }
+
+  /**
+   * Updates the leaf of the row identified by the primary-key values
+   * in the current change of the changeset iterator.
+   */
+  void
+  ApplyChange (sqlite3_changeset_iter* it)
+  {
+    const char* tblName;
+    int numCols, op, indirect;
+    CHECK_EQ (sqlite3changeset_op (it, &tblName, &numCols, &op, &indirect),
+              SQLITE_OK);
+    const std::string table(tblName);
+
+    auto mit = tables.find (table);
+    if (mit == tables.end () || rebuilt.count (table) > 0)
+      return;
+    auto& state = mit->second;
+
+    unsigned char* pk;
+    CHECK_EQ (sqlite3changeset_pk (it, &pk, &numCols), SQLITE_OK);
+
+    const auto& query = GetRowQuery (table);
+    auto row = db.PrepareRo (query.first);
+
+    std::string key;
+    int cnt = 0;
+    for (int i = 0; i < numCols; ++i)
+      if (pk[i])
+        {
+          sqlite3_value* val;
+          if (op == SQLITE_INSERT)
+            CHECK_EQ (sqlite3changeset_new (it, i, &val), SQLITE_OK);
+          else
+            CHECK_EQ (sqlite3changeset_old (it, i, &val), SQLITE_OK);
+
+          AppendKeyValue (key, val);
+          ++cnt;
+          CHECK_EQ (sqlite3_bind_value (*row, cnt, val), SQLITE_OK);
+        }
+    CHECK_EQ (cnt, query.second);
+
+    auto stmt = db.Prepare (R"(
+      SELECT `hash`
+        FROM `spacexpansegame_merkleleaves`
+        WHERE `tbl` = ?1 AND `key` = ?2
+    )");
+    stmt.Bind (1, table);
+    stmt.BindBlob (2, key);
+    auto& digest = GetDigest (table);
+    dirty.insert (table);
+    if (stmt.Step ())
+      {
+        digest.Remove (stmt.Get<uint256> (0));
+        --state.rows;
+        CHECK (!stmt.Step ());
+      }
+
+    if (row.Step ())
+      {
+        const uint256 leaf = LeafHash (table, row);
+        CHECK (!row.Step ());
+        digest.Add (leaf);
+        ++state.rows;
+
+        stmt = db.Prepare (R"(
+          INSERT OR REPLACE INTO `spacexpansegame_merkleleaves`
+            (`tbl`, `key`, `hash`) VALUES (?1, ?2, ?3)
+        )");
+        stmt.Bind (1, table);
+        stmt.BindBlob (2, key);
+        stmt.Bind (3, leaf);
+        stmt.Execute ();
+      }
+    else
+      {
+        stmt = db.Prepare (R"(
+          DELETE FROM `spacexpansegame_merkleleaves`
+            WHERE `tbl` = ?1 AND `key` = ?2
+        )");
+        stmt.Bind (1, table);
+        stmt.BindBlob (2, key);
+        stmt.Execute ();
+      }
+  }
+
+  /**
+   * Writes the data of modified tables back to the database and returns
+   * the new root.
+   */
+  uint256
+  Finish ()
+  {
+    for (auto& entry : digests)
+      tables.at (entry.first).digest = entry.second.Finalise ();
+    digests.clear ();
+
+    auto stmt = db.Prepare (R"(
+      INSERT OR REPLACE INTO `spacexpansegame_merkletables`
+        (`tbl`, `sql`, `rows`, `digest`) VALUES (?1, ?2, ?3, ?4)
+    )");
+    for (const auto& t : dirty)
+      {
+        const auto& entry = tables.at (t);
+        stmt.Reset ();
+        stmt.Bind (1, t);
+        stmt.Bind (2, entry.sql);
+        stmt.Bind (3, entry.rows);
+        stmt.BindBlob (4, entry.digest);
+        stmt.Execute ();
+      }
+    dirty.clear ();
+
+    return RootFromTables (tables);
+  }
+
+};
+
+/* ************************************************************************** */
+
+void
+SQLiteMerkleHasher::SetupSchema (SQLiteDatabase& db)
+{
+  db.Execute (R"(
+    CREATE TABLE IF NOT EXISTS `spacexpansegame_merkleleaves`
+        (`tbl` TEXT NOT NULL,
+         `key` BLOB NOT NULL,
+         `hash` BLOB NOT NULL,
+         PRIMARY KEY (`tbl`, `key`));
+    CREATE TABLE IF NOT EXISTS `spacexpansegame_merkletables`
+        (`tbl` TEXT PRIMARY KEY,
+         `sql` TEXT NOT NULL,
+         `rows` INTEGER NOT NULL,
+         `digest` BLOB NOT NULL);
+    CREATE TABLE IF NOT EXISTS `spacexpansegame_merkleroots`
+        (`block` BLOB PRIMARY KEY,
+         `root` BLOB NOT NULL);
+  )");
+}
+
+void
+SQLiteMerkleHasher::Initialise (SQLiteDatabase& db)
+{
+  VLOG (1) << "Initialising the state hash structure";
+
+  Update upd(db);
+  upd.SyncTables (GetTables (db));
+  upd.Finish ();
+}
+
+std::set<std::string>
+SQLiteMerkleHasher::GetTables (const SQLiteDatabase& db) const
+{
+  return GetSqliteTables (db);
+}
+
+uint256
+SQLiteMerkleHasher::ProcessBlock (SQLiteDatabase& db, const uint256& block,
+                                  const UndoData& changeset)
+{
+  VLOG (1) << "Updating state root for block " << block.ToHex ();
+
+  Update upd(db);
+  upd.SyncTables (GetTables (db));
+
+  sqlite3_changeset_iter* it;
+  CHECK_EQ (sqlite3changeset_start (&it, changeset.size (),
+                                    const_cast<char*> (changeset.data ())),
+            SQLITE_OK)
+      << "Failed to start iterating SQLite changeset";
+
+  int rc;
+  while ((rc = sqlite3changeset_next (it)) == SQLITE_ROW)
+    upd.ApplyChange (it);
+  CHECK_EQ (rc, SQLITE_DONE) << "Failed to iterate SQLite changeset";
+  CHECK_EQ (sqlite3changeset_finalize (it), SQLITE_OK);
+
+  const uint256 root = upd.Finish ();
+
+  /* Only the root of the current block is kept.  Since the change is part
+     of the block's undo data, the previous root is restored when the block
+     is detached again.  */
+  auto stmt = db.Prepare (R"(
+    DELETE FROM `spacexpansegame_merkleroots`
+      WHERE `block` != ?1
+  )");
+  stmt.Bind (1, block);
+  stmt.Execute ();
+
+  stmt = db.Prepare (R"(
+    INSERT OR REPLACE INTO `spacexpansegame_merkleroots`
+      (`block`, `root`) VALUES (?1, ?2)
+  )");
+  stmt.Bind (1, block);
+  stmt.Bind (2, root);
+  stmt.Execute ();
+
+  return root;
+}
+
+uint256
+SQLiteMerkleHasher::GetCurrentRoot (const SQLiteDatabase& db) const
+{
+  return RootFromTables (LoadTables (db));
+}
+
+bool
+SQLiteMerkleHasher::GetRoot (const SQLiteDatabase& db, const uint256& block,
+                             uint256& root) const
+{
+  auto stmt = db.PrepareRo (R"(
+    SELECT `root`
+      FROM `spacexpansegame_merkleroots`
+      WHERE `block` = ?1
+  )");
+  stmt.Bind (1, block);
+
+  if (!stmt.Step ())
+    return false;
+
+  root = stmt.Get<uint256> (0);
+  CHECK (!stmt.Step ());
+  return true;
+}
+
+uint256
+SQLiteMerkleHasher::ComputeFullRoot (const SQLiteDatabase& db) const
+{
+  std::map<std::string, TableState> tables;
+  for (const auto& t : GetTables (db))
+    tables[t] = HashTable (db, t,
+        [] (const std::string& key, const uint256& leaf) {});
+
+  return RootFromTables (tables);
+}
+
+} // namespace spacexpanse
@@ -0,0 +1,112 @@
+// Copyright (C) 2022 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_SQLITEMERKLE_HPP
+#define SPACEXPANSEGAME_SQLITEMERKLE_HPP
+
+#include "sqlitestorage.hpp"
+#include "storage.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <set>
+#include <string>
+
+namespace spacexpanse
+{
+
+/**
+ * Hasher for the game state in an SQLite database that is updated
+ * incrementally from the changeset of each block, rather than hashing
+ * the entire database like SQLiteHasher does.
+ *
+ * For each row of each (non-internal) table, a leaf hash of the row's
+ * content is kept in an internal table.  Each table has a digest, which is
+ * a multiset hash (MuHash modulo a 3072-bit prime) of all its leaf hashes
+ * and can thus be updated for each changed row without touching the others.
+ * The state root is the SHA256 of the schema, row count and digest of all
+ * tables.  Updating it takes time proportional to the rows changed plus the
+ * number of tables, and only the digests of changed tables are written.
+ *
+ * The internal tables are updated in the same transaction and while the
+ * same SQLite session is active as the game's own changes for a block.
+ * Thus they are part of the block's undo data, and are rolled back
+ * automatically when the block is detached.
+ *
+ * Tables that are new or whose schema changed are hashed from scratch the
+ * first time they are seen.  Initialise should be used to do this for the
+ * initial tables outside of block processing, as otherwise all the leaves
+ * end up in the undo data of the first block.
+ */
+class SQLiteMerkleHasher
+{
+
+private:
+
+  class Update;
+
+public:
+
+  SQLiteMerkleHasher () = default;
+  virtual ~SQLiteMerkleHasher () = default;
+
+  SQLiteMerkleHasher (const SQLiteMerkleHasher&) = delete;
+  void operator= (const SQLiteMerkleHasher&) = delete;
+
+  /**
+   * Sets up the internal tables used by the hasher.
+   */
+  void SetupSchema (SQLiteDatabase& db);
+
+  /**
+   * Brings the hash structure in line with the tables currently in the
+   * database, hashing those that are new (or changed) from scratch.  This
+   * is cheap if the structure is already up-to-date.
+   */
+  void Initialise (SQLiteDatabase& db);
+
+  /**
+   * Updates the hash structure for a block whose changes to the database
+   * are given by the changeset (as recorded by the SQLite session extension),
+   * and records the new state root for the block (replacing the one of the
+   * previous block).  The changeset must not yet include changes made by
+   * the hasher itself.  Returns the new root.
+   */
+  uint256 ProcessBlock (SQLiteDatabase& db, const uint256& block,
+                        const UndoData& changeset);
+
+  /**
+   * Returns the state root corresponding to the currently stored
+   * hash structure.
+   */
+  uint256 GetCurrentRoot (const SQLiteDatabase& db) const;
+
+  /**
+   * Retrieves the state root recorded for the given block, if any.  Only
+   * the root for the block of the current state is kept.  Returns true if
+   * a root was found, and false otherwise.
+   */
+  bool GetRoot (const SQLiteDatabase& db, const uint256& block,
+                uint256& root) const;
+
+  /**
+   * Computes the state root of the database from scratch, without
+   * using the stored hash structure.  This is mainly useful for testing.
+   */
+  uint256 ComputeFullRoot (const SQLiteDatabase& db) const;
+
+protected:
+
+  /**
+   * Computes the list of tables to hash.  By default, it is what
+   * GetSqliteTables returns as non-internal tables.  Subclasses may override
+   * it to use a different list.
+   */
+  virtual std::set<std::string> GetTables (const SQLiteDatabase& db) const;
+
+};
+
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_SQLITEMERKLE_HPP
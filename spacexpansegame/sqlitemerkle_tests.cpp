@@ -0,0 +1,298 @@
+// Copyright (C) 2022 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sqlitemerkle.hpp"
+
+#include <spacexpanseutil/hash.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <sqlite3.h>
+
+#include <map>
+#include <string>
+
+namespace spacexpanse
+{
+namespace
+{
+
+class SQLiteMerkleTests : public testing::Test
+{
+
+private:
+
+  /** The session recording changes of the current "block".  */
+  sqlite3_session* session = nullptr;
+
+protected:
+
+  SQLiteDatabase db;
+  SQLiteMerkleHasher hasher;
+
+  /**
+   * Number of rows per table changed by the hasher itself when processing
+   * the last block.
+   */
+  std::map<std::string, unsigned> hasherChanges;
+
+  SQLiteMerkleTests ()
+    : db("foo", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY)
+  {
+    db.Execute (R"(
+      CREATE TABLE `first` (`id` INTEGER PRIMARY KEY, `value` TEXT);
+      CREATE TABLE `second` (
+        `a` TEXT,
+        `b` BLOB,
+        `value` INTEGER,
+        PRIMARY KEY (`b`, `a`)
+      );
+
+      INSERT INTO `first` (`id`, `value`) VALUES (1, 'foo'), (2, NULL);
+      INSERT INTO `second` (`a`, `b`, `value`)
+        VALUES ('x', x'00', 10), ('y', x'0102', 20);
+    )");
+    hasher.SetupSchema (db);
+  }
+
+  ~SQLiteMerkleTests ()
+  {
+    if (session != nullptr)
+      sqlite3session_delete (session);
+  }
+
+  /**
+   * Starts recording changes for a new block.
+   */
+  void
+  StartBlock ()
+  {
+    CHECK (session == nullptr);
+    db.AccessDatabase ([this] (sqlite3* h)
+      {
+        CHECK_EQ (sqlite3session_create (h, "main", &session), SQLITE_OK);
+        CHECK_EQ (sqlite3session_attach (session, nullptr), SQLITE_OK);
+      });
+  }
+
+  /**
+   * Stops recording and returns the changeset of the current session.
+   */
+  UndoData
+  ExtractChangeset ()
+  {
+    CHECK (session != nullptr);
+
+    int size;
+    void* data;
+    CHECK_EQ (sqlite3session_changeset (session, &size, &data), SQLITE_OK);
+    const UndoData res(static_cast<const char*> (data), size);
+    sqlite3_free (data);
+    sqlite3session_delete (session);
+    session = nullptr;
+
+    return res;
+  }
+
+  /**
+   * Ends the current block and updates the hasher with its changes.  Then
+   * verifies that the incrementally updated root matches the one
+   * computed from scratch, and returns it.
+   */
+  uint256
+  EndBlock (const std::string& blk)
+  {
+    const UndoData changeset = ExtractChangeset ();
+
+    StartBlock ();
+    const uint256 root = hasher.ProcessBlock (db, SHA256::Hash (blk),
+                                              changeset);
+    const UndoData own = ExtractChangeset ();
+
+    hasherChanges.clear ();
+    sqlite3_changeset_iter* it;
+    CHECK_EQ (sqlite3changeset_start (&it, own.size (),
+                                      const_cast<char*> (own.data ())),
+              SQLITE_OK);
+    while (sqlite3changeset_next (it) == SQLITE_ROW)
+      {
+        const char* table;
+        int numCols, op, indirect;
+        CHECK_EQ (sqlite3changeset_op (it, &table, &numCols, &op, &indirect),
+                  SQLITE_OK);
+        ++hasherChanges[table];
+      }
+    CHECK_EQ (sqlite3changeset_finalize (it), SQLITE_OK);
+
+    EXPECT_EQ (root, hasher.GetCurrentRoot (db));
+    EXPECT_EQ (root, hasher.ComputeFullRoot (db));
+
+    uint256 stored;
+    EXPECT_TRUE (hasher.GetRoot (db, SHA256::Hash (blk), stored));
+    EXPECT_EQ (stored, root);
+
+    return root;
+  }
+
+};
+
+TEST_F (SQLiteMerkleTests, InitialBuild)
+{
+  StartBlock ();
+  const uint256 root = EndBlock ("initial");
+
+  uint256 value;
+  EXPECT_FALSE (hasher.GetRoot (db, SHA256::Hash ("other"), value));
+
+  /* Hashing again without changes yields the same root.  */
+  StartBlock ();
+  EXPECT_EQ (EndBlock ("same"), root);
+}
+
+TEST_F (SQLiteMerkleTests, OnlyCurrentRootKept)
+{
+  StartBlock ();
+  EndBlock ("first");
+
+  StartBlock ();
+  EndBlock ("second");
+  EXPECT_EQ (hasherChanges["spacexpansegame_merkleroots"], 2u);
+
+  uint256 value;
+  EXPECT_FALSE (hasher.GetRoot (db, SHA256::Hash ("first"), value));
+
+  auto stmt = db.PrepareRo (R"(
+    SELECT COUNT (*) FROM `spacexpansegame_merkleroots`
+  )");
+  ASSERT_TRUE (stmt.Step ());
+  EXPECT_EQ (stmt.Get<int64_t> (0), 1);
+}
+
+TEST_F (SQLiteMerkleTests, RowChanges)
+{
+  StartBlock ();
+  const uint256 root1 = EndBlock ("initial");
+
+  StartBlock ();
+  db.Execute (R"(
+    UPDATE `first` SET `value` = 'bar' WHERE `id` = 1;
+    INSERT INTO `first` (`id`, `value`) VALUES (3, 'new');
+    DELETE FROM `second` WHERE `a` = 'x';
+  )");
+  const uint256 root2 = EndBlock ("changes");
+  EXPECT_NE (root2, root1);
+
+  StartBlock ();
+  db.Execute (R"(
+    INSERT INTO `second` (`a`, `b`, `value`) VALUES ('x', x'00', 10);
+    UPDATE `second` SET `value` = 42 WHERE `a` = 'y';
+    UPDATE `first` SET `id` = 5 WHERE `id` = 3;
+  )");
+  EXPECT_NE (EndBlock ("more changes"), root2);
+
+  StartBlock ();
+  db.Execute (R"(
+    DELETE FROM `first` WHERE `id` = 5;
+    UPDATE `first` SET `value` = 'foo' WHERE `id` = 1;
+    UPDATE `second` SET `value` = 20 WHERE `a` = 'y';
+  )");
+  EXPECT_EQ (EndBlock ("revert"), root1);
+}
+
+TEST_F (SQLiteMerkleTests, SchemaChanges)
+{
+  StartBlock ();
+  const uint256 root1 = EndBlock ("initial");
+
+  StartBlock ();
+  db.Execute (R"(
+    CREATE TABLE `third` (`id` INTEGER PRIMARY KEY);
+    INSERT INTO `third` (`id`) VALUES (1), (2);
+    UPDATE `first` SET `value` = 'bar' WHERE `id` = 1;
+  )");
+  const uint256 root2 = EndBlock ("new table");
+  EXPECT_NE (root2, root1);
+
+  StartBlock ();
+  db.Execute (R"(
+    ALTER TABLE `first` ADD COLUMN `other` TEXT;
+    INSERT INTO `third` (`id`) VALUES (3);
+  )");
+  EXPECT_NE (EndBlock ("altered table"), root2);
+
+  StartBlock ();
+  db.Execute (R"(
+    DROP TABLE `third`;
+  )");
+  EndBlock ("dropped table");
+}
+
+TEST_F (SQLiteMerkleTests, InitialiseOutsideBlock)
+{
+  hasher.Initialise (db);
+  const uint256 root = hasher.GetCurrentRoot (db);
+  EXPECT_EQ (root, hasher.ComputeFullRoot (db));
+
+  /* The first block does not rehash the tables, so that its undo data only
+     contains the new root.  */
+  StartBlock ();
+  EXPECT_EQ (EndBlock ("initial"), root);
+  EXPECT_EQ (hasherChanges.count ("spacexpansegame_merkleleaves"), 0u);
+  EXPECT_EQ (hasherChanges.count ("spacexpansegame_merkletables"), 0u);
+  EXPECT_EQ (hasherChanges["spacexpansegame_merkleroots"], 1u);
+}
+
+TEST_F (SQLiteMerkleTests, OnlyChangedTablesWritten)
+{
+  hasher.Initialise (db);
+
+  StartBlock ();
+  db.Execute (R"(
+    UPDATE `first` SET `value` = 'bar' WHERE `id` = 1;
+    INSERT INTO `first` (`id`, `value`) VALUES (3, 'new');
+  )");
+  EndBlock ("changes");
+  EXPECT_EQ (hasherChanges["spacexpansegame_merkleleaves"], 2u);
+  EXPECT_EQ (hasherChanges["spacexpansegame_merkletables"], 1u);
+}
+
+TEST_F (SQLiteMerkleTests, SameLeavesDifferentOrder)
+{
+  StartBlock ();
+  const uint256 root = EndBlock ("initial");
+
+  /* Removing and re-adding rows (in a different order and block) yields
+     the same digests.  */
+  StartBlock ();
+  db.Execute (R"(
+    DELETE FROM `first`;
+  )");
+  EndBlock ("deleted");
+
+  StartBlock ();
+  db.Execute (R"(
+    INSERT INTO `first` (`id`, `value`) VALUES (2, NULL), (1, 'foo');
+  )");
+  EXPECT_EQ (EndBlock ("re-added"), root);
+}
+
+TEST_F (SQLiteMerkleTests, DifferentStatesDiffer)
+{
+  StartBlock ();
+  db.Execute (R"(
+    UPDATE `first` SET `value` = NULL WHERE `id` = 1;
+  )");
+  const uint256 root1 = EndBlock ("null");
+
+  StartBlock ();
+  db.Execute (R"(
+    UPDATE `first` SET `value` = '' WHERE `id` = 1;
+  )");
+  EXPECT_NE (EndBlock ("empty"), root1);
+}
+
+} // anonymous namespace
+} // namespace spacexpanse
@@ -33,10 +33,64 @@ void
 SQLiteProcessor::SetupSchema (SQLiteDatabase& db)
 {}
 
+SQLiteProcessor::~SQLiteProcessor ()
+{
+  /* The computation may still be using the subclass, which has already
+     been destructed at this point.  So we cannot just join here.  */
+  CHECK (!runner.joinable ())
+      << "SQLiteProcessor::Finish has not been called before destruction";
+}
+
+void
+SQLiteProcessor::StoreResult (SQLiteDatabase& db)
+{
+  db.Prepare ("SAVEPOINT `spacexpansegame-processor`").Execute ();
+  Store (db);
+  db.Prepare ("RELEASE `spacexpansegame-processor`").Execute ();
+}
+
+void
+SQLiteProcessor::StorePending (const bool wait)
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (!wait && computing)
+      return;
+  }
+
+  if (runner.joinable ())
+    runner.join ();
+
+  /* The thread has been joined, so no more locking is needed.  */
+  if (!resultPending)
+    return;
+
+  CHECK (storeDb != nullptr);
+  VLOG (1) << "Storing result of background processor computation";
+  StoreResult (*storeDb);
+  resultPending = false;
+  storeDb = nullptr;
+}
+
+bool
+SQLiteProcessor::IsComputing () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return computing;
+}
+
 void
 SQLiteProcessor::Finish ()
 {
-  /* Nothing needs to be done for now while processing runs synchronously.  */
+  StorePending (true);
+}
+
+void
+SQLiteProcessor::RunSynchronously (const Json::Value& blockData,
+                                   SQLiteDatabase& db)
+{
+  Compute (blockData, db);
+  StoreResult (db);
 }
 
 void
@@ -45,17 +99,89 @@ SQLiteProcessor::Process (const Json::Value& blockData, SQLiteDatabase& db)
   if (!ShouldRun (blockData))
     return;
 
-  /* TODO:  Actually make Compute() run on a snapshot asynchronously,
-     rather than blocking the entire GSP process for a long-running computation
-     (like hashing of a large game state).
+  StorePending (true);
+  RunSynchronously (blockData, db);
+}
+
+void
+SQLiteProcessor::Process (const Json::Value& blockData, SQLiteStorage& storage)
+{
+  SQLiteDatabase& db = storage.GetDatabase ();
+  StorePending (false);
+
+  if (!ShouldRun (blockData))
+    return;
+
+  /* Processors may rely on seeing every block they should run at, so if
+     the earlier computation is still running, we have to wait for it.  */
+  if (runner.joinable ())
+    {
+      LOG (WARNING)
+          << "Processor is still busy with an earlier block, waiting before"
+          << " processing block " << blockData["hash"].asString ();
+      StorePending (true);
+    }
 
-     For now we just run it synchronously here for simplicity.  */
+  /* We can only use a snapshot if it contains exactly the state of the
+     block to process.  This is not the case e.g. if the block's changes
+     are still in an uncommitted transaction batch.  */
+  auto snapshot = storage.GetSnapshot ();
+  uint256 block, snapshotBlock;
+  if (snapshot == nullptr
+        || !block.FromHex (blockData["hash"].asString ())
+        || !SQLiteStorage::GetCurrentBlockHash (*snapshot, snapshotBlock)
+        || snapshotBlock != block)
+    {
+      VLOG (1) << "No matching snapshot, running processor synchronously";
+      snapshot.reset ();
+      RunSynchronously (blockData, db);
+      return;
+    }
 
-  Compute (blockData, db);
+  /* The additional snapshots are opened right away from this thread, which
+     is also the one committing changes.  Thus they see the same state.  */
+  CHECK (helpers.empty ());
+  for (unsigned i = 0; i < extraSnapshots; ++i)
+    helpers.push_back (storage.GetSnapshot ());
 
-  db.Prepare ("SAVEPOINT `spacexpansegame-processor`").Execute ();
-  Store (db);
-  db.Prepare ("RELEASE `spacexpansegame-processor`").Execute ();
+  VLOG (1) << "Running processor on snapshot for block " << block.ToHex ();
+  computing = true;
+  resultPending = false;
+  storeDb = &db;
+
+  runner = std::thread (&SQLiteProcessor::ComputeInBackground, this,
+                        blockData, std::move (snapshot));
+}
+
+void
+SQLiteProcessor::ComputeInBackground (const Json::Value blockData,
+                                      SQLiteStorage::Snapshot snapshot)
+{
+  Compute (blockData, *snapshot);
+
+  /* Release the snapshots right away, so that they do not keep the WAL
+     from being checkpointed until the result is stored.  */
+  helpers.clear ();
+  snapshot.reset ();
+
+  std::lock_guard<std::mutex> lock(mut);
+  computing = false;
+  resultPending = true;
+}
+
+void
+SQLiteProcessor::SetExtraSnapshots (const unsigned num)
+{
+  extraSnapshots = num;
+}
+
+std::vector<const SQLiteDatabase*>
+SQLiteProcessor::GetExtraSnapshots () const
+{
+  std::vector<const SQLiteDatabase*> res;
+  for (const auto& h : helpers)
+    res.push_back (h.get ());
+  return res;
 }
 
 void
@@ -78,6 +204,13 @@ SQLiteHasher::SetupSchema (SQLiteDatabase& db)
   )");
 } 
 
+void
+SQLiteHasher::SetParallelism (const unsigned threads)
+{
+  CHECK_GT (threads, 0);
+  SetExtraSnapshots (threads - 1);
+}
+
 std::set<std::string>
 SQLiteHasher::GetTables (const SQLiteDatabase& db)
 {
@@ -92,8 +225,11 @@ SQLiteHasher::Compute (const Json::Value& blockData, const SQLiteDatabase& db)
   CHECK (block.FromHex (hashVal.asString ()));
 
   VLOG (1) << "Computing game-state hash for block " << block.ToHex ();
+  auto dbs = GetExtraSnapshots ();
+  dbs.insert (dbs.begin (), &db);
+
   SHA256 hasher;
-  WriteTables (hasher, db, GetTables (db));
+  WriteTablesParallel (hasher, dbs, GetTables (db));
   hash = hasher.Finalise ();
 }
 
@@ -9,8 +9,13 @@
 
 #include <json/json.h>
 
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -35,6 +40,15 @@ namespace spacexpanse
  * into member variables, and no second call to Compute will be done until
  * Store has been called (that can access those member variables).
  *
+ * When the processor is run through an SQLiteStorage whose database is in WAL
+ * mode and the state of the block has already been committed, Compute is
+ * run on a snapshot in a separate thread, and Store is called when the next
+ * block is processed after it finished (or in Finish).  Otherwise (e.g. for
+ * in-memory databases, or while catching up with batched transactions),
+ * both are called synchronously.  If a computation is still running
+ * when the processor should run again, the block processing waits for it
+ * to finish, so that no block is ever skipped.
+ *
  * Note that processors should be treated as "optional" and "best effort".
  * Their results must not influence the actual consensus game state.
  */
@@ -43,6 +57,34 @@ class SQLiteProcessor
 
 private:
 
+  /**
+   * Lock for the state shared with the background computation.  It is not
+   * needed for the results of Compute themselves, as those are only accessed
+   * by Store after the thread has been joined.
+   */
+  mutable std::mutex mut;
+
+  /** The thread running a background computation (if any).  */
+  std::thread runner;
+
+  /** Set while a background computation is running.  */
+  bool computing = false;
+
+  /** Set if a background computation has results not yet stored.  */
+  bool resultPending = false;
+
+  /** The database on which the pending result should be stored.  */
+  SQLiteDatabase* storeDb = nullptr;
+
+  /**
+   * Number of additional snapshots of the same state that are opened
+   * for each background computation.
+   */
+  unsigned extraSnapshots = 0;
+
+  /** The additional snapshots for the running background computation.  */
+  std::vector<SQLiteStorage::Snapshot> helpers;
+
   /**
    * If the default rule of "every X blocks" is used to determine when
    * processing is done, this is set to the block interval (X).  If zero,
@@ -55,8 +97,46 @@ private:
    */
   uint64_t blockModulo;
 
+  /**
+   * Calls Store wrapped in a SAVEPOINT on the given database.
+   */
+  void StoreResult (SQLiteDatabase& db);
+
+  /**
+   * Waits for a background computation (if any) and stores its result.
+   * If wait is false, this only does something if the computation has
+   * already finished.
+   */
+  void StorePending (bool wait);
+
+  /**
+   * Runs Compute and Store synchronously on the given database.
+   */
+  void RunSynchronously (const Json::Value& blockData, SQLiteDatabase& db);
+
+  /**
+   * Runs Compute on the snapshot.  This is the body of the background
+   * thread.  The arguments are passed by value, as they are owned
+   * by the thread.
+   */
+  void ComputeInBackground (Json::Value blockData,
+                            SQLiteStorage::Snapshot snapshot);
+
 protected:
 
+  /**
+   * Requests that the given number of additional snapshots are opened for
+   * each background computation.  They see the same state as the database
+   * passed to Compute, and can be used to parallelise the computation.
+   */
+  void SetExtraSnapshots (unsigned num);
+
+  /**
+   * Returns the additional snapshots for the current computation.  This is
+   * empty if Compute is run synchronously.
+   */
+  std::vector<const SQLiteDatabase*> GetExtraSnapshots () const;
+
   /**
    * Checks whether or not the processor should run at the given block.
    * By default, it uses a fixed block interval and modulo to determine
@@ -82,7 +162,10 @@ protected:
 public:
 
   SQLiteProcessor () = default;
-  virtual ~SQLiteProcessor () = default;
+  virtual ~SQLiteProcessor ();
+
+  SQLiteProcessor (const SQLiteProcessor&) = delete;
+  void operator= (const SQLiteProcessor&) = delete;
 
   /**
    * This is called when setting up the processor and database, and gives
@@ -92,20 +175,37 @@ public:
   virtual void SetupSchema (SQLiteDatabase& db);
 
   /**
-   * Waits for all potentially still running operations to finish.  This is
-   * invoked before the attached database is closed.  Note that the object
-   * stays valid, so a new call to Process can be made afterwards as desired
-   * (if the database is opened again), and then Finish called again.
+   * Waits for all potentially still running operations to finish, and
+   * stores their results.  This is invoked before the attached database is
+   * closed, and must be called before the processor is destructed if it
+   * has been used.  Note that the object stays valid, so a new call to
+   * Process can be made afterwards as desired (if the database is opened
+   * again), and then Finish called again.
    */
   void Finish ();
 
   /**
    * Checks if the processor should be executed for the given block,
    * and if so, triggers it by calling the subclass-specific Compute and
-   * Store methods accordingly.
+   * Store methods synchronously on the given database.
    */
   void Process (const Json::Value& blockData, SQLiteDatabase& db);
 
+  /**
+   * Checks if the processor should be executed for the given block,
+   * and if so, runs Compute in the background on a snapshot of the storage
+   * if possible.  The result is stored on a later call or in Finish.
+   * Results of earlier computations that are done are stored first.
+   * If an earlier computation is still running and the processor should
+   * run at this block, this blocks until that computation is done.
+   */
+  void Process (const Json::Value& blockData, SQLiteStorage& storage);
+
+  /**
+   * Returns true if a background computation is currently running.
+   */
+  bool IsComputing () const;
+
   /**
    * Enables the processor to run every X blocks (with modulo value M).
    */
@@ -144,6 +244,12 @@ public:
 
   void SetupSchema (SQLiteDatabase& db) override;
 
+  /**
+   * Sets the number of threads used to hash the database when running on
+   * snapshots.  The result is the same as with a single thread.
+   */
+  void SetParallelism (unsigned threads);
+
   /**
    * Retrieves the game-state hash stored in the database for the given
    * block hash, if any.  Returns true if a hash was found, and false
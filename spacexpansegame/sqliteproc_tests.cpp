@@ -5,14 +5,19 @@
 #include "sqliteproc.hpp"
 
 #include "sqliteintro.hpp"
+#include "testutils.hpp"
 
 #include <spacexpanseutil/hash.hpp>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 namespace spacexpanse
 {
@@ -46,6 +51,19 @@ template <typename T>
     EXPECT_EQ (actual, expectedHashed);
   }
 
+/**
+ * Builds fake JSON block data for the given block height.  The block
+ * hash will be the SHA256 of the block string.
+ */
+Json::Value
+BlockData (const unsigned height, const std::string& blk)
+{
+  Json::Value blockData(Json::objectValue);
+  blockData["height"] = static_cast<Json::Int64> (height);
+  blockData["hash"] = SHA256::Hash (blk).ToHex ();
+  return blockData;
+}
+
 /**
  * A simple processor class, which just records the value from the test database
  * "onerow" table with block hashes (without hashing the state otherwise,
@@ -144,19 +162,6 @@ protected:
     ExpectRecords (db, "spacexpansegame_procvalues", "value", expected);
   }
 
-  /**
-   * Builds fake JSON block data for the given block height.  The block
-   * hash will be the SHA256 of the block string.
-   */
-  static Json::Value
-  BlockData (const unsigned height, const std::string& blk)
-  {
-    Json::Value blockData(Json::objectValue);
-    blockData["height"] = static_cast<Json::Int64> (height);
-    blockData["hash"] = SHA256::Hash (blk).ToHex ();
-    return blockData;
-  }
-
 };
 
 TEST_F (SQLiteProcTests, RunsAtDefinedInterval)
@@ -175,6 +180,213 @@ TEST_F (SQLiteProcTests, RunsAtDefinedInterval)
 
 /* ************************************************************************** */
 
+/**
+ * Test processor whose Compute blocks until it is released by the test.
+ * This is used to verify that computations run in the background.
+ */
+class BlockingProcessor : public TestProcessor
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+
+  /** Whether Compute may proceed.  */
+  bool released = false;
+
+protected:
+
+  void
+  Compute (const Json::Value& blockData, const SQLiteDatabase& db) override
+  {
+    {
+      std::unique_lock<std::mutex> lock(mut);
+      while (!released)
+        cv.wait (lock);
+    }
+
+    TestProcessor::Compute (blockData, db);
+  }
+
+public:
+
+  void
+  Release ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    released = true;
+    cv.notify_all ();
+  }
+
+  /**
+   * Waits until the current background computation (if any) is done.
+   */
+  void
+  WaitUntilDone ()
+  {
+    while (IsComputing ())
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  }
+
+};
+
+class SQLiteProcAsyncTests : public testing::Test
+{
+
+protected:
+
+  /**
+   * SQLite storage that exposes the database for the test.
+   */
+  class Storage : public SQLiteStorage
+  {
+
+  public:
+
+    using SQLiteStorage::SQLiteStorage;
+    using SQLiteStorage::GetDatabase;
+
+  };
+
+  TemporaryDirectory dir;
+  Storage storage;
+  BlockingProcessor proc;
+
+  SQLiteProcAsyncTests ()
+    : storage(dir.GetPath () + "/storage.sqlite")
+  {
+    storage.Initialise ();
+
+    auto& db = storage.GetDatabase ();
+    db.Execute (R"(
+      CREATE TABLE `onerow` (`text` TEXT PRIMARY KEY);
+      INSERT INTO `onerow` (`text`) VALUES ('initial');
+    )");
+    proc.SetupSchema (db);
+    proc.SetInterval (1);
+  }
+
+  ~SQLiteProcAsyncTests ()
+  {
+    proc.Release ();
+    proc.Finish ();
+  }
+
+  /**
+   * Commits a new "block" to the storage, with the given value in the
+   * database and block hash.
+   */
+  void
+  CommitBlock (const std::string& blk, const std::string& val)
+  {
+    storage.BeginTransaction ();
+    auto stmt = storage.GetDatabase ().Prepare (R"(
+      UPDATE `onerow` SET `text` = ?1
+    )");
+    stmt.Bind (1, val);
+    stmt.Execute ();
+    storage.SetCurrentGameState (SHA256::Hash (blk), "");
+    storage.CommitTransaction ();
+  }
+
+  void
+  ExpectValues (const std::map<std::string, std::string>& expected)
+  {
+    ExpectRecords (storage.GetDatabase (), "spacexpansegame_procvalues",
+                   "value", expected);
+  }
+
+};
+
+TEST_F (SQLiteProcAsyncTests, ComputesOnSnapshot)
+{
+  CommitBlock ("one", "first");
+  proc.Process (BlockData (1, "one"), storage);
+  EXPECT_TRUE (proc.IsComputing ());
+
+  /* The computation is blocked, but processing can continue.  */
+  CommitBlock ("two", "second");
+  ExpectValues ({});
+
+  proc.Release ();
+  proc.Finish ();
+  ExpectValues ({{"one", "first"}});
+}
+
+TEST_F (SQLiteProcAsyncTests, WaitsForRunningComputation)
+{
+  CommitBlock ("one", "first");
+  proc.Process (BlockData (1, "one"), storage);
+  EXPECT_TRUE (proc.IsComputing ());
+
+  /* The next block is not skipped, even though the processor is still busy
+     with the first one when it comes in.  Instead, processing waits for
+     that computation to be done.  */
+  CommitBlock ("two", "second");
+  std::thread releaser([this] ()
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+      proc.Release ();
+    });
+  proc.Process (BlockData (2, "two"), storage);
+  releaser.join ();
+  ExpectValues ({{"one", "first"}});
+
+  proc.Finish ();
+  ExpectValues ({{"one", "first"}, {"two", "second"}});
+}
+
+TEST_F (SQLiteProcAsyncTests, StoredWithLaterBlock)
+{
+  proc.Release ();
+
+  CommitBlock ("one", "first");
+  proc.Process (BlockData (1, "one"), storage);
+  proc.WaitUntilDone ();
+  ExpectValues ({});
+
+  CommitBlock ("two", "second");
+  proc.Process (BlockData (2, "two"), storage);
+  ExpectValues ({{"one", "first"}});
+
+  proc.Finish ();
+  ExpectValues ({{"one", "first"}, {"two", "second"}});
+}
+
+TEST_F (SQLiteProcAsyncTests, SynchronousWithoutMatchingSnapshot)
+{
+  proc.Release ();
+
+  /* The state in the database does not belong to the block, so that
+     no snapshot can be used.  */
+  CommitBlock ("one", "first");
+  proc.Process (BlockData (2, "two"), storage);
+  ExpectValues ({{"two", "first"}});
+}
+
+TEST_F (SQLiteProcAsyncTests, ParallelHasher)
+{
+  SQLiteHasher hasher;
+  hasher.SetupSchema (storage.GetDatabase ());
+  hasher.SetInterval (1);
+  hasher.SetParallelism (3);
+
+  CommitBlock ("one", "first");
+  hasher.Process (BlockData (1, "one"), storage);
+  hasher.Finish ();
+
+  SHA256 expected;
+  WriteAllTables (expected, storage.GetDatabase ());
+
+  uint256 actual;
+  ASSERT_TRUE (hasher.GetHash (storage.GetDatabase (), SHA256::Hash ("one"),
+                               actual));
+  EXPECT_EQ (actual, expected.Finalise ());
+}
+
+/* ************************************************************************** */
+
 class SQLiteHasherTests : public SQLiteProcTests
 {
 
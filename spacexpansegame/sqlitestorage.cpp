@@ -7,9 +7,17 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <limits>
+#include <map>
+#include <vector>
 
 /**
  * The interval (in milliseconds) at which the database WAL file will
@@ -21,6 +29,14 @@
 DEFINE_int32 (spacexpanse_sqlite_wal_truncate_ms, 0,
               "if non-zero, interval between explicit WAL checkpoints");
 
+/**
+ * The maximum number of read-only connections that are kept open in a pool
+ * for reuse by snapshots.  If more snapshots are needed at the same time,
+ * extra connections are opened for them and closed again afterwards.
+ */
+DEFINE_int32 (spacexpanse_sqlite_snapshot_pool, 8,
+              "number of read connections pooled for snapshots");
+
 namespace spacexpanse
 {
 
@@ -281,10 +297,47 @@ SQLiteErrorLogger (void* arg, const int errCode, const char* msg)
 } // anonymous namespace
 
 bool SQLiteDatabase::sqliteInitialised = false;
+constexpr SQLiteDatabase::StatementId SQLiteDatabase::MAX_REGISTERED_STATEMENTS;
+
+namespace
+{
+
+/**
+ * The global registry of SQL statements for SQLiteDatabase::RegisterStatement.
+ * The ID of a statement is its index into the list of SQL strings.
+ */
+struct StatementRegistry
+{
+
+  /** Lock for this instance.  */
+  std::mutex mut;
+
+  /** The SQL of all registered statements by ID.  */
+  std::vector<std::string> sql;
+
+  /** The ID of each registered SQL string.  */
+  std::map<std::string, SQLiteDatabase::StatementId> ids;
+
+  /**
+   * Returns the singleton instance.
+   */
+  static StatementRegistry&
+  Get ()
+  {
+    static StatementRegistry instance;
+    return instance;
+  }
+
+};
+
+} // anonymous namespace
 
 SQLiteDatabase::SQLiteDatabase (const std::string& file, const int flags)
-  : db(nullptr)
+  : db(nullptr), cacheHits(0), cacheMisses(0), cacheRegisteredHits(0)
 {
+  for (auto& slot : registeredStatements)
+    slot.store (nullptr);
+
   if (!sqliteInitialised)
     {
       LOG (INFO)
@@ -331,7 +384,7 @@ SQLiteDatabase::SQLiteDatabase (const std::string& file, const int flags)
 
 SQLiteDatabase::~SQLiteDatabase ()
 {
-  if (parent != nullptr)
+  if (readTransaction)
     {
       LOG (INFO) << "Ending snapshot read transaction";
       PrepareRo ("ROLLBACK").Execute ();
@@ -364,7 +417,40 @@ SQLiteDatabase::SetReadonlySnapshot (const SQLiteStorage& p)
 {
   CHECK (parent == nullptr);
   parent = &p;
-  LOG (INFO) << "Starting read transaction for snapshot";
+  StartReadTransaction ();
+}
+
+void
+SQLiteDatabase::ReleaseReadonlySnapshot ()
+{
+  CHECK (parent != nullptr);
+  CHECK (readTransaction);
+
+  {
+    std::lock_guard<std::mutex> lock(mutPreparedStatements);
+    for (const auto& entry : preparedStatements)
+      {
+        CHECK (!entry.second->used.test_and_set ())
+            << "Cached statement is still in use";
+        /* Make sure no statement is left active, as the connection will
+           sit idle in the pool without a read transaction.  The return
+           value only reflects the last evaluation and is ignored.  */
+        sqlite3_reset (entry.second->stmt);
+        entry.second->used.clear ();
+      }
+  }
+
+  VLOG (1) << "Ending snapshot read transaction";
+  PrepareRo ("ROLLBACK").Execute ();
+  readTransaction = false;
+  parent = nullptr;
+}
+
+void
+SQLiteDatabase::StartReadTransaction ()
+{
+  CHECK (!readTransaction);
+  VLOG (1) << "Starting read transaction for snapshot";
 
   /* There is no way to do an "immediate" read transaction.  Thus we have
      to start a default deferred one, and then issue some SELECT query
@@ -375,12 +461,16 @@ SQLiteDatabase::SetReadonlySnapshot (const SQLiteStorage& p)
   auto stmt = PrepareRo ("SELECT COUNT(*) FROM `sqlite_master`");
   CHECK (stmt.Step ());
   CHECK (!stmt.Step ());
+
+  readTransaction = true;
 }
 
 void
 SQLiteDatabase::ClearStatementCache ()
 {
   std::lock_guard<std::mutex> lock(mutPreparedStatements);
+  for (auto& slot : registeredStatements)
+    slot.store (nullptr);
   preparedStatements.clear ();
 }
 
@@ -429,6 +519,7 @@ SQLiteDatabase::PrepareRo (const std::string& sql) const
       if (!it->second->used.test_and_set ())
         {
           VLOG (2) << "Reusing cached SQL statement at " << it->second.get ();
+          cacheHits.fetch_add (1, std::memory_order_relaxed);
           CHECK_EQ (sqlite3_clear_bindings (it->second->stmt), SQLITE_OK);
 
           auto res = Statement (*this, *it->second);
@@ -451,6 +542,8 @@ SQLiteDatabase::PrepareRo (const std::string& sql) const
           << "Failed to prepare SQL statement";
     });
 
+  cacheMisses.fetch_add (1, std::memory_order_relaxed);
+
   auto entry = std::make_unique<CachedStatement> (stmt);
   entry->used.test_and_set ();
   Statement res(*this, *entry);
@@ -465,8 +558,115 @@ SQLiteDatabase::PrepareRo (const std::string& sql) const
   return res;
 }
 
+SQLiteDatabase::StatementId
+SQLiteDatabase::RegisterStatement (const std::string& sql)
+{
+  auto& registry = StatementRegistry::Get ();
+  std::lock_guard<std::mutex> lock(registry.mut);
+
+  const auto mit = registry.ids.find (sql);
+  if (mit != registry.ids.end ())
+    return mit->second;
+
+  const StatementId id = registry.sql.size ();
+  CHECK_LT (id, MAX_REGISTERED_STATEMENTS)
+      << "Too many registered SQL statements";
+  registry.sql.push_back (sql);
+  registry.ids.emplace (sql, id);
+
+  VLOG (1) << "Registered SQL statement " << id << ":\n" << sql;
+  return id;
+}
+
+SQLiteDatabase::Statement
+SQLiteDatabase::Prepare (const StatementId id)
+{
+  return PrepareRo (id);
+}
+
+SQLiteDatabase::Statement
+SQLiteDatabase::PrepareRo (const StatementId id) const
+{
+  CHECK_LT (id, MAX_REGISTERED_STATEMENTS);
+  auto& slot = registeredStatements[id];
+
+  /* The slot is only reset (in ClearStatementCache) when no statements
+     are in use and no other thread is preparing any, so the entry it
+     points to stays valid while we look at it here.  */
+  CachedStatement* cached = slot.load (std::memory_order_acquire);
+  if (cached != nullptr && !cached->used.test_and_set ())
+    {
+      cacheRegisteredHits.fetch_add (1, std::memory_order_relaxed);
+      cacheHits.fetch_add (1, std::memory_order_relaxed);
+      CHECK_EQ (sqlite3_clear_bindings (cached->stmt), SQLITE_OK);
+
+      auto res = Statement (*this, *cached);
+      res.Reset ();
+
+      return res;
+    }
+
+  /* Otherwise use the general cache with the registered SQL string.  If
+     the slot was empty, we remember the entry we got for next time.  If
+     it was just in use (e.g. by another thread), we leave it as is.  */
+
+  std::string sql;
+  {
+    auto& registry = StatementRegistry::Get ();
+    std::lock_guard<std::mutex> lock(registry.mut);
+    CHECK_LT (id, registry.sql.size ()) << "Statement ID is not registered";
+    sql = registry.sql[id];
+  }
+
+  auto res = PrepareRo (sql);
+  if (cached == nullptr)
+    {
+      CachedStatement* expected = nullptr;
+      slot.compare_exchange_strong (expected, res.entry,
+                                    std::memory_order_release,
+                                    std::memory_order_relaxed);
+    }
+
+  return res;
+}
+
+SQLiteDatabase::StatementCacheStats
+SQLiteDatabase::GetStatementCacheStats () const
+{
+  StatementCacheStats res;
+  res.hits = cacheHits.load (std::memory_order_relaxed);
+  res.misses = cacheMisses.load (std::memory_order_relaxed);
+  res.registeredHits = cacheRegisteredHits.load (std::memory_order_relaxed);
+  return res;
+}
+
+double
+SQLiteDatabase::StatementCacheStats::GetHitRate () const
+{
+  const uint64_t total = hits + misses;
+  if (total == 0)
+    return 0.0;
+
+  return static_cast<double> (hits) / total;
+}
+
 /* ************************************************************************** */
 
+namespace
+{
+
+/**
+ * Returns the configured maximum size of the snapshot pool.
+ */
+unsigned
+GetSnapshotPoolCapacity ()
+{
+  CHECK_GE (FLAGS_spacexpanse_sqlite_snapshot_pool, 0);
+  return FLAGS_spacexpanse_sqlite_snapshot_pool;
+}
+
+} // anonymous namespace
+
 SQLiteStorage::~SQLiteStorage ()
 {
   if (db != nullptr)
@@ -481,6 +681,11 @@ SQLiteStorage::OpenDatabase ()
           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
 
   SetupSchema ();
+
+  /* The synchronous mode is per connection, so it has to be applied
+     again if the database is reopened (e.g. by Clear).  */
+  if (deferredSync)
+    db->Execute ("PRAGMA `synchronous` = NORMAL");
 }
 
 void
@@ -498,6 +703,21 @@ SQLiteStorage::CloseDatabase ()
 {
   CHECK (db != nullptr);
   WaitForSnapshots ();
+  ClearSnapshotPool ();
+
+  const auto stats = GetSnapshotStats ();
+  LOG_IF (INFO, stats.leases > 0)
+      << "Snapshots: " << stats.leases << " leased, "
+      << stats.reused << " from the pool, " << stats.overflow << " overflow, "
+      << "max wait " << stats.maxWait.count () << " us, "
+      << "max lease " << stats.maxLease.count () << " us";
+
+  const auto cache = db->GetStatementCacheStats ();
+  LOG (INFO)
+      << "Statement cache: " << cache.hits << " hits ("
+      << cache.registeredHits << " registered), " << cache.misses
+      << " misses, hit rate " << cache.GetHitRate ();
+
   db.reset ();
 }
 
@@ -515,7 +735,7 @@ SQLiteStorage::GetDatabase () const
   return *db;
 }
 
-std::unique_ptr<SQLiteDatabase>
+SQLiteStorage::Snapshot
 SQLiteStorage::GetSnapshot () const
 {
   CHECK (db != nullptr);
@@ -525,11 +745,119 @@ SQLiteStorage::GetSnapshot () const
       return nullptr;
     }
 
+  SnapshotLease lease;
+  lease.storage = this;
+  const auto before = Clock::now ();
+
+  /* Opening a new connection and starting the read transaction is done
+     without holding the lock.  Since the snapshot is already counted as
+     outstanding at that point, the database will not be closed or
+     checkpointed in the mean time.  */
+  std::unique_ptr<SQLiteDatabase> conn;
+  {
+    std::lock_guard<std::mutex> lock(mutSnapshots);
+    ++snapshots;
+    ++snapshotStats.leases;
+
+    if (!snapshotPool.empty ())
+      {
+        conn = std::move (snapshotPool.back ());
+        snapshotPool.pop_back ();
+        lease.pooled = true;
+        ++snapshotStats.reused;
+      }
+    else if (snapshotStats.poolSize < GetSnapshotPoolCapacity ())
+      {
+        lease.pooled = true;
+        ++snapshotStats.poolSize;
+      }
+    else
+      ++snapshotStats.overflow;
+  }
+
+  if (conn == nullptr)
+    conn = std::make_unique<SQLiteDatabase> (filename, SQLITE_OPEN_READONLY);
+  conn->SetReadonlySnapshot (*this);
+
+  lease.start = Clock::now ();
+  const auto wait = std::chrono::duration_cast<std::chrono::microseconds> (
+      lease.start - before);
+  {
+    std::lock_guard<std::mutex> lock(mutSnapshots);
+    snapshotStats.totalWait += wait;
+    snapshotStats.maxWait = std::max (snapshotStats.maxWait, wait);
+  }
+
+  return Snapshot (conn.release (), lease);
+}
+
+void
+SQLiteStorage::SnapshotLease::operator() (SQLiteDatabase* snapshot) const
+{
+  CHECK (storage != nullptr);
+  storage->ReturnSnapshot (snapshot, *this);
+}
+
+void
+SQLiteStorage::ReturnSnapshot (SQLiteDatabase* snapshot,
+                               const SnapshotLease& lease) const
+{
+  std::unique_ptr<SQLiteDatabase> conn(snapshot);
+  const auto duration = std::chrono::duration_cast<std::chrono::microseconds> (
+      Clock::now () - lease.start);
+
+  {
+    std::lock_guard<std::mutex> lock(mutSnapshots);
+    snapshotStats.totalLease += duration;
+    snapshotStats.maxLease = std::max (snapshotStats.maxLease, duration);
+  }
+
+  /* Connections not from the pool are just closed.  The SQLiteDatabase
+     destructor ends the read transaction and unrefs the snapshot.  */
+  if (!lease.pooled)
+    {
+      conn.reset ();
+      return;
+    }
+
+  /* Otherwise we end the read transaction and update the snapshot count
+     ourselves.  The connection has to be back in the pool before the count
+     drops, as CloseDatabase may clear the pool right after that.  */
+  conn->ReleaseReadonlySnapshot ();
+
+  std::lock_guard<std::mutex> lock(mutSnapshots);
+  if (snapshotStats.poolSize > GetSnapshotPoolCapacity ())
+    --snapshotStats.poolSize;
+  else
+    {
+      snapshotPool.push_back (std::move (conn));
+      CHECK_LE (snapshotPool.size (), snapshotStats.poolSize);
+    }
+
+  CHECK_GT (snapshots, 0);
+  --snapshots;
+  cvSnapshots.notify_all ();
+}
+
+void
+SQLiteStorage::ClearSnapshotPool ()
+{
   std::lock_guard<std::mutex> lock(mutSnapshots);
-  ++snapshots;
+  CHECK_EQ (snapshots, 0);
+  CHECK_EQ (snapshotPool.size (), snapshotStats.poolSize);
 
-  auto res = std::make_unique<SQLiteDatabase> (filename, SQLITE_OPEN_READONLY);
-  res->SetReadonlySnapshot (*this);
+  snapshotPool.clear ();
+  snapshotStats.poolSize = 0;
+}
+
+SQLiteStorage::SnapshotStats
+SQLiteStorage::GetSnapshotStats () const
+{
+  std::lock_guard<std::mutex> lock(mutSnapshots);
+
+  SnapshotStats res = snapshotStats;
+  res.idle = snapshotPool.size ();
+  res.leased = snapshots;
 
   return res;
 }
@@ -555,6 +883,8 @@ SQLiteStorage::SetupSchema ()
         (`hash` BLOB PRIMARY KEY,
          `data` BLOB NOT NULL,
          `height` INTEGER NOT NULL);
+    CREATE INDEX IF NOT EXISTS `spacexpansegame_undo_height`
+        ON `spacexpansegame_undo` (`height`);
   )");
 }
 
@@ -649,9 +979,68 @@ SQLiteStorage::SetCurrentGameState (const uint256& hash,
   stmt.BindBlob (1, data);
   stmt.Execute ();
 
+  /* The height is not known for the new state.  If it is,
+     SetCurrentGameStateWithHeight will add it back afterwards.  */
+  db->Prepare (R"(
+    DELETE FROM `spacexpansegame_current`
+      WHERE `key` = 'blockheight'
+  )").Execute ();
+
   db->Prepare ("RELEASE `spacexpansegame-setcurrentstate`").Execute ();
 }
 
+void
+SQLiteStorage::SetCurrentGameStateWithHeight (const uint256& hash,
+                                              const unsigned height,
+                                              const GameStateData& data)
+{
+  SetCurrentGameState (hash, data);
+
+  auto stmt = db->Prepare (R"(
+    INSERT OR REPLACE INTO `spacexpansegame_current` (`key`, `value`)
+      VALUES ('blockheight', ?1)
+  )");
+  stmt.Bind (1, height);
+  stmt.Execute ();
+}
+
+bool
+SQLiteStorage::GetCurrentBlockHeight (unsigned& height) const
+{
+  auto stmt = db->Prepare (R"(
+    SELECT `value`
+      FROM `spacexpansegame_current`
+      WHERE `key` = 'blockheight'
+  )");
+
+  if (!stmt.Step ())
+    return false;
+
+  height = stmt.Get<unsigned> (0);
+  CHECK (!stmt.Step ());
+
+  return true;
+}
+
+bool
+SQLiteStorage::GetBlockHeight (const uint256& hash, unsigned& height) const
+{
+  auto stmt = db->Prepare (R"(
+    SELECT `height`
+      FROM `spacexpansegame_undo`
+      WHERE `hash` = ?1
+  )");
+  stmt.Bind (1, hash);
+
+  if (!stmt.Step ())
+    return false;
+
+  height = stmt.Get<unsigned> (0);
+  CHECK (!stmt.Step ());
+
+  return true;
+}
+
 bool
 SQLiteStorage::GetUndoData (const uint256& hash, UndoData& data) const
 {
@@ -717,6 +1106,32 @@ SQLiteStorage::PruneUndoData (const unsigned height)
   stmt.Execute ();
 }
 
+unsigned
+SQLiteStorage::PruneUndoDataRange (const unsigned height, const unsigned limit)
+{
+  CHECK (startedTransaction);
+  CHECK_GT (limit, 0);
+
+  /* The subquery uses the index on height, so that each chunk only touches
+     the rows it actually deletes.  */
+  auto stmt = db->Prepare (R"(
+    DELETE FROM `spacexpansegame_undo`
+      WHERE `rowid` IN (SELECT `rowid`
+                          FROM `spacexpansegame_undo`
+                          WHERE `height` <= ?1
+                          LIMIT ?2)
+  )");
+  stmt.Bind (1, height);
+  stmt.Bind (2, limit);
+
+  stmt.Execute ();
+
+  return db->AccessDatabase ([] (sqlite3* h)
+    {
+      return sqlite3_changes (h);
+    });
+}
+
 void
 SQLiteStorage::BeginTransaction ()
 {
@@ -774,11 +1189,61 @@ SQLiteStorage::WalCheckpoint ()
 void
 SQLiteStorage::RollbackTransaction ()
 {
+  /* ROLLBACK TO keeps the savepoint (and thus the transaction) open,
+     so it has to be released explicitly as well.  */
   db->Prepare ("ROLLBACK TO `spacexpansegame-sqlitegame`").Execute ();
+  db->Prepare ("RELEASE `spacexpansegame-sqlitegame`").Execute ();
   CHECK (startedTransaction);
   startedTransaction = false;
 }
 
+bool
+SQLiteStorage::SetDeferredSync (const bool enable)
+{
+  CHECK (db != nullptr);
+  CHECK (!startedTransaction);
+
+  if (enable && !db->IsWalMode ())
+    {
+      LOG (WARNING) << "Deferred syncing requires a WAL-mode database";
+      return false;
+    }
+
+  /* In WAL mode with synchronous=NORMAL, commits only append to the WAL
+     file without syncing it.  The database stays consistent if the latest
+     commits are lost, and SyncCommitted flushes the WAL explicitly.  */
+  db->Execute (enable ? "PRAGMA `synchronous` = NORMAL"
+                      : "PRAGMA `synchronous` = FULL");
+  deferredSync = enable;
+
+  LOG (INFO) << "Deferred syncing for SQLite enabled: " << enable;
+  return enable;
+}
+
+void
+SQLiteStorage::SyncCommitted ()
+{
+  /* This runs on a background thread, so we do not touch the connection
+     (which the main thread uses at the same time).  Syncing the WAL file
+     through a separate descriptor flushes everything committed so far.  */
+  const std::string walFile = filename + "-wal";
+  const int fd = open (walFile.c_str (), O_RDONLY);
+  if (fd < 0)
+    {
+      /* Without a WAL file, there is nothing that needs syncing (it has
+         been checkpointed and removed).  */
+      CHECK_EQ (errno, ENOENT)
+          << "Failed to open " << walFile << ": " << std::strerror (errno);
+      return;
+    }
+
+  const int rc = fdatasync (fd);
+  const int err = errno;
+  close (fd);
+  CHECK_EQ (rc, 0)
+      << "Failed to sync " << walFile << ": " << std::strerror (err);
+}
+
 /* ************************************************************************** */
 
 } // namespace spacexpanse
@@ -11,12 +11,16 @@
 
 #include <sqlite3.h>
 
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -35,6 +39,44 @@ public:
 
   class Statement;
 
+  /**
+   * Handle for an SQL statement that has been registered globally
+   * through RegisterStatement.
+   */
+  using StatementId = unsigned;
+
+  /**
+   * Maximum number of distinct statements that can be registered
+   * with RegisterStatement.
+   */
+  static constexpr StatementId MAX_REGISTERED_STATEMENTS = 1'024;
+
+  /**
+   * Counters for the usage of the prepared-statement cache.
+   */
+  struct StatementCacheStats
+  {
+
+    /** Number of times an already prepared statement was reused.  */
+    uint64_t hits = 0;
+
+    /** Number of times a new statement had to be prepared.  */
+    uint64_t misses = 0;
+
+    /**
+     * Number of the hits that went through the lock-free lookup of
+     * a registered statement.
+     */
+    uint64_t registeredHits = 0;
+
+    /**
+     * Returns the fraction of cache hits among all lookups (or zero if
+     * there were no lookups yet).
+     */
+    double GetHitRate () const;
+
+  };
+
 private:
 
   struct CachedStatement;
@@ -67,6 +109,9 @@ private:
   /** The "parent" storage if this is a read-only snapshot.  */
   const SQLiteStorage* parent = nullptr;
 
+  /** Whether a read transaction has been started on this connection.  */
+  bool readTransaction = false;
+
   /**
    * Mutex protecting the statement cache (but not the statements
    * themselves inside, which have their own locks).
@@ -81,6 +126,23 @@ private:
   mutable std::multimap<std::string, std::unique_ptr<CachedStatement>>
       preparedStatements;
 
+  /**
+   * For each registered statement ID, one of the entries in
+   * preparedStatements for its SQL (or null if none has been chosen yet).
+   * This entry is tried first and without locking mutPreparedStatements
+   * when the statement is prepared by ID.  The slots are reset in
+   * ClearStatementCache together with the entries they point to.
+   */
+  mutable std::array<std::atomic<CachedStatement*>, MAX_REGISTERED_STATEMENTS>
+      registeredStatements;
+
+  /** Number of cache hits when preparing statements.  */
+  mutable std::atomic<uint64_t> cacheHits;
+  /** Number of cache misses when preparing statements.  */
+  mutable std::atomic<uint64_t> cacheMisses;
+  /** Number of cache hits on the fast path for registered statements.  */
+  mutable std::atomic<uint64_t> cacheRegisteredHits;
+
   /**
    * Marks this is a read-only snapshot (with the given parent storage).  When
    * called, this starts a read transaction to ensure that the current view is
@@ -89,6 +151,15 @@ private:
    */
   void SetReadonlySnapshot (const SQLiteStorage& p);
 
+  /**
+   * Ends the read transaction of a read-only snapshot and detaches it from
+   * its parent storage, so that the connection can be reused for another
+   * snapshot later on.  This does not unregister the snapshot with
+   * the parent; the caller is responsible for that.  It is an error
+   * if any of the cached statements are still in use.
+   */
+  void ReleaseReadonlySnapshot ();
+
   /**
    * Clears the cache of prepared statements.
    */
@@ -144,6 +215,13 @@ public:
     return cb (db);
   }
 
+  /**
+   * Starts a read transaction, so that the current view of the database
+   * is preserved for all future queries on this connection.  The
+   * transaction is ended when the instance is destructed.
+   */
+  void StartReadTransaction ();
+
   /**
    * Directly runs a particular SQL statement on the database, without
    * going through a prepared statement.  This can be useful for things like
@@ -169,6 +247,36 @@ public:
    */
   Statement PrepareRo (const std::string& sql) const;
 
+  /**
+   * Registers an SQL statement and returns a handle for it, which can then
+   * be passed to Prepare and PrepareRo on any database instance instead
+   * of the SQL string.  Registering the same SQL again returns the same
+   * handle.  This is meant to be called once per statement, typically to
+   * initialise a static variable next to the code using the statement:
+   *
+   *   static const auto id = SQLiteDatabase::RegisterStatement ("...");
+   *   auto stmt = db.Prepare (id);
+   */
+  static StatementId RegisterStatement (const std::string& sql);
+
+  /**
+   * Prepares a registered SQL statement.  This behaves like Prepare with
+   * the statement's SQL, but in the common case where the statement has
+   * been used before and is not in use right now, it is found in constant
+   * time and without locking or comparing the SQL string.
+   */
+  Statement Prepare (StatementId id);
+
+  /**
+   * Prepares a registered read-only statement, like PrepareRo.
+   */
+  Statement PrepareRo (StatementId id) const;
+
+  /**
+   * Returns the current usage counters of the statement cache.
+   */
+  StatementCacheStats GetStatementCacheStats () const;
+
 };
 
 /**
@@ -331,6 +439,57 @@ public:
 class SQLiteStorage : public StorageInterface
 {
 
+public:
+
+  class SnapshotLease;
+
+  /**
+   * A read-only snapshot of the database as returned by GetSnapshot.  When
+   * it is destructed, the underlying connection is returned to the pool
+   * of the storage (or closed).
+   */
+  using Snapshot = std::unique_ptr<SQLiteDatabase, SnapshotLease>;
+
+  /**
+   * Statistics about the read snapshots and the pool of connections
+   * used for them.
+   */
+  struct SnapshotStats
+  {
+
+    /** Number of connections owned by the pool (idle or leased out).  */
+    unsigned poolSize = 0;
+
+    /** Number of pooled connections that are currently idle.  */
+    unsigned idle = 0;
+
+    /** Number of snapshots that are currently leased out.  */
+    unsigned leased = 0;
+
+    /** Total number of snapshots that have been leased out.  */
+    uint64_t leases = 0;
+
+    /** Number of leases that reused an idle connection from the pool.  */
+    uint64_t reused = 0;
+
+    /**
+     * Number of leases for which the pool was exhausted, so that an
+     * extra connection was opened and closed again afterwards.
+     */
+    uint64_t overflow = 0;
+
+    /** Total time spent on obtaining snapshots.  */
+    std::chrono::microseconds totalWait{0};
+    /** Longest time spent on obtaining a single snapshot.  */
+    std::chrono::microseconds maxWait{0};
+
+    /** Total time finished snapshots have been leased out for.  */
+    std::chrono::microseconds totalLease{0};
+    /** Longest time a finished snapshot has been leased out for.  */
+    std::chrono::microseconds maxLease{0};
+
+  };
+
 private:
 
   /**
@@ -352,13 +511,28 @@ private:
    */
   bool startedTransaction = false;
 
+  /**
+   * Whether deferred syncing is enabled.  Then the connection uses
+   * synchronous=NORMAL, and SyncCommitted flushes the WAL file.
+   */
+  bool deferredSync = false;
+
   /**
    * Number of outstanding snapshots.  This has to drop to zero before
    * we can close the database.
    */
   mutable unsigned snapshots = 0;
 
-  /** Mutex for the snapshot number.  */
+  /**
+   * Idle connections of the snapshot pool.  They do not have a read
+   * transaction open, but keep their cache of prepared statements.
+   */
+  mutable std::vector<std::unique_ptr<SQLiteDatabase>> snapshotPool;
+
+  /** Statistics about the snapshots and their pool.  */
+  mutable SnapshotStats snapshotStats;
+
+  /** Mutex for the snapshot number, pool and stats.  */
   mutable std::mutex mutSnapshots;
   /** Condition variable for waiting for snapshot unrefs.  */
   mutable std::condition_variable cvSnapshots;
@@ -384,12 +558,26 @@ private:
    */
   void UnrefSnapshot () const;
 
+  /**
+   * Handles the end of a lease of the given snapshot connection.  If it
+   * belongs to the pool, it is returned there.  Otherwise it is closed.
+   */
+  void ReturnSnapshot (SQLiteDatabase* snapshot,
+                       const SnapshotLease& lease) const;
+
+  /**
+   * Closes all idle connections in the snapshot pool.  This must only be
+   * called while no snapshots are leased out.
+   */
+  void ClearSnapshotPool ();
+
   /**
    * Performs an explicit WAL checkpoint.
    */
   void WalCheckpoint ();
 
   friend class SQLiteDatabase;
+  friend class SQLiteProcessor;
 
 protected:
 
@@ -425,8 +613,12 @@ protected:
    * Creates a read-only snapshot of the underlying database and returns
    * the corresponding SQLiteDatabase instance.  May return NULL if the
    * underlying database is not using WAL mode (e.g. in-memory).
+   *
+   * The snapshot is pinned to the currently committed state.  If possible,
+   * an idle connection from a pool is reused for it, so that the snapshot
+   * can benefit from statements prepared on it before.
    */
-  std::unique_ptr<SQLiteDatabase> GetSnapshot () const;
+  Snapshot GetSnapshot () const;
 
   /**
    * Returns the current block hash (if any) for the given database connection.
@@ -462,17 +654,62 @@ public:
   GameStateData GetCurrentGameState () const override;
   void SetCurrentGameState (const uint256& hash,
                             const GameStateData& data) override;
+  void SetCurrentGameStateWithHeight (const uint256& hash, unsigned height,
+                                      const GameStateData& data) override;
+  bool GetCurrentBlockHeight (unsigned& height) const override;
+  bool GetBlockHeight (const uint256& hash, unsigned& height) const override;
 
   bool GetUndoData (const uint256& hash, UndoData& data) const override;
   void AddUndoData (const uint256& hash,
                     unsigned height, const UndoData& data) override;
   void ReleaseUndoData (const uint256& hash) override;
   void PruneUndoData (unsigned height) override;
+  unsigned PruneUndoDataRange (unsigned height, unsigned limit) override;
 
   void BeginTransaction () override;
   void CommitTransaction () override;
   void RollbackTransaction () override;
 
+  /**
+   * Enables deferred syncing.  This is only supported for databases
+   * in WAL mode.
+   */
+  bool SetDeferredSync (bool enable) override;
+  void SyncCommitted () override;
+
+  /**
+   * Returns statistics about the read snapshots.
+   */
+  SnapshotStats GetSnapshotStats () const;
+
+};
+
+/**
+ * Deleter for SQLiteStorage::Snapshot, which hands the connection
+ * back to the storage it was leased from.
+ */
+class SQLiteStorage::SnapshotLease
+{
+
+private:
+
+  /** The storage the snapshot belongs to.  */
+  const SQLiteStorage* storage = nullptr;
+
+  /** Whether the connection is owned by the pool.  */
+  bool pooled = false;
+
+  /** When the lease started.  */
+  std::chrono::steady_clock::time_point start;
+
+  friend class SQLiteStorage;
+
+public:
+
+  SnapshotLease () = default;
+
+  void operator() (SQLiteDatabase* snapshot) const;
+
 };
 
 } // namespace spacexpanse
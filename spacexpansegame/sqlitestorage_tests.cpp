@@ -19,6 +19,7 @@
 #include <memory>
 #include <thread>
 
+DECLARE_int32 (spacexpanse_sqlite_snapshot_pool);
 DECLARE_int32 (spacexpanse_sqlite_wal_truncate_ms);
 
 namespace spacexpanse
@@ -277,6 +278,110 @@ TEST_F (SQLiteStatementTests, ConcurrentStatementUse)
   CHECK (after - before < 2 * waitTime);
 }
 
+TEST_F (SQLiteStatementTests, RegisteredStatements)
+{
+  const std::string insertSql = R"(
+    INSERT INTO `test` (`int`) VALUES (?1)
+  )";
+  const std::string selectSql = R"(
+    SELECT `int`
+      FROM `test`
+      ORDER BY `int`
+  )";
+
+  const auto insertId = SQLiteDatabase::RegisterStatement (insertSql);
+  const auto selectId = SQLiteDatabase::RegisterStatement (selectSql);
+  EXPECT_NE (insertId, selectId);
+  EXPECT_EQ (SQLiteDatabase::RegisterStatement (insertSql), insertId);
+
+  for (int i = 1; i <= 3; ++i)
+    {
+      auto stmt = db.Prepare (insertId);
+      stmt.Bind (1, i);
+      stmt.Execute ();
+    }
+
+  /* Using the same registered statement twice at the same time should
+     yield two independent statements.  */
+  auto stmt1 = db.PrepareRo (selectId);
+  ASSERT_TRUE (stmt1.Step ());
+  ASSERT_EQ (stmt1.Get<int64_t> (0), 1);
+
+  auto stmt2 = db.PrepareRo (selectId);
+  for (int j = 1; j <= 3; ++j)
+    {
+      ASSERT_TRUE (stmt2.Step ());
+      ASSERT_EQ (stmt2.Get<int64_t> (0), j);
+    }
+  ASSERT_FALSE (stmt2.Step ());
+
+  ASSERT_TRUE (stmt1.Step ());
+  ASSERT_EQ (stmt1.Get<int64_t> (0), 2);
+
+  /* Registered statements share the cache with preparing by string.  */
+  auto stmt3 = db.PrepareRo (selectSql);
+  ASSERT_TRUE (stmt3.Step ());
+  ASSERT_EQ (stmt3.Get<int64_t> (0), 1);
+}
+
+TEST_F (SQLiteStatementTests, ConcurrentRegisteredUse)
+{
+  constexpr unsigned numThreads = 10;
+  constexpr unsigned numQueries = 100;
+
+  db.Execute (R"(
+    INSERT INTO `test` (`int`) VALUES (1), (2), (3)
+  )");
+
+  const auto id = SQLiteDatabase::RegisterStatement (R"(
+    SELECT SUM(`int`)
+      FROM `test`
+  )");
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < numThreads; ++i)
+    threads.emplace_back ([this, id] ()
+      {
+        for (unsigned j = 0; j < numQueries; ++j)
+          {
+            auto stmt = db.PrepareRo (id);
+            ASSERT_TRUE (stmt.Step ());
+            ASSERT_EQ (stmt.Get<int64_t> (0), 6);
+            ASSERT_FALSE (stmt.Step ());
+          }
+      });
+  for (auto& t : threads)
+    t.join ();
+
+  const auto stats = db.GetStatementCacheStats ();
+  EXPECT_GT (stats.registeredHits, 0u);
+  EXPECT_LE (stats.misses, numThreads + 1);
+}
+
+TEST_F (SQLiteStatementTests, CacheStats)
+{
+  const auto before = db.GetStatementCacheStats ();
+
+  const std::string sql = "SELECT COUNT(*) FROM `test`";
+  const auto id = SQLiteDatabase::RegisterStatement (sql);
+
+  EXPECT_TRUE (db.PrepareRo (sql).Step ());
+  EXPECT_TRUE (db.PrepareRo (sql).Step ());
+  EXPECT_TRUE (db.PrepareRo (id).Step ());
+  EXPECT_TRUE (db.PrepareRo (id).Step ());
+
+  const auto after = db.GetStatementCacheStats ();
+  EXPECT_EQ (after.misses - before.misses, 1u);
+  EXPECT_EQ (after.hits - before.hits, 3u);
+  EXPECT_EQ (after.registeredHits - before.registeredHits, 1u);
+
+  SQLiteDatabase::StatementCacheStats stats;
+  EXPECT_EQ (stats.GetHitRate (), 0.0);
+  stats.hits = 3;
+  stats.misses = 1;
+  EXPECT_EQ (stats.GetHitRate (), 0.75);
+}
+
 /* ************************************************************************** */
 
 /**
@@ -344,6 +449,50 @@ TEST_F (PersistentSQLiteStorageTests, PersistsData)
   }
 }
 
+TEST_F (PersistentSQLiteStorageTests, DeferredSync)
+{
+  {
+    SQLiteStorage storage(filename);
+    storage.Initialise ();
+    ASSERT_TRUE (storage.SetDeferredSync (true));
+
+    storage.BeginTransaction ();
+    storage.SetCurrentGameState (hash, state);
+    storage.AddUndoData (hash, 42, undo);
+    storage.CommitTransaction ();
+
+    /* The next transaction can run while the previous one is synced.  */
+    storage.BeginTransaction ();
+    std::thread syncer([&storage] () { storage.SyncCommitted (); });
+    storage.ReleaseUndoData (hash);
+    storage.RollbackTransaction ();
+    syncer.join ();
+
+    storage.SetDeferredSync (false);
+  }
+
+  {
+    SQLiteStorage storage(filename);
+    storage.Initialise ();
+
+    uint256 h;
+    ASSERT_TRUE (storage.GetCurrentBlockHash (h));
+    EXPECT_TRUE (h == hash);
+    EXPECT_EQ (storage.GetCurrentGameState (), state);
+
+    UndoData val;
+    ASSERT_TRUE (storage.GetUndoData (hash, val));
+    EXPECT_EQ (val, undo);
+  }
+}
+
+TEST (SQLiteStorageTests, NoDeferredSyncInMemory)
+{
+  InMemorySQLiteStorage storage;
+  storage.Initialise ();
+  EXPECT_FALSE (storage.SetDeferredSync (true));
+}
+
 TEST_F (PersistentSQLiteStorageTests, ClearWithOnDiskFile)
 {
   SQLiteStorage storage(filename);
@@ -511,6 +660,87 @@ TEST_F (SQLiteStorageSnapshotTests, StatementsMustAllBeDestructed)
   EXPECT_DEATH (s.reset (), "statement is still in use");
 }
 
+TEST_F (SQLiteStorageSnapshotTests, PooledConnectionsAreReused)
+{
+  Storage storage(filename);
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash, "first");
+  storage.CommitTransaction ();
+
+  auto s = storage.GetSnapshot ();
+  ExpectDatabaseState (*s, "first");
+  const SQLiteDatabase* conn = s.get ();
+  s.reset ();
+
+  /* A reused connection sees the state committed at the time it is
+     leased again, and its statement cache is still warm.  */
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash, "second");
+  storage.CommitTransaction ();
+
+  s = storage.GetSnapshot ();
+  EXPECT_EQ (s.get (), conn);
+  const auto cacheBefore = s->GetStatementCacheStats ();
+  ExpectDatabaseState (*s, "second");
+  const auto cacheAfter = s->GetStatementCacheStats ();
+  EXPECT_EQ (cacheAfter.misses, cacheBefore.misses);
+  EXPECT_EQ (cacheAfter.hits, cacheBefore.hits + 1);
+
+  auto stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.poolSize, 1u);
+  EXPECT_EQ (stats.idle, 0u);
+  EXPECT_EQ (stats.leased, 1u);
+  EXPECT_EQ (stats.leases, 2u);
+  EXPECT_EQ (stats.reused, 1u);
+  EXPECT_EQ (stats.overflow, 0u);
+
+  s.reset ();
+  stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.idle, 1u);
+  EXPECT_EQ (stats.leased, 0u);
+}
+
+TEST_F (SQLiteStorageSnapshotTests, PoolOverflow)
+{
+  gflags::FlagSaver flags;
+  FLAGS_spacexpanse_sqlite_snapshot_pool = 1;
+
+  Storage storage(filename);
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash, "state");
+  storage.CommitTransaction ();
+
+  auto s1 = storage.GetSnapshot ();
+  auto s2 = storage.GetSnapshot ();
+  ExpectDatabaseState (*s1, "state");
+  ExpectDatabaseState (*s2, "state");
+
+  auto stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.poolSize, 1u);
+  EXPECT_EQ (stats.leased, 2u);
+  EXPECT_EQ (stats.overflow, 1u);
+
+  s1.reset ();
+  s2.reset ();
+  stats = storage.GetSnapshotStats ();
+  EXPECT_EQ (stats.poolSize, 1u);
+  EXPECT_EQ (stats.idle, 1u);
+  EXPECT_EQ (stats.leased, 0u);
+  EXPECT_EQ (stats.leases, 2u);
+
+  /* Clearing the storage closes the pooled connections, so that they do
+     not refer to the removed database file.  */
+  storage.Clear ();
+  EXPECT_EQ (storage.GetSnapshotStats ().poolSize, 0u);
+
+  auto s3 = storage.GetSnapshot ();
+  ExpectDatabaseState (*s3, "");
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
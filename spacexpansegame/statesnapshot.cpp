@@ -0,0 +1,54 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "statesnapshot.hpp"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <utility>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+StateSnapshot::StateSnapshot (const uint256& h, const unsigned ht,
+                              SharedGameStateData s,
+                              const JsonConverter& conv)
+  : hash(h), height(ht), state(std::move (s)), toJson(conv)
+{
+  CHECK (state != nullptr);
+}
+
+const Json::Value&
+StateSnapshot::GetJson () const
+{
+  CHECK (HasJson ()) << "No JSON converter set for the state snapshot";
+
+  /* If the converter throws, then the flag is not set and the next
+     caller will try again.  */
+  std::call_once (jsonComputed, [this] ()
+    {
+      json = toJson (*state);
+    });
+
+  return json;
+}
+
+void
+SnapshotPublisher::Publish (std::shared_ptr<const StateSnapshot> snapshot)
+{
+  std::atomic_store_explicit (&current, std::move (snapshot),
+                              std::memory_order_release);
+}
+
+std::shared_ptr<const StateSnapshot>
+SnapshotPublisher::Get () const
+{
+  return std::atomic_load_explicit (&current, std::memory_order_acquire);
+}
+
+} // namespace internal
+} // namespace spacexpanse
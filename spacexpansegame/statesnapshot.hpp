@@ -0,0 +1,159 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_STATESNAPSHOT_HPP
+#define SPACEXPANSEGAME_STATESNAPSHOT_HPP
+
+#include "storage.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <json/json.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/**
+ * An immutable copy of the current game state together with the block
+ * it corresponds to.  Game publishes a new instance of this after each
+ * processed block, so that readers can access the state without having
+ * to lock the Game instance (and thus without blocking on the block
+ * processing that is going on at the same time).
+ *
+ * If a converter function is given, then the JSON form of the state is
+ * computed lazily (at most once) when it is first requested.
+ */
+class StateSnapshot
+{
+
+public:
+
+  /**
+   * Function that converts the game state to JSON.  It is called without
+   * any locks held, so it must depend only on the passed-in state and be
+   * thread-safe.
+   */
+  using JsonConverter = std::function<Json::Value (const GameStateData& state)>;
+
+private:
+
+  /** The block hash of this state.  */
+  const uint256 hash;
+
+  /** The block height of this state.  */
+  const unsigned height;
+
+  /**
+   * The game state data itself.  It is shared with the storage (if that
+   * supports it), so that publishing a snapshot does not copy the state.
+   */
+  const SharedGameStateData state;
+
+  /** The converter to JSON, if any.  */
+  const JsonConverter toJson;
+
+  /** Flag used to compute the JSON form exactly once.  */
+  mutable std::once_flag jsonComputed;
+
+  /** The JSON form of the state, once computed.  */
+  mutable Json::Value json;
+
+public:
+
+  explicit StateSnapshot (const uint256& h, unsigned ht,
+                          SharedGameStateData s, const JsonConverter& conv);
+
+  explicit StateSnapshot (const uint256& h, const unsigned ht,
+                          const GameStateData& s, const JsonConverter& conv)
+    : StateSnapshot(h, ht, std::make_shared<const GameStateData> (s), conv)
+  {}
+
+  StateSnapshot () = delete;
+  StateSnapshot (const StateSnapshot&) = delete;
+  void operator= (const StateSnapshot&) = delete;
+
+  const uint256&
+  GetHash () const
+  {
+    return hash;
+  }
+
+  unsigned
+  GetHeight () const
+  {
+    return height;
+  }
+
+  const GameStateData&
+  GetState () const
+  {
+    return *state;
+  }
+
+  /**
+   * Returns true if a JSON converter is set, i.e. if GetJson can be used.
+   */
+  bool
+  HasJson () const
+  {
+    return toJson != nullptr;
+  }
+
+  /**
+   * Returns the JSON form of the game state.  It is computed on the first
+   * call (by whichever thread comes first), and then reused.  Must only be
+   * called if HasJson returns true.
+   */
+  const Json::Value& GetJson () const;
+
+};
+
+/**
+ * Holder for the currently published StateSnapshot.  The writer replaces
+ * the snapshot with Publish, while any number of readers may retrieve
+ * the current one concurrently.  A retrieved snapshot stays valid for as
+ * long as the reader holds on to it, even if newer ones are published
+ * in the mean time.
+ */
+class SnapshotPublisher
+{
+
+private:
+
+  /**
+   * The current snapshot.  This is only accessed through the atomic
+   * functions for std::shared_ptr.
+   */
+  std::shared_ptr<const StateSnapshot> current;
+
+public:
+
+  SnapshotPublisher () = default;
+
+  SnapshotPublisher (const SnapshotPublisher&) = delete;
+  void operator= (const SnapshotPublisher&) = delete;
+
+  /**
+   * Publishes a new snapshot, replacing the current one.  It may be null
+   * to indicate that there is no current state.
+   */
+  void Publish (std::shared_ptr<const StateSnapshot> snapshot);
+
+  /**
+   * Returns the current snapshot, which may be null if there is none.
+   */
+  std::shared_ptr<const StateSnapshot> Get () const;
+
+};
+
+} // namespace internal
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_STATESNAPSHOT_HPP
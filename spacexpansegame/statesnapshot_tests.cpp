@@ -0,0 +1,177 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "statesnapshot.hpp"
+
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace spacexpanse
+{
+namespace internal
+{
+namespace
+{
+
+class StateSnapshotTests : public testing::Test
+{
+
+protected:
+
+  /** Number of times the converter has been called.  */
+  std::atomic<unsigned> conversions;
+
+  /** Converter that we use for the tests.  */
+  StateSnapshot::JsonConverter converter;
+
+  StateSnapshotTests ()
+  {
+    conversions = 0;
+    converter = [this] (const GameStateData& state)
+      {
+        ++conversions;
+        Json::Value res(Json::objectValue);
+        res["state"] = state;
+        return res;
+      };
+  }
+
+};
+
+TEST_F (StateSnapshotTests, BasicData)
+{
+  const StateSnapshot snapshot(BlockHash (10), 10, "foo", nullptr);
+  EXPECT_EQ (snapshot.GetHash (), BlockHash (10));
+  EXPECT_EQ (snapshot.GetHeight (), 10);
+  EXPECT_EQ (snapshot.GetState (), "foo");
+  EXPECT_FALSE (snapshot.HasJson ());
+}
+
+TEST_F (StateSnapshotTests, JsonComputedOnce)
+{
+  const StateSnapshot snapshot(BlockHash (10), 10, "foo", converter);
+  ASSERT_TRUE (snapshot.HasJson ());
+  EXPECT_EQ (conversions, 0);
+
+  EXPECT_EQ (snapshot.GetJson (), ParseJson (R"({"state": "foo"})"));
+  EXPECT_EQ (snapshot.GetJson (), ParseJson (R"({"state": "foo"})"));
+  EXPECT_EQ (conversions, 1);
+}
+
+TEST_F (StateSnapshotTests, JsonComputedOnceInParallel)
+{
+  const StateSnapshot snapshot(BlockHash (10), 10, "foo", converter);
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < 10; ++i)
+    threads.emplace_back ([&snapshot] ()
+      {
+        EXPECT_EQ (snapshot.GetJson ()["state"], "foo");
+      });
+  for (auto& t : threads)
+    t.join ();
+
+  EXPECT_EQ (conversions, 1);
+}
+
+TEST_F (StateSnapshotTests, ConverterThrows)
+{
+  bool shouldThrow = true;
+  const StateSnapshot snapshot(BlockHash (10), 10, "foo",
+      [&shouldThrow] (const GameStateData& state)
+      {
+        if (shouldThrow)
+          throw std::runtime_error ("failed");
+        return Json::Value (state);
+      });
+
+  EXPECT_THROW (snapshot.GetJson (), std::runtime_error);
+  shouldThrow = false;
+  EXPECT_EQ (snapshot.GetJson (), "foo");
+}
+
+TEST_F (StateSnapshotTests, NoConverter)
+{
+  const StateSnapshot snapshot(BlockHash (10), 10, "foo", nullptr);
+  EXPECT_DEATH (snapshot.GetJson (), "No JSON converter");
+}
+
+TEST (SnapshotPublisherTests, Empty)
+{
+  SnapshotPublisher publisher;
+  EXPECT_EQ (publisher.Get (), nullptr);
+}
+
+TEST (SnapshotPublisherTests, PublishAndReplace)
+{
+  SnapshotPublisher publisher;
+
+  publisher.Publish (std::make_shared<StateSnapshot> (BlockHash (10), 10,
+                                                      "foo", nullptr));
+  const auto first = publisher.Get ();
+  ASSERT_NE (first, nullptr);
+  EXPECT_EQ (first->GetState (), "foo");
+
+  publisher.Publish (std::make_shared<StateSnapshot> (BlockHash (11), 11,
+                                                      "bar", nullptr));
+  const auto second = publisher.Get ();
+  ASSERT_NE (second, nullptr);
+  EXPECT_EQ (second->GetState (), "bar");
+
+  /* The old snapshot is still valid for its holder.  */
+  EXPECT_EQ (first->GetState (), "foo");
+  EXPECT_EQ (first->GetHash (), BlockHash (10));
+
+  publisher.Publish (nullptr);
+  EXPECT_EQ (publisher.Get (), nullptr);
+}
+
+TEST (SnapshotPublisherTests, ConcurrentReaders)
+{
+  constexpr unsigned numBlocks = 1'000;
+
+  SnapshotPublisher publisher;
+  publisher.Publish (std::make_shared<StateSnapshot> (BlockHash (0), 0,
+                                                      "0", nullptr));
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  for (unsigned i = 0; i < 4; ++i)
+    readers.emplace_back ([&] ()
+      {
+        unsigned lastHeight = 0;
+        while (!done)
+          {
+            const auto snapshot = publisher.Get ();
+            ASSERT_NE (snapshot, nullptr);
+            EXPECT_GE (snapshot->GetHeight (), lastHeight);
+            EXPECT_EQ (snapshot->GetState (),
+                       std::to_string (snapshot->GetHeight ()));
+            lastHeight = snapshot->GetHeight ();
+          }
+      });
+
+  for (unsigned h = 1; h <= numBlocks; ++h)
+    publisher.Publish (std::make_shared<StateSnapshot> (
+        BlockHash (h), h, std::to_string (h), nullptr));
+
+  done = true;
+  for (auto& t : readers)
+    t.join ();
+
+  EXPECT_EQ (publisher.Get ()->GetHeight (), numBlocks);
+}
+
+} // anonymous namespace
+} // namespace internal
+} // namespace spacexpanse
@@ -6,6 +6,8 @@
 
 #include <glog/logging.h>
 
+#include <cstring>
+
 namespace spacexpanse
 {
 
@@ -15,6 +17,51 @@ StorageInterface::Initialise ()
   /* Nothing is done here, but can be overridden by subclasses.  */
 }
 
+void
+StorageInterface::SetCurrentGameStateWithHeight (const uint256& hash,
+                                                 const unsigned height,
+                                                 const GameStateData& data)
+{
+  /* By default, the height is not persisted.  */
+  SetCurrentGameState (hash, data);
+}
+
+SharedGameStateData
+StorageInterface::GetCurrentGameStateShared () const
+{
+  return std::make_shared<const GameStateData> (GetCurrentGameState ());
+}
+
+void
+StorageInterface::SetCurrentGameStateShared (const uint256& hash,
+                                             const unsigned height,
+                                             const SharedGameStateData& data)
+{
+  CHECK (data != nullptr);
+  SetCurrentGameStateWithHeight (hash, height, *data);
+}
+
+bool
+StorageInterface::GetCurrentBlockHeight (unsigned& height) const
+{
+  return false;
+}
+
+bool
+StorageInterface::GetBlockHeight (const uint256& hash, unsigned& height) const
+{
+  return false;
+}
+
+unsigned
+StorageInterface::PruneUndoDataRange (const unsigned height,
+                                      const unsigned limit)
+{
+  CHECK_GT (limit, 0);
+  PruneUndoData (height);
+  return 0;
+}
+
 void
 StorageInterface::BeginTransaction ()
 {
@@ -33,13 +80,199 @@ StorageInterface::RollbackTransaction ()
   /* Nothing is done in the default implementation.  */
 }
 
+bool
+StorageInterface::SetDeferredSync (const bool enable)
+{
+  return false;
+}
+
+void
+StorageInterface::SyncCommitted ()
+{
+  /* Nothing is done in the default implementation.  */
+}
+
+/* ************************************************************************** */
+
+constexpr size_t MemoryStorage::UNDO_SLAB_SIZE;
+
+namespace
+{
+
+/**
+ * Blobs larger than this get their own slab in the undo arena, so that
+ * they do not waste the rest of a normal slab.
+ */
+constexpr size_t DEDICATED_SLAB_THRESHOLD = MemoryStorage::UNDO_SLAB_SIZE / 4;
+
+} // anonymous namespace
+
+size_t
+MemoryStorage::UndoArena::AllocateSlab (const size_t capacity)
+{
+  size_t index;
+  if (freeSlabs.empty ())
+    {
+      index = slabs.size ();
+      slabs.emplace_back ();
+    }
+  else
+    {
+      index = freeSlabs.back ();
+      freeSlabs.pop_back ();
+    }
+
+  Slab& slab = slabs[index];
+  CHECK_EQ (slab.live, 0);
+  if (slab.capacity != capacity)
+    {
+      allocated -= slab.capacity;
+      slab.data.reset (new char[capacity]);
+      slab.capacity = capacity;
+      allocated += capacity;
+    }
+  slab.used = 0;
+
+  return index;
+}
+
+void
+MemoryStorage::UndoArena::FreeSlab (const size_t index)
+{
+  Slab& slab = slabs[index];
+  CHECK_EQ (slab.live, 0);
+  slab.used = 0;
+
+  /* Keep the memory of one normal slab around, so that we do not have
+     to allocate again right away when the current slab is full.  */
+  bool keep = (slab.capacity == UNDO_SLAB_SIZE);
+  for (const size_t i : freeSlabs)
+    if (slabs[i].capacity > 0)
+      keep = false;
+
+  if (!keep)
+    {
+      allocated -= slab.capacity;
+      slab.data.reset ();
+      slab.capacity = 0;
+    }
+
+  freeSlabs.push_back (index);
+}
+
+MemoryStorage::UndoArena::Ref
+MemoryStorage::UndoArena::Store (const std::string& data)
+{
+  Ref res;
+  res.size = data.size ();
+  if (res.size == 0)
+    {
+      res.slab = 0;
+      res.offset = 0;
+      return res;
+    }
+
+  if (res.size > DEDICATED_SLAB_THRESHOLD)
+    res.slab = AllocateSlab (res.size);
+  else
+    {
+      /* The previous current slab is not empty (otherwise it would have
+         been reset when its last blob was released).  It will be freed
+         once all blobs in it are released.  */
+      if (!hasCurrent
+            || slabs[current].used + res.size > slabs[current].capacity)
+        {
+          current = AllocateSlab (UNDO_SLAB_SIZE);
+          hasCurrent = true;
+        }
+      res.slab = current;
+    }
+
+  Slab& slab = slabs[res.slab];
+  res.offset = slab.used;
+  std::memcpy (slab.data.get () + res.offset, data.data (), res.size);
+  slab.used += res.size;
+  slab.live += res.size;
+
+  return res;
+}
+
+void
+MemoryStorage::UndoArena::Read (const Ref& ref, std::string& out) const
+{
+  if (ref.size == 0)
+    {
+      out.clear ();
+      return;
+    }
+
+  const Slab& slab = slabs[ref.slab];
+  CHECK_LE (ref.offset + ref.size, slab.used);
+  out.assign (slab.data.get () + ref.offset, ref.size);
+}
+
+void
+MemoryStorage::UndoArena::Release (const Ref& ref)
+{
+  if (ref.size == 0)
+    return;
+
+  Slab& slab = slabs[ref.slab];
+  CHECK_GE (slab.live, ref.size);
+  slab.live -= ref.size;
+  if (slab.live > 0)
+    return;
+
+  /* If the current slab becomes empty, we can simply start filling it
+     from the beginning again.  */
+  if (hasCurrent && ref.slab == current)
+    slab.used = 0;
+  else
+    FreeSlab (ref.slab);
+}
+
+void
+MemoryStorage::UndoArena::TrimSpare ()
+{
+  for (const size_t i : freeSlabs)
+    {
+      Slab& slab = slabs[i];
+      allocated -= slab.capacity;
+      slab.data.reset ();
+      slab.capacity = 0;
+    }
+}
+
+void
+MemoryStorage::UndoArena::Clear ()
+{
+  slabs.clear ();
+  freeSlabs.clear ();
+  hasCurrent = false;
+  allocated = 0;
+}
+
+/* ************************************************************************** */
+
 void
 MemoryStorage::Clear ()
 {
   CHECK (!startedTxn);
 
   hasState = false;
+  hasHeight = false;
+  currentState.reset ();
   undoData.clear ();
+  undoOrder.clear ();
+  arena.Clear ();
+}
+
+void
+MemoryStorage::SetUndoMemoryLimit (const size_t bytes)
+{
+  LOG (INFO) << "Limiting memory for undo data to " << bytes << " bytes";
+  undoLimit = bytes;
+  EnforceUndoLimit ();
 }
 
 bool
@@ -54,6 +287,13 @@ MemoryStorage::GetCurrentBlockHash (uint256& hash) const
 
 GameStateData
 MemoryStorage::GetCurrentGameState () const
+{
+  CHECK (hasState);
+  return *currentState;
+}
+
+SharedGameStateData
+MemoryStorage::GetCurrentGameStateShared () const
 {
   CHECK (hasState);
   return currentState;
@@ -66,10 +306,80 @@ MemoryStorage::SetCurrentGameState (const uint256& hash,
   CHECK (startedTxn);
 
   hasState = true;
+  hasHeight = false;
+  currentBlock = hash;
+  currentState = std::make_shared<const GameStateData> (data);
+}
+
+void
+MemoryStorage::SetCurrentGameState (const uint256& hash, GameStateData&& data)
+{
+  CHECK (startedTxn);
+
+  hasState = true;
+  hasHeight = false;
   currentBlock = hash;
+  currentState = std::make_shared<const GameStateData> (std::move (data));
+}
+
+void
+MemoryStorage::SetCurrentGameStateWithHeight (const uint256& hash,
+                                              const unsigned height,
+                                              const GameStateData& data)
+{
+  SetCurrentGameState (hash, data);
+
+  hasHeight = true;
+  currentHeight = height;
+}
+
+void
+MemoryStorage::SetCurrentGameStateWithHeight (const uint256& hash,
+                                              const unsigned height,
+                                              GameStateData&& data)
+{
+  SetCurrentGameState (hash, std::move (data));
+
+  hasHeight = true;
+  currentHeight = height;
+}
+
+void
+MemoryStorage::SetCurrentGameStateShared (const uint256& hash,
+                                          const unsigned height,
+                                          const SharedGameStateData& data)
+{
+  CHECK (startedTxn);
+  CHECK (data != nullptr);
+
+  hasState = true;
+  hasHeight = true;
+  currentBlock = hash;
+  currentHeight = height;
   currentState = data;
 }
 
+bool
+MemoryStorage::GetCurrentBlockHeight (unsigned& height) const
+{
+  if (!hasState || !hasHeight)
+    return false;
+
+  height = currentHeight;
+  return true;
+}
+
+bool
+MemoryStorage::GetBlockHeight (const uint256& hash, unsigned& height) const
+{
+  const auto mit = undoData.find (hash);
+  if (mit == undoData.end ())
+    return false;
+
+  height = mit->second.height;
+  return true;
+}
+
 bool
 MemoryStorage::GetUndoData (const uint256& hash, UndoData& data) const
 {
@@ -77,7 +387,7 @@ MemoryStorage::GetUndoData (const uint256& hash, UndoData& data) const
   if (mit == undoData.end ())
     return false;
 
-  data = mit->second.data;
+  arena.Read (mit->second.ref, data);
   return true;
 }
 
@@ -87,15 +397,84 @@ MemoryStorage::AddUndoData (const uint256& hash,
 {
   CHECK (startedTxn);
 
-  HeightAndUndoData heightAndData = {height, data};
-  undoData.emplace (hash, std::move (heightAndData));
+  /* If there is already data for the hash, it is equivalent and we can
+     just keep it.  */
+  if (undoData.count (hash) > 0)
+    return;
+
+  UndoEntry entry;
+  entry.height = height;
+  entry.ref = arena.Store (data);
+  entry.seq = nextSeq++;
+  undoData.emplace (hash, entry);
+  undoOrder.emplace_back (entry.seq, hash);
+
+  EnforceUndoLimit ();
+}
+
+MemoryStorage::UndoMap::iterator
+MemoryStorage::EraseUndo (const UndoMap::iterator it)
+{
+  arena.Release (it->second.ref);
+  return undoData.erase (it);
+}
+
+void
+MemoryStorage::CompactUndoOrder ()
+{
+  constexpr size_t MIN_SIZE = 1'024;
+  if (undoOrder.size () < MIN_SIZE || undoOrder.size () < 2 * undoData.size ())
+    return;
+
+  std::deque<std::pair<uint64_t, uint256>> compacted;
+  for (auto& e : undoOrder)
+    {
+      const auto mit = undoData.find (e.second);
+      if (mit != undoData.end () && mit->second.seq == e.first)
+        compacted.push_back (std::move (e));
+    }
+
+  undoOrder = std::move (compacted);
+}
+
+void
+MemoryStorage::EnforceUndoLimit ()
+{
+  if (undoLimit == 0)
+    return;
+
+  while (arena.GetAllocatedBytes () > undoLimit)
+    {
+      arena.TrimSpare ();
+      if (arena.GetAllocatedBytes () <= undoLimit || undoData.size () <= 1)
+        break;
+
+      CHECK (!undoOrder.empty ());
+      const auto front = undoOrder.front ();
+      undoOrder.pop_front ();
+
+      const auto mit = undoData.find (front.second);
+      if (mit == undoData.end () || mit->second.seq != front.first)
+        continue;
+
+      VLOG (1)
+          << "Evicting undo data for height " << mit->second.height
+          << " due to the memory limit";
+      EraseUndo (mit);
+      ++evicted;
+    }
 }
 
 void
 MemoryStorage::ReleaseUndoData (const uint256& hash)
 {
   CHECK (startedTxn);
-  undoData.erase (hash);
+
+  const auto mit = undoData.find (hash);
+  if (mit != undoData.end ())
+    EraseUndo (mit);
+
+  CompactUndoOrder ();
 }
 
 void
@@ -103,11 +482,52 @@ MemoryStorage::PruneUndoData (const unsigned height)
 {
   CHECK (startedTxn);
 
-  for (auto it = undoData.cbegin (); it != undoData.cend (); )
+  for (auto it = undoData.begin (); it != undoData.end (); )
     if (it->second.height <= height)
-      it = undoData.erase (it);
+      it = EraseUndo (it);
     else
       ++it;
+
+  CompactUndoOrder ();
+}
+
+unsigned
+MemoryStorage::PruneUndoDataRange (const unsigned height, const unsigned limit)
+{
+  CHECK (startedTxn);
+  CHECK_GT (limit, 0);
+
+  /* We walk the entries in the order they were added, which (apart from
+     reorgs) is also by height.  Thus the entries to prune are usually at
+     the front, where they (and stale elements) are dropped right away.
+     This way each chunk only looks at the entries it actually removes,
+     rather than starting from scratch on the whole map.  */
+  unsigned removed = 0;
+  size_t i = 0;
+  while (i < undoOrder.size () && removed < limit)
+    {
+      const auto& e = undoOrder[i];
+      const auto mit = undoData.find (e.second);
+      if (mit != undoData.end () && mit->second.seq == e.first)
+        {
+          if (mit->second.height > height)
+            {
+              ++i;
+              continue;
+            }
+
+          EraseUndo (mit);
+          ++removed;
+        }
+
+      if (i == 0)
+        undoOrder.pop_front ();
+      else
+        ++i;
+    }
+
+  CompactUndoOrder ();
+  return removed;
 }
 
 void
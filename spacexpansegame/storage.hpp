@@ -7,9 +7,15 @@
 
 #include <spacexpanseutil/uint256.hpp>
 
+#include <cstdint>
+#include <deque>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -24,6 +30,50 @@ using GameStateData = std::string;
 /** The game-specific undo data for a block.  */
 using UndoData = std::string;
 
+/**
+ * Immutable, reference-counted handle to game-state data.  This is used to
+ * pass the state between the storage, the game logic and readers (like
+ * published snapshots) without copying the underlying bytes.
+ */
+using SharedGameStateData = std::shared_ptr<const GameStateData>;
+
+/**
+ * Read-only view of the current state in a storage at a fixed point in time.
+ * Snapshots can be used from other threads while the storage itself is
+ * being updated, and they keep seeing the data as it was when the snapshot
+ * was created (without any uncommitted changes of the writer).
+ */
+class StorageSnapshot
+{
+
+public:
+
+  StorageSnapshot () = default;
+  virtual ~StorageSnapshot () = default;
+
+  StorageSnapshot (const StorageSnapshot&) = delete;
+  void operator= (const StorageSnapshot&) = delete;
+
+  /**
+   * Retrieves the block hash of the snapshot's current game state.
+   * Returns false if there is no current state.
+   */
+  virtual bool GetCurrentBlockHash (uint256& hash) const = 0;
+
+  /**
+   * Retrieves the snapshot's current game state.  Must not be called
+   * if there is none.
+   */
+  virtual GameStateData GetCurrentGameState () const = 0;
+
+  /**
+   * Retrieves the block height of the snapshot's current state, if it
+   * is known.
+   */
+  virtual bool GetCurrentBlockHeight (unsigned& height) const = 0;
+
+};
+
 /**
  * Interface for the storage layer used by the game.  This is used to
  * hold undo data for every block in the currently active chain as well
@@ -70,12 +120,72 @@ public:
    */
   virtual GameStateData GetCurrentGameState () const = 0;
 
+  /**
+   * Retrieves the current game state as shared handle.  Must not be called
+   * if there is no current state.  The default implementation wraps the
+   * result of GetCurrentGameState, but storages that keep the state
+   * in memory can return their own handle without copying it.
+   */
+  virtual SharedGameStateData GetCurrentGameStateShared () const;
+
+  /**
+   * Returns a read-only snapshot of the committed state, which can be read
+   * from other threads while the storage is being updated.  Returns null
+   * if the storage does not support snapshots, which is what the default
+   * implementation does.
+   */
+  virtual std::unique_ptr<StorageSnapshot>
+  GetReadSnapshot () const
+  {
+    return nullptr;
+  }
+
   /**
    * Updates the current game state and associated block hash.
    */
   virtual void SetCurrentGameState (const uint256& hash,
                                     const GameStateData& data) = 0;
 
+  /**
+   * Updates the current game state and associated block hash, and also
+   * gives the storage the chance to persist the block height.  If that
+   * is done, then the height can later be returned from
+   * GetCurrentBlockHeight, which avoids a round-trip to the blockchain
+   * daemon for looking it up.
+   *
+   * By default, the height is ignored and SetCurrentGameState is called.
+   * Implementations that override it should make sure that a later call
+   * to SetCurrentGameState (without height) removes the stored height.
+   */
+  virtual void SetCurrentGameStateWithHeight (const uint256& hash,
+                                              unsigned height,
+                                              const GameStateData& data);
+
+  /**
+   * Updates the current game state, block hash and height from a shared
+   * handle.  The default implementation calls SetCurrentGameStateWithHeight,
+   * but storages that keep the state in memory can retain the handle
+   * instead of copying the data.
+   */
+  virtual void SetCurrentGameStateShared (const uint256& hash, unsigned height,
+                                          const SharedGameStateData& data);
+
+  /**
+   * Retrieves the block height associated to the current game state, if
+   * it has been persisted through SetCurrentGameStateWithHeight.  Returns
+   * false if there is no current state or no known height for it.  This is
+   * what the default implementation does.
+   */
+  virtual bool GetCurrentBlockHeight (unsigned& height) const;
+
+  /**
+   * Looks up the height of a block for which undo data is currently stored,
+   * based on the height that has been passed to AddUndoData.  Returns false
+   * if the height is not known (which is what the default implementation
+   * does always).
+   */
+  virtual bool GetBlockHeight (const uint256& hash, unsigned& height) const;
+
   /**
    * Retrieves undo data for the given block hash.  Returns false if none is
    * stored with that key.
@@ -118,6 +228,18 @@ public:
        future (because the blocks involved have many confirmations).  */
   }
 
+  /**
+   * Releases undo data with heights up to (including) the given height
+   * like PruneUndoData, but removes at most limit entries.  This allows
+   * callers to prune a large backlog in bounded chunks, each in its own
+   * transaction.  Returns the number of entries removed.  If that is less
+   * than limit, then no more undo data up to height remains.
+   *
+   * The default implementation prunes everything with PruneUndoData and
+   * returns zero, which is fine for storages where that is cheap.
+   */
+  virtual unsigned PruneUndoDataRange (unsigned height, unsigned limit);
+
   /**
    * Tells the storage that a change to the state is about to be made
    * (because a new block is being attached or detached).
@@ -147,6 +269,29 @@ public:
    */
   virtual void RollbackTransaction ();
 
+  /**
+   * Asks the storage to enable or disable deferred syncing.  With it,
+   * CommitTransaction does not wait for the data to be flushed to disk.
+   * Instead, SyncCommitted is called afterwards (typically from a background
+   * thread) to make the committed transactions durable.  A crash before that
+   * may lose the latest commits, but must leave the storage consistent.
+   *
+   * This is only called while no transaction is active.  Returns true if the
+   * storage supports deferred syncing (and thus SyncCommitted has to be
+   * called after commits).  The default implementation returns false,
+   * which means that commits stay synchronous.
+   */
+  virtual bool SetDeferredSync (bool enable);
+
+  /**
+   * Flushes all transactions committed so far to disk, if deferred syncing
+   * is enabled.  This may be called from another thread, and may run
+   * concurrently with a new transaction (including reads, updates and
+   * RollbackTransaction) on the storage.  It is never called concurrently
+   * with CommitTransaction, Clear or itself.
+   */
+  virtual void SyncCommitted ();
+
 };
 
 /**
@@ -182,35 +327,212 @@ public:
  *
  * Besides needing to sync from scratch on every restart, this is actually
  * a fully functional implementation.
+ *
+ * Undo data is indexed in a hash table, and its bytes are kept in large
+ * slabs rather than individual strings, so that attaching and pruning
+ * blocks does not allocate per block.  Optionally, the memory used for undo
+ * data can be capped.  Then the oldest undo data is evicted when the cap
+ * is exceeded.  Detaching such a block fails, and the Game resyncs from
+ * scratch in that case.
  */
 class MemoryStorage : public StorageInterface
 {
 
+public:
+
+  /** Size of the slabs in which undo data is stored.  */
+  static constexpr size_t UNDO_SLAB_SIZE = 1 << 20;
+
 private:
 
+  /**
+   * Storage for undo data blobs in large slabs.  New blobs are appended to
+   * the current slab, and a slab is recycled once all blobs in it have been
+   * released.  Since undo data is mostly released in the order it was
+   * added (by pruning or eviction of the oldest blocks), this keeps the
+   * fragmentation low.  Blobs that are large compared to the slab size
+   * get a slab of their own.
+   */
+  class UndoArena
+  {
+
+  public:
+
+    /** Reference to a blob stored in the arena.  */
+    struct Ref
+    {
+      size_t slab;
+      size_t offset;
+      size_t size;
+    };
+
+  private:
+
+    /** A single slab of memory.  */
+    struct Slab
+    {
+
+      /** The memory of this slab (may be null for unused slabs).  */
+      std::unique_ptr<char[]> data;
+
+      /** Size of the allocated memory.  */
+      size_t capacity = 0;
+
+      /** Number of bytes at the beginning that have been handed out.  */
+      size_t used = 0;
+
+      /** Number of bytes in blobs that have not yet been released.  */
+      size_t live = 0;
+
+    };
+
+    /** All slabs, indexed by the slab number of Ref.  */
+    std::vector<Slab> slabs;
+
+    /** Indices of slabs that hold no blobs and can be reused.  */
+    std::vector<size_t> freeSlabs;
+
+    /** Whether there is a current slab that new blobs are appended to.  */
+    bool hasCurrent = false;
+
+    /** Index of the current slab.  */
+    size_t current;
+
+    /** Total number of bytes allocated for slabs.  */
+    size_t allocated = 0;
+
+    /**
+     * Returns the index of an empty slab with the given capacity, reusing
+     * free slabs if possible.
+     */
+    size_t AllocateSlab (size_t capacity);
+
+    /**
+     * Marks the given slab as free.  Its memory is kept around for reuse
+     * if it is a normal-sized slab and we do not have a spare one yet.
+     */
+    void FreeSlab (size_t index);
+
+  public:
+
+    UndoArena () = default;
+    UndoArena (const UndoArena&) = delete;
+    void operator= (const UndoArena&) = delete;
+
+    /**
+     * Copies the given data into the arena and returns a reference to it.
+     */
+    Ref Store (const std::string& data);
+
+    /**
+     * Copies the blob referenced into the output string.
+     */
+    void Read (const Ref& ref, std::string& out) const;
+
+    /**
+     * Releases a blob.  The reference must not be used anymore afterwards.
+     */
+    void Release (const Ref& ref);
+
+    /**
+     * Releases the memory of free slabs that is kept around for reuse.
+     */
+    void TrimSpare ();
+
+    /**
+     * Releases all memory.
+     */
+    void Clear ();
+
+    /**
+     * Returns the number of bytes currently allocated for slabs.
+     */
+    size_t
+    GetAllocatedBytes () const
+    {
+      return allocated;
+    }
+
+  };
+
   /** Whether or not we have a current block hash / state.  */
   bool hasState = false;
 
+  /** Whether or not we know the height of the current block.  */
+  bool hasHeight = false;
+
   /** The current block hash, if we have one.  */
   uint256 currentBlock;
-  /** The current game state.  */
-  GameStateData currentState;
+  /** The current block height, if hasHeight is true.  */
+  unsigned currentHeight;
+  /**
+   * The current game state.  It is kept as shared handle, so that it can be
+   * handed out with GetCurrentGameStateShared without copying.
+   */
+  SharedGameStateData currentState;
 
   /**
-   * Convenience struct to hold a block height together with undo data.
+   * Data about the undo entry for a block.
    */
-  struct HeightAndUndoData
+  struct UndoEntry
   {
+
+    /** The block height.  */
     unsigned height;
-    UndoData data;
+
+    /** The undo data in the arena.  */
+    UndoArena::Ref ref;
+
+    /** Sequence number in the order the entries were added.  */
+    uint64_t seq;
+
   };
 
   /** Type of the map holding undo data.  */
-  using UndoMap = std::map<uint256, HeightAndUndoData>;
+  using UndoMap = std::unordered_map<uint256, UndoEntry>;
 
   /** Undo data associated to block hashes we know about.  */
   UndoMap undoData;
 
+  /** The arena holding the actual bytes of undo data.  */
+  UndoArena arena;
+
+  /**
+   * Hashes of the undo entries in the order they were added, together with
+   * their sequence number.  This is used to find the oldest entries for
+   * eviction.  Entries that have been removed in the meantime (and thus
+   * are not in undoData or have a different sequence number there) are
+   * skipped, and cleaned up from time to time.
+   */
+  std::deque<std::pair<uint64_t, uint256>> undoOrder;
+
+  /** The sequence number for the next added undo entry.  */
+  uint64_t nextSeq = 0;
+
+  /** Maximum memory for undo data in bytes (zero for no limit).  */
+  size_t undoLimit = 0;
+
+  /** Number of undo entries that have been evicted due to the limit.  */
+  uint64_t evicted = 0;
+
+  /**
+   * Removes the given entry from undoData and releases its memory.
+   * Returns the iterator to the next entry.
+   */
+  UndoMap::iterator EraseUndo (UndoMap::iterator it);
+
+  /**
+   * Drops stale elements from undoOrder if it has become much larger than
+   * the number of actual entries.
+   */
+  void CompactUndoOrder ();
+
+  /**
+   * Evicts the oldest undo data while the arena's memory is above the limit.
+   * The newest entry is always kept.
+   */
+  void EnforceUndoLimit ();
+
   /**
    * Whether or not a transaction has currently been started.  The storage
    * itself does not support transaction rollbacks, but it keeps track of
@@ -227,18 +549,65 @@ public:
 
   void operator= (const MemoryStorage&) = delete;
 
+  /**
+   * Sets a limit for the memory (in bytes) used for undo data.  If it is
+   * exceeded, the oldest undo data is evicted.  Zero means no limit.
+   * Since slabs are allocated as a whole, the limit should be a good deal
+   * larger than UNDO_SLAB_SIZE to be useful.
+   */
+  void SetUndoMemoryLimit (size_t bytes);
+
+  /**
+   * Returns the number of bytes currently allocated for undo data.
+   */
+  size_t
+  GetUndoMemory () const
+  {
+    return arena.GetAllocatedBytes ();
+  }
+
+  /**
+   * Returns the number of undo entries that have been evicted because of
+   * the memory limit.
+   */
+  uint64_t
+  GetEvictedUndoEntries () const
+  {
+    return evicted;
+  }
+
   void Clear () override;
 
   bool GetCurrentBlockHash (uint256& hash) const override;
   GameStateData GetCurrentGameState () const override;
+  SharedGameStateData GetCurrentGameStateShared () const override;
   void SetCurrentGameState (const uint256& hash,
                             const GameStateData& data) override;
+  void SetCurrentGameStateWithHeight (const uint256& hash, unsigned height,
+                                      const GameStateData& data) override;
+  void SetCurrentGameStateShared (const uint256& hash, unsigned height,
+                                  const SharedGameStateData& data) override;
+
+  /**
+   * Updates the current state by moving in the given data, which avoids
+   * copying it.
+   */
+  void SetCurrentGameState (const uint256& hash, GameStateData&& data);
+
+  /**
+   * Updates the current state and height by moving in the given data.
+   */
+  void SetCurrentGameStateWithHeight (const uint256& hash, unsigned height,
+                                      GameStateData&& data);
+  bool GetCurrentBlockHeight (unsigned& height) const override;
+  bool GetBlockHeight (const uint256& hash, unsigned& height) const override;
 
   bool GetUndoData (const uint256& hash, UndoData& data) const override;
   void AddUndoData (const uint256& hash,
                     unsigned height, const UndoData& data) override;
   void ReleaseUndoData (const uint256& hash) override;
   void PruneUndoData (unsigned height) override;
+  unsigned PruneUndoDataRange (unsigned height, unsigned limit) override;
 
   void BeginTransaction () override;
   void CommitTransaction () override;
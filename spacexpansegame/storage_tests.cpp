@@ -4,6 +4,11 @@
 
 #include "storage_tests.hpp"
 
+#include "testutils.hpp"
+
+#include <memory>
+#include <utility>
+
 namespace spacexpanse
 {
 namespace
@@ -12,5 +17,253 @@ namespace
 INSTANTIATE_TYPED_TEST_CASE_P (Memory, BasicStorageTests, MemoryStorage);
 INSTANTIATE_TYPED_TEST_CASE_P (Memory, PruningStorageTests, MemoryStorage);
 
+TEST (MemoryStorageTests, NoReadSnapshots)
+{
+  /* MemoryStorage relies on the snapshots published by Game instead.  */
+  MemoryStorage storage;
+  EXPECT_EQ (storage.GetReadSnapshot (), nullptr);
+}
+
+/* ************************************************************************** */
+
+class MemoryStorageSharedStateTests : public testing::Test
+{
+
+protected:
+
+  MemoryStorage storage;
+
+  /**
+   * Sets the given state as current one in the storage (using a shared
+   * handle, within a transaction).
+   */
+  void
+  SetState (const unsigned height, const SharedGameStateData& state)
+  {
+    storage.BeginTransaction ();
+    storage.SetCurrentGameStateShared (BlockHash (height), height, state);
+    storage.CommitTransaction ();
+  }
+
+};
+
+TEST_F (MemoryStorageSharedStateTests, HandleIsNotCopied)
+{
+  const auto state = std::make_shared<const GameStateData> ("state");
+  SetState (1, state);
+
+  EXPECT_EQ (storage.GetCurrentGameStateShared (), state);
+  EXPECT_EQ (storage.GetCurrentGameStateShared (),
+             storage.GetCurrentGameStateShared ());
+
+  unsigned height;
+  ASSERT_TRUE (storage.GetCurrentBlockHeight (height));
+  EXPECT_EQ (height, 1u);
+}
+
+TEST_F (MemoryStorageSharedStateTests, ClearReleasesState)
+{
+  const auto state = std::make_shared<const GameStateData> ("state");
+  SetState (1, state);
+  EXPECT_GT (state.use_count (), 1);
+
+  storage.Clear ();
+  EXPECT_EQ (state.use_count (), 1);
+}
+
+TEST_F (MemoryStorageSharedStateTests, SharedAcrossBlocks)
+{
+  const auto state = std::make_shared<const GameStateData> (1 << 10, 'x');
+  SetState (0, state);
+
+  /* Passing the state on through a series of blocks (as a game that does
+     not change it would) and reading it back never copies the data.  */
+  for (unsigned i = 1; i <= 20; ++i)
+    {
+      const auto oldState = storage.GetCurrentGameStateShared ();
+      EXPECT_EQ (oldState, state);
+      SetState (i, oldState);
+    }
+
+  EXPECT_EQ (storage.GetCurrentGameStateShared (), state);
+  EXPECT_EQ (state.use_count (), 2);
+
+  /* Setting a state by value makes a new copy, which releases the
+     shared handle.  */
+  storage.BeginTransaction ();
+  storage.SetCurrentGameStateWithHeight (BlockHash (21), 21, *state);
+  storage.CommitTransaction ();
+
+  const auto copied = storage.GetCurrentGameStateShared ();
+  EXPECT_NE (copied, state);
+  EXPECT_EQ (*copied, *state);
+  EXPECT_EQ (state.use_count (), 1);
+}
+
+/* ************************************************************************** */
+
+class MemoryStorageUndoTests : public testing::Test
+{
+
+protected:
+
+  MemoryStorage storage;
+
+  /**
+   * Returns the undo data we use for a given height.  It is large enough
+   * so that a few of them fill a slab.
+   */
+  static UndoData
+  UndoForHeight (const unsigned height)
+  {
+    return UndoData (100 << 10, static_cast<char> ('a' + height % 26));
+  }
+
+  /**
+   * Adds undo data for blocks in the given range (inclusive) in a single
+   * transaction.
+   */
+  void
+  AddBlocks (const unsigned from, const unsigned to)
+  {
+    storage.BeginTransaction ();
+    for (unsigned h = from; h <= to; ++h)
+      storage.AddUndoData (BlockHash (h), h, UndoForHeight (h));
+    storage.CommitTransaction ();
+  }
+
+  /**
+   * Expects that undo data for the given height is present and correct.
+   */
+  void
+  ExpectUndo (const unsigned height) const
+  {
+    UndoData undo;
+    ASSERT_TRUE (storage.GetUndoData (BlockHash (height), undo))
+        << "No undo data for height " << height;
+    EXPECT_EQ (undo, UndoForHeight (height));
+  }
+
+};
+
+TEST_F (MemoryStorageUndoTests, SpecialSizes)
+{
+  const UndoData large(MemoryStorage::UNDO_SLAB_SIZE + 10, 'x');
+
+  storage.BeginTransaction ();
+  storage.AddUndoData (BlockHash (1), 1, "");
+  storage.AddUndoData (BlockHash (2), 2, large);
+  storage.AddUndoData (BlockHash (3), 3, "foo");
+  storage.CommitTransaction ();
+
+  UndoData undo = "bar";
+  ASSERT_TRUE (storage.GetUndoData (BlockHash (1), undo));
+  EXPECT_EQ (undo, "");
+  ASSERT_TRUE (storage.GetUndoData (BlockHash (2), undo));
+  EXPECT_EQ (undo, large);
+  ASSERT_TRUE (storage.GetUndoData (BlockHash (3), undo));
+  EXPECT_EQ (undo, "foo");
+
+  storage.BeginTransaction ();
+  storage.ReleaseUndoData (BlockHash (2));
+  storage.CommitTransaction ();
+  EXPECT_LE (storage.GetUndoMemory (), MemoryStorage::UNDO_SLAB_SIZE);
+  ASSERT_TRUE (storage.GetUndoData (BlockHash (3), undo));
+  EXPECT_EQ (undo, "foo");
+}
+
+TEST_F (MemoryStorageUndoTests, SlabsAreReused)
+{
+  AddBlocks (0, 39);
+  const size_t used = storage.GetUndoMemory ();
+  EXPECT_GE (used, 40 * UndoForHeight (0).size ());
+
+  for (unsigned round = 1; round <= 5; ++round)
+    {
+      storage.BeginTransaction ();
+      storage.PruneUndoData (40 * round - 1);
+      storage.CommitTransaction ();
+      AddBlocks (40 * round, 40 * round + 39);
+
+      EXPECT_LE (storage.GetUndoMemory (),
+                 used + MemoryStorage::UNDO_SLAB_SIZE);
+    }
+
+  for (unsigned h = 200; h < 240; ++h)
+    ExpectUndo (h);
+}
+
+TEST_F (MemoryStorageUndoTests, MemoryLimitEvictsOldest)
+{
+  const size_t limit = 4 * MemoryStorage::UNDO_SLAB_SIZE;
+  storage.SetUndoMemoryLimit (limit);
+
+  for (unsigned h = 0; h < 100; ++h)
+    {
+      AddBlocks (h, h);
+      EXPECT_LE (storage.GetUndoMemory (), limit);
+    }
+
+  EXPECT_GT (storage.GetEvictedUndoEntries (), 0);
+
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (BlockHash (0), undo));
+  for (unsigned h = 90; h < 100; ++h)
+    ExpectUndo (h);
+
+  unsigned height;
+  ASSERT_TRUE (storage.GetBlockHeight (BlockHash (99), height));
+  EXPECT_EQ (height, 99);
+}
+
+TEST_F (MemoryStorageUndoTests, RangePruningOutOfOrder)
+{
+  AddBlocks (0, 19);
+
+  /* Add some entries at lower height after the others, as would happen
+     after a reorg.  */
+  storage.BeginTransaction ();
+  storage.ReleaseUndoData (BlockHash (15));
+  storage.AddUndoData (BlockHash (100), 5, UndoForHeight (5));
+  storage.AddUndoData (BlockHash (15), 15, UndoForHeight (15));
+  storage.CommitTransaction ();
+
+  unsigned chunks = 0;
+  while (true)
+    {
+      ASSERT_LE (chunks, 4) << "Range pruning does not finish";
+      ++chunks;
+
+      storage.BeginTransaction ();
+      const unsigned removed = storage.PruneUndoDataRange (9, 3);
+      storage.CommitTransaction ();
+
+      if (removed < 3)
+        break;
+    }
+
+  UndoData undo;
+  for (unsigned h = 0; h <= 9; ++h)
+    EXPECT_FALSE (storage.GetUndoData (BlockHash (h), undo));
+  EXPECT_FALSE (storage.GetUndoData (BlockHash (100), undo));
+  for (unsigned h = 10; h < 20; ++h)
+    ExpectUndo (h);
+}
+
+TEST_F (MemoryStorageUndoTests, MoveInState)
+{
+  GameStateData state(1 << 20, 'x');
+  const char* const ptr = state.data ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameStateWithHeight (BlockHash (1), 1, std::move (state));
+  storage.CommitTransaction ();
+
+  EXPECT_EQ (storage.GetCurrentGameStateShared ()->data (), ptr);
+  unsigned height;
+  ASSERT_TRUE (storage.GetCurrentBlockHeight (height));
+  EXPECT_EQ (height, 1);
+}
+
 } // anonymous namespace
 } // namespace spacexpanse
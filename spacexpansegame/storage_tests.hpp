@@ -13,6 +13,7 @@
 
 #include <glog/logging.h>
 
+#include <memory>
 #include <string>
 
 namespace spacexpanse
@@ -158,9 +159,67 @@ TYPED_TEST_P (BasicStorageTests, ReadInTransaction)
   this->storage.RollbackTransaction ();
 }
 
+TYPED_TEST_P (BasicStorageTests, BlockHeights)
+{
+  unsigned height;
+  EXPECT_FALSE (this->storage.GetCurrentBlockHeight (height));
+  EXPECT_FALSE (this->storage.GetBlockHeight (this->hash1, height));
+
+  this->storage.BeginTransaction ();
+  this->storage.SetCurrentGameStateWithHeight (this->hash1, 10, this->state1);
+  this->storage.AddUndoData (this->hash1, 10, this->undo1);
+  this->storage.CommitTransaction ();
+
+  uint256 hash;
+  ASSERT_TRUE (this->storage.GetCurrentBlockHash (hash));
+  EXPECT_EQ (hash, this->hash1);
+  EXPECT_EQ (this->storage.GetCurrentGameState (), this->state1);
+
+  ASSERT_TRUE (this->storage.GetCurrentBlockHeight (height));
+  EXPECT_EQ (height, 10u);
+  ASSERT_TRUE (this->storage.GetBlockHeight (this->hash1, height));
+  EXPECT_EQ (height, 10u);
+  EXPECT_FALSE (this->storage.GetBlockHeight (this->hash2, height));
+
+  this->storage.BeginTransaction ();
+  this->storage.SetCurrentGameStateWithHeight (this->hash2, 11, this->state2);
+  this->storage.CommitTransaction ();
+  ASSERT_TRUE (this->storage.GetCurrentBlockHeight (height));
+  EXPECT_EQ (height, 11u);
+
+  this->storage.Clear ();
+  EXPECT_FALSE (this->storage.GetCurrentBlockHeight (height));
+  EXPECT_FALSE (this->storage.GetBlockHeight (this->hash1, height));
+}
+
+TYPED_TEST_P (BasicStorageTests, SharedState)
+{
+  this->storage.BeginTransaction ();
+  this->storage.SetCurrentGameStateShared (
+      this->hash1, 10, std::make_shared<const GameStateData> (this->state1));
+  this->storage.CommitTransaction ();
+
+  uint256 hash;
+  ASSERT_TRUE (this->storage.GetCurrentBlockHash (hash));
+  EXPECT_EQ (hash, this->hash1);
+  EXPECT_EQ (this->storage.GetCurrentGameState (), this->state1);
+  const auto shared = this->storage.GetCurrentGameStateShared ();
+  ASSERT_NE (shared, nullptr);
+  EXPECT_EQ (*shared, this->state1);
+
+  this->storage.BeginTransaction ();
+  this->storage.SetCurrentGameState (this->hash2, this->state2);
+  this->storage.CommitTransaction ();
+  EXPECT_EQ (*this->storage.GetCurrentGameStateShared (), this->state2);
+
+  /* A handle retrieved earlier stays valid and unchanged.  */
+  EXPECT_EQ (*shared, this->state1);
+}
+
 REGISTER_TYPED_TEST_CASE_P (BasicStorageTests,
                             Empty, CurrentState, StoringUndoData,
-                            Clear, ReadInTransaction);
+                            Clear, ReadInTransaction, BlockHeights,
+                            SharedState);
 
 /**
  * Tests specific for the pruning/removing of undo data in a storage.  Since
@@ -226,6 +285,41 @@ TYPED_TEST_P (PruningStorageTests, PruneUndoData)
   EXPECT_FALSE (this->storage.GetUndoData (this->hash2, undo));
 }
 
+TYPED_TEST_P (PruningStorageTests, PruneUndoDataRange)
+{
+  this->storage.BeginTransaction ();
+  this->storage.AddUndoData (this->hash1, 42, this->undo1);
+  this->storage.AddUndoData (this->hash2, 43, this->undo2);
+  this->storage.CommitTransaction ();
+
+  /* Prune in chunks of a single entry.  Storages may remove everything
+     at once (and return zero), but must never remove more than the limit
+     and must signal completion by returning less than it.  */
+  unsigned chunks = 0;
+  while (true)
+    {
+      ASSERT_LE (chunks, 2) << "Range pruning does not finish";
+      ++chunks;
+
+      this->storage.BeginTransaction ();
+      const unsigned removed = this->storage.PruneUndoDataRange (42, 1);
+      this->storage.CommitTransaction ();
+
+      ASSERT_LE (removed, 1);
+      if (removed < 1)
+        break;
+    }
+
+  UndoData undo;
+  EXPECT_FALSE (this->storage.GetUndoData (this->hash1, undo));
+  EXPECT_TRUE (this->storage.GetUndoData (this->hash2, undo));
+
+  this->storage.BeginTransaction ();
+  EXPECT_LT (this->storage.PruneUndoDataRange (43, 10), 10);
+  this->storage.CommitTransaction ();
+  EXPECT_FALSE (this->storage.GetUndoData (this->hash2, undo));
+}
+
 TYPED_TEST_P (PruningStorageTests, MultibyteHeight)
 {
   /* In this test, we store undo data for heights that require multiple
@@ -251,7 +345,8 @@ TYPED_TEST_P (PruningStorageTests, MultibyteHeight)
 }
 
 REGISTER_TYPED_TEST_CASE_P (PruningStorageTests,
-                            ReleaseUndoData, PruneUndoData, MultibyteHeight);
+                            ReleaseUndoData, PruneUndoData,
+                            PruneUndoDataRange, MultibyteHeight);
 
 /**
  * Tests the transaction mechanism in a storage implementation.  This can
@@ -6,6 +6,8 @@
 
 #include <glog/logging.h>
 
+#include <experimental/filesystem>
+
 #include <chrono>
 #include <cstdio>
 #include <sstream>
@@ -14,6 +16,8 @@
 namespace spacexpanse
 {
 
+namespace fs = std::experimental::filesystem;
+
 using testing::_;
 
 uint256
@@ -46,6 +50,19 @@ ParseJson (const std::string& str)
   return val;
 }
 
+TemporaryDirectory::TemporaryDirectory ()
+{
+  dir = std::tmpnam (nullptr);
+  LOG (INFO) << "Temporary directory: " << dir;
+  CHECK (fs::create_directories (dir));
+}
+
+TemporaryDirectory::~TemporaryDirectory ()
+{
+  LOG (INFO) << "Cleaning up temporary directory: " << dir;
+  fs::remove_all (dir);
+}
+
 MockSpaceXpanseRpcServer::MockSpaceXpanseRpcServer (jsonrpc::AbstractServerConnector& conn)
   : SpaceXpanseRpcServerStub(conn)
 {
@@ -50,6 +50,33 @@ void SleepSome ();
  */
 Json::Value ParseJson (const std::string& str);
 
+/**
+ * Creates a temporary directory and removes it again in the destructor.
+ */
+class TemporaryDirectory
+{
+
+private:
+
+  /** Path of the created directory.  */
+  std::string dir;
+
+public:
+
+  TemporaryDirectory ();
+  ~TemporaryDirectory ();
+
+  TemporaryDirectory (const TemporaryDirectory&) = delete;
+  void operator= (const TemporaryDirectory&) = delete;
+
+  const std::string&
+  GetPath () const
+  {
+    return dir;
+  }
+
+};
+
 /**
  * Mock server for SpaceXpanse Core's JSON-RPC interface.
  */
@@ -268,13 +295,13 @@ protected:
   static std::string
   GetZmqEndpoint (const Game& g)
   {
-    return g.zmq.addrBlocks;
+    return g.zmq->addrBlocks;
   }
 
   static std::string
   GetZmqEndpointPending (const Game& g)
   {
-    return g.zmq.addrPending;
+    return g.zmq->addrPending;
   }
 
   static State
@@ -318,7 +345,7 @@ protected:
   static internal::ZmqSubscriber&
   GetZmq (Game& g)
   {
-    return g.zmq;
+    return *g.zmq;
   }
 
   /**
@@ -6,11 +6,145 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <exception>
+
 namespace spacexpanse
 {
 namespace internal
 {
 
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+constexpr double AdaptiveBatchSizer::ALPHA;
+
+AdaptiveBatchSizer::AdaptiveBatchSizer (const Limits& l)
+  : limits(l), sizeCap(l.maxBatchSize)
+{
+  CHECK_GE (limits.maxBatchSize, 1);
+}
+
+void
+AdaptiveBatchSizer::SetRemainingBlocks (const unsigned n)
+{
+  remaining = n;
+  targetReached = false;
+}
+
+void
+AdaptiveBatchSizer::BlockProcessed (const Clock::time_point now)
+{
+  if (hasLastBlock)
+    {
+      const std::chrono::duration<double, std::micro> delta = now - lastBlock;
+      if (blockInterval.count () <= 0.0)
+        blockInterval = delta;
+      else
+        blockInterval = ALPHA * delta + (1.0 - ALPHA) * blockInterval;
+    }
+  hasLastBlock = true;
+  lastBlock = now;
+
+  targetReached = false;
+  if (remaining > 0)
+    {
+      --remaining;
+      targetReached = (remaining == 0);
+    }
+}
+
+void
+AdaptiveBatchSizer::BatchCommitted (const std::chrono::microseconds latency)
+{
+  if (commitLatency.count () <= 0.0)
+    commitLatency = latency;
+  else
+    commitLatency = ALPHA * latency + (1.0 - ALPHA) * commitLatency;
+
+  sizeCap = std::min (limits.maxBatchSize, 2 * sizeCap);
+}
+
+void
+AdaptiveBatchSizer::BatchRolledBack (const unsigned size)
+{
+  /* If the batch has to be redone (e.g. after an LMDB resize), a smaller
+     one is less likely to hit the same problem and cheaper to retry.  */
+  sizeCap = std::max (1u, std::min (sizeCap, size / 2));
+  VLOG (1) << "Reduced adaptive batch size cap to " << sizeCap;
+}
+
+unsigned
+AdaptiveBatchSizer::GetBatchSize () const
+{
+  /* Until we know how fast blocks come in, do not batch at all.  */
+  if (blockInterval.count () <= 0.0)
+    return 1;
+
+  const auto budget = limits.maxDataLoss - commitLatency;
+  const double blocks = budget / blockInterval;
+  if (blocks >= sizeCap)
+    return sizeCap;
+  if (blocks < 1.0)
+    return 1;
+
+  return static_cast<unsigned> (blocks);
+}
+
+bool
+AdaptiveBatchSizer::ShouldFlush (const unsigned batched,
+                                 const Clock::duration unsyncedAge) const
+{
+  if (targetReached)
+    return true;
+
+  if (batched >= GetBatchSize ())
+    return true;
+
+  /* We cannot commit between blocks, so if the oldest unsynced block would
+     exceed the window by the time the next block is expected (and then
+     committed), we have to commit now.  */
+  return unsyncedAge + blockInterval + commitLatency >= limits.maxDataLoss;
+}
+
+bool
+AdaptiveBatchSizer::DataLossDue (const Clock::duration unsyncedAge) const
+{
+  return unsyncedAge + commitLatency >= limits.maxDataLoss;
+}
+
+/* ************************************************************************** */
+
+constexpr unsigned TransactionManager::CommitStats::LATENCY_BUCKETS;
+
+unsigned
+TransactionManager::CommitStats::LatencyBucket (
+    const std::chrono::microseconds latency)
+{
+  unsigned res = 0;
+  for (auto ms = latency.count () / 1'000;
+       ms > 0 && res + 1 < LATENCY_BUCKETS; ms >>= 1)
+    ++res;
+
+  return res;
+}
+
+void
+TransactionManager::CommitStats::AddCommit (
+    const std::chrono::microseconds latency)
+{
+  ++commits;
+  totalTime += latency;
+  maxTime = std::max (maxTime, latency);
+  ++latencies[LatencyBucket (latency)];
+}
+
 TransactionManager::~TransactionManager ()
 {
   /* The code in Game should be written to make sure that all transactions
@@ -20,6 +154,15 @@ TransactionManager::~TransactionManager ()
   CHECK (!inTransaction);
 
   Flush ();
+  WaitForSync ();
+
+  {
+    std::lock_guard<std::mutex> lock(mutFlush);
+    stopFlush = true;
+    cvFlush.notify_all ();
+  }
+  if (flushThread.joinable ())
+    flushThread.join ();
 }
 
 void
@@ -37,7 +180,25 @@ TransactionManager::Flush ()
       if (storage != nullptr)
         try
           {
+            /* Batches are committed strictly in order, so the previous one
+               must be durable before the next one is committed.  */
+            WaitForSync ();
+
+            const auto start = Clock::now ();
             storage->CommitTransaction ();
+
+            std::lock_guard<std::mutex> lock(mutFlush);
+            if (deferredSync)
+              {
+                syncPending = true;
+                syncStart = start;
+                syncBatchStart = batchStart;
+                cvFlush.notify_all ();
+              }
+            else
+              RecordCommit (
+                  std::chrono::duration_cast<std::chrono::microseconds> (
+                      Clock::now () - start));
           }
         catch (...)
           {
@@ -45,6 +206,86 @@ TransactionManager::Flush ()
             throw;
           }
       batchedCommits = 0;
+      batchedBlocks = 0;
+
+      for (auto* l : listeners)
+        l->BatchCommitted ();
+    }
+}
+
+void
+TransactionManager::NotifyRolledBack ()
+{
+  for (auto* l : listeners)
+    l->BatchRolledBack ();
+}
+
+void
+TransactionManager::AddListener (BatchListener& l)
+{
+  listeners.push_back (&l);
+}
+
+void
+TransactionManager::RemoveListener (BatchListener& l)
+{
+  auto it = std::find (listeners.begin (), listeners.end (), &l);
+  CHECK (it != listeners.end ()) << "Batch listener is not registered";
+  listeners.erase (it);
+}
+
+bool
+TransactionManager::IsBatching () const
+{
+  std::lock_guard<std::mutex> lock(mutFlush);
+  return sizer != nullptr || batchSize > 1;
+}
+
+void
+TransactionManager::RecordCommit (const std::chrono::microseconds latency)
+{
+  commitStats.AddCommit (latency);
+  if (sizer != nullptr)
+    sizer->BatchCommitted (latency);
+}
+
+void
+TransactionManager::WaitForSync ()
+{
+  std::unique_lock<std::mutex> lock(mutFlush);
+  cvFlush.wait (lock, [this] () { return !syncPending; });
+}
+
+void
+TransactionManager::RunFlushThread ()
+{
+  std::unique_lock<std::mutex> lock(mutFlush);
+  while (true)
+    {
+      cvFlush.wait (lock, [this] () { return syncPending || stopFlush; });
+      if (!syncPending)
+        break;
+
+      lock.unlock ();
+      VLOG (1) << "Syncing committed batch in the background";
+      try
+        {
+          storage->SyncCommitted ();
+        }
+      catch (const std::exception& exc)
+        {
+          /* We do not know what made it to disk, and the next batch is
+             already being built on top of this one.  The only safe way out
+             is to restart from whatever state is durable.  */
+          LOG (FATAL) << "Syncing committed batch failed: " << exc.what ();
+        }
+      lock.lock ();
+
+      RecordCommit (
+          std::chrono::duration_cast<std::chrono::microseconds> (
+              Clock::now () - syncStart));
+      syncPending = false;
+      cvFlush.notify_all ();
     }
 }
 
@@ -52,7 +293,55 @@ void
 TransactionManager::SetStorage (StorageInterface& s)
 {
   Flush ();
+  WaitForSync ();
+
+  if (deferredSync)
+    {
+      storage->SetDeferredSync (false);
+      deferredSync = false;
+    }
+
   storage = &s;
+  if (asyncCommit)
+    deferredSync = storage->SetDeferredSync (true);
+}
+
+void
+TransactionManager::SetExplicitBlocks (const bool enable)
+{
+  CHECK (!inTransaction);
+  LOG (INFO) << "Explicit block reporting enabled: " << enable;
+  explicitBlocks = enable;
+}
+
+void
+TransactionManager::SetAsyncCommit (const bool enable)
+{
+  CHECK (!inTransaction);
+  LOG (INFO) << "Asynchronous commits enabled: " << enable;
+
+  if (enable == asyncCommit)
+    return;
+
+  /* The storage's sync mode can only be changed without a transaction,
+     and everything committed so far should be durable before.  */
+  Flush ();
+  WaitForSync ();
+
+  asyncCommit = enable;
+  if (storage != nullptr)
+    {
+      if (enable)
+        deferredSync = storage->SetDeferredSync (true);
+      else if (deferredSync)
+        {
+          storage->SetDeferredSync (false);
+          deferredSync = false;
+        }
+    }
+
+  if (enable && !flushThread.joinable ())
+    flushThread = std::thread ([this] () { RunFlushThread (); });
 }
 
 void
@@ -62,11 +351,17 @@ TransactionManager::SetBatchSize (const unsigned sz)
   batchSize = sz;
   LOG (INFO) << "Set batch size for TransactionManager to " << batchSize;
 
-  if (batchedCommits >= batchSize)
+  if (sizer != nullptr)
+    {
+      LOG (INFO) << "Adaptive batching is enabled, ignoring the batch size";
+      return;
+    }
+
+  if (batchedCommits > 0 && (batchSize == 1 || batchedBlocks >= batchSize))
     {
       LOG (INFO)
-          << "We have " << batchedCommits
-          << " batched transactions, trying to commit the batch now";
+          << "We have " << batchedBlocks
+          << " batched blocks, trying to commit the batch now";
       if (inTransaction)
         LOG (INFO) << "There is a pending transaction, not committing";
       else
@@ -74,6 +369,43 @@ TransactionManager::SetBatchSize (const unsigned sz)
     }
 }
 
+void
+TransactionManager::EnableAdaptiveBatching (
+    const AdaptiveBatchSizer::Limits& limits)
+{
+  CHECK (!inTransaction);
+  LOG (INFO)
+      << "Enabling adaptive batching with at most " << limits.maxBatchSize
+      << " blocks per batch and a data-loss window of "
+      << limits.maxDataLoss.count () << " ms";
+
+  std::lock_guard<std::mutex> lock(mutFlush);
+  sizer = std::make_unique<AdaptiveBatchSizer> (limits);
+}
+
+void
+TransactionManager::DisableAdaptiveBatching ()
+{
+  CHECK (!inTransaction);
+  LOG (INFO) << "Disabling adaptive batching";
+
+  {
+    std::lock_guard<std::mutex> lock(mutFlush);
+    sizer.reset ();
+  }
+
+  if (batchedCommits > 0 && (batchSize == 1 || batchedBlocks >= batchSize))
+    Flush ();
+}
+
+void
+TransactionManager::SetRemainingBlocks (const unsigned n)
+{
+  std::lock_guard<std::mutex> lock(mutFlush);
+  if (sizer != nullptr)
+    sizer->SetRemainingBlocks (n);
+}
+
 void
 TransactionManager::BeginTransaction ()
 {
@@ -101,15 +433,108 @@ TransactionManager::CommitTransaction ()
   CHECK (inTransaction);
   inTransaction = false;
 
+  if (batchedCommits == 0)
+    batchStart = Clock::now ();
+
   ++batchedCommits;
   VLOG (1)
       << "Committing current transaction on TransactionManager, now we have "
       << batchedCommits << " batched transactions";
 
-  if (batchedCommits >= batchSize)
+  if (!explicitBlocks)
+    {
+      if (CountBlock ())
+        Flush ();
+      return;
+    }
+
+  /* With batching, the batch is only committed based on the number
+     of blocks, in BlockProcessed.  */
+  if (!IsBatching ())
     Flush ();
 }
 
+void
+TransactionManager::BlockProcessed ()
+{
+  CHECK (!inTransaction);
+
+  if (!explicitBlocks)
+    return;
+
+  /* Without batching, the block's transaction has been committed already.  */
+  if (batchedCommits == 0)
+    return;
+
+  if (!CountBlock ())
+    return;
+
+  /* If committing fails, the whole batch is rolled back right away, just
+     like when the block's own transaction fails to commit.  */
+  try
+    {
+      Flush ();
+    }
+  catch (...)
+    {
+      RollbackTransaction ();
+      throw;
+    }
+}
+
+bool
+TransactionManager::CountBlock ()
+{
+  const auto now = Clock::now ();
+  ++batchedBlocks;
+
+  bool flush;
+  {
+    std::lock_guard<std::mutex> lock(mutFlush);
+    if (sizer == nullptr)
+      flush = (batchedBlocks >= batchSize);
+    else
+      {
+        /* If the previous batch is still being synced, its blocks are
+           the oldest ones that may be lost.  */
+        sizer->BlockProcessed (now);
+        const auto oldest = syncPending ? syncBatchStart : batchStart;
+        flush = sizer->ShouldFlush (batchedBlocks, now - oldest);
+      }
+  }
+
+  return flush;
+}
+
+bool
+TransactionManager::FlushIfDue (const Clock::time_point now)
+{
+  if (inTransaction || commitFailed || batchedCommits == 0)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutFlush);
+    if (sizer == nullptr || !sizer->DataLossDue (now - batchStart))
+      return false;
+  }
+
+  LOG (INFO)
+      << "Batch of " << batchedBlocks
+      << " blocks reached the data-loss window, committing it";
+
+  try
+    {
+      Flush ();
+    }
+  catch (...)
+    {
+      RollbackTransaction ();
+      throw;
+    }
+
+  return true;
+}
+
 void
 TransactionManager::RollbackTransaction ()
 {
@@ -123,8 +548,17 @@ TransactionManager::RollbackTransaction ()
       << "Rolling back current and " << batchedCommits
       << " batched transactions";
 
+  {
+    std::lock_guard<std::mutex> lock(mutFlush);
+    if (sizer != nullptr)
+      sizer->BatchRolledBack (batchedBlocks + 1);
+  }
+
   storage->RollbackTransaction ();
   batchedCommits = 0;
+  batchedBlocks = 0;
+
+  NotifyRolledBack ();
 }
 
 void
@@ -132,7 +566,8 @@ TransactionManager::TryAbortTransaction ()
 {
   CHECK (storage != nullptr);
 
-  if (inTransaction || commitFailed || batchedCommits > 0)
+  const bool abort = (inTransaction || commitFailed || batchedCommits > 0);
+  if (abort)
     {
       LOG (INFO) << "Aborting current transaction and batched commits";
       storage->RollbackTransaction ();
@@ -141,6 +576,19 @@ TransactionManager::TryAbortTransaction ()
   inTransaction = false;
   commitFailed = false;
   batchedCommits = 0;
+  batchedBlocks = 0;
+
+  if (abort)
+    NotifyRolledBack ();
+
+  WaitForSync ();
+}
+
+TransactionManager::CommitStats
+TransactionManager::GetCommitStats () const
+{
+  std::lock_guard<std::mutex> lock(mutFlush);
+  return commitStats;
 }
 
 ActiveTransaction::ActiveTransaction (TransactionManager& m)
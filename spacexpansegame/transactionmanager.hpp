@@ -10,11 +10,143 @@
 
 #include "storage.hpp"
 
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace spacexpanse
 {
 namespace internal
 {
 
+/**
+ * Controller that decides when a batch of transactions should be committed,
+ * based on how fast blocks come in, how long commits take and how many
+ * blocks remain until the catch-up target.  The main constraint is a
+ * maximum data-loss window:  Blocks that have not yet been durably committed
+ * would be lost in a crash, and the oldest of them must not be older than
+ * the window.  Within that, batches are as large as possible (up to a maximum
+ * batch size), so that blocks near the tip are batched as well if they come
+ * in quickly enough.
+ *
+ * The class itself is not thread-safe; TransactionManager synchronises
+ * access to it.
+ */
+class AdaptiveBatchSizer
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * The configurable limits for the batches.
+   */
+  struct Limits
+  {
+
+    /** Maximum number of blocks in a batch.  */
+    unsigned maxBatchSize = 1'000;
+
+    /**
+     * Maximum time that a block may stay without being durably committed.
+     * This includes the time it takes to commit it.
+     */
+    std::chrono::milliseconds maxDataLoss{10'000};
+
+  };
+
+private:
+
+  /** Smoothing factor for the moving averages.  */
+  static constexpr double ALPHA = 0.2;
+
+  /** The configured limits.  */
+  const Limits limits;
+
+  /** Moving average of the time between blocks.  */
+  std::chrono::duration<double, std::micro> blockInterval{0};
+
+  /** Moving average of the commit latency.  */
+  std::chrono::duration<double, std::micro> commitLatency{0};
+
+  /** Time of the last block, if any has been seen yet.  */
+  bool hasLastBlock = false;
+  Clock::time_point lastBlock;
+
+  /**
+   * Upper bound for the batch size, which is reduced after rollbacks (which
+   * have to redo the whole batch) and recovers with successful commits.
+   */
+  unsigned sizeCap;
+
+  /**
+   * Number of blocks remaining until the catch-up target, or zero if there
+   * is none known.
+   */
+  unsigned remaining = 0;
+
+  /** Set when the catch-up target has just been reached.  */
+  bool targetReached = false;
+
+public:
+
+  explicit AdaptiveBatchSizer (const Limits& l);
+
+  AdaptiveBatchSizer () = delete;
+  AdaptiveBatchSizer (const AdaptiveBatchSizer&) = delete;
+  void operator= (const AdaptiveBatchSizer&) = delete;
+
+  /**
+   * Sets the number of blocks remaining until the catch-up target (or zero
+   * if there is no target).  When the target is reached, the batch is
+   * committed regardless of its size.
+   */
+  void SetRemainingBlocks (unsigned n);
+
+  /**
+   * Records that a block has been processed (committed into the batch)
+   * at the given time.
+   */
+  void BlockProcessed (Clock::time_point now);
+
+  /**
+   * Records that a batch has been committed with the given latency.
+   */
+  void BatchCommitted (std::chrono::microseconds latency);
+
+  /**
+   * Records that a batch of the given size has been rolled back.
+   */
+  void BatchRolledBack (unsigned size);
+
+  /**
+   * Returns the current target batch size, based on the measured block
+   * interval and commit latency.
+   */
+  unsigned GetBatchSize () const;
+
+  /**
+   * Returns true if the batch should be committed now, given its size and
+   * the age of the oldest block that is not yet durable.
+   */
+  bool ShouldFlush (unsigned batched, Clock::duration unsyncedAge) const;
+
+  /**
+   * Returns true if a batch whose oldest block has the given age must be
+   * committed now to stay within the data-loss window, independently of
+   * when the next block comes in.  This is used for flushes between
+   * blocks, e.g. when blocks stop arriving after a burst.
+   */
+  bool DataLossDue (Clock::duration unsyncedAge) const;
+
+};
+
 /**
  * Utility class that takes care of (potentially) batching together
  * atomic transactions while the game is catching up.  It has an underlying
@@ -22,10 +154,72 @@ namespace internal
  * allows to enable batching, in which case a started transaction will not
  * immediately be committed, but only after the manager has been requested
  * to do a certain number of transactions itself.
+ *
+ * Callers can opt in to reporting blocks explicitly with BlockProcessed
+ * instead.  Then only those count towards the batch size, and other
+ * transactions (like pruning) just become part of the current batch.
+ *
+ * With asynchronous commits enabled, the storage's commit of a batch does
+ * not wait for the data to be flushed to disk.  Instead, a background thread
+ * syncs it while the next batch is already being accumulated.  Batches are
+ * still committed strictly in order:  The next batch is only committed after
+ * the previous one has been synced.  Rolling back only affects the current
+ * batch, since the one being synced has already been committed.  If the
+ * process crashes before a sync is done, the storage falls back to the last
+ * synced batch, from where the game just syncs again.
+ *
+ * With adaptive batching, the batch size is not fixed but determined by
+ * an AdaptiveBatchSizer instead.
  */
 class TransactionManager
 {
 
+public:
+
+  class BatchListener;
+
+  /**
+   * Statistics about the commits done on the underlying storage.
+   */
+  struct CommitStats
+  {
+
+    /**
+     * Number of buckets in the latency histogram.  Bucket zero counts
+     * commits faster than one millisecond, bucket i > 0 those that took
+     * between 2^(i-1) and 2^i milliseconds, and the last bucket all
+     * slower ones.
+     */
+    static constexpr unsigned LATENCY_BUCKETS = 16;
+
+    /** Number of commits done on the underlying storage.  */
+    uint64_t commits = 0;
+
+    /**
+     * Total latency of the commits.  This is the time spent in the storage's
+     * CommitTransaction, plus the background sync with asynchronous
+     * commits (i.e. until the batch was durable).
+     */
+    std::chrono::microseconds totalTime{0};
+
+    /** Maximum latency of a single commit.  */
+    std::chrono::microseconds maxTime{0};
+
+    /** Histogram of the commit latencies.  */
+    std::array<uint64_t, LATENCY_BUCKETS> latencies{};
+
+    /**
+     * Returns the index of the histogram bucket for the given latency.
+     */
+    static unsigned LatencyBucket (std::chrono::microseconds latency);
+
+    /**
+     * Records a commit with the given latency.
+     */
+    void AddCommit (std::chrono::microseconds latency);
+
+  };
+
 private:
 
   /** The underlying storage instance.  */
@@ -41,6 +235,15 @@ private:
    */
   unsigned batchedCommits = 0;
 
+  /**
+   * Number of blocks that have been processed in the current batch.  Without
+   * explicit block reporting, this is the same as batchedCommits.
+   */
+  unsigned batchedBlocks = 0;
+
+  /** Whether blocks are reported explicitly with BlockProcessed.  */
+  bool explicitBlocks = false;
+
   /**
    * Whether or not a transaction has currently been started *on the manager*.
    * This is independent of batching.
@@ -53,14 +256,118 @@ private:
    */
   bool commitFailed = false;
 
+  /** Whether or not asynchronous commits are enabled.  */
+  bool asyncCommit = false;
+
+  /**
+   * Whether the current storage has deferred syncing enabled, i.e. whether
+   * commits have to be synced by the background thread.
+   */
+  bool deferredSync = false;
+
+  /** Background thread syncing commits, if it has been started.  */
+  std::thread flushThread;
+
+  /**
+   * Lock for the state shared with the background thread (including
+   * the commit statistics).
+   */
+  mutable std::mutex mutFlush;
+
+  /** Signalled when a sync is requested or finished.  */
+  std::condition_variable cvFlush;
+
+  /** Set while a committed batch is waiting to be synced.  */
+  bool syncPending = false;
+
+  /** Set to tell the background thread to stop.  */
+  bool stopFlush = false;
+
+  /** Time at which the commit of the pending batch started.  */
+  std::chrono::steady_clock::time_point syncStart;
+
+  /** Time when the first block of the batch being synced was processed.  */
+  std::chrono::steady_clock::time_point syncBatchStart;
+
+  /** Time when the first block of the current batch was processed.  */
+  std::chrono::steady_clock::time_point batchStart;
+
+  /**
+   * The controller for adaptive batching, if enabled.  It is accessed
+   * with mutFlush held, as commits are recorded in the background thread.
+   */
+  std::unique_ptr<AdaptiveBatchSizer> sizer;
+
+  /** Statistics about the commits done so far.  */
+  CommitStats commitStats;
+
+  /** The registered batch listeners.  */
+  std::vector<BatchListener*> listeners;
+
+  /**
+   * Notifies all listeners that the current batch has been rolled back.
+   */
+  void NotifyRolledBack ();
+
   /**
    * Flushes the current batch of transactions to the underlying storage.
    * This must not be called if a transaction is in progress.
    */
   void Flush ();
 
+  /**
+   * Counts a block towards the current batch (and the adaptive batching
+   * controller), and returns true if the batch should be committed now.
+   */
+  bool CountBlock ();
+
+  /**
+   * Returns true if commits are currently batched, either with a fixed
+   * batch size or adaptively.
+   */
+  bool IsBatching () const;
+
+  /**
+   * Main function of the background thread.
+   */
+  void RunFlushThread ();
+
+  /**
+   * Records a durable commit with the given latency in the statistics
+   * and the adaptive batching controller.  Must be called with mutFlush
+   * held.
+   */
+  void RecordCommit (std::chrono::microseconds latency);
+
 public:
 
+  /**
+   * Interface for code that needs to know when the batch with its
+   * committed changes has actually been committed to the storage or
+   * rolled back.
+   */
+  class BatchListener
+  {
+
+  public:
+
+    virtual ~BatchListener () = default;
+
+    /**
+     * Called after the current batch has been committed to the storage.
+     * With asynchronous commits, it may not yet be synced to disk, but
+     * it can no longer be rolled back either.
+     */
+    virtual void BatchCommitted () = 0;
+
+    /**
+     * Called when the current batch (including all transactions committed
+     * on the manager into it) has been rolled back.
+     */
+    virtual void BatchRolledBack () = 0;
+
+  };
+
   TransactionManager () = default;
   ~TransactionManager ();
 
@@ -80,9 +387,45 @@ public:
    * it to one disables batching, a larger number enables batching.  If the
    * number is set to something lower than the number of currently batched
    * transactions, then the batch may be committed right away.
+   *
+   * While adaptive batching is enabled, the value is only remembered for
+   * when it gets disabled again.
    */
   void SetBatchSize (unsigned sz);
 
+  /**
+   * Enables adaptive batching with the given limits, replacing the fixed
+   * batch size.  This must not be called while a transaction is ongoing.
+   */
+  void EnableAdaptiveBatching (const AdaptiveBatchSizer::Limits& limits);
+
+  /**
+   * Disables adaptive batching and goes back to the fixed batch size.
+   */
+  void DisableAdaptiveBatching ();
+
+  /**
+   * Tells the manager how many blocks remain until the catch-up target
+   * (or zero if there is none).  This is used by adaptive batching to
+   * commit the batch when the target is reached.
+   */
+  void SetRemainingBlocks (unsigned n);
+
+  /**
+   * Enables or disables explicit reporting of blocks with BlockProcessed.
+   * If enabled, only the reported blocks count towards the batch size,
+   * rather than every transaction committed on the manager.  This must
+   * not be called while a transaction is ongoing.
+   */
+  void SetExplicitBlocks (bool enable);
+
+  /**
+   * Enables or disables asynchronous commits.  This must not be called while
+   * a transaction is ongoing.  Batched commits are flushed first.  If the
+   * storage does not support deferred syncing, commits stay synchronous.
+   */
+  void SetAsyncCommit (bool enable);
+
   /**
    * Starts a new transaction on the manager.  Depending on batching
    * behaviour, this may or may not start a transaction on the underlying
@@ -98,6 +441,37 @@ public:
    */
   void CommitTransaction ();
 
+  /**
+   * Records that a block has been processed, i.e. that the transaction for
+   * it has been committed on the manager.  With explicit block reporting,
+   * this is what counts towards the batch size, and may commit the batch
+   * on the underlying storage.  Otherwise it does nothing, as each commit
+   * is counted already.  It must not be called while a transaction
+   * is ongoing.
+   */
+  void BlockProcessed ();
+
+  /**
+   * Commits the current batch if adaptive batching is enabled and its oldest
+   * block is about to exceed the data-loss window.  This is meant to be
+   * called regularly from a timer, so that a batch does not stay open
+   * indefinitely when no more blocks come in.  The current time is passed
+   * in by the caller.  It does nothing while a transaction is ongoing.
+   * Returns true if the batch was committed.
+   */
+  bool FlushIfDue (std::chrono::steady_clock::time_point now);
+
+  /**
+   * Registers a listener to be notified about batches being committed
+   * or rolled back.  It must stay alive until it is removed again.
+   */
+  void AddListener (BatchListener& l);
+
+  /**
+   * Removes a previously registered listener.
+   */
+  void RemoveListener (BatchListener& l);
+
   /**
    * Aborts and rolls back the current transaction in the manager.  This has the
    * effect of rolling back the entire current batch in case more transactions
@@ -108,10 +482,24 @@ public:
   /**
    * Aborts the current transaction in the backing storage if there is one
    * open.  This makes sure that afterwards there is no open transaction
-   * either in the manager or the underlying storage.
+   * either in the manager or the underlying storage, and no sync running
+   * in the background (so that e.g. the storage can be cleared).
    */
   void TryAbortTransaction ();
 
+  /**
+   * Blocks until the last committed batch has been synced to disk (if there
+   * is one in flight).  This must be done before the storage is destructed.
+   */
+  void WaitForSync ();
+
+  /**
+   * Returns statistics about the commits done on the underlying storage
+   * so far.  With asynchronous commits, a batch is counted once it
+   * has been synced.
+   */
+  CommitStats GetCommitStats () const;
+
 };
 
 /**
@@ -13,7 +13,14 @@
 
 #include <glog/logging.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace spacexpanse
 {
@@ -103,6 +110,99 @@ TEST_F (TransactionManagerTests, BasicBatching)
   tm.CommitTransaction ();
 }
 
+TEST_F (TransactionManagerTests, OnlyBlocksCountForBatch)
+{
+  {
+    InSequence dummy;
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+  }
+
+  tm.SetExplicitBlocks (true);
+  tm.SetBatchSize (2);
+
+  tm.BeginTransaction ();
+  tm.CommitTransaction ();
+  tm.BlockProcessed ();
+
+  /* Other transactions (e.g. pruning) just join the batch.  */
+  for (unsigned i = 0; i < 5; ++i)
+    {
+      tm.BeginTransaction ();
+      tm.CommitTransaction ();
+    }
+
+  tm.BeginTransaction ();
+  tm.CommitTransaction ();
+  tm.BlockProcessed ();
+}
+
+/**
+ * Batch listener that just counts the notifications.
+ */
+class CountingListener : public TransactionManager::BatchListener
+{
+
+public:
+
+  unsigned committed = 0;
+  unsigned rolledBack = 0;
+
+  void
+  BatchCommitted () override
+  {
+    ++committed;
+  }
+
+  void
+  BatchRolledBack () override
+  {
+    ++rolledBack;
+  }
+
+};
+
+TEST_F (TransactionManagerTests, BatchListener)
+{
+  {
+    InSequence dummy;
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, RollbackTransactionMock ());
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, RollbackTransactionMock ());
+  }
+
+  CountingListener listener;
+  tm.AddListener (listener);
+  tm.SetExplicitBlocks (true);
+  tm.SetBatchSize (2);
+
+  for (unsigned i = 0; i < 2; ++i)
+    {
+      tm.BeginTransaction ();
+      tm.CommitTransaction ();
+      EXPECT_EQ (listener.committed, 0u);
+      tm.BlockProcessed ();
+    }
+  EXPECT_EQ (listener.committed, 1u);
+
+  tm.BeginTransaction ();
+  tm.CommitTransaction ();
+  tm.BeginTransaction ();
+  tm.RollbackTransaction ();
+  EXPECT_EQ (listener.rolledBack, 1u);
+
+  tm.BeginTransaction ();
+  tm.CommitTransaction ();
+  tm.TryAbortTransaction ();
+  EXPECT_EQ (listener.rolledBack, 2u);
+
+  tm.RemoveListener (listener);
+  EXPECT_EQ (listener.committed, 1u);
+}
+
 TEST_F (TransactionManagerTests, Rollback)
 {
   {
@@ -312,6 +412,463 @@ TEST_F (SetBatchSizeTests, NoFlushWhenTransactionInProgress)
   tm.RollbackTransaction ();
 }
 
+/* ************************************************************************** */
+
+/**
+ * Memory storage that supports deferred syncing.  It records the commits
+ * and syncs done, and syncs can be blocked to simulate a slow disk.
+ */
+class DeferredSyncStorage : public MemoryStorage
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+
+  /** While true, syncs block (after recording that they started).  */
+  bool blockSyncs = false;
+
+  /** The recorded events.  */
+  std::vector<std::string> events;
+
+  void
+  AddEvent (const std::string& e)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    events.push_back (e);
+    cv.notify_all ();
+  }
+
+public:
+
+  /** Whether deferred syncing is enabled.  */
+  bool deferred = false;
+
+  bool
+  SetDeferredSync (const bool enable) override
+  {
+    deferred = enable;
+    return true;
+  }
+
+  void
+  CommitTransaction () override
+  {
+    MemoryStorage::CommitTransaction ();
+    AddEvent ("commit");
+  }
+
+  void
+  SyncCommitted () override
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    events.push_back ("sync start");
+    cv.notify_all ();
+    cv.wait (lock, [this] () { return !blockSyncs; });
+    events.push_back ("sync");
+  }
+
+  void
+  BlockSyncs (const bool block)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    blockSyncs = block;
+    cv.notify_all ();
+  }
+
+  /**
+   * Waits until the given number of events has been recorded.
+   */
+  void
+  WaitForEvents (const size_t n)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait (lock, [this, n] () { return events.size () >= n; });
+  }
+
+  std::vector<std::string>
+  GetEvents ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return events;
+  }
+
+};
+
+class AsyncCommitTests : public testing::Test
+{
+
+protected:
+
+  /* The storage is declared first, so that it outlives the manager
+     (which may still be syncing on it while it is destructed).  */
+  DeferredSyncStorage storage;
+  TransactionManager tm;
+
+  AsyncCommitTests ()
+  {
+    tm.SetStorage (storage);
+    tm.SetBatchSize (2);
+    tm.SetAsyncCommit (true);
+  }
+
+  /**
+   * Applies the given number of (empty) transactions.
+   */
+  void
+  Transactions (const unsigned n)
+  {
+    for (unsigned i = 0; i < n; ++i)
+      {
+        ActiveTransaction tx(tm);
+        tx.Commit ();
+      }
+  }
+
+};
+
+TEST_F (AsyncCommitTests, TogglesDeferredSync)
+{
+  EXPECT_TRUE (storage.deferred);
+  tm.SetAsyncCommit (false);
+  EXPECT_FALSE (storage.deferred);
+  tm.SetAsyncCommit (true);
+  EXPECT_TRUE (storage.deferred);
+
+  DeferredSyncStorage other;
+  tm.SetStorage (other);
+  EXPECT_FALSE (storage.deferred);
+  EXPECT_TRUE (other.deferred);
+
+  tm.SetStorage (storage);
+  EXPECT_TRUE (storage.deferred);
+}
+
+TEST_F (AsyncCommitTests, NextBatchWhileSyncing)
+{
+  storage.BlockSyncs (true);
+  Transactions (2);
+  storage.WaitForEvents (2);
+
+  /* The next batch can be worked on (and rolled back) while the previous
+     one is still being synced.  */
+  Transactions (1);
+  {
+    ActiveTransaction tx(tm);
+  }
+  Transactions (1);
+
+  storage.BlockSyncs (false);
+  tm.WaitForSync ();
+  EXPECT_EQ (storage.GetEvents (),
+             std::vector<std::string> ({"commit", "sync start", "sync"}));
+}
+
+TEST_F (AsyncCommitTests, StrictOrdering)
+{
+  storage.BlockSyncs (true);
+  Transactions (2);
+  storage.WaitForEvents (2);
+
+  /* Completing the next batch blocks until the previous one is synced.
+     Since the sync is blocked, the second commit can only come after the
+     first "sync" event if it waited for it, no matter how long the
+     worker takes to get there.  */
+  std::thread worker([this] () { Transactions (2); });
+  storage.BlockSyncs (false);
+  worker.join ();
+  tm.WaitForSync ();
+
+  EXPECT_EQ (storage.GetEvents (),
+             std::vector<std::string> ({"commit", "sync start", "sync",
+                                        "commit", "sync start", "sync"}));
+}
+
+TEST_F (AsyncCommitTests, TryAbortWaitsForSync)
+{
+  storage.BlockSyncs (true);
+  Transactions (2);
+  storage.WaitForEvents (2);
+
+  std::thread unblocker([this] ()
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+      storage.BlockSyncs (false);
+    });
+
+  tm.TryAbortTransaction ();
+  EXPECT_EQ (storage.GetEvents ().back (), "sync");
+  storage.Clear ();
+
+  unblocker.join ();
+}
+
+TEST_F (AsyncCommitTests, StatsCountSyncedBatches)
+{
+  Transactions (6);
+  tm.WaitForSync ();
+
+  const auto stats = tm.GetCommitStats ();
+  EXPECT_EQ (stats.commits, 3u);
+
+  uint64_t total = 0;
+  for (const auto cnt : stats.latencies)
+    total += cnt;
+  EXPECT_EQ (total, 3u);
+}
+
+TEST_F (TransactionManagerTests, AsyncCommitWithoutStorageSupport)
+{
+  {
+    InSequence dummy;
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+  }
+
+  /* The mocked storage does not support deferred syncing, so the commit
+     is just done synchronously.  */
+  tm.SetAsyncCommit (true);
+  tm.BeginTransaction ();
+  tm.CommitTransaction ();
+
+  EXPECT_EQ (tm.GetCommitStats ().commits, 1u);
+}
+
+TEST (CommitStatsTests, LatencyBuckets)
+{
+  using CommitStats = TransactionManager::CommitStats;
+  using std::chrono::microseconds;
+
+  EXPECT_EQ (CommitStats::LatencyBucket (microseconds (0)), 0u);
+  EXPECT_EQ (CommitStats::LatencyBucket (microseconds (999)), 0u);
+  EXPECT_EQ (CommitStats::LatencyBucket (microseconds (1'000)), 1u);
+  EXPECT_EQ (CommitStats::LatencyBucket (microseconds (1'999)), 1u);
+  EXPECT_EQ (CommitStats::LatencyBucket (microseconds (2'000)), 2u);
+  EXPECT_EQ (CommitStats::LatencyBucket (microseconds (5'000)), 3u);
+  EXPECT_EQ (CommitStats::LatencyBucket (std::chrono::hours (1)),
+             CommitStats::LATENCY_BUCKETS - 1);
+
+  CommitStats stats;
+  stats.AddCommit (microseconds (500));
+  stats.AddCommit (microseconds (3'000));
+  EXPECT_EQ (stats.commits, 2u);
+  EXPECT_EQ (stats.totalTime, microseconds (3'500));
+  EXPECT_EQ (stats.maxTime, microseconds (3'000));
+  EXPECT_EQ (stats.latencies[0], 1u);
+  EXPECT_EQ (stats.latencies[2], 1u);
+}
+
+/* ************************************************************************** */
+
+class AdaptiveBatchSizerTests : public testing::Test
+{
+
+protected:
+
+  using Clock = AdaptiveBatchSizer::Clock;
+  using ms = std::chrono::milliseconds;
+
+  AdaptiveBatchSizer::Limits limits;
+  std::unique_ptr<AdaptiveBatchSizer> sizer;
+
+  /** The simulated current time.  */
+  Clock::time_point now;
+
+  AdaptiveBatchSizerTests ()
+  {
+    limits.maxBatchSize = 1'000;
+    limits.maxDataLoss = ms (10'000);
+    Reset ();
+  }
+
+  /**
+   * Recreates the sizer (e.g. after changing the limits).
+   */
+  void
+  Reset ()
+  {
+    sizer = std::make_unique<AdaptiveBatchSizer> (limits);
+  }
+
+  /**
+   * Processes the given number of blocks, each the given time after
+   * the previous one.
+   */
+  void
+  Blocks (const unsigned n, const ms interval)
+  {
+    for (unsigned i = 0; i < n; ++i)
+      {
+        now += interval;
+        sizer->BlockProcessed (now);
+      }
+  }
+
+};
+
+TEST_F (AdaptiveBatchSizerTests, NoBatchingWithoutMeasurements)
+{
+  EXPECT_EQ (sizer->GetBatchSize (), 1u);
+  Blocks (1, ms (1));
+  EXPECT_EQ (sizer->GetBatchSize (), 1u);
+  EXPECT_TRUE (sizer->ShouldFlush (1, ms (0)));
+}
+
+TEST_F (AdaptiveBatchSizerTests, SizeFromBlockInterval)
+{
+  Blocks (10, ms (1));
+  EXPECT_EQ (sizer->GetBatchSize (), 1'000u);
+
+  Reset ();
+  Blocks (10, ms (100));
+  EXPECT_EQ (sizer->GetBatchSize (), 100u);
+
+  /* Blocks near the tip arriving slower than the window are not
+     batched at all.  */
+  Reset ();
+  Blocks (10, ms (20'000));
+  EXPECT_EQ (sizer->GetBatchSize (), 1u);
+}
+
+TEST_F (AdaptiveBatchSizerTests, CommitLatencyReducesSize)
+{
+  Blocks (10, ms (100));
+  sizer->BatchCommitted (ms (5'000));
+  EXPECT_EQ (sizer->GetBatchSize (), 50u);
+
+  /* The latency is smoothed, so now we expect 8s.  */
+  sizer->BatchCommitted (ms (20'000));
+  EXPECT_EQ (sizer->GetBatchSize (), 20u);
+
+  for (unsigned i = 0; i < 20; ++i)
+    sizer->BatchCommitted (ms (20'000));
+  EXPECT_EQ (sizer->GetBatchSize (), 1u);
+}
+
+TEST_F (AdaptiveBatchSizerTests, UnsyncedAgeForcesFlush)
+{
+  Blocks (10, ms (100));
+  EXPECT_FALSE (sizer->ShouldFlush (5, ms (1'000)));
+  EXPECT_TRUE (sizer->ShouldFlush (5, ms (9'950)));
+  EXPECT_TRUE (sizer->ShouldFlush (100, ms (0)));
+
+  /* Between blocks, the expected block interval is not taken into account.  */
+  EXPECT_FALSE (sizer->DataLossDue (ms (9'950)));
+  sizer->BatchCommitted (ms (100));
+  EXPECT_TRUE (sizer->DataLossDue (ms (9'950)));
+}
+
+TEST_F (AdaptiveBatchSizerTests, FlushAtTarget)
+{
+  Blocks (10, ms (1));
+  sizer->SetRemainingBlocks (3);
+
+  Blocks (2, ms (1));
+  EXPECT_FALSE (sizer->ShouldFlush (2, ms (0)));
+  Blocks (1, ms (1));
+  EXPECT_TRUE (sizer->ShouldFlush (3, ms (0)));
+  Blocks (1, ms (1));
+  EXPECT_FALSE (sizer->ShouldFlush (1, ms (0)));
+}
+
+TEST_F (AdaptiveBatchSizerTests, RollbackReducesCap)
+{
+  Blocks (10, ms (1));
+  EXPECT_EQ (sizer->GetBatchSize (), 1'000u);
+
+  sizer->BatchRolledBack (100);
+  EXPECT_EQ (sizer->GetBatchSize (), 50u);
+  sizer->BatchRolledBack (1);
+  EXPECT_EQ (sizer->GetBatchSize (), 1u);
+
+  sizer->BatchCommitted (ms (0));
+  EXPECT_EQ (sizer->GetBatchSize (), 2u);
+  for (unsigned i = 0; i < 20; ++i)
+    sizer->BatchCommitted (ms (0));
+  EXPECT_EQ (sizer->GetBatchSize (), 1'000u);
+}
+
+TEST_F (TransactionManagerTests, AdaptiveBatching)
+{
+  {
+    InSequence dummy;
+
+    /* The first block is committed on its own, since nothing is known
+       about the timing yet.  */
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+
+    /* Then we batch up to the maximum size.  */
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+
+    /* The last block reaches the target.  */
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+  }
+
+  AdaptiveBatchSizer::Limits limits;
+  limits.maxBatchSize = 3;
+  limits.maxDataLoss = std::chrono::hours (1);
+  tm.EnableAdaptiveBatching (limits);
+
+  /* The fixed batch size is ignored.  */
+  tm.SetBatchSize (1);
+  tm.SetRemainingBlocks (5);
+
+  for (unsigned i = 0; i < 5; ++i)
+    {
+      tm.BeginTransaction ();
+      tm.CommitTransaction ();
+    }
+}
+
+TEST_F (TransactionManagerTests, FlushIfDue)
+{
+  {
+    InSequence dummy;
+
+    /* The first block is committed on its own, the second is batched until
+       the data-loss window is reached.  */
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+    EXPECT_CALL (storage, BeginTransactionMock ());
+    EXPECT_CALL (storage, CommitTransactionMock ());
+  }
+
+  using Clock = AdaptiveBatchSizer::Clock;
+
+  tm.SetExplicitBlocks (true);
+
+  /* Without adaptive batching, there is no window.  */
+  EXPECT_FALSE (tm.FlushIfDue (Clock::now ()));
+
+  AdaptiveBatchSizer::Limits limits;
+  limits.maxBatchSize = 100;
+  limits.maxDataLoss = std::chrono::hours (1);
+  tm.EnableAdaptiveBatching (limits);
+
+  for (unsigned i = 0; i < 2; ++i)
+    {
+      tm.BeginTransaction ();
+      tm.CommitTransaction ();
+      tm.BlockProcessed ();
+    }
+  EXPECT_FALSE (tm.FlushIfDue (Clock::now ()));
+
+  /* The batch has been started before now, so this is past its window.  */
+  const auto later = Clock::now () + std::chrono::hours (2);
+
+  /* Nothing is committed in the middle of a transaction.  */
+  tm.BeginTransaction ();
+  EXPECT_FALSE (tm.FlushIfDue (later));
+  tm.CommitTransaction ();
+
+  EXPECT_TRUE (tm.FlushIfDue (later));
+  EXPECT_FALSE (tm.FlushIfDue (later));
+}
+
 } // anonymous namespace
 } // namespace internal
 } // namespace spacexpanse
@@ -0,0 +1,188 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "undocompression.hpp"
+
+#include <spacexpanseutil/compression.hpp>
+
+#include <glog/logging.h>
+
+namespace spacexpanse
+{
+
+namespace
+{
+
+/**
+ * Magic bytes at the start of undo data written by CompressedUndoStorage.
+ * They are followed by one byte for the format, four bytes (little endian)
+ * for the uncompressed size and then the payload.
+ */
+constexpr const char MAGIC[] = "\xFFSXU";
+
+/** Length of the magic bytes.  */
+constexpr size_t MAGIC_LENGTH = sizeof (MAGIC) - 1;
+
+/** Total length of the header.  */
+constexpr size_t HEADER_LENGTH = MAGIC_LENGTH + 1 + 4;
+
+/** Format byte for data stored uncompressed.  */
+constexpr char FORMAT_RAW = 'r';
+/** Format byte for raw-deflate data.  */
+constexpr char FORMAT_DEFLATE = 'd';
+
+/** Clock used to time (un)compression.  */
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Returns the elapsed time since the given start as microseconds.
+ */
+std::chrono::microseconds
+Elapsed (const Clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds> (
+      Clock::now () - start);
+}
+
+/**
+ * Constructs the header for stored undo data.
+ */
+std::string
+Header (const char format, const uint32_t size)
+{
+  std::string res(MAGIC, MAGIC_LENGTH);
+  res.push_back (format);
+  for (unsigned i = 0; i < 4; ++i)
+    res.push_back (static_cast<char> ((size >> (8 * i)) & 0xFF));
+  return res;
+}
+
+} // anonymous namespace
+
+CompressedUndoStorage::CompressedUndoStorage (StorageInterface& s,
+                                              const Codec c)
+  : storage(&s), codec(c)
+{
+  CHECK (storage != nullptr);
+}
+
+CompressedUndoStorage::~CompressedUndoStorage ()
+{
+  if (stats.blocks == 0)
+    return;
+
+  LOG (INFO)
+      << "Undo data of " << stats.blocks << " blocks compressed from "
+      << stats.uncompressedBytes << " to " << stats.storedBytes
+      << " bytes (ratio " << stats.GetRatio () << ") in "
+      << stats.compressTime.count () << " us";
+}
+
+CompressedUndoStorage::Codec
+CompressedUndoStorage::CodecFromString (const std::string& name)
+{
+  if (name == "none")
+    return Codec::NONE;
+  if (name == "zlib")
+    return Codec::ZLIB;
+  if (name == "fast")
+    return Codec::ZLIB_FAST;
+
+  LOG (FATAL) << "Invalid undo compression codec: " << name;
+  return Codec::NONE;
+}
+
+bool
+CompressedUndoStorage::GetUndoData (const uint256& hash, UndoData& data) const
+{
+  UndoData stored;
+  if (!storage->GetUndoData (hash, stored))
+    return false;
+
+  if (stored.size () < HEADER_LENGTH
+        || stored.compare (0, MAGIC_LENGTH, MAGIC) != 0)
+    {
+      VLOG (1)
+          << "Undo data for " << hash.ToHex () << " is not compressed";
+      data = std::move (stored);
+      return true;
+    }
+
+  const char format = stored[MAGIC_LENGTH];
+  uint32_t size = 0;
+  for (unsigned i = 0; i < 4; ++i)
+    size |= static_cast<uint32_t> (
+        static_cast<unsigned char> (stored[MAGIC_LENGTH + 1 + i])) << (8 * i);
+
+  switch (format)
+    {
+    case FORMAT_RAW:
+      data = stored.substr (HEADER_LENGTH);
+      break;
+
+    case FORMAT_DEFLATE:
+      {
+        const auto start = Clock::now ();
+        CHECK (UncompressData (stored.substr (HEADER_LENGTH), size, data))
+            << "Failed to uncompress undo data for " << hash.ToHex ();
+        stats.uncompressTime += Elapsed (start);
+        break;
+      }
+
+    default:
+      LOG (FATAL)
+          << "Invalid undo data format " << static_cast<int> (format)
+          << " for " << hash.ToHex ();
+    }
+
+  CHECK_EQ (data.size (), size)
+      << "Undo data for " << hash.ToHex () << " has unexpected size";
+  ++stats.reads;
+
+  return true;
+}
+
+void
+CompressedUndoStorage::AddUndoData (const uint256& hash, const unsigned height,
+                                    const UndoData& data)
+{
+  CHECK_LE (data.size (), UINT32_MAX) << "Undo data is too large";
+
+  const auto start = Clock::now ();
+
+  std::string compressed;
+  switch (codec)
+    {
+    case Codec::NONE:
+      break;
+    case Codec::ZLIB:
+      compressed = CompressData (data);
+      break;
+    case Codec::ZLIB_FAST:
+      compressed = CompressDataWithLevel (data, 1);
+      break;
+    }
+
+  UndoData stored;
+  if (codec != Codec::NONE && compressed.size () < data.size ())
+    stored = Header (FORMAT_DEFLATE, data.size ()) + compressed;
+  else
+    stored = Header (FORMAT_RAW, data.size ()) + data;
+
+  const auto time = Elapsed (start);
+
+  ++stats.blocks;
+  stats.uncompressedBytes += data.size ();
+  stats.storedBytes += stored.size ();
+  stats.compressTime += time;
+
+  VLOG (1)
+      << "Undo data for block " << height << " (" << hash.ToHex () << "): "
+      << data.size () << " bytes stored as " << stored.size ()
+      << ", compressed in " << time.count () << " us";
+
+  storage->AddUndoData (hash, height, stored);
+}
+
+} // namespace spacexpanse
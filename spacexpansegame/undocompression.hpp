@@ -0,0 +1,252 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_UNDOCOMPRESSION_HPP
+#define SPACEXPANSEGAME_UNDOCOMPRESSION_HPP
+
+#include "storage.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace spacexpanse
+{
+
+/**
+ * Wrapper around any StorageInterface that transparently compresses the
+ * undo data before it is passed to the wrapped storage, and uncompresses
+ * it again when it is read.  All other methods just call through.
+ *
+ * Compressed undo data is stored with a small header that identifies the
+ * codec and the uncompressed size.  Undo data without that header is
+ * returned as-is, so that the wrapper can be enabled on an existing
+ * storage with uncompressed undo data.  If compression does not make
+ * the data smaller, it is stored uncompressed (but with header).
+ *
+ * Like the other storages, this class is not thread-safe.
+ */
+class CompressedUndoStorage : public StorageInterface
+{
+
+public:
+
+  /**
+   * The codec used for compressing new undo data.  Reading works for
+   * data written with any of the codecs.
+   */
+  enum class Codec
+  {
+    /** No compression, new undo data is stored as-is.  */
+    NONE,
+    /** Raw deflate with the best (but slowest) compression level.  */
+    ZLIB,
+    /** Raw deflate with the fastest compression level.  */
+    ZLIB_FAST,
+  };
+
+  /**
+   * Statistics about the compression of undo data.
+   */
+  struct Stats
+  {
+
+    /** Number of blocks for which undo data has been added.  */
+    uint64_t blocks = 0;
+
+    /** Total size of the undo data passed in.  */
+    uint64_t uncompressedBytes = 0;
+
+    /** Total size of the undo data stored (including headers).  */
+    uint64_t storedBytes = 0;
+
+    /** Total time spent compressing undo data.  */
+    std::chrono::microseconds compressTime{0};
+
+    /** Number of times undo data has been read.  */
+    uint64_t reads = 0;
+
+    /** Total time spent uncompressing undo data when reading it.  */
+    std::chrono::microseconds uncompressTime{0};
+
+    /**
+     * Returns the overall compression ratio (stored size divided by
+     * original size), or 1 if no data has been added yet.
+     */
+    double
+    GetRatio () const
+    {
+      if (uncompressedBytes == 0)
+        return 1.0;
+      return static_cast<double> (storedBytes) / uncompressedBytes;
+    }
+
+  };
+
+private:
+
+  /** The wrapped storage interface.  */
+  StorageInterface* const storage;
+
+  /** The codec used for new undo data.  */
+  const Codec codec;
+
+  /** Statistics about compression.  */
+  mutable Stats stats;
+
+public:
+
+  explicit CompressedUndoStorage (StorageInterface& s, Codec c);
+  ~CompressedUndoStorage ();
+
+  CompressedUndoStorage () = delete;
+  CompressedUndoStorage (const CompressedUndoStorage&) = delete;
+  void operator= (const CompressedUndoStorage&) = delete;
+
+  /**
+   * Parses a codec from its name ("none", "zlib" or "fast").  Crashes
+   * for invalid names.
+   */
+  static Codec CodecFromString (const std::string& name);
+
+  /**
+   * Returns the statistics about compression so far.
+   */
+  const Stats&
+  GetStats () const
+  {
+    return stats;
+  }
+
+  bool GetUndoData (const uint256& hash, UndoData& data) const override;
+  void AddUndoData (const uint256& hash, unsigned height,
+                    const UndoData& data) override;
+
+  /* The other methods from StorageInterface simply call through to the
+     wrapped instance.  */
+
+  void
+  Initialise () override
+  {
+    storage->Initialise ();
+  }
+
+  void
+  Clear () override
+  {
+    storage->Clear ();
+  }
+
+  bool
+  GetCurrentBlockHash (uint256& hash) const override
+  {
+    return storage->GetCurrentBlockHash (hash);
+  }
+
+  GameStateData
+  GetCurrentGameState () const override
+  {
+    return storage->GetCurrentGameState ();
+  }
+
+  SharedGameStateData
+  GetCurrentGameStateShared () const override
+  {
+    return storage->GetCurrentGameStateShared ();
+  }
+
+  std::unique_ptr<StorageSnapshot>
+  GetReadSnapshot () const override
+  {
+    return storage->GetReadSnapshot ();
+  }
+
+  void
+  SetCurrentGameState (const uint256& hash, const GameStateData& data) override
+  {
+    storage->SetCurrentGameState (hash, data);
+  }
+
+  void
+  SetCurrentGameStateWithHeight (const uint256& hash, const unsigned height,
+                                 const GameStateData& data) override
+  {
+    storage->SetCurrentGameStateWithHeight (hash, height, data);
+  }
+
+  void
+  SetCurrentGameStateShared (const uint256& hash, const unsigned height,
+                             const SharedGameStateData& data) override
+  {
+    storage->SetCurrentGameStateShared (hash, height, data);
+  }
+
+  bool
+  GetCurrentBlockHeight (unsigned& height) const override
+  {
+    return storage->GetCurrentBlockHeight (height);
+  }
+
+  bool
+  GetBlockHeight (const uint256& hash, unsigned& height) const override
+  {
+    return storage->GetBlockHeight (hash, height);
+  }
+
+  void
+  ReleaseUndoData (const uint256& hash) override
+  {
+    storage->ReleaseUndoData (hash);
+  }
+
+  void
+  PruneUndoData (const unsigned height) override
+  {
+    storage->PruneUndoData (height);
+  }
+
+  unsigned
+  PruneUndoDataRange (const unsigned height, const unsigned limit) override
+  {
+    return storage->PruneUndoDataRange (height, limit);
+  }
+
+  void
+  BeginTransaction () override
+  {
+    storage->BeginTransaction ();
+  }
+
+  void
+  CommitTransaction () override
+  {
+    storage->CommitTransaction ();
+  }
+
+  void
+  RollbackTransaction () override
+  {
+    storage->RollbackTransaction ();
+  }
+
+  bool
+  SetDeferredSync (const bool enable) override
+  {
+    return storage->SetDeferredSync (enable);
+  }
+
+  void
+  SyncCommitted () override
+  {
+    storage->SyncCommitted ();
+  }
+
+};
+
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_UNDOCOMPRESSION_HPP
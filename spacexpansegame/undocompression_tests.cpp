@@ -0,0 +1,215 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "undocompression.hpp"
+
+#include "storage.hpp"
+
+#include "storage_tests.hpp"
+#include "testutils.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace spacexpanse
+{
+namespace
+{
+
+/**
+ * Compressed storage wrapping a memory storage that it owns, so that it can
+ * be used with the standard storage tests.  The memory storage is in a
+ * separate base class, so that it is constructed before the wrapper.
+ */
+class OwnedMemoryStorage
+{
+
+protected:
+
+  MemoryStorage memoryStorage;
+
+};
+
+template <CompressedUndoStorage::Codec C>
+  class CompressedMemoryStorage : private OwnedMemoryStorage,
+                                  public CompressedUndoStorage
+{
+
+public:
+
+  CompressedMemoryStorage ()
+    : CompressedUndoStorage (memoryStorage, C)
+  {}
+
+};
+
+using ZlibStorage = CompressedMemoryStorage<CompressedUndoStorage::Codec::ZLIB>;
+using FastStorage
+    = CompressedMemoryStorage<CompressedUndoStorage::Codec::ZLIB_FAST>;
+using NoneStorage = CompressedMemoryStorage<CompressedUndoStorage::Codec::NONE>;
+
+INSTANTIATE_TYPED_TEST_CASE_P (UndoCompressionZlib, BasicStorageTests,
+                               ZlibStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (UndoCompressionZlib, PruningStorageTests,
+                               ZlibStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (UndoCompressionFast, BasicStorageTests,
+                               FastStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (UndoCompressionNone, BasicStorageTests,
+                               NoneStorage);
+
+/* ************************************************************************** */
+
+class UndoCompressionTests : public testing::Test
+{
+
+protected:
+
+  MemoryStorage base;
+
+  /**
+   * Returns some compressible undo data of roughly the given size.
+   */
+  static UndoData
+  CompressibleData (const size_t size)
+  {
+    UndoData res;
+    for (unsigned i = 0; res.size () < size; ++i)
+      res += "undo entry " + std::to_string (i % 50) + ";";
+    return res;
+  }
+
+  /**
+   * Adds undo data through the given storage and reads it back, expecting
+   * the same data.
+   */
+  static void
+  ExpectRoundTrip (StorageInterface& s, const UndoData& data)
+  {
+    s.BeginTransaction ();
+    s.AddUndoData (BlockHash (1), 1, data);
+    s.CommitTransaction ();
+
+    UndoData read;
+    ASSERT_TRUE (s.GetUndoData (BlockHash (1), read));
+    EXPECT_EQ (read, data);
+  }
+
+};
+
+TEST_F (UndoCompressionTests, Compressed)
+{
+  CompressedUndoStorage storage(base, CompressedUndoStorage::Codec::ZLIB);
+  const UndoData data = CompressibleData (10'000);
+  ExpectRoundTrip (storage, data);
+
+  UndoData raw;
+  ASSERT_TRUE (base.GetUndoData (BlockHash (1), raw));
+  EXPECT_LT (raw.size (), data.size () / 2);
+
+  const auto& stats = storage.GetStats ();
+  EXPECT_EQ (stats.blocks, 1u);
+  EXPECT_EQ (stats.reads, 1u);
+  EXPECT_EQ (stats.uncompressedBytes, data.size ());
+  EXPECT_EQ (stats.storedBytes, raw.size ());
+  EXPECT_LT (stats.GetRatio (), 0.5);
+}
+
+TEST_F (UndoCompressionTests, IncompressibleStoredRaw)
+{
+  CompressedUndoStorage storage(base, CompressedUndoStorage::Codec::ZLIB);
+  const UndoData data = "x";
+  ExpectRoundTrip (storage, data);
+
+  UndoData raw;
+  ASSERT_TRUE (base.GetUndoData (BlockHash (1), raw));
+  EXPECT_GT (raw.size (), data.size ());
+  EXPECT_EQ (raw.substr (raw.size () - data.size ()), data);
+}
+
+TEST_F (UndoCompressionTests, EmptyData)
+{
+  CompressedUndoStorage storage(base, CompressedUndoStorage::Codec::ZLIB);
+  ExpectRoundTrip (storage, "");
+}
+
+TEST_F (UndoCompressionTests, LegacyUncompressed)
+{
+  const UndoData data = CompressibleData (1'000);
+  base.BeginTransaction ();
+  base.AddUndoData (BlockHash (1), 1, data);
+  base.CommitTransaction ();
+
+  CompressedUndoStorage storage(base, CompressedUndoStorage::Codec::ZLIB);
+  UndoData read;
+  ASSERT_TRUE (storage.GetUndoData (BlockHash (1), read));
+  EXPECT_EQ (read, data);
+}
+
+TEST_F (UndoCompressionTests, CodecsInteroperate)
+{
+  const UndoData data = CompressibleData (1'000);
+  {
+    CompressedUndoStorage storage(base,
+                                  CompressedUndoStorage::Codec::ZLIB_FAST);
+    storage.BeginTransaction ();
+    storage.AddUndoData (BlockHash (1), 1, data);
+    storage.CommitTransaction ();
+  }
+
+  CompressedUndoStorage storage(base, CompressedUndoStorage::Codec::NONE);
+  UndoData read;
+  ASSERT_TRUE (storage.GetUndoData (BlockHash (1), read));
+  EXPECT_EQ (read, data);
+}
+
+TEST_F (UndoCompressionTests, CodecFromString)
+{
+  EXPECT_EQ (CompressedUndoStorage::CodecFromString ("none"),
+             CompressedUndoStorage::Codec::NONE);
+  EXPECT_EQ (CompressedUndoStorage::CodecFromString ("zlib"),
+             CompressedUndoStorage::Codec::ZLIB);
+  EXPECT_EQ (CompressedUndoStorage::CodecFromString ("fast"),
+             CompressedUndoStorage::Codec::ZLIB_FAST);
+  EXPECT_DEATH (CompressedUndoStorage::CodecFromString ("lz4"),
+                "Invalid undo compression codec");
+}
+
+TEST_F (UndoCompressionTests, StatsAccumulate)
+{
+  constexpr unsigned numBlocks = 5;
+  const UndoData data = CompressibleData (10'000);
+
+  for (const auto codec : {CompressedUndoStorage::Codec::ZLIB,
+                           CompressedUndoStorage::Codec::ZLIB_FAST})
+    {
+      MemoryStorage mem;
+      CompressedUndoStorage storage(mem, codec);
+      storage.BeginTransaction ();
+      for (unsigned i = 1; i <= numBlocks; ++i)
+        storage.AddUndoData (BlockHash (i), i, data);
+      storage.CommitTransaction ();
+      for (unsigned i = 1; i <= numBlocks; ++i)
+        {
+          UndoData read;
+          ASSERT_TRUE (storage.GetUndoData (BlockHash (i), read));
+          ASSERT_EQ (read, data);
+        }
+
+      const auto& stats = storage.GetStats ();
+      EXPECT_EQ (stats.blocks, numBlocks);
+      EXPECT_EQ (stats.reads, numBlocks);
+      EXPECT_EQ (stats.uncompressedBytes, numBlocks * data.size ());
+      EXPECT_LT (stats.GetRatio (), 0.5);
+    }
+}
+
+} // anonymous namespace
+} // namespace spacexpanse
@@ -0,0 +1,189 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zmqrecording.hpp"
+
+#include <glog/logging.h>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+namespace
+{
+
+/** Magic string at the start of each recording file.  */
+constexpr const char MAGIC[] = "SPXZMQREC1";
+
+/**
+ * Writes an unsigned integer in little-endian byte order.
+ */
+template <typename T>
+  void
+  WriteInt (std::ostream& out, T val)
+{
+  char bytes[sizeof (T)];
+  for (size_t i = 0; i < sizeof (T); ++i)
+    {
+      bytes[i] = static_cast<char> (val & 0xFF);
+      val >>= 8;
+    }
+  out.write (bytes, sizeof (T));
+}
+
+/**
+ * Reads an unsigned integer in little-endian byte order.  Returns false
+ * if the end of the stream was reached before reading all bytes.
+ */
+template <typename T>
+  bool
+  ReadInt (std::istream& in, T& val)
+{
+  unsigned char bytes[sizeof (T)];
+  if (!in.read (reinterpret_cast<char*> (bytes), sizeof (T)))
+    return false;
+
+  val = 0;
+  for (size_t i = 0; i < sizeof (T); ++i)
+    val |= static_cast<T> (bytes[i]) << (8 * i);
+
+  return true;
+}
+
+/**
+ * Writes a string prefixed by its length.
+ */
+void
+WriteString (std::ostream& out, const std::string& str)
+{
+  WriteInt<uint32_t> (out, str.size ());
+  out.write (str.data (), str.size ());
+}
+
+/**
+ * Reads a length-prefixed string.  Returns false if the stream ended
+ * before the full string could be read.
+ */
+bool
+ReadString (std::istream& in, std::string& str)
+{
+  uint32_t len;
+  if (!ReadInt (in, len))
+    return false;
+
+  str.resize (len);
+  return len == 0 || static_cast<bool> (in.read (&str[0], len));
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+ZmqRecorder::ZmqRecorder (const std::string& file, const std::string& gameId,
+                          const std::string& chain)
+  : out(file, std::ios::binary | std::ios::trunc), start(Clock::now ())
+{
+  CHECK (out) << "Failed to open ZMQ recording file " << file;
+  LOG (INFO) << "Recording ZMQ messages to " << file;
+
+  out.write (MAGIC, sizeof (MAGIC) - 1);
+  WriteString (out, gameId);
+  WriteString (out, chain);
+  CHECK (out);
+}
+
+void
+ZmqRecorder::Record (const std::string& topic,
+                     const char* payload, const size_t payloadSize,
+                     const uint32_t seq)
+{
+  const auto time = std::chrono::duration_cast<std::chrono::microseconds> (
+      Clock::now () - start);
+
+  std::lock_guard<std::mutex> lock(mut);
+
+  WriteInt<uint64_t> (out, time.count ());
+  WriteInt<uint32_t> (out, seq);
+
+  /* A topic index equal to the current size of the table means that a
+     new topic follows, which then gets that index.  */
+  auto mit = topics.find (topic);
+  if (mit == topics.end ())
+    {
+      const uint32_t index = topics.size ();
+      topics.emplace (topic, index);
+      WriteInt<uint32_t> (out, index);
+      WriteString (out, topic);
+    }
+  else
+    WriteInt<uint32_t> (out, mit->second);
+
+  WriteInt<uint32_t> (out, payloadSize);
+  out.write (payload, payloadSize);
+  CHECK (out) << "Failed to write to ZMQ recording";
+}
+
+void
+ZmqRecorder::Flush ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  out.flush ();
+}
+
+/* ************************************************************************** */
+
+ZmqRecordingReader::ZmqRecordingReader (const std::string& file)
+  : in(file, std::ios::binary)
+{
+  CHECK (in) << "Failed to open ZMQ recording file " << file;
+
+  std::string magic(sizeof (MAGIC) - 1, '\0');
+  CHECK (in.read (&magic[0], magic.size ()) && magic == MAGIC)
+      << file << " is not a ZMQ recording";
+  CHECK (ReadString (in, gameId) && ReadString (in, chain))
+      << "Failed to read header of ZMQ recording " << file;
+
+  LOG (INFO)
+      << "Opened ZMQ recording " << file
+      << " for game " << gameId << " on chain " << chain;
+}
+
+bool
+ZmqRecordingReader::Next (RecordedMessage& msg)
+{
+  uint64_t time;
+  if (!ReadInt (in, time))
+    return false;
+
+  bool ok = true;
+  uint32_t topicIndex;
+  ok = ok && ReadInt (in, msg.seq);
+  ok = ok && ReadInt (in, topicIndex);
+
+  if (ok && topicIndex == topics.size ())
+    {
+      std::string topic;
+      ok = ReadString (in, topic);
+      if (ok)
+        topics.push_back (std::move (topic));
+    }
+
+  ok = ok && ReadString (in, msg.payload);
+
+  if (!ok)
+    {
+      LOG (WARNING) << "Ignoring truncated message at end of ZMQ recording";
+      return false;
+    }
+
+  CHECK_LT (topicIndex, topics.size ()) << "Invalid topic in ZMQ recording";
+  msg.topic = topics[topicIndex];
+  msg.time = std::chrono::microseconds (time);
+
+  return true;
+}
+
+} // namespace internal
+} // namespace spacexpanse
@@ -0,0 +1,169 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_ZMQRECORDING_HPP
+#define SPACEXPANSEGAME_ZMQRECORDING_HPP
+
+/* This file is an implementation detail of Game and should not be
+   used directly by external code!  */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace spacexpanse
+{
+namespace internal
+{
+
+/**
+ * A single ZMQ message as stored in a recording.
+ */
+struct RecordedMessage
+{
+
+  /** Time when the message was received, relative to the recording start.  */
+  std::chrono::microseconds time{0};
+
+  /** The message topic.  */
+  std::string topic;
+
+  /** The message payload (i.e. the JSON data as string).  */
+  std::string payload;
+
+  /** The sequence number of the message.  */
+  uint32_t seq = 0;
+
+};
+
+/**
+ * Writes the ZMQ messages received by a ZmqSubscriber to a file, so that
+ * they can later be replayed (e.g. for benchmarking the game logic offline
+ * without a running SpaceXpanse daemon).
+ *
+ * The file starts with a magic string and the game ID and chain the
+ * recording is for (which the replay needs to set up the game).  Then
+ * follow the messages, each with the receiving time, the sequence number,
+ * the topic and the payload.  Since there are only very few distinct
+ * topics, they are stored as indices into a table, which is extended
+ * on the fly when a new topic is first seen.  All integers are stored
+ * in little-endian byte order.
+ */
+class ZmqRecorder
+{
+
+private:
+
+  /** Clock used for the message times.  */
+  using Clock = std::chrono::steady_clock;
+
+  /** The output stream.  */
+  std::ofstream out;
+
+  /** Lock for writing to the file.  */
+  std::mutex mut;
+
+  /** The time the recording started.  */
+  const Clock::time_point start;
+
+  /** Indices of the topics seen so far.  */
+  std::unordered_map<std::string, uint32_t> topics;
+
+public:
+
+  /**
+   * Opens the given file (truncating it if it exists already) and
+   * writes the header for a recording of the given game and chain.
+   */
+  explicit ZmqRecorder (const std::string& file, const std::string& gameId,
+                        const std::string& chain);
+
+  ZmqRecorder () = delete;
+  ZmqRecorder (const ZmqRecorder&) = delete;
+  void operator= (const ZmqRecorder&) = delete;
+
+  /**
+   * Appends a received message to the recording.  The payload is passed
+   * as raw buffer, so that it can be written directly from the received
+   * ZMQ message.
+   */
+  void Record (const std::string& topic,
+               const char* payload, size_t payloadSize, uint32_t seq);
+
+  void
+  Record (const std::string& topic, const std::string& payload,
+          const uint32_t seq)
+  {
+    Record (topic, payload.data (), payload.size (), seq);
+  }
+
+  /**
+   * Flushes all data written so far to disk.
+   */
+  void Flush ();
+
+};
+
+/**
+ * Reads back a recording written by ZmqRecorder.
+ */
+class ZmqRecordingReader
+{
+
+private:
+
+  /** The input stream.  */
+  std::ifstream in;
+
+  /** The game ID from the header.  */
+  std::string gameId;
+
+  /** The chain from the header.  */
+  std::string chain;
+
+  /** The topics read so far (by index).  */
+  std::vector<std::string> topics;
+
+public:
+
+  /**
+   * Opens the given file and reads the header.  Fails if the file is
+   * not a valid recording.
+   */
+  explicit ZmqRecordingReader (const std::string& file);
+
+  ZmqRecordingReader () = delete;
+  ZmqRecordingReader (const ZmqRecordingReader&) = delete;
+  void operator= (const ZmqRecordingReader&) = delete;
+
+  const std::string&
+  GetGameId () const
+  {
+    return gameId;
+  }
+
+  const std::string&
+  GetChain () const
+  {
+    return chain;
+  }
+
+  /**
+   * Reads the next message.  Returns false if there are no more messages.
+   * A truncated message at the end of the file (e.g. because the recording
+   * process was killed) is ignored with a warning.
+   */
+  bool Next (RecordedMessage& msg);
+
+};
+
+} // namespace internal
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_ZMQRECORDING_HPP
@@ -0,0 +1,139 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zmqrecording.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+namespace spacexpanse
+{
+namespace internal
+{
+namespace
+{
+
+class ZmqRecordingTests : public testing::Test
+{
+
+protected:
+
+  /** Temporary file used for the recording.  */
+  const std::string file;
+
+  ZmqRecordingTests ()
+    : file(std::tmpnam (nullptr))
+  {
+    LOG (INFO) << "Temporary file for ZMQ recording: " << file;
+  }
+
+  ~ZmqRecordingTests ()
+  {
+    std::remove (file.c_str ());
+  }
+
+  /**
+   * Reads the next message from the reader and checks that it
+   * matches the expected data.
+   */
+  static void
+  ExpectMessage (ZmqRecordingReader& reader, const std::string& topic,
+                 const std::string& payload, const uint32_t seq)
+  {
+    RecordedMessage msg;
+    ASSERT_TRUE (reader.Next (msg));
+    EXPECT_EQ (msg.topic, topic);
+    EXPECT_EQ (msg.payload, payload);
+    EXPECT_EQ (msg.seq, seq);
+  }
+
+};
+
+TEST_F (ZmqRecordingTests, RoundTrip)
+{
+  {
+    ZmqRecorder rec(file, "game", "regtest");
+    rec.Record ("topic a", "first", 1);
+    rec.Record ("topic b", "", 10);
+    rec.Record ("topic a", std::string ("with\0zero", 9), 2);
+  }
+
+  ZmqRecordingReader reader(file);
+  EXPECT_EQ (reader.GetGameId (), "game");
+  EXPECT_EQ (reader.GetChain (), "regtest");
+
+  ExpectMessage (reader, "topic a", "first", 1);
+  ExpectMessage (reader, "topic b", "", 10);
+  ExpectMessage (reader, "topic a", std::string ("with\0zero", 9), 2);
+
+  RecordedMessage msg;
+  EXPECT_FALSE (reader.Next (msg));
+}
+
+TEST_F (ZmqRecordingTests, MessageTimes)
+{
+  {
+    ZmqRecorder rec(file, "game", "main");
+    rec.Record ("topic", "first", 1);
+    rec.Record ("topic", "second", 2);
+  }
+
+  ZmqRecordingReader reader(file);
+  RecordedMessage first, second;
+  ASSERT_TRUE (reader.Next (first));
+  ASSERT_TRUE (reader.Next (second));
+  EXPECT_LE (first.time, second.time);
+}
+
+TEST_F (ZmqRecordingTests, TruncatedMessage)
+{
+  {
+    ZmqRecorder rec(file, "game", "main");
+    rec.Record ("topic", "complete", 1);
+    rec.Record ("topic", "truncated message", 2);
+  }
+
+  /* Cut off the last few bytes of the file, as if the recording process
+     had been killed while writing the message.  */
+  std::string data;
+  {
+    std::ifstream in(file, std::ios::binary);
+    data.assign (std::istreambuf_iterator<char> (in),
+                 std::istreambuf_iterator<char> ());
+  }
+  {
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    out.write (data.data (), data.size () - 5);
+  }
+
+  ZmqRecordingReader reader(file);
+  ExpectMessage (reader, "topic", "complete", 1);
+
+  RecordedMessage msg;
+  EXPECT_FALSE (reader.Next (msg));
+}
+
+TEST_F (ZmqRecordingTests, InvalidFile)
+{
+  {
+    std::ofstream out(file);
+    out << "not a recording";
+  }
+
+  EXPECT_DEATH (
+    {
+      ZmqRecordingReader reader(file);
+    }, "is not a ZMQ recording");
+}
+
+} // anonymous namespace
+} // namespace internal
+} // namespace spacexpanse
@@ -0,0 +1,410 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zmqreplayer.hpp"
+
+#include <spacexpanseutil/uint256.hpp>
+
+#include <json/json.h>
+#include <jsonrpccpp/common/errors.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace spacexpanse
+{
+
+/**
+ * JSON-RPC client connector that takes the place of the SpaceXpanse daemon
+ * during a replay.  It answers the RPC methods that Game uses for syncing
+ * based on the current "tip", which the replayer updates as it goes
+ * through the recorded blocks.
+ */
+class ZmqReplayer::RpcConnector : public jsonrpc::IClientConnector
+{
+
+private:
+
+  /** The chain of the recording.  */
+  const std::string chain;
+
+  /** Lock for the tip data.  */
+  std::mutex mut;
+
+  /** Height of the current tip.  */
+  unsigned tipHeight = 0;
+
+  /** Block hashes by height, as known from the replayed blocks.  */
+  std::map<unsigned, uint256> hashes;
+
+  /**
+   * Computes the result for a given method call.  Throws a JsonRpcException
+   * for methods that are not supported.
+   */
+  Json::Value
+  Call (const std::string& method, const Json::Value& params)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    if (method == "getblockchaininfo")
+      {
+        const auto mit = hashes.find (tipHeight);
+        CHECK (mit != hashes.end ());
+
+        Json::Value res(Json::objectValue);
+        res["chain"] = chain;
+        res["blocks"] = static_cast<Json::Int64> (tipHeight);
+        res["bestblockhash"] = mit->second.ToHex ();
+        return res;
+      }
+
+    if (method == "getblockhash")
+      {
+        const unsigned height = params[0].asUInt ();
+        const auto mit = hashes.find (height);
+        if (mit == hashes.end ())
+          throw jsonrpc::JsonRpcException (
+              jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+              "block hash not known in the recording");
+        return mit->second.ToHex ();
+      }
+
+    if (method == "getblockheader")
+      {
+        const std::string hash = params[0].asString ();
+        for (const auto& entry : hashes)
+          if (entry.second.ToHex () == hash)
+            {
+              Json::Value res(Json::objectValue);
+              res["hash"] = hash;
+              res["height"] = static_cast<Json::Int64> (entry.first);
+              return res;
+            }
+        throw jsonrpc::JsonRpcException (
+            jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+            "block not known in the recording");
+      }
+
+    if (method == "trackedgames")
+      return Json::Value ();
+
+    if (method == "getzmqnotifications" || method == "getrawmempool")
+      return Json::Value (Json::arrayValue);
+
+    if (method == "game_sendupdates")
+      throw jsonrpc::JsonRpcException (
+          jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+          "the game state does not match the start of the recording");
+
+    throw jsonrpc::JsonRpcException (
+        jsonrpc::Errors::ERROR_RPC_METHOD_NOT_FOUND,
+        method + " is not available during a replay");
+  }
+
+public:
+
+  explicit RpcConnector (const std::string& c)
+    : chain(c)
+  {}
+
+  /**
+   * Updates the current tip to the given block.
+   */
+  void
+  SetTip (const uint256& hash, const unsigned height)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    tipHeight = height;
+    hashes[height] = hash;
+  }
+
+  void
+  SendRPCMessage (const std::string& message, std::string& result) override
+  {
+    Json::Value request;
+    std::istringstream in(message);
+    CHECK (Json::parseFromStream (Json::CharReaderBuilder (), in,
+                                  &request, nullptr))
+        << "Invalid JSON-RPC request: " << message;
+
+    Json::Value response(Json::objectValue);
+    response["jsonrpc"] = "2.0";
+    response["id"] = request["id"];
+
+    try
+      {
+        response["result"]
+            = Call (request["method"].asString (), request["params"]);
+      }
+    catch (const jsonrpc::JsonRpcException& exc)
+      {
+        VLOG (1) << "Failing RPC call during replay: " << exc.what ();
+        Json::Value error(Json::objectValue);
+        error["code"] = exc.GetCode ();
+        error["message"] = exc.GetMessage ();
+        response["error"] = error;
+      }
+
+    Json::StreamWriterBuilder wbuilder;
+    wbuilder["indentation"] = "";
+    result = Json::writeString (wbuilder, response);
+  }
+
+};
+
+/* ************************************************************************** */
+
+void
+ZmqReplayer::Stats::Print (std::ostream& out, const std::string& label) const
+{
+  const uint64_t blocks = attaches + detaches;
+
+  out << "Replay with " << label << ":\n"
+      << "  blocks: " << attaches << " attached, " << detaches << " detached"
+      << ", pending moves: " << pending << "\n"
+      << "  total time: " << seconds << " s";
+  if (seconds > 0)
+    out << " (" << blocks / seconds << " blocks/s)";
+  out << "\n"
+      << "  block latency: p50 " << p50BlockLatency.count () << " us"
+      << ", p99 " << p99BlockLatency.count () << " us"
+      << ", max " << maxBlockLatency.count () << " us\n"
+      << "  storage commits: " << commits.commits
+      << ", total " << commits.totalTime.count () << " us";
+  if (commits.commits > 0)
+    out << ", average " << commits.totalTime.count () / commits.commits
+        << " us, max " << commits.maxTime.count () << " us";
+  out << "\n";
+
+  using CommitStats = internal::TransactionManager::CommitStats;
+  for (unsigned i = 0; i < CommitStats::LATENCY_BUCKETS; ++i)
+    {
+      if (commits.latencies[i] == 0)
+        continue;
+
+      out << "    ";
+      if (i == 0)
+        out << "< 1 ms";
+      else if (i + 1 == CommitStats::LATENCY_BUCKETS)
+        out << ">= " << (1u << (i - 1)) << " ms";
+      else
+        out << (1u << (i - 1)) << "-" << (1u << i) << " ms";
+      out << ": " << commits.latencies[i] << "\n";
+    }
+
+  out << std::flush;
+}
+
+/* ************************************************************************** */
+
+namespace
+{
+
+/**
+ * Types of recorded messages, as far as the replay is concerned.
+ */
+enum class MessageType
+{
+  ATTACH,
+  DETACH,
+  PENDING,
+};
+
+/**
+ * Determines the type of a recorded message from its topic.
+ */
+MessageType
+GetMessageType (const std::string& topic)
+{
+  if (topic.compare (0, 18, "game-block-attach ") == 0)
+    return MessageType::ATTACH;
+  if (topic.compare (0, 18, "game-block-detach ") == 0)
+    return MessageType::DETACH;
+  return MessageType::PENDING;
+}
+
+/**
+ * Extracts the block data (hash, parent and height) from the payload
+ * of a block notification.
+ */
+void
+ParseBlock (const std::string& payload,
+            uint256& hash, uint256& parent, unsigned& height)
+{
+  Json::Value data;
+  std::istringstream in(payload);
+  CHECK (Json::parseFromStream (Json::CharReaderBuilder (), in,
+                                &data, nullptr));
+
+  const auto& block = data["block"];
+  CHECK (hash.FromHex (block["hash"].asString ()));
+  CHECK (parent.FromHex (block["parent"].asString ()));
+  height = block["height"].asUInt ();
+}
+
+/**
+ * Returns the given percentile of a sorted list of latencies.
+ */
+std::chrono::microseconds
+Percentile (const std::vector<std::chrono::microseconds>& sorted,
+            const unsigned pct)
+{
+  if (sorted.empty ())
+    return std::chrono::microseconds (0);
+
+  const size_t index = std::min (sorted.size () - 1,
+                                 sorted.size () * pct / 100);
+  return sorted[index];
+}
+
+} // anonymous namespace
+
+ZmqReplayer::ZmqReplayer (const std::string& file)
+  : reader(file)
+{
+  rpc = std::make_unique<RpcConnector> (reader.GetChain ());
+}
+
+ZmqReplayer::~ZmqReplayer () = default;
+
+jsonrpc::IClientConnector&
+ZmqReplayer::GetRpcConnector ()
+{
+  return *rpc;
+}
+
+ZmqReplayer::Stats
+ZmqReplayer::Run (Game& g)
+{
+  CHECK (g.host == nullptr) << "Hosted games cannot be replayed";
+  CHECK (!g.zmq->IsRunning ());
+  CHECK_EQ (g.gameId, reader.GetGameId ())
+      << "Recording is for a different game";
+
+  /* The first block notification determines the tip that the game should
+     be at before the replay starts.  */
+  std::deque<internal::RecordedMessage> buffered;
+  while (true)
+    {
+      internal::RecordedMessage msg;
+      CHECK (reader.Next (msg)) << "Recording contains no blocks";
+      buffered.push_back (msg);
+
+      const MessageType type = GetMessageType (msg.topic);
+      if (type == MessageType::PENDING)
+        continue;
+
+      uint256 hash, parent;
+      unsigned height;
+      ParseBlock (msg.payload, hash, parent, height);
+      CHECK_GT (height, 0);
+      if (type == MessageType::ATTACH)
+        rpc->SetTip (parent, height - 1);
+      else
+        rpc->SetTip (hash, height);
+      break;
+    }
+
+  {
+    std::lock_guard<std::mutex> lock(g.mut);
+    g.ReinitialiseState ();
+    CHECK (g.state == Game::State::UP_TO_DATE
+              || g.state == Game::State::PREGENESIS)
+        << "Unexpected game state for replay: "
+        << Game::StateToString (g.state);
+  }
+
+  LOG (INFO) << "Replaying ZMQ messages for game " << g.gameId;
+  const auto commitsBefore = g.transactionManager.GetCommitStats ();
+
+  Stats stats;
+  std::vector<std::chrono::microseconds> latencies;
+  const auto start = Clock::now ();
+
+  while (true)
+    {
+      internal::RecordedMessage msg;
+      if (!buffered.empty ())
+        {
+          msg = std::move (buffered.front ());
+          buffered.pop_front ();
+        }
+      else if (!reader.Next (msg))
+        break;
+
+      if (realTime)
+        std::this_thread::sleep_until (start + msg.time);
+
+      /* A live game only subscribes to pending moves if it has a processor
+         for them, so skip them as well in the replay otherwise.  */
+      const MessageType type = GetMessageType (msg.topic);
+      if (type == MessageType::PENDING && g.pending == nullptr)
+        continue;
+
+      if (type != MessageType::PENDING)
+        {
+          uint256 hash, parent;
+          unsigned height;
+          ParseBlock (msg.payload, hash, parent, height);
+          if (type == MessageType::ATTACH)
+            rpc->SetTip (hash, height);
+          else
+            rpc->SetTip (parent, height - 1);
+        }
+
+      const auto before = Clock::now ();
+      CHECK (g.zmq->ReplayMessage (msg.topic, msg.payload, msg.seq))
+          << "Game failed to process replayed message";
+      const auto latency
+          = std::chrono::duration_cast<std::chrono::microseconds> (
+              Clock::now () - before);
+
+      switch (type)
+        {
+        case MessageType::ATTACH:
+          ++stats.attaches;
+          latencies.push_back (latency);
+          break;
+        case MessageType::DETACH:
+          ++stats.detaches;
+          latencies.push_back (latency);
+          break;
+        case MessageType::PENDING:
+          ++stats.pending;
+          break;
+        }
+    }
+
+  stats.seconds = std::chrono::duration<double> (Clock::now () - start).count ();
+
+  std::sort (latencies.begin (), latencies.end ());
+  stats.p50BlockLatency = Percentile (latencies, 50);
+  stats.p99BlockLatency = Percentile (latencies, 99);
+  if (!latencies.empty ())
+    stats.maxBlockLatency = latencies.back ();
+
+  g.transactionManager.WaitForSync ();
+  const auto commitsAfter = g.transactionManager.GetCommitStats ();
+  stats.commits.commits = commitsAfter.commits - commitsBefore.commits;
+  stats.commits.totalTime = commitsAfter.totalTime - commitsBefore.totalTime;
+  stats.commits.maxTime = commitsAfter.maxTime;
+  for (unsigned i = 0; i < stats.commits.latencies.size (); ++i)
+    stats.commits.latencies[i]
+        = commitsAfter.latencies[i] - commitsBefore.latencies[i];
+
+  LOG (INFO)
+      << "Replayed " << stats.attaches + stats.detaches << " blocks and "
+      << stats.pending << " pending moves in " << stats.seconds << " s";
+
+  return stats;
+}
+
+} // namespace spacexpanse
@@ -0,0 +1,145 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SPACEXPANSEGAME_ZMQREPLAYER_HPP
+#define SPACEXPANSEGAME_ZMQREPLAYER_HPP
+
+#include "game.hpp"
+#include "transactionmanager.hpp"
+#include "zmqrecording.hpp"
+
+#include <jsonrpccpp/client.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+namespace spacexpanse
+{
+
+/**
+ * Replays a recording of ZMQ notifications (made with
+ * Game::EnableZmqRecording) into a Game instance, without the need for
+ * a running SpaceXpanse daemon.  This can be used to benchmark the game
+ * logic and storage against real traffic in a reproducible way.
+ *
+ * The game needs to be connected to the RPC connector returned by
+ * GetRpcConnector instead of a real daemon.  It fakes the few RPC methods
+ * that Game needs based on the blocks in the recording.  The game state
+ * in the storage must either be empty or match the start of the recording.
+ */
+class ZmqReplayer
+{
+
+public:
+
+  /**
+   * Statistics about a replay run.
+   */
+  struct Stats
+  {
+
+    /** Number of attached blocks.  */
+    uint64_t attaches = 0;
+
+    /** Number of detached blocks.  */
+    uint64_t detaches = 0;
+
+    /** Number of pending-move notifications.  */
+    uint64_t pending = 0;
+
+    /** Total (wall-clock) time of the replay in seconds.  */
+    double seconds = 0.0;
+
+    /** Median latency of processing a block notification.  */
+    std::chrono::microseconds p50BlockLatency{0};
+
+    /** 99th percentile of the block processing latency.  */
+    std::chrono::microseconds p99BlockLatency{0};
+
+    /** Maximum block processing latency.  */
+    std::chrono::microseconds maxBlockLatency{0};
+
+    /** Statistics about the storage commits during the replay.  */
+    internal::TransactionManager::CommitStats commits;
+
+    /**
+     * Prints a human-readable report of the statistics, labelled
+     * with the given name (e.g. the storage type).
+     */
+    void Print (std::ostream& out, const std::string& label) const;
+
+  };
+
+private:
+
+  class RpcConnector;
+
+  /** Clock used for timing.  */
+  using Clock = std::chrono::steady_clock;
+
+  /** The recording we replay.  */
+  internal::ZmqRecordingReader reader;
+
+  /** The fake daemon connector.  */
+  std::unique_ptr<RpcConnector> rpc;
+
+  /**
+   * Whether messages are replayed at the recorded timing, instead of
+   * as fast as possible.
+   */
+  bool realTime = false;
+
+public:
+
+  /**
+   * Opens the given recording file for replay.
+   */
+  explicit ZmqReplayer (const std::string& file);
+
+  ~ZmqReplayer ();
+
+  ZmqReplayer () = delete;
+  ZmqReplayer (const ZmqReplayer&) = delete;
+  void operator= (const ZmqReplayer&) = delete;
+
+  /**
+   * Returns the game ID of the recording.
+   */
+  const std::string&
+  GetGameId () const
+  {
+    return reader.GetGameId ();
+  }
+
+  /**
+   * Returns the RPC connector to which the game has to be connected.
+   * It uses JSON-RPC version 2.
+   */
+  jsonrpc::IClientConnector& GetRpcConnector ();
+
+  /**
+   * Sets whether messages should be replayed at the recorded timing
+   * rather than as fast as possible (the default).
+   */
+  void
+  SetRealTime (const bool rt)
+  {
+    realTime = rt;
+  }
+
+  /**
+   * Replays all messages into the given game, which must have its storage
+   * and rules set up already and must not be running.  Returns the
+   * statistics of the replay.
+   */
+  Stats Run (Game& g);
+
+};
+
+} // namespace spacexpanse
+
+#endif // SPACEXPANSEGAME_ZMQREPLAYER_HPP
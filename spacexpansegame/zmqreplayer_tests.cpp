@@ -0,0 +1,277 @@
+// Copyright (C) 2023 The SpaceXpanse developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zmqreplayer.hpp"
+
+#include "gamelogic.hpp"
+#include "lmdbstorage.hpp"
+#include "sqlitestorage.hpp"
+#include "storage.hpp"
+#include "zmqrecording.hpp"
+
+#include "testutils.hpp"
+
+#include <json/json.h>
+#include <jsonrpccpp/common/exception.h>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <experimental/filesystem>
+
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace spacexpanse
+{
+namespace
+{
+
+namespace fs = std::experimental::filesystem;
+
+constexpr const char GAME_ID[] = "test-game";
+constexpr unsigned GENESIS_HEIGHT = 10;
+
+constexpr const char ATTACH_TOPIC[] = "game-block-attach json test-game";
+constexpr const char DETACH_TOPIC[] = "game-block-detach json test-game";
+
+/**
+ * Simple game whose state is the concatenation of all moves.  The undo
+ * data is just the previous state.
+ */
+class AppendingGame : public GameLogic
+{
+
+protected:
+
+  GameStateData
+  GetInitialStateInternal (unsigned& height, std::string& hashHex) override
+  {
+    height = GENESIS_HEIGHT;
+    hashHex = BlockHash (GENESIS_HEIGHT).ToHex ();
+    return "";
+  }
+
+  GameStateData
+  ProcessForwardInternal (const GameStateData& oldState,
+                          const Json::Value& blockData,
+                          UndoData& undoData) override
+  {
+    std::string res = oldState;
+    for (const auto& m : blockData["moves"])
+      res += m["move"].asString ();
+    undoData = oldState;
+    return res;
+  }
+
+  GameStateData
+  ProcessBackwardsInternal (const GameStateData& newState,
+                            const Json::Value& blockData,
+                            const UndoData& undoData) override
+  {
+    return undoData;
+  }
+
+};
+
+class ZmqReplayerTests : public testing::Test
+{
+
+protected:
+
+  /** Temporary file for the recording.  */
+  const std::string file;
+
+  /** Temporary directory for persistent storages.  */
+  const fs::path dir;
+
+  AppendingGame rules;
+
+  ZmqReplayerTests ()
+    : file(std::tmpnam (nullptr)), dir(std::tmpnam (nullptr))
+  {
+    CHECK (fs::create_directories (dir));
+  }
+
+  ~ZmqReplayerTests ()
+  {
+    std::remove (file.c_str ());
+    fs::remove_all (dir);
+  }
+
+  /**
+   * Returns the payload for a block notification.
+   */
+  static std::string
+  BlockPayload (const unsigned height, const std::string& move)
+  {
+    Json::Value block(Json::objectValue);
+    block["hash"] = BlockHash (height).ToHex ();
+    block["parent"] = BlockHash (height - 1).ToHex ();
+    block["height"] = height;
+    block["rngseed"] = BlockHash (height).ToHex ();
+
+    Json::Value mv(Json::objectValue);
+    mv["name"] = "domob";
+    mv["move"] = move;
+
+    Json::Value data(Json::objectValue);
+    data["block"] = block;
+    data["moves"] = Json::Value (Json::arrayValue);
+    data["moves"].append (mv);
+
+    std::ostringstream out;
+    out << data;
+    return out.str ();
+  }
+
+  /**
+   * Writes a recording with the genesis block and then the given number
+   * of further blocks with moves "a" or "b".  Before the last block,
+   * a reorg (detach and reattach) is done.
+   */
+  void
+  WriteRecording (const unsigned numBlocks)
+  {
+    CHECK_GE (numBlocks, 2);
+
+    internal::ZmqRecorder rec(file, GAME_ID, "main");
+    uint32_t attachSeq = 0;
+    uint32_t detachSeq = 0;
+
+    for (unsigned h = GENESIS_HEIGHT; h < GENESIS_HEIGHT + numBlocks; ++h)
+      rec.Record (ATTACH_TOPIC, BlockPayload (h, h % 2 == 0 ? "a" : "b"),
+                  attachSeq++);
+
+    const unsigned last = GENESIS_HEIGHT + numBlocks - 1;
+    rec.Record (DETACH_TOPIC, BlockPayload (last, last % 2 == 0 ? "a" : "b"),
+                detachSeq++);
+    rec.Record (ATTACH_TOPIC, BlockPayload (last, "x"), attachSeq++);
+    rec.Record (ATTACH_TOPIC, BlockPayload (last + 1, "y"), attachSeq++);
+  }
+
+  /**
+   * Replays the recording into a fresh game with the given storage,
+   * and returns the stats.
+   */
+  ZmqReplayer::Stats
+  Replay (StorageInterface& storage)
+  {
+    ZmqReplayer replayer(file);
+    EXPECT_EQ (replayer.GetGameId (), GAME_ID);
+
+    Game g(GAME_ID);
+    g.ConnectRpcClient (replayer.GetRpcConnector (),
+                        jsonrpc::JSONRPC_CLIENT_V2);
+    g.SetStorage (storage);
+    g.SetGameLogic (rules);
+
+    return replayer.Run (g);
+  }
+
+  /**
+   * Returns the expected final state after replaying a recording
+   * with the given number of blocks.
+   */
+  static std::string
+  ExpectedState (const unsigned numBlocks)
+  {
+    std::string res;
+    for (unsigned h = GENESIS_HEIGHT + 1; h < GENESIS_HEIGHT + numBlocks - 1;
+         ++h)
+      res += (h % 2 == 0 ? "a" : "b");
+    return res + "xy";
+  }
+
+};
+
+TEST_F (ZmqReplayerTests, FromGenesis)
+{
+  WriteRecording (5);
+
+  MemoryStorage storage;
+  const auto stats = Replay (storage);
+
+  EXPECT_EQ (storage.GetCurrentGameState (), ExpectedState (5));
+  uint256 hash;
+  ASSERT_TRUE (storage.GetCurrentBlockHash (hash));
+  EXPECT_EQ (hash, BlockHash (GENESIS_HEIGHT + 5));
+
+  EXPECT_EQ (stats.attaches, 7u);
+  EXPECT_EQ (stats.detaches, 1u);
+  EXPECT_EQ (stats.pending, 0u);
+  EXPECT_LE (stats.p50BlockLatency, stats.p99BlockLatency);
+  EXPECT_LE (stats.p99BlockLatency, stats.maxBlockLatency);
+}
+
+TEST_F (ZmqReplayerTests, FromExistingState)
+{
+  WriteRecording (5);
+
+  MemoryStorage storage;
+  storage.Initialise ();
+  storage.BeginTransaction ();
+  storage.SetCurrentGameStateWithHeight (BlockHash (GENESIS_HEIGHT - 1),
+                                         GENESIS_HEIGHT - 1, "foo");
+  storage.CommitTransaction ();
+
+  /* The move in the genesis block is applied here, since the state
+     is not the game's initial state from before that block.  */
+  Replay (storage);
+  EXPECT_EQ (storage.GetCurrentGameState (), "fooa" + ExpectedState (5));
+}
+
+TEST_F (ZmqReplayerTests, StateMismatch)
+{
+  WriteRecording (5);
+
+  MemoryStorage storage;
+  storage.Initialise ();
+  storage.BeginTransaction ();
+  storage.SetCurrentGameStateWithHeight (BlockHash (42), 42, "foo");
+  storage.CommitTransaction ();
+
+  EXPECT_THROW (Replay (storage), jsonrpc::JsonRpcException);
+}
+
+/**
+ * Replays a recording into the persistent storage types, checking that
+ * they end up with the same state as the memory storage.
+ */
+TEST_F (ZmqReplayerTests, PersistentStorages)
+{
+  constexpr unsigned numBlocks = 20;
+  WriteRecording (numBlocks);
+
+  const auto check = [&] (StorageInterface& storage, const std::string& label)
+    {
+      const auto stats = Replay (storage);
+      EXPECT_EQ (storage.GetCurrentGameState (), ExpectedState (numBlocks))
+          << label;
+      EXPECT_EQ (stats.attaches, numBlocks + 2) << label;
+      EXPECT_EQ (stats.detaches, 1u) << label;
+
+      std::ostringstream out;
+      stats.Print (out, label);
+      EXPECT_NE (out.str ().find (label), std::string::npos);
+    };
+
+  {
+    const fs::path lmdbDir = dir / "lmdb";
+    CHECK (fs::create_directories (lmdbDir));
+    LMDBStorage storage(lmdbDir.string ());
+    check (storage, "lmdb storage");
+  }
+
+  {
+    SQLiteStorage storage((dir / "storage.sqlite").string ());
+    check (storage, "sqlite storage");
+  }
+}
+
+} // anonymous namespace
+} // namespace spacexpanse
@@ -6,16 +6,420 @@
 
 #include <glog/logging.h>
 
-#include <sstream>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 namespace spacexpanse
 {
 namespace internal
 {
 
+struct ZmqSubscriber::Notification
+{
+
+  /** The type of notification.  */
+  TopicType type;
+
+  /** The game ID this is for.  */
+  std::string gameId;
+
+  /** The parsed JSON payload.  */
+  Json::Value data;
+
+  /** For a PENDING_BATCH notification, the moves in it (in order).  */
+  std::vector<Json::Value> moves;
+
+  /** Whether or not there was a sequence-number mismatch.  */
+  bool seqMismatch;
+
+};
+
+/* ************************************************************************** */
+
+/**
+ * Simple bounded FIFO queue of notifications, which is filled by the
+ * thread receiving from ZMQ and drained by the dispatching thread.  It also
+ * keeps track of some statistics about its usage.
+ */
+class ZmqSubscriber::NotificationQueue
+{
+
+private:
+
+  /** Clock used for measuring the stall time.  */
+  using StallClock = std::chrono::steady_clock;
+
+  /** Maximum number of elements in the queue.  */
+  const size_t capacity;
+
+  /** Lock for the state of this instance.  */
+  mutable std::mutex mut;
+
+  /** Signalled when an element has been pushed or the queue is closed.  */
+  std::condition_variable cvNotEmpty;
+  /** Signalled when an element has been popped or the queue is closed.  */
+  std::condition_variable cvNotFull;
+
+  /** The queued notifications.  */
+  std::deque<Notification> elements;
+
+  /**
+   * Set to true when no more elements will be pushed.  The consumer will
+   * still drain all elements that are already in the queue.
+   */
+  bool closed = false;
+
+  /**
+   * Set to true if the consumer has stopped.  In that case, pushing fails
+   * immediately and the producer should stop as well.
+   */
+  bool aborted = false;
+
+  /** Statistics about the queue.  */
+  PipelineStats stats;
+
+public:
+
+  explicit NotificationQueue (const size_t c)
+    : capacity(c)
+  {
+    CHECK_GT (capacity, 0);
+  }
+
+  NotificationQueue () = delete;
+  NotificationQueue (const NotificationQueue&) = delete;
+  void operator= (const NotificationQueue&) = delete;
+
+  /**
+   * Adds a new element, blocking while the queue is full.  Returns false
+   * if the consumer has aborted.
+   */
+  bool
+  Push (Notification&& n)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+
+    if (elements.size () >= capacity && !aborted)
+      {
+        const auto start = StallClock::now ();
+        cvNotFull.wait (lock, [this] ()
+          {
+            return elements.size () < capacity || aborted;
+          });
+        const auto stall = StallClock::now () - start;
+        stats.stallTime
+            += std::chrono::duration_cast<std::chrono::microseconds> (stall);
+      }
+
+    if (aborted)
+      return false;
+
+    elements.push_back (std::move (n));
+    stats.maxDepth = std::max (stats.maxDepth, elements.size ());
+    cvNotEmpty.notify_one ();
+
+    return true;
+  }
+
+  /**
+   * Removes the next element, blocking while the queue is empty.  Returns
+   * false if the queue is closed and empty (or the consumer aborted).
+   */
+  bool
+  Pop (Notification& n)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cvNotEmpty.wait (lock, [this] ()
+      {
+        return !elements.empty () || closed || aborted;
+      });
+
+    if (aborted || elements.empty ())
+      return false;
+
+    n = std::move (elements.front ());
+    elements.pop_front ();
+    ++stats.processed;
+    cvNotFull.notify_one ();
+
+    return true;
+  }
+
+  /**
+   * Marks the queue as closed, i.e. the producer will not push any more
+   * elements.
+   */
+  void
+  Close ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    closed = true;
+    cvNotEmpty.notify_all ();
+  }
+
+  /**
+   * Marks the queue as aborted by the consumer.  This wakes up a waiting
+   * producer, and drops all elements that are still queued.
+   */
+  void
+  Abort ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    aborted = true;
+    elements.clear ();
+    cvNotEmpty.notify_all ();
+    cvNotFull.notify_all ();
+  }
+
+  /**
+   * Returns the current statistics.
+   */
+  PipelineStats
+  GetStats () const
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    PipelineStats res = stats;
+    res.depth = elements.size ();
+    return res;
+  }
+
+};
+
+/* ************************************************************************** */
+
+/**
+ * Bounded FIFO queue of pending-move notifications, which is filled by the
+ * thread receiving from ZMQ and drained in batches by the thread processing
+ * pending moves.  It also keeps track of how many block notifications are
+ * waiting to be processed; while there are any, pending moves are held
+ * back so that they do not delay the blocks (e.g. by contending for the
+ * game's lock).  When the queue is full, the oldest moves are dropped;
+ * pending moves are best effort only anyway.
+ *
+ * Moves received before a block must never be forwarded after it, as they
+ * may have been confirmed in that very block.  Thus when a block arrives,
+ * all queued moves are taken out of the queue so that they can be forwarded
+ * as one batch directly ahead of the block, and a batch that is being
+ * forwarded at that moment is allowed to finish before that.
+ */
+class ZmqSubscriber::PendingQueue
+{
+
+private:
+
+  /** A queued notification together with the time it was received.  */
+  struct Entry
+  {
+    Notification n;
+    Clock::time_point received;
+  };
+
+  /** Maximum number of elements in the queue.  */
+  const size_t capacity;
+
+  /** Lock for the state of this instance.  */
+  mutable std::mutex mut;
+
+  /**
+   * Signalled when an element has been pushed, the last waiting block
+   * has been processed, or the queue is closed.
+   */
+  std::condition_variable cv;
+
+  /** The queued notifications.  */
+  std::deque<Entry> elements;
+
+  /** Number of block notifications received but not yet processed.  */
+  unsigned blocksWaiting = 0;
+
+  /** Set to true while a popped batch is being forwarded.  */
+  bool batchInFlight = false;
+
+  /** Set to true when the queue is closed.  */
+  bool closed = false;
+
+  /** Statistics about the queue.  */
+  PendingStats stats;
+
+public:
+
+  explicit PendingQueue (const size_t c)
+    : capacity(c)
+  {
+    CHECK_GT (capacity, 0);
+  }
+
+  PendingQueue () = delete;
+  PendingQueue (const PendingQueue&) = delete;
+  void operator= (const PendingQueue&) = delete;
+
+  /**
+   * Adds a new element, dropping the oldest one if the queue is full.
+   */
+  void
+  Push (Notification&& n)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    if (elements.size () >= capacity)
+      {
+        elements.pop_front ();
+        ++stats.dropped;
+      }
+
+    elements.emplace_back ();
+    elements.back ().n = std::move (n);
+    elements.back ().received = Clock::now ();
+    stats.maxDepth = std::max (stats.maxDepth, elements.size ());
+
+    cv.notify_all ();
+  }
+
+  /**
+   * Records that a block notification has been received and is waiting
+   * to be processed.  All moves still queued are removed into the batch,
+   * and must be forwarded before the block.  If a batch is currently being
+   * forwarded, this waits for it to be done.  After this returns, the
+   * queue will not forward any move received before the block.
+   */
+  void
+  BlockReceived (std::vector<Notification>& batch)
+  {
+    batch.clear ();
+
+    std::unique_lock<std::mutex> lock(mut);
+    ++blocksWaiting;
+
+    for (auto& e : elements)
+      batch.push_back (std::move (e.n));
+    elements.clear ();
+
+    if (!batch.empty ())
+      {
+        stats.flushed += batch.size ();
+        stats.processed += batch.size ();
+        ++stats.batches;
+      }
+
+    while (batchInFlight && !closed)
+      cv.wait (lock);
+  }
+
+  /**
+   * Records that a block notification has been processed.
+   */
+  void
+  BlockDone ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    CHECK_GT (blocksWaiting, 0);
+    --blocksWaiting;
+    if (blocksWaiting == 0)
+      cv.notify_all ();
+  }
+
+  /**
+   * Waits until there are queued elements and no blocks waiting, and then
+   * removes up to maxBatch elements into the batch.  Returns false if the
+   * queue has been closed.  Elements still queued at that point are
+   * dropped.  After a batch has been returned, BatchDone must be called
+   * once it has been forwarded.
+   */
+  bool
+  PopBatch (std::vector<Notification>& batch, const size_t maxBatch)
+  {
+    batch.clear ();
+
+    std::unique_lock<std::mutex> lock(mut);
+    bool deferred = false;
+    while (true)
+      {
+        if (closed)
+          return false;
+        if (!elements.empty ())
+          {
+            if (blocksWaiting == 0)
+              break;
+            deferred = true;
+          }
+        cv.wait (lock);
+      }
+
+    if (deferred)
+      ++stats.deferrals;
+
+    while (!elements.empty () && batch.size () < maxBatch)
+      {
+        batch.push_back (std::move (elements.front ().n));
+        elements.pop_front ();
+      }
+    stats.processed += batch.size ();
+    ++stats.batches;
+    batchInFlight = true;
+
+    return true;
+  }
+
+  /**
+   * Records that the batch returned by the last PopBatch has been
+   * forwarded (or abandoned).
+   */
+  void
+  BatchDone ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    CHECK (batchInFlight);
+    batchInFlight = false;
+    cv.notify_all ();
+  }
+
+  /**
+   * Marks the queue as closed, which makes the consumer stop.
+   */
+  void
+  Close ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    closed = true;
+    cv.notify_all ();
+  }
+
+  /**
+   * Returns the current statistics.
+   */
+  PendingStats
+  GetStats () const
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    PendingStats res = stats;
+    res.depth = elements.size ();
+    if (!elements.empty ())
+      res.oldestAge = std::chrono::duration_cast<std::chrono::microseconds> (
+          Clock::now () - elements.front ().received);
+    return res;
+  }
+
+};
+
+/* ************************************************************************** */
+
 ZmqSubscriber::ZmqSubscriber ()
   : running(false)
-{}
+{
+  Json::CharReaderBuilder rbuilder;
+  rbuilder["allowComments"] = false;
+  rbuilder["strictRoot"] = true;
+  rbuilder["failIfExtra"] = true;
+  /* SpaceXpanse Core's univalue accepts duplicate keys, so it may forward moves to
+     us that contain duplicate keys.  We need to handle them gracefully when
+     parsing.  With our options, JsonCpp will accept them, and dedup by
+     keeping only the last value.  */
+  rbuilder["rejectDupKeys"] = false;
+
+  jsonReader.reset (rbuilder.newCharReader ());
+}
 
 ZmqSubscriber::~ZmqSubscriber ()
 {
@@ -38,6 +442,40 @@ ZmqSubscriber::SetEndpointForPending (const std::string& address)
   addrPending = address;
 }
 
+bool
+ZmqSubscriber::ConfigureEndpoints (const Json::Value& notifications)
+{
+  bool foundBlocks = false;
+  for (const auto& val : notifications)
+    {
+      const auto& typeVal = val["type"];
+      if (!typeVal.isString ())
+        continue;
+
+      const auto& addrVal = val["address"];
+      CHECK (addrVal.isString ());
+      const std::string address = addrVal.asString ();
+      CHECK (!address.empty ());
+
+      const std::string type = typeVal.asString ();
+      if (type == "pubgameblocks")
+        {
+          LOG (INFO) << "Detected ZMQ blocks endpoint: " << address;
+          SetEndpoint (address);
+          foundBlocks = true;
+          continue;
+        }
+      if (type == "pubgamepending")
+        {
+          LOG (INFO) << "Detected ZMQ pending endpoint: " << address;
+          SetEndpointForPending (address);
+          continue;
+        }
+    }
+
+  return foundBlocks;
+}
+
 void
 ZmqSubscriber::AddListener (const std::string& gameId, ZmqListener* listener)
 {
@@ -45,8 +483,50 @@ ZmqSubscriber::AddListener (const std::string& gameId, ZmqListener* listener)
   listeners.emplace (gameId, listener);
 }
 
+void
+ZmqSubscriber::SetPipelineDepth (const size_t depth)
+{
+  CHECK (!IsRunning ());
+  pipelineDepth = depth;
+}
+
+void
+ZmqSubscriber::SetPendingQueue (const size_t capacity, const size_t batchSize)
+{
+  CHECK (!IsRunning ());
+  CHECK_GT (capacity, 0);
+  CHECK_GT (batchSize, 0);
+  pendingCapacity = capacity;
+  pendingBatchSize = batchSize;
+}
+
+void
+ZmqSubscriber::SetRecorder (ZmqRecorder* rec)
+{
+  CHECK (!IsRunning ());
+  recorder = rec;
+}
+
+ZmqSubscriber::PipelineStats
+ZmqSubscriber::GetPipelineStats () const
+{
+  std::lock_guard<std::mutex> lock(mutQueues);
+  if (queue == nullptr)
+    return PipelineStats ();
+  return queue->GetStats ();
+}
+
+ZmqSubscriber::PendingStats
+ZmqSubscriber::GetPendingStats () const
+{
+  std::lock_guard<std::mutex> lock(mutQueues);
+  if (pendingQueue == nullptr)
+    return PendingStats ();
+  return pendingQueue->GetStats ();
+}
+
 bool
-ZmqSubscriber::ReceiveMultiparts (std::string& topic, std::string& payload,
+ZmqSubscriber::ReceiveMultiparts (std::string& topic, zmq::message_t& payload,
                                   uint32_t& seq)
 {
   CHECK (!sockets.empty ());
@@ -87,27 +567,27 @@ ZmqSubscriber::ReceiveMultiparts (std::string& topic, std::string& payload,
       }
   CHECK (socket != nullptr);
 
-  /* Read all message parts from the socket.  */
+  /* Read all message parts from the socket.  The payload (which may be
+     large) is received directly into the caller's message, so that it
+     can be parsed from the ZMQ buffer without copying it.  */
+  zmq::message_t msg;
   for (unsigned parts = 1; ; ++parts)
     {
-      zmq::message_t msg;
-      CHECK (socket->recv (msg));
+      zmq::message_t& target = (parts == 2 ? payload : msg);
+      CHECK (socket->recv (target));
 
       switch (parts)
         {
         case 1:
           {
             const char* data = static_cast<const char*> (msg.data ());
-            topic = std::string (data, data + msg.size ());
+            topic.assign (data, msg.size ());
             break;
           }
 
         case 2:
-          {
-            const char* data = static_cast<const char*> (msg.data ());
-            payload = std::string (data, data + msg.size ());
-            break;
-          }
+          /* Already received into the payload message.  */
+          break;
 
         case 3:
           {
@@ -159,115 +639,303 @@ CheckTopicPrefix (const std::string& topic, const std::string& prefix,
 
 } // anonymous namespace
 
+bool
+ZmqSubscriber::Dispatch (const Notification& n)
+{
+  const auto range = listeners.equal_range (n.gameId);
+  try
+    {
+      for (auto i = range.first; i != range.second; ++i)
+        switch (n.type)
+          {
+          case TopicType::ATTACH:
+            i->second->BlockAttach (n.gameId, n.data, n.seqMismatch);
+            break;
+          case TopicType::DETACH:
+            i->second->BlockDetach (n.gameId, n.data, n.seqMismatch);
+            break;
+          case TopicType::PENDING:
+            i->second->PendingMove (n.gameId, n.data);
+            break;
+          case TopicType::PENDING_BATCH:
+            i->second->PendingMoves (n.gameId, n.moves);
+            break;
+          default:
+            LOG (FATAL)
+                << "Invalid topic type: " << static_cast<int> (n.type);
+          }
+    }
+  catch (const std::exception& exc)
+    {
+      LOG (ERROR)
+          << "Exception while processing ZMQ update: " << exc.what ();
+      return false;
+    }
+
+  return true;
+}
+
+std::vector<ZmqSubscriber::Notification>
+ZmqSubscriber::GroupPending (std::vector<Notification>& batch)
+{
+  std::vector<Notification> res;
+  std::unordered_map<std::string, size_t> byGame;
+  for (auto& n : batch)
+    {
+      CHECK (n.type == TopicType::PENDING);
+
+      auto mit = byGame.find (n.gameId);
+      if (mit == byGame.end ())
+        {
+          mit = byGame.emplace (n.gameId, res.size ()).first;
+          res.emplace_back ();
+          res.back ().type = TopicType::PENDING_BATCH;
+          res.back ().gameId = n.gameId;
+          res.back ().seqMismatch = false;
+        }
+
+      res[mit->second].moves.push_back (std::move (n.data));
+    }
+
+  return res;
+}
+
+bool
+ZmqSubscriber::DispatchPending (std::vector<Notification>& batch)
+{
+  for (const auto& n : GroupPending (batch))
+    if (!Dispatch (n))
+      return false;
+
+  return true;
+}
+
+void
+ZmqSubscriber::BlockDone (const Notification& n)
+{
+  if (pendingQueue == nullptr)
+    return;
+
+  switch (n.type)
+    {
+    case TopicType::ATTACH:
+    case TopicType::DETACH:
+      pendingQueue->BlockDone ();
+      break;
+    default:
+      break;
+    }
+}
+
+bool
+ZmqSubscriber::ParseMessage (const std::string& topic,
+                             const char* payload, const size_t payloadSize,
+                             const uint32_t seq, Notification& n)
+{
+  n.type = TopicType::UNKNOWN;
+  if (CheckTopicPrefix (topic, "game-block-attach json ", n.gameId))
+    n.type = TopicType::ATTACH;
+  else if (CheckTopicPrefix (topic, "game-block-detach json ", n.gameId))
+    n.type = TopicType::DETACH;
+  else if (CheckTopicPrefix (topic, "game-pending-move json ", n.gameId))
+    n.type = TopicType::PENDING;
+  else
+    LOG (FATAL) << "Unexpected topic of ZMQ notification: " << topic;
+
+  auto mit = lastSeq.find (topic);
+  if (mit == lastSeq.end ())
+    {
+      lastSeq.emplace (topic, seq);
+      n.seqMismatch = true;
+    }
+  else
+    {
+      n.seqMismatch = (seq != mit->second + 1);
+      mit->second = seq;
+    }
+
+  switch (n.type)
+    {
+    case TopicType::ATTACH:
+    case TopicType::DETACH:
+      lastBlockUpdate = Clock::now ();
+      break;
+    default:
+      break;
+    }
+
+  if (listeners.count (n.gameId) == 0)
+    return false;
+
+  std::string parseErrs;
+  CHECK (jsonReader->parse (payload, payload + payloadSize,
+                            &n.data, &parseErrs))
+      << "Error parsing notification JSON: " << parseErrs
+      << "\n" << std::string (payload, payloadSize);
+
+  return true;
+}
+
 void
 ZmqSubscriber::Listen (ZmqSubscriber* self)
 {
   if (self->noListeningForTesting)
     return;
 
-  Json::CharReaderBuilder rbuilder;
-  rbuilder["allowComments"] = false;
-  rbuilder["strictRoot"] = true;
-  rbuilder["failIfExtra"] = true;
-  /* SpaceXpanse Core's univalue accepts duplicate keys, so it may forward moves to
-     us that contain duplicate keys.  We need to handle them gracefully when
-     parsing.  With our options, JsonCpp will accept them, and dedup by
-     keeping only the last value.  */
-  rbuilder["rejectDupKeys"] = false;
+  /* With pipelining enabled, the listeners are called from a separate
+     thread, so that we can already receive and parse the next
+     notifications in the meantime.  */
+  std::unique_ptr<std::thread> dispatcher;
+  if (self->queue != nullptr)
+    dispatcher = std::make_unique<std::thread> (&ZmqSubscriber::DispatchQueued,
+                                                self);
+
+  /* Pending moves are processed on their own thread, so that they never
+     hold up the processing of blocks.  */
+  std::unique_ptr<std::thread> pendingThread;
+  if (self->pendingQueue != nullptr)
+    pendingThread = std::make_unique<std::thread> (
+        &ZmqSubscriber::ProcessPending, self);
 
   std::string topic;
-  std::string payload;
+  zmq::message_t payload;
   uint32_t seq;
+  std::vector<Notification> ahead;
   while (self->ReceiveMultiparts (topic, payload, seq))
     {
-      VLOG (1) << "Received " << topic << " with sequence number " << seq;
-      VLOG (2) << "Payload:\n" << payload;
+      const char* payloadData = static_cast<const char*> (payload.data ());
+      const size_t payloadSize = payload.size ();
 
-      enum class TopicType
-      {
-        UNKNOWN,
-        ATTACH,
-        DETACH,
-        PENDING,
-      };
-
-      std::string gameId;
-      TopicType type = TopicType::UNKNOWN;
-      if (CheckTopicPrefix (topic, "game-block-attach json ", gameId))
-        type = TopicType::ATTACH;
-      else if (CheckTopicPrefix (topic, "game-block-detach json ", gameId))
-        type = TopicType::DETACH;
-      else if (CheckTopicPrefix (topic, "game-pending-move json ", gameId))
-        type = TopicType::PENDING;
-      else
-        LOG (FATAL) << "Unexpected topic of ZMQ notification: " << topic;
+      VLOG (1)
+          << "Received " << topic << " with sequence number " << seq
+          << " and " << payloadSize << " bytes of payload";
+      VLOG (2) << "Payload:\n" << std::string (payloadData, payloadSize);
 
-      auto mit = self->lastSeq.find (topic);
-      bool seqMismatch;
-      if (mit == self->lastSeq.end ())
-        {
-          self->lastSeq.emplace (topic, seq);
-          seqMismatch = true;
-        }
-      else
+      if (self->recorder != nullptr)
+        self->recorder->Record (topic, payloadData, payloadSize, seq);
+
+      Notification n;
+      if (!self->ParseMessage (topic, payloadData, payloadSize, seq, n))
+        continue;
+
+      /* Pending moves still queued when a block arrives are forwarded
+         right ahead of it, so that the listeners see them in the order
+         they were received (and can then drop the ones confirmed in the
+         block), without holding back the block itself.  */
+      if (self->pendingQueue != nullptr)
         {
-          seqMismatch = (seq != mit->second + 1);
-          mit->second = seq;
+          if (n.type == TopicType::PENDING)
+            {
+              self->pendingQueue->Push (std::move (n));
+              continue;
+            }
+          self->pendingQueue->BlockReceived (ahead);
+          if (!ahead.empty ())
+            VLOG (1)
+                << "Forwarding " << ahead.size ()
+                << " queued pending moves ahead of block";
         }
 
-      switch (type)
+      if (self->queue == nullptr)
         {
-        case TopicType::ATTACH:
-        case TopicType::DETACH:
-          self->lastBlockUpdate = Clock::now ();
-          break;
-        default:
-          break;
+          const bool ok = self->DispatchPending (ahead)
+                            && self->Dispatch (n);
+          self->BlockDone (n);
+          if (!ok)
+            break;
         }
-
-      const auto range = self->listeners.equal_range (gameId);
-      if (range.first == self->listeners.end ())
-        continue;
-
-      Json::Value data;
-      std::string parseErrs;
-      std::istringstream in(payload);
-      CHECK (Json::parseFromStream (rbuilder, in, &data, &parseErrs))
-          << "Error parsing notification JSON: " << parseErrs
-          << "\n" << payload;
-
-      try
+      else
         {
-          for (auto i = range.first; i != range.second; ++i)
-            switch (type)
+          bool ok = true;
+          for (auto& batch : GroupPending (ahead))
+            if (!self->queue->Push (std::move (batch)))
               {
-              case TopicType::ATTACH:
-                i->second->BlockAttach (gameId, data, seqMismatch);
-                break;
-              case TopicType::DETACH:
-                i->second->BlockDetach (gameId, data, seqMismatch);
-                break;
-              case TopicType::PENDING:
-                i->second->PendingMove (gameId, data);
+                ok = false;
                 break;
-              default:
-                LOG (FATAL)
-                    << "Invalid topic type: " << static_cast<int> (type);
               }
-        }
-      catch (const std::exception& exc)
-        {
-          LOG (ERROR)
-              << "Exception while processing ZMQ update: " << exc.what ();
-          break;
+          if (!ok || !self->queue->Push (std::move (n)))
+            break;
         }
     }
 
+  if (dispatcher != nullptr)
+    {
+      self->queue->Close ();
+      dispatcher->join ();
+
+      const auto stats = self->queue->GetStats ();
+      LOG (INFO)
+          << "ZMQ pipeline processed " << stats.processed
+          << " notifications, maximum queue depth " << stats.maxDepth
+          << ", stalled for " << stats.stallTime.count () << " us";
+    }
+
+  if (pendingThread != nullptr)
+    {
+      self->pendingQueue->Close ();
+      pendingThread->join ();
+
+      const auto stats = self->pendingQueue->GetStats ();
+      LOG (INFO)
+          << "Processed " << stats.processed << " pending moves in "
+          << stats.batches << " batches, deferred " << stats.deferrals
+          << " times for blocks, dropped " << stats.dropped
+          << ", flushed " << stats.flushed << " ahead of blocks"
+          << ", maximum queue depth " << stats.maxDepth;
+    }
+
   self->running = false;
   for (auto& l : self->listeners)
     l.second->HasStopped ();
 }
 
+void
+ZmqSubscriber::DispatchQueued (ZmqSubscriber* self)
+{
+  Notification n;
+  while (self->queue->Pop (n))
+    {
+      /* If a stop has been requested, do not bother processing the
+         notifications that are still queued up.  */
+      if (self->shouldStop)
+        break;
+
+      /* If processing failed, make sure that also the receiving stage
+         stops (as it would without pipelining).  */
+      const bool ok = self->Dispatch (n);
+      self->BlockDone (n);
+      if (!ok)
+        {
+          self->shouldStop = true;
+          break;
+        }
+    }
+
+  self->queue->Abort ();
+}
+
+void
+ZmqSubscriber::ProcessPending (ZmqSubscriber* self)
+{
+  std::vector<Notification> batch;
+  while (self->pendingQueue->PopBatch (batch, self->pendingBatchSize))
+    {
+      bool ok = !self->shouldStop;
+      if (ok)
+        {
+          VLOG (1)
+              << "Processing batch of " << batch.size () << " pending moves";
+          ok = self->DispatchPending (batch);
+          if (!ok)
+            self->shouldStop = true;
+        }
+
+      self->pendingQueue->BatchDone ();
+      if (!ok)
+        break;
+    }
+}
+
 void
 ZmqSubscriber::Start ()
 {
@@ -320,12 +988,51 @@ ZmqSubscriber::Start ()
   /* Reset last-seen sequence numbers for a fresh start.  */
   lastSeq.clear ();
 
+  {
+    std::lock_guard<std::mutex> lock(mutQueues);
+
+    if (pipelineDepth > 0)
+      {
+        LOG (INFO)
+            << "Pipelining ZMQ notifications with queue depth "
+            << pipelineDepth;
+        queue = std::make_unique<NotificationQueue> (pipelineDepth);
+      }
+    else
+      queue.reset ();
+
+    if (!addrPending.empty ())
+      pendingQueue = std::make_unique<PendingQueue> (pendingCapacity);
+    else
+      pendingQueue.reset ();
+  }
+
   shouldStop = false;
   running = true;
   lastBlockUpdate = Clock::now ();
   worker = std::make_unique<std::thread> (&ZmqSubscriber::Listen, this);
 }
 
+bool
+ZmqSubscriber::ReplayMessage (const std::string& topic,
+                              const std::string& payload, const uint32_t seq)
+{
+  CHECK (!IsRunning ());
+
+  /* A replay starts at a game state that matches the beginning of the
+     recording, so unlike for a live connection, the first message
+     of each topic is not treated as a sequence mismatch.  */
+  const bool first = (lastSeq.count (topic) == 0);
+
+  Notification n;
+  if (!ParseMessage (topic, payload.data (), payload.size (), seq, n))
+    return true;
+  if (first)
+    n.seqMismatch = false;
+
+  return Dispatch (n);
+}
+
 void
 ZmqSubscriber::RequestStop ()
 {
@@ -346,5 +1053,190 @@ ZmqSubscriber::Stop ()
   sockets.clear ();
 }
 
+/* ************************************************************************** */
+
+struct QueuedZmqListener::Notification
+{
+
+  /** The type of notification.  */
+  enum class Type
+  {
+    ATTACH,
+    DETACH,
+    PENDING,
+    STOPPED,
+  };
+
+  Type type;
+
+  /** The game ID this is for.  */
+  std::string gameId;
+
+  /** The JSON payload.  */
+  Json::Value data;
+
+  /** The batch of moves for a pending notification.  */
+  std::vector<Json::Value> moves;
+
+  /** Whether or not there was a sequence-number mismatch.  */
+  bool seqMismatch;
+
+};
+
+QueuedZmqListener::QueuedZmqListener (ZmqListener& t, const ErrorCallback& cb)
+  : target(t), onError(cb)
+{
+  worker = std::thread ([this] () { Run (); });
+}
+
+QueuedZmqListener::~QueuedZmqListener ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cvQueued.notify_all ();
+  }
+
+  worker.join ();
+}
+
+void
+QueuedZmqListener::Push (Notification&& n)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  queue.push_back (std::move (n));
+  maxDepth = std::max (maxDepth, queue.size ());
+  cvQueued.notify_all ();
+}
+
+void
+QueuedZmqListener::Run ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      cvQueued.wait (lock, [this] ()
+        {
+          return shouldStop || !queue.empty ();
+        });
+      if (shouldStop)
+        break;
+
+      Notification n = std::move (queue.front ());
+      queue.pop_front ();
+      const bool skip = failed && n.type != Notification::Type::STOPPED;
+      busy = true;
+      lock.unlock ();
+
+      bool error = false;
+      if (!skip)
+        try
+          {
+            switch (n.type)
+              {
+              case Notification::Type::ATTACH:
+                target.BlockAttach (n.gameId, n.data, n.seqMismatch);
+                break;
+              case Notification::Type::DETACH:
+                target.BlockDetach (n.gameId, n.data, n.seqMismatch);
+                break;
+              case Notification::Type::PENDING:
+                target.PendingMoves (n.gameId, n.moves);
+                break;
+              case Notification::Type::STOPPED:
+                target.HasStopped ();
+                break;
+              }
+          }
+        catch (const std::exception& exc)
+          {
+            LOG (ERROR)
+                << "Exception while processing ZMQ update: " << exc.what ();
+            error = true;
+          }
+
+      if (error && onError)
+        onError ();
+
+      lock.lock ();
+      busy = false;
+      if (error)
+        failed = true;
+      else if (n.type == Notification::Type::STOPPED)
+        failed = false;
+      if (queue.empty ())
+        cvIdle.notify_all ();
+    }
+}
+
+void
+QueuedZmqListener::BlockAttach (const std::string& gameId,
+                                const Json::Value& data, const bool seqMismatch)
+{
+  Notification n;
+  n.type = Notification::Type::ATTACH;
+  n.gameId = gameId;
+  n.data = data;
+  n.seqMismatch = seqMismatch;
+  Push (std::move (n));
+}
+
+void
+QueuedZmqListener::BlockDetach (const std::string& gameId,
+                                const Json::Value& data, const bool seqMismatch)
+{
+  Notification n;
+  n.type = Notification::Type::DETACH;
+  n.gameId = gameId;
+  n.data = data;
+  n.seqMismatch = seqMismatch;
+  Push (std::move (n));
+}
+
+void
+QueuedZmqListener::PendingMove (const std::string& gameId,
+                                const Json::Value& data)
+{
+  PendingMoves (gameId, {data});
+}
+
+void
+QueuedZmqListener::PendingMoves (const std::string& gameId,
+                                 const std::vector<Json::Value>& moves)
+{
+  Notification n;
+  n.type = Notification::Type::PENDING;
+  n.gameId = gameId;
+  n.moves = moves;
+  n.seqMismatch = false;
+  Push (std::move (n));
+}
+
+void
+QueuedZmqListener::HasStopped ()
+{
+  Notification n;
+  n.type = Notification::Type::STOPPED;
+  n.seqMismatch = false;
+  Push (std::move (n));
+}
+
+void
+QueuedZmqListener::Flush ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  cvIdle.wait (lock, [this] ()
+    {
+      return shouldStop || (queue.empty () && !busy);
+    });
+}
+
+size_t
+QueuedZmqListener::GetMaxDepth () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return maxDepth;
+}
+
 } // namespace internal
 } // namespace spacexpanse
@@ -8,13 +8,21 @@
 /* This file is an implementation detail of Game and should not be
    used directly by external code!  */
 
+#include "zmqrecording.hpp"
+
 #include <zmq.hpp>
 
 #include <json/json.h>
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -62,6 +70,20 @@ public:
   virtual void PendingMove (const std::string& gameId,
                             const Json::Value& data) = 0;
 
+  /**
+   * Callback for a batch of pending moves (for the same game), which the
+   * subscriber has coalesced after they piled up while blocks were being
+   * processed.  The moves are in the order they were received.  By default,
+   * this just calls PendingMove for each of them.
+   */
+  virtual void
+  PendingMoves (const std::string& gameId,
+                const std::vector<Json::Value>& moves)
+  {
+    for (const auto& mv : moves)
+      PendingMove (gameId, mv);
+  }
+
   /**
    * Callback that is invoked when the ZMQ subscriber has stopped its
    * listening thread (i.e. when the thread stops, independent of whether
@@ -81,11 +103,96 @@ public:
 class ZmqSubscriber
 {
 
+public:
+
+  /**
+   * Statistics about the queue between the receiving/parsing stage and
+   * the dispatching stage, if pipelining is enabled.
+   */
+  struct PipelineStats
+  {
+
+    /** Number of notifications currently waiting in the queue.  */
+    size_t depth = 0;
+
+    /** Maximum queue depth seen so far.  */
+    size_t maxDepth = 0;
+
+    /** Total number of notifications that went through the queue.  */
+    uint64_t processed = 0;
+
+    /**
+     * Total time the receiving stage has been stalled, waiting for
+     * space in the (full) queue.
+     */
+    std::chrono::microseconds stallTime{0};
+
+  };
+
+  /**
+   * Statistics about the queue of pending moves, which are processed on
+   * their own thread and only while no block notifications are waiting.
+   */
+  struct PendingStats
+  {
+
+    /** Number of pending moves currently waiting in the queue.  */
+    size_t depth = 0;
+
+    /** Maximum queue depth seen so far.  */
+    size_t maxDepth = 0;
+
+    /** Total number of pending moves forwarded to the listeners.  */
+    uint64_t processed = 0;
+
+    /** Number of batches in which the processed moves were forwarded.  */
+    uint64_t batches = 0;
+
+    /** Number of pending moves dropped because the queue was full.  */
+    uint64_t dropped = 0;
+
+    /**
+     * Number of pending moves that were still queued when a block
+     * notification arrived, and were thus forwarded (as one batch)
+     * directly ahead of the block.  They are included in processed.
+     */
+    uint64_t flushed = 0;
+
+    /**
+     * Number of times processing of pending moves was deferred because
+     * block notifications were waiting.
+     */
+    uint64_t deferrals = 0;
+
+    /** Age of the oldest move in the queue (zero if it is empty).  */
+    std::chrono::microseconds oldestAge{0};
+
+  };
+
 private:
 
   /** The clock used to measure time since last block notification.  */
   using Clock = std::chrono::steady_clock;
 
+  /** The types of notifications that we handle.  */
+  enum class TopicType
+  {
+    UNKNOWN,
+    ATTACH,
+    DETACH,
+    PENDING,
+    PENDING_BATCH,
+  };
+
+  /** A notification that has been received and parsed already.  */
+  struct Notification;
+
+  /** Bounded queue of parsed notifications used for pipelining.  */
+  class NotificationQueue;
+
+  /** Queue of pending moves, which yields to block notifications.  */
+  class PendingQueue;
+
   /** The ZMQ endpoint to connect to for block updates.  */
   std::string addrBlocks;
   /** The ZMQ endpoint to connect to for pending moves.  */
@@ -127,20 +234,114 @@ private:
    */
   bool noListeningForTesting = false;
 
+  /**
+   * Maximum number of parsed notifications that may be queued up between
+   * the receiving and the dispatching stage.  If zero, then no pipelining
+   * is done and notifications are dispatched directly from the thread that
+   * receives and parses them.
+   */
+  size_t pipelineDepth = 0;
+
+  /**
+   * The queue for pipelined processing.  It is set in Start() if pipelining
+   * is enabled, and kept around afterwards so that stats can be queried.
+   */
+  std::unique_ptr<NotificationQueue> queue;
+
+  /** Maximum number of pending moves waiting to be processed.  */
+  size_t pendingCapacity = 10'000;
+
+  /** Maximum number of pending moves forwarded in one batch.  */
+  size_t pendingBatchSize = 100;
+
+  /**
+   * The queue of pending moves.  It is set in Start() if pending moves are
+   * enabled, and kept around afterwards so that stats can be queried.
+   */
+  std::unique_ptr<PendingQueue> pendingQueue;
+
+  /**
+   * Lock for replacing queue and pendingQueue in Start(), since their stats
+   * may be queried from other threads at any time.  The worker threads
+   * use the queues without it, as they only run while the pointers
+   * stay unchanged.
+   */
+  mutable std::mutex mutQueues;
+
+  /** If set, all received messages are recorded to it.  */
+  ZmqRecorder* recorder = nullptr;
+
+  /**
+   * The JSON reader used for parsing notifications.  It is created once
+   * and reused for all messages; it is only ever used from one thread at
+   * a time (the listening thread, or the caller of ReplayMessage).
+   */
+  std::unique_ptr<Json::CharReader> jsonReader;
+
   /**
    * Receives a three-part message sent by the SpaceXpanse daemon (consisting
-   * of topic and payload as strings as well as the serial number).  Returns
-   * false if the socket was closed or the subscriber stopped, and errors out
-   * on any other errors.
+   * of topic and payload as well as the serial number).  The payload is
+   * received directly into the given ZMQ message without copying it.
+   * The topic string is assigned in place, so that its buffer is reused
+   * across calls.  Returns false if the socket was closed or the subscriber
+   * stopped, and errors out on any other errors.
    */
-  bool ReceiveMultiparts (std::string& topic, std::string& payload,
+  bool ReceiveMultiparts (std::string& topic, zmq::message_t& payload,
                           uint32_t& seq);
 
+  /**
+   * Forwards a parsed notification to all listeners registered for its
+   * game ID.  Returns false if one of them threw an exception, in which
+   * case the subscriber should stop.
+   */
+  bool Dispatch (const Notification& n);
+
+  /**
+   * Groups a batch of pending-move notifications per game, into one
+   * PENDING_BATCH notification for each game in the batch.
+   */
+  static std::vector<Notification> GroupPending (
+      std::vector<Notification>& batch);
+
+  /**
+   * Forwards a batch of pending-move notifications to the listeners, with
+   * the moves grouped per game.  Returns false if one of the listeners threw.
+   */
+  bool DispatchPending (std::vector<Notification>& batch);
+
+  /**
+   * Marks a block notification as fully processed, which allows the
+   * pending moves to continue if no other blocks are waiting.
+   */
+  void BlockDone (const Notification& n);
+
+  /**
+   * Parses a received message into a notification, and updates the
+   * sequence-number tracking and staleness for it.  Returns false if the
+   * message is for a game without listeners, in which case the payload
+   * is not parsed and the notification should be ignored.
+   */
+  bool ParseMessage (const std::string& topic,
+                     const char* payload, size_t payloadSize,
+                     uint32_t seq, Notification& n);
+
   /**
    * Listens on the ZMQ socket for messages until the socket is closed.
    */
   static void Listen (ZmqSubscriber* self);
 
+  /**
+   * Runs the dispatching stage for pipelined processing, taking parsed
+   * notifications from the queue until it is closed.
+   */
+  static void DispatchQueued (ZmqSubscriber* self);
+
+  /**
+   * Runs the thread processing pending moves, taking batches from the
+   * pending queue whenever no block notifications are waiting.
+   */
+  static void ProcessPending (ZmqSubscriber* self);
+
   friend class BasicZmqSubscriberTests;
   friend class spacexpanse::GameTestFixture;
 
@@ -166,12 +367,56 @@ public:
    */
   void SetEndpointForPending (const std::string& address);
 
+  /**
+   * Configures the endpoints for blocks and pending moves from the
+   * result of SpaceXpanse Core's getzmqnotifications RPC method.  Returns
+   * false if no endpoint for game blocks is set up there.
+   */
+  bool ConfigureEndpoints (const Json::Value& notifications);
+
   /**
    * Adds a new listener for the given game ID.  Must not be called when
    * the subscriber is running.
    */
   void AddListener (const std::string& gameId, ZmqListener* listener);
 
+  /**
+   * Enables pipelined processing with the given maximum queue depth (or
+   * disables it if zero is passed).  With pipelining, the next notifications
+   * are received and their JSON parsed while the listeners are still busy
+   * processing the previous one (e.g. applying a block to the game state).
+   * Must not be called when the subscriber is running.
+   */
+  void SetPipelineDepth (size_t depth);
+
+  /**
+   * Configures the queue of pending moves:  At most the given number of
+   * moves are queued up (older ones are dropped when it is full), and
+   * they are forwarded to listeners in batches of at most the given size.
+   * Must not be called when the subscriber is running.
+   */
+  void SetPendingQueue (size_t capacity, size_t batchSize);
+
+  /**
+   * Sets a recorder to which all received messages are written (or
+   * disables recording if null is passed).  The recorder must stay valid
+   * while the subscriber is running.  Must not be called when the
+   * subscriber is running.
+   */
+  void SetRecorder (ZmqRecorder* rec);
+
+  /**
+   * Returns the current statistics of the pipeline queue.  If pipelining
+   * is not enabled, all values are zero.
+   */
+  PipelineStats GetPipelineStats () const;
+
+  /**
+   * Returns the current statistics of the pending-move queue.  If pending
+   * moves are not enabled, all values are zero.
+   */
+  PendingStats GetPendingStats () const;
+
   /**
    * Returns true if the ZMQ subscriber is currently running.
    */
@@ -209,6 +454,15 @@ public:
    */
   void Start ();
 
+  /**
+   * Processes a message from a recording as if it had been received,
+   * dispatching it to the listeners directly on the calling thread.
+   * Returns false if a listener failed to process it.  Must not be called
+   * when the subscriber is running.
+   */
+  bool ReplayMessage (const std::string& topic, const std::string& payload,
+                      uint32_t seq);
+
   /**
    * Signals the subscriber to stop.  This just tells the listening thread to
    * stop as soon as possible, but does not try to wait for it / join it.
@@ -222,6 +476,108 @@ public:
 
 };
 
+/**
+ * ZmqListener that forwards all notifications to another listener, but
+ * does so from its own worker thread.  Notifications are queued up in
+ * between, so that the subscriber does not wait for the target to process
+ * them.  This is used to dispatch from a single subscriber to multiple
+ * games, each of which processes its blocks on its own thread.
+ */
+class QueuedZmqListener : public ZmqListener
+{
+
+public:
+
+  /**
+   * Callback that is invoked (on the worker thread) if the target listener
+   * throws while processing a notification.
+   */
+  using ErrorCallback = std::function<void ()>;
+
+private:
+
+  /** A notification waiting in the queue.  */
+  struct Notification;
+
+  /** The listener to which notifications are forwarded.  */
+  ZmqListener& target;
+
+  /** The callback for processing errors.  */
+  const ErrorCallback onError;
+
+  /** Lock for the queue and flags.  */
+  mutable std::mutex mut;
+
+  /** Signalled when a notification is queued or we should stop.  */
+  std::condition_variable cvQueued;
+
+  /** Signalled when the worker has processed all queued notifications.  */
+  std::condition_variable cvIdle;
+
+  /** The queued notifications.  */
+  std::deque<Notification> queue;
+
+  /** Set while the worker is processing a notification.  */
+  bool busy = false;
+
+  /** Set when the worker thread should stop.  */
+  bool shouldStop = false;
+
+  /**
+   * Set after the target threw an exception.  In that case, all further
+   * notifications are dropped until the next HasStopped, as the target
+   * will need to reinitialise anyway.
+   */
+  bool failed = false;
+
+  /** Maximum number of queued notifications seen so far.  */
+  size_t maxDepth = 0;
+
+  /** The worker thread.  */
+  std::thread worker;
+
+  /**
+   * Adds a notification to the queue.
+   */
+  void Push (Notification&& n);
+
+  /**
+   * Runs the worker thread's main loop.
+   */
+  void Run ();
+
+public:
+
+  explicit QueuedZmqListener (ZmqListener& t, const ErrorCallback& cb);
+  ~QueuedZmqListener ();
+
+  QueuedZmqListener () = delete;
+  QueuedZmqListener (const QueuedZmqListener&) = delete;
+  void operator= (const QueuedZmqListener&) = delete;
+
+  void BlockAttach (const std::string& gameId,
+                    const Json::Value& data, bool seqMismatch) override;
+  void BlockDetach (const std::string& gameId,
+                    const Json::Value& data, bool seqMismatch) override;
+  void PendingMove (const std::string& gameId,
+                    const Json::Value& data) override;
+  void PendingMoves (const std::string& gameId,
+                     const std::vector<Json::Value>& moves) override;
+  void HasStopped () override;
+
+  /**
+   * Blocks until all notifications queued so far have been processed
+   * by the target listener.
+   */
+  void Flush ();
+
+  /**
+   * Returns the maximum number of queued notifications seen so far.
+   */
+  size_t GetMaxDepth () const;
+
+};
+
 } // namespace internal
 } // namespace spacexpanse
 
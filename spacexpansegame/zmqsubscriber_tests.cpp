@@ -6,10 +6,18 @@
 
 #include <zmq.hpp>
 
+#include <json/json.h>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <glog/logging.h>
+
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
@@ -25,6 +33,7 @@ namespace
 using testing::_;
 using testing::AnyNumber;
 using testing::InSequence;
+using testing::Invoke;
 using testing::Throw;
 
 constexpr const char IPC_ENDPOINT[] = "ipc:///tmp/spacexpansegame_zmqsubscriber_tests";
@@ -152,7 +161,13 @@ protected:
   ReceiveMultiparts (ZmqSubscriber& zmq, std::string& topic,
                      std::string& payload, uint32_t& seq)
   {
-    return zmq.ReceiveMultiparts (topic, payload, seq);
+    zmq::message_t payloadMsg;
+    if (!zmq.ReceiveMultiparts (topic, payloadMsg, seq))
+      return false;
+
+    payload.assign (static_cast<const char*> (payloadMsg.data ()),
+                    payloadMsg.size ());
+    return true;
   }
 
   /**
@@ -656,7 +671,10 @@ TEST_F (ZmqSubscriberPendingTests, MixedOneSocket)
 
   /* When we use just one socket for both types of notifications, then
      they should be received in exactly the order in which they are sent
-     (as we just read from that one socket sequentially).  */
+     (as we just read from that one socket sequentially).  A pending move
+     received before a block is never forwarded after it; if the block
+     arrives before the move has been processed, it is forwarded right
+     ahead of the block instead.  */
 
   {
     InSequence dummy;
@@ -667,9 +685,53 @@ TEST_F (ZmqSubscriberPendingTests, MixedOneSocket)
 
   SendMessage (zmqSocket, "game-block-detach json " + gameId, payload, 1);
   SendPending (zmqSocket, gameId, payload);
+  SleepSome ();
   SendMessage (zmqSocket, "game-block-attach json " + gameId, payload, 2);
 }
 
+TEST_F (ZmqSubscriberPendingTests, FlushedAheadOfBlock)
+{
+  zmq.SetEndpointForPending (IPC_ENDPOINT);
+  zmq.SetPipelineDepth (10);
+  zmq.Start ();
+  SleepSome ();
+
+  const std::string gameId = GAME_ID;
+
+  Json::Value first, second, move;
+  first["block"] = 1;
+  second["block"] = 2;
+  move["foo"] = "bar";
+
+  /* The move arrives while the first block is still being processed, and
+     is thus still queued when the second block arrives.  It must not be
+     forwarded after that block, as it may have been confirmed in it, but
+     it must not be lost either.  Instead, it is forwarded right before
+     the second block.  */
+
+  {
+    InSequence dummy;
+    EXPECT_CALL (mockListener, BlockAttach (gameId, first, _))
+        .WillOnce (Invoke ([] (const std::string& gameId,
+                               const Json::Value& data,
+                               const bool seqMismatch)
+          {
+            std::this_thread::sleep_for (std::chrono::milliseconds (50));
+          }));
+    EXPECT_CALL (mockListener, PendingMove (gameId, move));
+    EXPECT_CALL (mockListener, BlockAttach (gameId, second, _));
+  }
+
+  SendMessage (zmqSocket, "game-block-attach json " + gameId, first, 1);
+  SendPending (zmqSocket, gameId, move);
+  SendMessage (zmqSocket, "game-block-attach json " + gameId, second, 2);
+  std::this_thread::sleep_for (std::chrono::milliseconds (100));
+
+  const auto stats = zmq.GetPendingStats ();
+  EXPECT_EQ (stats.processed, 1u);
+  EXPECT_EQ (stats.flushed, 1u);
+}
+
 TEST_F (ZmqSubscriberPendingTests, MixedTwoSockets)
 {
   zmq.SetEndpointForPending (IPC_ENDPOINT_PENDING);
@@ -696,6 +758,458 @@ TEST_F (ZmqSubscriberPendingTests, MixedTwoSockets)
   SendMessage (zmqSocket, "game-block-attach json " + gameId, payload, 2);
 }
 
+class ZmqSubscriberPendingPriorityTests : public ZmqSubscriberPendingTests
+{
+
+protected:
+
+  const std::string attachTopic;
+
+  /** The block payload that is sent.  */
+  Json::Value block;
+
+  /** The pending moves sent while the block is being processed.  */
+  std::vector<Json::Value> moves;
+
+  /** Pending-queue stats at the end of processing the block.  */
+  ZmqSubscriber::PendingStats statsInBlock;
+
+  ZmqSubscriberPendingPriorityTests ()
+    : attachTopic(std::string ("game-block-attach json ") + GAME_ID)
+  {
+    block["block"] = 1;
+    for (int i = 0; i < 5; ++i)
+      {
+        Json::Value mv;
+        mv["move"] = i;
+        moves.push_back (mv);
+      }
+
+    /* With pipelining, the pending moves are received while the block
+       is still being processed.  */
+    zmq.SetEndpointForPending (IPC_ENDPOINT);
+    zmq.SetPipelineDepth (10);
+  }
+
+  /**
+   * Expects the block attach, which takes some time to process, and
+   * records the pending-queue stats at its end.
+   */
+  void
+  ExpectSlowBlock ()
+  {
+    EXPECT_CALL (mockListener, BlockAttach (GAME_ID, block, _))
+        .WillOnce (Invoke ([this] (const std::string& gameId,
+                                   const Json::Value& data,
+                                   const bool seqMismatch)
+          {
+            std::this_thread::sleep_for (std::chrono::milliseconds (50));
+            statsInBlock = zmq.GetPendingStats ();
+          }));
+  }
+
+  /**
+   * Sends the block notification followed by the pending moves.
+   */
+  void
+  SendBlockAndMoves ()
+  {
+    SendMessage (zmqSocket, attachTopic, block, 1);
+    for (const auto& mv : moves)
+      SendPending (zmqSocket, GAME_ID, mv);
+
+    std::this_thread::sleep_for (std::chrono::milliseconds (100));
+  }
+
+};
+
+TEST_F (ZmqSubscriberPendingPriorityTests, DeferredAndBatched)
+{
+  {
+    InSequence dummy;
+    ExpectSlowBlock ();
+    for (const auto& mv : moves)
+      EXPECT_CALL (mockListener, PendingMove (GAME_ID, mv));
+  }
+
+  zmq.Start ();
+  SleepSome ();
+  SendBlockAndMoves ();
+
+  EXPECT_EQ (statsInBlock.depth, moves.size ());
+  EXPECT_GT (statsInBlock.oldestAge.count (), 0);
+  EXPECT_EQ (statsInBlock.processed, 0u);
+
+  const auto stats = zmq.GetPendingStats ();
+  EXPECT_EQ (stats.depth, 0u);
+  EXPECT_EQ (stats.processed, moves.size ());
+  EXPECT_EQ (stats.batches, 1u);
+  EXPECT_GE (stats.deferrals, 1u);
+  EXPECT_EQ (stats.dropped, 0u);
+}
+
+TEST_F (ZmqSubscriberPendingPriorityTests, SmallBatches)
+{
+  {
+    InSequence dummy;
+    ExpectSlowBlock ();
+    for (const auto& mv : moves)
+      EXPECT_CALL (mockListener, PendingMove (GAME_ID, mv));
+  }
+
+  zmq.SetPendingQueue (100, 2);
+  zmq.Start ();
+  SleepSome ();
+  SendBlockAndMoves ();
+
+  const auto stats = zmq.GetPendingStats ();
+  EXPECT_EQ (stats.processed, moves.size ());
+  EXPECT_EQ (stats.batches, 3u);
+}
+
+TEST_F (ZmqSubscriberPendingPriorityTests, OldestDropped)
+{
+  {
+    InSequence dummy;
+    ExpectSlowBlock ();
+    EXPECT_CALL (mockListener, PendingMove (GAME_ID, moves[3]));
+    EXPECT_CALL (mockListener, PendingMove (GAME_ID, moves[4]));
+  }
+
+  zmq.SetPendingQueue (2, 100);
+  zmq.Start ();
+  SleepSome ();
+  SendBlockAndMoves ();
+
+  EXPECT_EQ (statsInBlock.depth, 2u);
+  EXPECT_EQ (statsInBlock.maxDepth, 2u);
+
+  const auto stats = zmq.GetPendingStats ();
+  EXPECT_EQ (stats.processed, 2u);
+  EXPECT_EQ (stats.dropped, 3u);
+}
+
+TEST (ZmqSubscriberPendingStatsTests, DisabledPending)
+{
+  ZmqSubscriber zmq;
+  const auto stats = zmq.GetPendingStats ();
+  EXPECT_EQ (stats.depth, 0u);
+  EXPECT_EQ (stats.processed, 0u);
+  EXPECT_EQ (stats.oldestAge.count (), 0);
+}
+
+/* ************************************************************************** */
+
+class ZmqSubscriberPipelineTests : public BasicZmqSubscriberTests
+{
+
+protected:
+
+  ZmqSubscriber zmq;
+
+  ZmqSubscriberPipelineTests ()
+  {
+    zmq.SetEndpoint (IPC_ENDPOINT);
+    zmq.AddListener (GAME_ID, &mockListener);
+    zmq.SetPipelineDepth (2);
+    zmq.Start ();
+    SleepSome ();
+  }
+
+  ~ZmqSubscriberPipelineTests ()
+  {
+    SleepSome ();
+  }
+
+  void
+  SendAttach (const Json::Value& payload, const uint32_t seq)
+  {
+    SendMessage (zmqSocket, std::string ("game-block-attach json ") + GAME_ID,
+                 payload, seq);
+  }
+
+};
+
+TEST_F (ZmqSubscriberPipelineTests, OrderAndSequenceNumbers)
+{
+  /* The listener is slow to process notifications, so that the queue
+     fills up and the receiving stage has to wait for it.  */
+  const auto slowHandler = [] (const std::string& gameId,
+                               const Json::Value& data, const bool seqMismatch)
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (20));
+    };
+
+  Json::Value payload;
+  {
+    InSequence dummy;
+    for (int i = 1; i <= 5; ++i)
+      {
+        payload["block"] = i;
+        EXPECT_CALL (mockListener, BlockAttach (GAME_ID, payload, i == 1))
+            .WillOnce (Invoke (slowHandler));
+      }
+  }
+
+  for (int i = 1; i <= 5; ++i)
+    {
+      payload["block"] = i;
+      SendAttach (payload, i);
+    }
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (200));
+
+  const auto stats = zmq.GetPipelineStats ();
+  EXPECT_EQ (stats.depth, 0);
+  EXPECT_EQ (stats.maxDepth, 2);
+  EXPECT_EQ (stats.processed, 5);
+  EXPECT_GT (stats.stallTime.count (), 0);
+}
+
+TEST_F (ZmqSubscriberPipelineTests, ExceptionInHandler)
+{
+  Json::Value payload;
+  payload["test"] = 42;
+
+  EXPECT_CALL (mockListener, BlockAttach (GAME_ID, _, _))
+      .WillOnce (Throw (std::runtime_error ("test")));
+
+  SendAttach (payload, 1);
+
+  while (mockListener.stopCalls < 1)
+    SleepSome ();
+  EXPECT_FALSE (zmq.IsRunning ());
+}
+
+TEST (ZmqSubscriberPipelineStatsTests, DisabledPipeline)
+{
+  ZmqSubscriber zmq;
+  const auto stats = zmq.GetPipelineStats ();
+  EXPECT_EQ (stats.depth, 0);
+  EXPECT_EQ (stats.maxDepth, 0);
+  EXPECT_EQ (stats.processed, 0);
+  EXPECT_EQ (stats.stallTime.count (), 0);
+}
+
+TEST_F (BasicZmqSubscriberTests, StatsWhileRestarting)
+{
+  ZmqSubscriber zmq;
+  zmq.SetEndpoint (IPC_ENDPOINT);
+  zmq.SetEndpointForPending (IPC_ENDPOINT);
+  zmq.AddListener (GAME_ID, &mockListener);
+  zmq.SetPipelineDepth (2);
+
+  /* Start() replaces the queues, while stats may be queried from
+     other threads at the same time.  */
+  std::atomic<bool> done(false);
+  std::thread reader([&] ()
+    {
+      while (!done)
+        {
+          EXPECT_EQ (zmq.GetPipelineStats ().depth, 0);
+          EXPECT_EQ (zmq.GetPendingStats ().depth, 0);
+        }
+    });
+
+  for (unsigned i = 0; i < 5; ++i)
+    {
+      zmq.Start ();
+      SleepSome ();
+      zmq.Stop ();
+    }
+
+  done = true;
+  reader.join ();
+}
+
+/* ************************************************************************** */
+
+class ZmqSubscriberRecordingTests : public BasicZmqSubscriberTests
+{
+
+protected:
+
+  /** Temporary file for the recording.  */
+  const std::string file;
+
+  ZmqSubscriberRecordingTests ()
+    : file(std::tmpnam (nullptr))
+  {}
+
+  ~ZmqSubscriberRecordingTests ()
+  {
+    std::remove (file.c_str ());
+  }
+
+};
+
+TEST_F (ZmqSubscriberRecordingTests, RecordAndReplay)
+{
+  const std::string topic = std::string ("game-block-attach json ") + GAME_ID;
+  Json::Value payload;
+
+  {
+    ZmqRecorder rec(file, GAME_ID, "regtest");
+    MockZmqListener liveListener;
+    EXPECT_CALL (liveListener, BlockAttach (GAME_ID, _, _)).Times (3);
+
+    ZmqSubscriber zmq;
+    zmq.SetEndpoint (IPC_ENDPOINT);
+    zmq.AddListener (GAME_ID, &liveListener);
+    zmq.SetRecorder (&rec);
+    zmq.Start ();
+    SleepSome ();
+
+    for (int i = 1; i <= 3; ++i)
+      {
+        payload["block"] = i;
+        /* Skip one sequence number to produce a mismatch.  */
+        SendMessage (zmqSocket, topic, payload, i == 3 ? 5 : i);
+      }
+    SleepSome ();
+  }
+
+  /* The first replayed message is not seen as mismatch, unlike for
+     a live subscriber.  */
+  {
+    InSequence dummy;
+    for (int i = 1; i <= 3; ++i)
+      {
+        payload["block"] = i;
+        EXPECT_CALL (mockListener, BlockAttach (GAME_ID, payload, i == 3));
+      }
+  }
+
+  ZmqSubscriber zmq;
+  zmq.AddListener (GAME_ID, &mockListener);
+
+  ZmqRecordingReader reader(file);
+  RecordedMessage msg;
+  unsigned replayed = 0;
+  while (reader.Next (msg))
+    {
+      EXPECT_EQ (msg.topic, topic);
+      EXPECT_TRUE (zmq.ReplayMessage (msg.topic, msg.payload, msg.seq));
+      ++replayed;
+    }
+  EXPECT_EQ (replayed, 3u);
+  EXPECT_EQ (mockListener.stopCalls, 0);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Tests parsing of large block payloads, which the subscriber does directly
+ * from the message buffer with a reader that is reused between messages.
+ */
+TEST_F (BasicZmqSubscriberTests, ParseLargeBlocks)
+{
+  constexpr unsigned numMoves = 1'000;
+  constexpr unsigned numBlocks = 3;
+
+  Json::Value data(Json::objectValue);
+  data["block"]["hash"] = std::string (64, 'a');
+  data["moves"] = Json::Value (Json::arrayValue);
+  for (unsigned i = 0; i < numMoves; ++i)
+    {
+      Json::Value mv(Json::objectValue);
+      mv["txid"] = std::string (64, 'b');
+      mv["name"] = "player " + std::to_string (i);
+      mv["move"]["x"] = i;
+      mv["move"]["msg"] = "some longer message text in the move";
+      data["moves"].append (mv);
+    }
+
+  const std::string topic = std::string ("game-block-attach json ") + GAME_ID;
+
+  std::vector<std::string> payloads;
+  {
+    InSequence dummy;
+    for (unsigned i = 0; i < numBlocks; ++i)
+      {
+        data["block"]["height"] = 42 + i;
+        EXPECT_CALL (mockListener, BlockAttach (GAME_ID, data, false));
+
+        std::ostringstream out;
+        out << data;
+        payloads.push_back (out.str ());
+      }
+  }
+
+  ZmqSubscriber zmq;
+  zmq.AddListener (GAME_ID, &mockListener);
+  for (unsigned i = 0; i < numBlocks; ++i)
+    ASSERT_TRUE (zmq.ReplayMessage (topic, payloads[i], i + 1));
+}
+
+/* ************************************************************************** */
+
+class QueuedZmqListenerTests : public testing::Test
+{
+
+protected:
+
+  MockZmqListener mockListener;
+
+  /** Number of times the error callback has been invoked.  */
+  std::atomic<unsigned> errors;
+
+  QueuedZmqListener queued;
+
+  QueuedZmqListenerTests ()
+    : errors(0), queued(mockListener, [this] () { ++errors; })
+  {}
+
+};
+
+TEST_F (QueuedZmqListenerTests, ForwardsInOrder)
+{
+  const auto callerThread = std::this_thread::get_id ();
+  const auto checkThread = [callerThread] ()
+    {
+      EXPECT_NE (std::this_thread::get_id (), callerThread);
+    };
+
+  {
+    InSequence dummy;
+    EXPECT_CALL (mockListener, BlockAttach (GAME_ID, Json::Value (1), true))
+        .WillOnce (Invoke (checkThread));
+    EXPECT_CALL (mockListener, PendingMove (GAME_ID, Json::Value (2)))
+        .WillOnce (Invoke (checkThread));
+    EXPECT_CALL (mockListener, BlockDetach (GAME_ID, Json::Value (3), false))
+        .WillOnce (Invoke (checkThread));
+  }
+
+  queued.BlockAttach (GAME_ID, Json::Value (1), true);
+  queued.PendingMove (GAME_ID, Json::Value (2));
+  queued.BlockDetach (GAME_ID, Json::Value (3), false);
+  queued.HasStopped ();
+  queued.Flush ();
+
+  EXPECT_EQ (mockListener.stopCalls, 1);
+  EXPECT_GE (queued.GetMaxDepth (), 1u);
+  EXPECT_EQ (errors, 0);
+}
+
+TEST_F (QueuedZmqListenerTests, ExceptionDropsUntilStopped)
+{
+  {
+    InSequence dummy;
+    EXPECT_CALL (mockListener, BlockAttach (GAME_ID, Json::Value (1), _))
+        .WillOnce (Throw (std::runtime_error ("error")));
+    EXPECT_CALL (mockListener, BlockAttach (GAME_ID, Json::Value (3), _));
+  }
+
+  queued.BlockAttach (GAME_ID, Json::Value (1), false);
+  queued.BlockAttach (GAME_ID, Json::Value (2), false);
+  queued.HasStopped ();
+  queued.BlockAttach (GAME_ID, Json::Value (3), false);
+  queued.Flush ();
+
+  EXPECT_EQ (errors, 1);
+  EXPECT_EQ (mockListener.stopCalls, 1);
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
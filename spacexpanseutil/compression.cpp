@@ -20,6 +20,12 @@ constexpr int WINDOW_BITS = 15;
 /** Compression level we use.  */
 constexpr int LEVEL = 9;
 
+/**
+ * Window bits to pass to deflateInit2 for producing gzip output instead
+ * of a raw deflate stream.
+ */
+constexpr int GZIP_WINDOW_BITS = WINDOW_BITS + 16;
+
 /**
  * Utility class wrapping a z_stream instance used for inflating data.
  */
@@ -87,7 +93,23 @@ public:
 std::string
 CompressData (const std::string& data)
 {
-  DeflateStream compressor(-WINDOW_BITS, LEVEL);
+  return CompressDataWithLevel (data, LEVEL);
+}
+
+std::string
+CompressDataWithLevel (const std::string& data, const int level)
+{
+  CHECK_GE (level, 1);
+  CHECK_LE (level, 9);
+
+  DeflateStream compressor(-WINDOW_BITS, level);
+  return compressor.Compress (data);
+}
+
+std::string
+GzipData (const std::string& data)
+{
+  DeflateStream compressor(GZIP_WINDOW_BITS, LEVEL);
   return compressor.Compress (data);
 }
 
@@ -28,6 +28,24 @@ namespace spacexpanse
  */
 std::string CompressData (const std::string& data);
 
+/**
+ * Compresses the given byte-string with an explicit zlib compression level,
+ * from 1 (fastest) to 9 (best compression, which is what CompressData uses).
+ * The output format is the same as for CompressData, so that it can be
+ * uncompressed with UncompressData.
+ *
+ * This is meant for local, non-consensus uses (e.g. compressing data
+ * in the game's storage), where speed may matter more than size.
+ */
+std::string CompressDataWithLevel (const std::string& data, int level);
+
+/**
+ * Compresses the given byte-string in gzip format (in memory), e.g. for
+ * serving it in an HTTP response.  This is not meant for consensus data,
+ * and the output is not accepted by UncompressData.
+ */
+std::string GzipData (const std::string& data);
+
 /**
  * Tries to uncompress the given byte-string, returning the original data.
  * If the input data is invalid or the output size is larger than maxOutputSize,
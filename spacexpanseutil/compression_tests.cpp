@@ -69,6 +69,25 @@ TEST_F (CompressionTests, RoundTrip)
     }
 }
 
+TEST_F (CompressionTests, WithLevel)
+{
+  std::string input;
+  for (unsigned i = 0; i < 10'000; ++i)
+    input.append ("foo " + std::to_string (i % 100) + " bar ");
+
+  const std::string best = CompressDataWithLevel (input, 9);
+  EXPECT_EQ (best, CompressData (input));
+
+  for (int level = 1; level <= 9; ++level)
+    {
+      const std::string compressed = CompressDataWithLevel (input, level);
+      EXPECT_LT (compressed.size (), input.size ());
+      ExpectValidUncompress (compressed, input.size (), input);
+    }
+
+  EXPECT_LE (best.size (), CompressDataWithLevel (input, 1).size ());
+}
+
 TEST_F (CompressionTests, MaxOutputSize)
 {
   const std::string input = "foobar";
@@ -139,6 +158,42 @@ TEST_F (CompressionTests, GzipFormat)
   ExpectInvalidUncompress (compressed, input.size ());
 }
 
+TEST_F (CompressionTests, GzipData)
+{
+  std::string input;
+  for (unsigned i = 0; i < 10'000; ++i)
+    input.append ("abcdef");
+
+  const std::string compressed = GzipData (input);
+  ASSERT_GE (compressed.size (), 2);
+  EXPECT_EQ (compressed.substr (0, 2), "\x1f\x8b");
+  EXPECT_LT (compressed.size (), input.size () / 10);
+
+  /* Gzip data is not accepted by UncompressData, but zlib can read it
+     with gzip window bits.  */
+  ExpectInvalidUncompress (compressed, input.size ());
+
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.next_in = Z_NULL;
+  stream.avail_in = 0;
+  ASSERT_EQ (inflateInit2 (&stream, 15 + 16), Z_OK);
+
+  std::string output(input.size (), '\0');
+  stream.next_in
+      = reinterpret_cast<Bytef*> (const_cast<char*> (compressed.data ()));
+  stream.avail_in = compressed.size ();
+  stream.next_out = reinterpret_cast<Bytef*> (&output[0]);
+  stream.avail_out = output.size ();
+  EXPECT_EQ (inflate (&stream, Z_FINISH), Z_STREAM_END);
+  EXPECT_EQ (stream.total_out, input.size ());
+  EXPECT_EQ (inflateEnd (&stream), Z_OK);
+
+  EXPECT_EQ (output, input);
+}
+
 /* ************************************************************************** */
 
 class JsonCompressionTests : public testing::Test
@@ -6,6 +6,8 @@
 #define SPACEXPANSEUTIL_UINT256_HPP
 
 #include <array>
+#include <cstring>
+#include <functional>
 #include <string>
 
 namespace spacexpanse
@@ -106,4 +108,38 @@ public:
 
 } // namespace spacexpanse
 
+namespace std
+{
+
+/**
+ * Hashing of uint256 values, so that they can be used as keys in unordered
+ * containers.  The values are typically hashes already, but block hashes
+ * have leading zero bytes (from proof-of-work) and test values often
+ * differ only in a few bytes.  Hence we fold all of the bytes together
+ * instead of just taking some of them.
+ */
+template <>
+  struct hash<spacexpanse::uint256>
+{
+
+  size_t
+  operator() (const spacexpanse::uint256& x) const
+  {
+    const unsigned char* blob = x.GetBlob ();
+
+    size_t res = 0;
+    for (size_t i = 0; i < spacexpanse::uint256::NUM_BYTES; i += sizeof (res))
+      {
+        size_t part;
+        std::memcpy (&part, blob + i, sizeof (part));
+        res ^= part;
+      }
+
+    return res;
+  }
+
+};
+
+} // namespace std
+
 #endif // SPACEXPANSEUTIL_UINT256_HPP
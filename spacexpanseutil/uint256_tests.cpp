@@ -116,5 +116,21 @@ TEST (Uint256Tests, SetNull)
   EXPECT_EQ (obj.ToHex (), std::string (64, '0'));
 }
 
+TEST (Uint256Tests, Hash)
+{
+  const std::hash<uint256> hasher;
+
+  uint256 a, b;
+  ASSERT_TRUE (a.FromHex ("01" + std::string (62, '0')));
+  ASSERT_TRUE (b.FromHex ("01" + std::string (62, '0')));
+  EXPECT_EQ (hasher (a), hasher (b));
+
+  /* Values that differ in only one byte (anywhere) hash differently.  */
+  ASSERT_TRUE (b.FromHex ("02" + std::string (62, '0')));
+  EXPECT_NE (hasher (a), hasher (b));
+  ASSERT_TRUE (b.FromHex ("01" + std::string (60, '0') + "01"));
+  EXPECT_NE (hasher (a), hasher (b));
+}
+
 } // anonymous namespace
 } // namespace spacexpanse